@@ -0,0 +1,297 @@
+/* Copyright (C) 2007-2008 Geoff Richards
+ * Copyright (C) 2010-2011 Uli Schlachter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Blurs approximating a Gaussian with three box blurs in a row, each done
+ * as a horizontal pass followed by a vertical one.  A box blur costs the
+ * same whatever its size, since it only needs running sums.  Rows of the
+ * horizontal passes, and columns of the vertical ones, are shared out
+ * between threads.  Pixels outside the area being blurred count as fully
+ * transparent.
+ *
+ * This file doesn't use Lua at all. */
+
+#define BLUR_PASSES 3
+
+/* Radii of box blurs which together come close to a Gaussian with the
+ * standard deviation 'sigma', as described in Wojciech Jarosz's "Fast
+ * Image Convolutions". */
+static void
+blur_box_radii (double sigma, int *radii) {
+    double ideal = sqrt(12 * sigma * sigma / BLUR_PASSES + 1);
+    int lower = (int) floor(ideal), upper, m, i;
+
+    if (lower % 2 == 0)
+        --lower;
+    upper = lower + 2;
+    m = (int) floor((12 * sigma * sigma - BLUR_PASSES * lower * lower
+                     - 4 * BLUR_PASSES * lower - 3 * BLUR_PASSES)
+                    / (-4.0 * lower - 4) + 0.5);
+    for (i = 0; i < BLUR_PASSES; ++i)
+        radii[i] = ((i < m ? lower : upper) - 1) / 2;
+}
+
+/* How far the blur spreads, which is how much bigger a shadow has to be
+ * than the shape casting it. */
+static int
+blur_extent (double sigma) {
+    int radii[BLUR_PASSES], i, total = 0;
+    blur_box_radii(sigma, radii);
+    for (i = 0; i < BLUR_PASSES; ++i)
+        total += radii[i];
+    return total;
+}
+
+typedef struct BlurJob_ {
+    unsigned char *data, *tmp;  /* the image, and space for a copy of it */
+    int width, height, channels;
+    size_t stride;              /* bytes per row of both */
+    int radius;
+    uint32_t inv;               /* 2^23 / (2 * radius + 1) */
+    uint32_t *sums;             /* one for each byte of a row */
+    const unsigned char *zero;  /* a row of transparent pixels */
+} BlurJob;
+
+/* Output pixels x0 to x1 of a row, where the window can hang off either
+ * end of it. */
+static void
+blur_row_edge (const unsigned char *src, unsigned char *dst, int w, int ch,
+               int r, uint32_t inv, uint32_t *sum, int x0, int x1)
+{
+    int x, c;
+    for (x = x0; x < x1; ++x) {
+        if (x + r < w)
+            for (c = 0; c < ch; ++c)
+                sum[c] += src[(x + r) * ch + c];
+        for (c = 0; c < ch; ++c)
+            dst[x * ch + c] = (sum[c] * inv + (1 << (BOX_SHIFT - 1)))
+                              >> BOX_SHIFT;
+        if (x >= r)
+            for (c = 0; c < ch; ++c)
+                sum[c] -= src[(x - r) * ch + c];
+    }
+}
+
+static void
+blur_row (const unsigned char *src, unsigned char *dst, int w, int ch, int r,
+          uint32_t inv)
+{
+    uint32_t sum[4] = { 0, 0, 0, 0 }, t;
+    int x, c, left = r < w ? r : w;
+
+    for (x = 0; x < left; ++x)
+        for (c = 0; c < ch; ++c)
+            sum[c] += src[x * ch + c];
+    blur_row_edge(src, dst, w, ch, r, inv, sum, 0, left);
+    /* In the middle the whole window is inside the row. */
+    for (x = left; x + r < w; ++x) {
+        for (c = 0; c < ch; ++c) {
+            t = sum[c] + src[(x + r) * ch + c];
+            dst[x * ch + c] = (t * inv + (1 << (BOX_SHIFT - 1))) >> BOX_SHIFT;
+            sum[c] = t - src[(x - r) * ch + c];
+        }
+    }
+    blur_row_edge(src, dst, w, ch, r, inv, sum, x, w);
+}
+
+static void
+blur_rows (void *closure, int begin, int end) {
+    BlurJob *job = closure;
+    const unsigned char *src;
+    unsigned char *dst;
+    int y;
+
+    for (y = begin; y < end; ++y) {
+        src = job->data + y * job->stride;
+        dst = job->tmp + y * job->stride;
+        /* Constant channel counts let the compiler unroll the inner loops. */
+        if (job->channels == 4)
+            blur_row(src, dst, job->width, 4, job->radius, job->inv);
+        else
+            blur_row(src, dst, job->width, 1, job->radius, job->inv);
+    }
+}
+
+/* The columns are byte offsets within the rows, which are independent of
+ * each other whatever the number of channels. */
+static void
+blur_columns (void *closure, int begin, int end) {
+    BlurJob *job = closure;
+    const int h = job->height, r = job->radius, n = end - begin;
+    const unsigned char *src = job->tmp + begin, *add, *sub;
+    uint32_t *sums = job->sums + begin;
+    int y, i;
+
+    for (i = 0; i < n; ++i)
+        sums[i] = 0;
+    for (y = 0; y < r && y < h; ++y)
+        for (i = 0; i < n; ++i)
+            sums[i] += src[y * job->stride + i];
+    for (y = 0; y < h; ++y) {
+        add = y + r < h ? src + (y + r) * job->stride : job->zero;
+        sub = y >= r ? src + (y - r) * job->stride : job->zero;
+        pixel_kernels->box_step(sums, add, sub,
+                                job->data + y * job->stride + begin, n,
+                                job->inv);
+    }
+}
+
+/* Blur an image in place.  'channels' is 4 for premultiplied ARGB pixels
+ * or 1 for alpha values.  Returns an error message, or null on success. */
+static const char *
+blur_buffer (unsigned char *data, int width, int height, int channels,
+             size_t stride, double sigma)
+{
+    int radii[BLUR_PASSES], i;
+    size_t row_bytes = (size_t) width * channels;
+    BlurJob job;
+
+    if (width <= 0 || height <= 0)
+        return 0;
+    blur_box_radii(sigma, radii);
+    job.data = data;
+    job.width = width;
+    job.height = height;
+    job.channels = channels;
+    job.stride = stride;
+    job.tmp = malloc(stride * height);
+    job.sums = malloc(row_bytes * sizeof(uint32_t));
+    job.zero = calloc(row_bytes, 1);
+    if (!job.tmp || !job.sums || !job.zero) {
+        free(job.tmp);
+        free(job.sums);
+        free((void *) job.zero);
+        return "out of memory";
+    }
+
+    for (i = 0; i < BLUR_PASSES; ++i) {
+        if (radii[i] == 0)
+            continue;
+        job.radius = radii[i];
+        job.inv = (1 << BOX_SHIFT) / (2 * radii[i] + 1);
+        parallel_for(height, 16, blur_rows, &job);
+        parallel_for((int) row_bytes, 256, blur_columns, &job);
+    }
+
+    free(job.tmp);
+    free(job.sums);
+    free((void *) job.zero);
+    return 0;
+}
+
+/* Blur the rectangle x, y, w, h of an image with 'channels' bytes per
+ * pixel.  Pixels around the rectangle affect the result as they would if
+ * the whole image were blurred, but only those inside it are changed. */
+static const char *
+blur_image_rect (unsigned char *data, int img_width, int img_height,
+                 int stride, int channels, int x, int y, int w, int h,
+                 double sigma)
+{
+    int extent = blur_extent(sigma), x0, y0, x1, y1, row;
+    size_t work_stride;
+    unsigned char *work;
+    const char *err;
+
+    if (x == 0 && y == 0 && w == img_width && h == img_height)
+        return blur_buffer(data, w, h, channels, stride, sigma);
+
+    /* Blur a copy of the rectangle with enough of its surroundings for
+     * the inside to come out right, then copy back just the inside. */
+    x0 = x - extent < 0 ? 0 : x - extent;
+    y0 = y - extent < 0 ? 0 : y - extent;
+    x1 = x + w + extent > img_width ? img_width : x + w + extent;
+    y1 = y + h + extent > img_height ? img_height : y + h + extent;
+    work_stride = (size_t) (x1 - x0) * channels;
+    work = malloc(work_stride * (y1 - y0));
+    if (!work)
+        return "out of memory";
+    for (row = y0; row < y1; ++row)
+        memcpy(work + (row - y0) * work_stride,
+               data + (size_t) row * stride + (size_t) x0 * channels,
+               work_stride);
+    err = blur_buffer(work, x1 - x0, y1 - y0, channels, work_stride, sigma);
+    if (!err) {
+        for (row = y; row < y + h; ++row)
+            memcpy(data + (size_t) row * stride + (size_t) x * channels,
+                   work + (row - y0) * work_stride
+                        + (size_t) (x - x0) * channels,
+                   (size_t) w * channels);
+    }
+    free(work);
+    return err;
+}
+
+/* Fill 'dst', an ARGB32 image 2 * extent pixels wider and taller than
+ * 'src', with a blurred copy of the shape of 'src' in a single colour.
+ * The colour components are premultiplied, in the range 0 to 255. */
+static const char *
+blur_shadow (const unsigned char *src, cairo_format_t src_format,
+             int width, int height, int src_stride,
+             unsigned char *dst, int dst_stride, double sigma,
+             const unsigned int *color)
+{
+    int extent = blur_extent(sigma);
+    int sw = width + 2 * extent, sh = height + 2 * extent, x, y;
+    unsigned char *alpha = calloc((size_t) sw * sh, 1), *a;
+    const char *err;
+
+    if (!alpha)
+        return "out of memory";
+    for (y = 0; y < height; ++y) {
+        const unsigned char *row = src + (size_t) y * src_stride;
+        a = alpha + (size_t) (y + extent) * sw + extent;
+        for (x = 0; x < width; ++x) {
+            switch (src_format) {
+                case CAIRO_FORMAT_ARGB32:
+                    a[x] = ((const uint32_t *) row)[x] >> 24; break;
+                case CAIRO_FORMAT_A8:
+                    a[x] = row[x]; break;
+                case CAIRO_FORMAT_A1:
+                    /* Bits in 32 bit words, as with a1_bit(). */
+                    a[x] = (((const uint32_t *) row)[x / 32]
+                            >> (IS_BIG_ENDIAN ? 31 - x % 32 : x % 32)) & 1
+                           ? 255 : 0;
+                    break;
+                default:
+                    a[x] = 255; break;
+            }
+        }
+    }
+
+    err = blur_buffer(alpha, sw, sh, 1, sw, sigma);
+    if (!err) {
+        for (y = 0; y < sh; ++y) {
+            uint32_t *out = (uint32_t *) (dst + (size_t) y * dst_stride);
+            a = alpha + (size_t) y * sw;
+            for (x = 0; x < sw; ++x) {
+                unsigned int v = a[x];
+                out[x] = (premultiply_channel(color[0], v) << 24)
+                       | (premultiply_channel(color[1], v) << 16)
+                       | (premultiply_channel(color[2], v) << 8)
+                       | premultiply_channel(color[3], v);
+            }
+        }
+    }
+    free(alpha);
+    return err;
+}
+
+/* vi:set ts=4 sw=4 expandtab: */
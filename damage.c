@@ -0,0 +1,135 @@
+/* Copyright (C) 2007-2008 Geoff Richards
+ * Copyright (C) 2010-2011 Uli Schlachter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Damage tracking.  Surfaces and contexts can be asked to remember which
+ * pixels have been drawn on, as a region which Lua code can take away each
+ * frame to find out what needs to be copied to the screen.  Drawing done
+ * through contexts is recorded by the hooks in draw_ops.c, using the same
+ * device space extents as the profiler, and changes made to image memory
+ * through this module (such as with image buffer objects) are recorded as
+ * they are marked dirty.
+ *
+ * Each tracker counts as one user of the drawing hooks, so drawing only
+ * costs anything extra while at least one tracker exists. */
+
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+static const cairo_user_data_key_t damage_surface_key = { 0 };
+static const cairo_user_data_key_t damage_context_key = { 0 };
+
+/* Number of regions currently attached to surfaces or contexts. */
+static int damage_trackers = 0;
+
+static void
+damage_region_free (void *data) {
+    cairo_region_destroy(data);
+    --damage_trackers;
+    --draw_hooks_active;
+}
+
+static cairo_region_t *
+damage_tracker_create (void) {
+    cairo_region_t *region = cairo_region_create();
+    if (cairo_region_status(region) != CAIRO_STATUS_SUCCESS) {
+        cairo_region_destroy(region);
+        return 0;
+    }
+    ++damage_trackers;
+    ++draw_hooks_active;
+    return region;
+}
+
+/* Record that a rectangle of 'surface', in the coordinates of its pixels,
+ * has been changed, if the surface is being tracked. */
+static void
+damage_add_surface_rect (cairo_surface_t *surface, int x, int y, int width,
+                         int height)
+{
+    cairo_region_t *region;
+    cairo_rectangle_int_t rect;
+
+    if (!damage_trackers || width <= 0 || height <= 0)
+        return;
+    region = cairo_surface_get_user_data(surface, &damage_surface_key);
+    if (region) {
+        rect.x = x;
+        rect.y = y;
+        rect.width = width;
+        rect.height = height;
+        cairo_region_union_rectangle(region, &rect);
+    }
+}
+
+/* Same as above, for changes which could be anywhere on an image. */
+static void
+damage_add_surface_all (cairo_surface_t *surface) {
+    if (damage_trackers
+        && cairo_surface_get_type(surface) == CAIRO_SURFACE_TYPE_IMAGE)
+        damage_add_surface_rect(surface, 0, 0,
+                                cairo_image_surface_get_width(surface),
+                                cairo_image_surface_get_height(surface));
+}
+
+/* Called by the drawing hooks with the device space bounding box of an
+ * operation on 'cr'.  Contexts record damage in their own device space,
+ * and surfaces in terms of their pixels, which are offset from device
+ * space by the surface's device offset. */
+static void
+damage_add_draw_op (cairo_t *cr, const cairo_rectangle_int_t *rect) {
+    cairo_region_t *region = cairo_get_user_data(cr, &damage_context_key);
+    cairo_surface_t *target;
+    double dx, dy;
+
+    if (region)
+        cairo_region_union_rectangle(region, rect);
+
+    target = cairo_get_group_target(cr);
+    if (cairo_surface_get_user_data(target, &damage_surface_key)) {
+        cairo_surface_get_device_offset(target, &dx, &dy);
+        damage_add_surface_rect(target, rect->x + (int) floor(dx),
+                                rect->y + (int) floor(dy),
+                                rect->width + (dx != floor(dx)),
+                                rect->height + (dy != floor(dy)));
+    }
+}
+
+/* Push a copy of the damage recorded in 'region' as a region object, or
+ * nil if there's no tracker, and empty the tracker. */
+static int
+damage_take (lua_State *L, cairo_region_t *region) {
+    cairo_region_t **reg;
+    cairo_rectangle_int_t empty = { 0, 0, 0, 0 };
+
+    if (!region) {
+        lua_pushnil(L);
+        return 1;
+    }
+    reg = create_region_userdata(L);
+    *reg = cairo_region_copy(region);
+    cairo_region_intersect_rectangle(region, &empty);
+    return 1;
+}
+#else
+#define damage_add_surface_rect(surface, x, y, width, height)
+#define damage_add_surface_all(surface)
+#endif
+
+/* vi:set ts=4 sw=4 expandtab: */
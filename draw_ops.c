@@ -0,0 +1,347 @@
+/* Copyright (C) 2007-2008 Geoff Richards
+ * Copyright (C) 2010-2011 Uli Schlachter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Hooks around the drawing operations on context objects.  The context
+ * methods which actually put ink on a surface wrap the Cairo call in one of
+ * the DRAW_OP macros below.  Normally that costs a single test of a global
+ * counter, but while anything is interested in the drawing (such as the
+ * frame profiler or a damage tracker) the operation is timed and the area
+ * it touches worked out in device space.  Mipmaps hook in here too, to swap
+ * in a smaller copy of the source image.
+ *
+ * While any recording surfaces made by this module exist, they are marked
+ * when something is drawn on them which makes them unsafe to play back on
+ * another thread: text in a user font, whose callbacks run Lua code, or a
+ * source or mask with a surface in it, which Cairo may cache things on
+ * while playing back, or which has its own drawing in it. */
+
+enum {
+    DRAW_OP_PAINT,
+    DRAW_OP_MASK,
+    DRAW_OP_FILL,
+    DRAW_OP_STROKE,
+    DRAW_OP_GLYPHS,
+    DRAW_OP_COUNT
+};
+
+static const char * const draw_op_names[] = {
+    "paint", "mask", "fill", "stroke", "glyphs", 0
+};
+
+/* Number of things which currently want to hear about drawing operations. */
+static int draw_hooks_active = 0;
+
+/* profiler_now() is declared in parallel.c. */
+static void profiler_add_draw_op (int op, double elapsed, double pixels);
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+static int damage_trackers;
+static void damage_add_draw_op (cairo_t *cr, const cairo_rectangle_int_t *rect);
+#endif
+static int mipmap_hooks;
+static cairo_pattern_t *mipmap_draw_begin (cairo_t *cr);
+static void mipmap_draw_end (cairo_t *cr, cairo_pattern_t *source);
+#ifdef CAIRO_HAS_RECORDING_SURFACE
+static int tiled_stale_recordings;
+static int tiled_context_is_stale (cairo_t *cr);
+#endif
+
+typedef struct DrawOpInfo_ {
+    lua_State *L;
+    cairo_t *cr;
+    int op;
+    /* For glyph operations, whichever of these is set is used to find the
+     * area covered by the text. */
+    const char *text;
+    const cairo_glyph_t *glyphs;
+    int num_glyphs;
+    double pixels;
+    double start;
+    cairo_pattern_t *source;    /* to put back if mipmaps replaced it */
+} DrawOpInfo;
+
+/* Operators which clear the destination wherever the source is transparent,
+ * and so can change pixels outside the shape being drawn. */
+static int
+draw_op_unbounded (cairo_operator_t op) {
+    return op == CAIRO_OPERATOR_IN || op == CAIRO_OPERATOR_OUT
+        || op == CAIRO_OPERATOR_DEST_IN || op == CAIRO_OPERATOR_DEST_ATOP;
+}
+
+/* Find the area which will be affected by a drawing operation, as a
+ * rectangle in user space clipped to the current clip region.  Returns
+ * false if nothing will be drawn. */
+static int
+draw_op_user_extents (const DrawOpInfo *info, double *x1, double *y1,
+                      double *x2, double *y2)
+{
+    cairo_t *cr = info->cr;
+    cairo_text_extents_t te;
+    double cx1, cy1, cx2, cy2, x, y;
+
+    cairo_clip_extents(cr, &cx1, &cy1, &cx2, &cy2);
+
+    switch (draw_op_unbounded(cairo_get_operator(cr)) ? DRAW_OP_PAINT
+                                                      : info->op) {
+        case DRAW_OP_FILL:
+            cairo_fill_extents(cr, x1, y1, x2, y2);
+            break;
+        case DRAW_OP_STROKE:
+            cairo_stroke_extents(cr, x1, y1, x2, y2);
+            break;
+        case DRAW_OP_GLYPHS:
+            if (info->glyphs && info->num_glyphs > 0) {
+                cairo_glyph_extents(cr, info->glyphs, info->num_glyphs, &te);
+                x = info->glyphs[0].x;
+                y = info->glyphs[0].y;
+            }
+            else if (info->text) {
+                cairo_text_extents(cr, info->text, &te);
+                x = y = 0;
+                if (cairo_has_current_point(cr))
+                    cairo_get_current_point(cr, &x, &y);
+            }
+            else
+                return 0;
+            *x1 = x + te.x_bearing;
+            *y1 = y + te.y_bearing;
+            *x2 = *x1 + te.width;
+            *y2 = *y1 + te.height;
+            break;
+        default:
+            /* Painting and masking can affect everything inside the clip. */
+            *x1 = cx1; *y1 = cy1; *x2 = cx2; *y2 = cy2;
+            break;
+    }
+
+    if (*x1 < cx1) *x1 = cx1;
+    if (*y1 < cy1) *y1 = cy1;
+    if (*x2 > cx2) *x2 = cx2;
+    if (*y2 > cy2) *y2 = cy2;
+    return *x1 < *x2 && *y1 < *y2;
+}
+
+/* Same as above, but gives the bounding box in device space, rounded out
+ * to whole pixels.  Returns false if nothing will be drawn. */
+static int
+draw_op_device_extents (const DrawOpInfo *info, cairo_rectangle_int_t *rect)
+{
+    double x1, y1, x2, y2, px[4], py[4], minx, miny, maxx, maxy;
+    int i;
+
+    if (!draw_op_user_extents(info, &x1, &y1, &x2, &y2))
+        return 0;
+
+    px[0] = x1; py[0] = y1;
+    px[1] = x2; py[1] = y1;
+    px[2] = x1; py[2] = y2;
+    px[3] = x2; py[3] = y2;
+    for (i = 0; i < 4; ++i)
+        cairo_user_to_device(info->cr, &px[i], &py[i]);
+
+    minx = maxx = px[0];
+    miny = maxy = py[0];
+    for (i = 1; i < 4; ++i) {
+        if (px[i] < minx) minx = px[i];
+        if (px[i] > maxx) maxx = px[i];
+        if (py[i] < miny) miny = py[i];
+        if (py[i] > maxy) maxy = py[i];
+    }
+
+    rect->x = (int) floor(minx);
+    rect->y = (int) floor(miny);
+    rect->width = (int) ceil(maxx) - rect->x;
+    rect->height = (int) ceil(maxy) - rect->y;
+    return rect->width > 0 && rect->height > 0;
+}
+
+#ifdef CAIRO_HAS_RECORDING_SURFACE
+/* Number of recording surfaces which drawing needs to be checked for. */
+static int draw_recordings = 0;
+static const cairo_user_data_key_t draw_recording_key = { 0 };
+static const cairo_user_data_key_t draw_lua_thread_key = { 0 };
+/* Set on surfaces which wrap another, such as subsurfaces, to find it. */
+static const cairo_user_data_key_t draw_parent_key = { 0 };
+
+/* Find the recording surface which drawing on 'surface' ends up in, if
+ * there is one. */
+static cairo_surface_t *
+draw_op_recording (cairo_surface_t *surface) {
+    while (surface) {
+        switch (cairo_surface_get_type(surface)) {
+            case CAIRO_SURFACE_TYPE_RECORDING:
+                return surface;
+            case CAIRO_SURFACE_TYPE_IMAGE:
+                return 0;
+            default:
+                surface = cairo_surface_get_user_data(surface,
+                                                      &draw_parent_key);
+                break;
+        }
+    }
+    return 0;
+}
+
+static void
+draw_recording_release (void *data) {
+    (void) data;
+    --draw_recordings;
+    --draw_hooks_active;
+}
+
+/* Start checking what is drawn on a new recording surface. */
+static void
+draw_recording_register (cairo_surface_t *recording) {
+    if (cairo_surface_set_user_data(recording, &draw_recording_key,
+                                    (void *) &draw_recording_key,
+                                    draw_recording_release)
+        == CAIRO_STATUS_SUCCESS)
+    {
+        ++draw_recordings;
+        ++draw_hooks_active;
+    }
+}
+
+/* True if 'recording' can safely be played back off the Lua thread, as
+ * long as nothing else is using it at the same time. */
+static int
+recording_is_thread_safe (cairo_surface_t *recording) {
+    return !cairo_surface_get_user_data(recording, &draw_lua_thread_key);
+}
+
+static void
+draw_op_mark_lua_thread (cairo_t *cr) {
+    cairo_surface_t *recording = draw_op_recording(cairo_get_group_target(cr));
+    if (recording && recording_is_thread_safe(recording))
+        cairo_surface_set_user_data(recording, &draw_lua_thread_key,
+                                    (void *) &draw_lua_thread_key, 0);
+}
+
+/* Note a source or mask pattern about to be drawn with on 'cr'. */
+static void
+draw_op_note_pattern (cairo_t *cr, cairo_pattern_t *pattern) {
+    if (cairo_pattern_get_type(pattern) == CAIRO_PATTERN_TYPE_SURFACE)
+        draw_op_mark_lua_thread(cr);
+}
+
+/* Called before every operation while there are recordings, to see whether
+ * it makes one unsafe for threads. */
+static void
+draw_op_note (cairo_t *cr, int op) {
+    cairo_surface_t *target = cairo_get_group_target(cr);
+    cairo_scaled_font_t *font;
+
+    if (cairo_surface_get_type(target) == CAIRO_SURFACE_TYPE_IMAGE)
+        return;
+    draw_op_note_pattern(cr, cairo_get_source(cr));
+    if (op == DRAW_OP_GLYPHS) {
+        font = cairo_get_scaled_font(cr);
+        if (cairo_font_face_get_type(cairo_scaled_font_get_font_face(font))
+            == CAIRO_FONT_TYPE_USER)
+            draw_op_mark_lua_thread(cr);
+    }
+}
+#define DRAW_OP_NOTE_MASK(cr, pattern) \
+    do { if (draw_recordings) draw_op_note_pattern((cr), (pattern)); } while (0)
+#define DRAW_OP_NOTE_MASK_SURFACE(cr) \
+    do { if (draw_recordings) draw_op_mark_lua_thread(cr); } while (0)
+#define DRAW_PASSIVE_HOOKS (tiled_stale_recordings + draw_recordings)
+#else
+#define DRAW_OP_NOTE_MASK(cr, pattern)
+#define DRAW_OP_NOTE_MASK_SURFACE(cr)
+#define DRAW_PASSIVE_HOOKS 0
+#endif
+
+/* True if the operation will run Lua code, which might throw an error. */
+static int
+draw_op_calls_lua (const DrawOpInfo *info) {
+    cairo_font_face_t *face;
+
+    if (info->op != DRAW_OP_GLYPHS)
+        return 0;
+    face = cairo_scaled_font_get_font_face(cairo_get_scaled_font(info->cr));
+    return cairo_font_face_get_type(face) == CAIRO_FONT_TYPE_USER;
+}
+
+/* The extents have to be worked out before the operation, since filling
+ * and stroking clear the path, but the clock is only started afterwards so
+ * that the time taken doing so isn't counted as drawing time. */
+static void
+draw_op_begin (DrawOpInfo *info) {
+    cairo_rectangle_int_t rect;
+
+#ifdef CAIRO_HAS_RECORDING_SURFACE
+    if (tiled_stale_recordings && tiled_context_is_stale(info->cr))
+        luaL_error(info->L, "context is for a tiled surface which has been"
+                   " flushed since, so a new one is needed");
+    if (draw_recordings)
+        draw_op_note(info->cr, info->op);
+#endif
+    info->pixels = 0;
+    /* Only the profiler and damage trackers need the extents, so don't
+     * bother if nothing else is hooked in. */
+    if (draw_hooks_active > mipmap_hooks + DRAW_PASSIVE_HOOKS
+        && draw_op_device_extents(info, &rect))
+    {
+        info->pixels = (double) rect.width * rect.height;
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+        if (damage_trackers)
+            damage_add_draw_op(info->cr, &rect);
+#endif
+    }
+
+    /* Once a mipmap is swapped in only draw_op_end puts the real source
+     * back, so nothing can be allowed to throw an error from here until
+     * then.  Text in a user font calls back into Lua, which could, so it
+     * is drawn without mipmaps. */
+    info->source = mipmap_hooks && !draw_op_calls_lua(info)
+                 ? mipmap_draw_begin(info->cr) : 0;
+    info->start = profiler_now();
+}
+
+static void
+draw_op_end (DrawOpInfo *info) {
+    profiler_add_draw_op(info->op, profiler_now() - info->start,
+                         info->pixels);
+    if (info->source)
+        mipmap_draw_end(info->cr, info->source);
+}
+
+#define DRAW_GLYPHS_OP(L_, cr_, op_, text_, glyphs_, num_glyphs_, call) \
+    do { \
+        if (draw_hooks_active) { \
+            DrawOpInfo draw_op_info_; \
+            draw_op_info_.L = (L_); \
+            draw_op_info_.cr = (cr_); \
+            draw_op_info_.op = (op_); \
+            draw_op_info_.text = (text_); \
+            draw_op_info_.glyphs = (glyphs_); \
+            draw_op_info_.num_glyphs = (num_glyphs_); \
+            draw_op_begin(&draw_op_info_); \
+            call; \
+            draw_op_end(&draw_op_info_); \
+        } \
+        else \
+            call; \
+    } while (0)
+#define DRAW_OP(L, cr, op, call) DRAW_GLYPHS_OP(L, cr, op, 0, 0, 0, call)
+
+/* vi:set ts=4 sw=4 expandtab: */
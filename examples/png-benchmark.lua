@@ -0,0 +1,54 @@
+-- This example times PNG encoding with different compression levels and
+-- filters, to show how they trade the size of the output against speed.
+-- It needs oocairo to have been built with libpng.
+
+local Cairo = require "oocairo"
+
+if not Cairo.HAS_PNG_OPTIONS then
+    error("this example needs oocairo to be built with libpng")
+end
+
+local IMAGE_WD, IMAGE_HT = 1280, 800
+local RUNS = 5
+
+-- Something like a screenshot: flat areas of colour, gradients and text.
+local surface = Cairo.image_surface_create("rgb24", IMAGE_WD, IMAGE_HT)
+local cr = Cairo.context_create(surface)
+local grad = Cairo.pattern_create_linear(0, 0, 0, IMAGE_HT)
+grad:add_color_stop_rgb(0, 0.9, 0.9, 1)
+grad:add_color_stop_rgb(1, 0.3, 0.3, 0.6)
+cr:set_source(grad)
+cr:paint()
+cr:set_source_rgb(1, 1, 1)
+for i = 0, 7 do
+    cr:rectangle(40 + i * 150, 60, 130, 660)
+end
+cr:fill()
+cr:set_source_rgb(0, 0, 0)
+cr:set_font_size(11)
+for y = 80, 700, 14 do
+    for i = 0, 7 do
+        cr:move_to(48 + i * 150, y)
+        cr:show_text("The quick brown fox")
+    end
+end
+
+local function bench (desc, options)
+    local start = os.clock()
+    local data
+    for _ = 1, RUNS do
+        data = surface:to_png_string(options)
+    end
+    local ms = (os.clock() - start) / RUNS * 1000
+    print(string.format("%-28s %8.1f ms %10d bytes", desc, ms, #data))
+end
+
+bench("cairo default", nil)
+for _, level in ipairs{ 0, 1, 3, 6, 9 } do
+    for _, filter in ipairs{ "none", "sub", "paeth", "adaptive" } do
+        bench("compression=" .. level .. " filter=" .. filter,
+              { compression = level, filter = filter })
+    end
+end
+
+-- vi:ts=4 sw=4 expandtab
@@ -0,0 +1,167 @@
+/* Copyright (C) 2007-2008 Geoff Richards
+ * Copyright (C) 2010-2011 Uli Schlachter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* XXH64, a fast non-cryptographic hash, used for hashing pixel data.  The
+ * data can be fed in a piece at a time, so that the rows of an image can
+ * be hashed without copying them together first.  The results are the
+ * same as the reference implementation with a seed of zero.
+ *
+ * This file doesn't use Lua at all. */
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+typedef struct Xxh64State_ {
+    uint64_t v[4];
+    uint64_t total_len;
+    unsigned char buf[32];      /* input not yet making up a whole stripe */
+    size_t buf_len;
+} Xxh64State;
+
+static uint64_t
+xxh_rotl64 (uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/* The input is read as little endian numbers, whatever the machine. */
+static uint64_t
+xxh_read64 (const unsigned char *p) {
+    uint64_t v;
+    if (IS_BIG_ENDIAN)
+        return ((uint64_t) p[0]) | ((uint64_t) p[1] << 8)
+             | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24)
+             | ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40)
+             | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint32_t
+xxh_read32 (const unsigned char *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8)
+         | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t
+xxh64_round (uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return xxh_rotl64(acc, 31) * XXH_PRIME64_1;
+}
+
+static uint64_t
+xxh64_merge_round (uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void
+xxh64_init (Xxh64State *state) {
+    state->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = XXH_PRIME64_2;
+    state->v[2] = 0;
+    state->v[3] = 0 - XXH_PRIME64_1;
+    state->total_len = 0;
+    state->buf_len = 0;
+}
+
+/* Process whole 32 byte stripes. */
+static void
+xxh64_stripes (Xxh64State *state, const unsigned char *p, size_t len) {
+    uint64_t v0 = state->v[0], v1 = state->v[1];
+    uint64_t v2 = state->v[2], v3 = state->v[3];
+    const unsigned char *end = p + len;
+    for (; p < end; p += 32) {
+        v0 = xxh64_round(v0, xxh_read64(p));
+        v1 = xxh64_round(v1, xxh_read64(p + 8));
+        v2 = xxh64_round(v2, xxh_read64(p + 16));
+        v3 = xxh64_round(v3, xxh_read64(p + 24));
+    }
+    state->v[0] = v0; state->v[1] = v1;
+    state->v[2] = v2; state->v[3] = v3;
+}
+
+static void
+xxh64_update (Xxh64State *state, const unsigned char *p, size_t len) {
+    size_t n;
+
+    state->total_len += len;
+    if (state->buf_len) {
+        n = 32 - state->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(state->buf + state->buf_len, p, n);
+        state->buf_len += n;
+        p += n;
+        len -= n;
+        if (state->buf_len < 32)
+            return;
+        xxh64_stripes(state, state->buf, 32);
+        state->buf_len = 0;
+    }
+    n = len & ~(size_t) 31;
+    xxh64_stripes(state, p, n);
+    memcpy(state->buf, p + n, len - n);
+    state->buf_len = len - n;
+}
+
+static uint64_t
+xxh64_digest (const Xxh64State *state) {
+    const unsigned char *p = state->buf, *end = p + state->buf_len;
+    uint64_t h;
+    int i;
+
+    if (state->total_len >= 32) {
+        h = xxh_rotl64(state->v[0], 1) + xxh_rotl64(state->v[1], 7)
+          + xxh_rotl64(state->v[2], 12) + xxh_rotl64(state->v[3], 18);
+        for (i = 0; i < 4; ++i)
+            h = xxh64_merge_round(h, state->v[i]);
+    }
+    else
+        h = XXH_PRIME64_5;
+    h += state->total_len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, xxh_read64(p));
+        h = xxh_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) xxh_read32(p) * XXH_PRIME64_1;
+        h = xxh_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= *p * XXH_PRIME64_5;
+        h = xxh_rotl64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* vi:set ts=4 sw=4 expandtab: */
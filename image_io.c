@@ -0,0 +1,602 @@
+/* Copyright (C) 2007-2008 Geoff Richards
+ * Copyright (C) 2010-2011 Uli Schlachter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Reading and writing image surfaces in simple uncompressed or lightly
+ * compressed formats, for when PNG's deflate step costs more than the space
+ * it saves.  Pixels are streamed a row at a time between Cairo's buffer and
+ * the file, through the same sort of read and write callbacks Cairo uses
+ * for PNG files.
+ *
+ *   raw  - Cairo's own pixel format, rows packed without padding, no header
+ *   pam  - Netpbm PAM, straight alpha (argb32, rgb24 and a8 images)
+ *   ppm  - Netpbm binary PPM, or PGM for a8 images, without any alpha
+ *   qoi  - the "Quite OK Image" format, straight alpha
+ *
+ * Like pixel_ops.c this doesn't use Lua. */
+
+enum {
+    IMAGE_IO_RAW,
+    IMAGE_IO_PAM,
+    IMAGE_IO_PPM,
+    IMAGE_IO_QOI
+};
+static const char * const image_io_format_names[] = {
+    "raw", "pam", "ppm", "qoi", 0
+};
+
+/* Cairo can't make image surfaces bigger than this anyway, and checking
+ * keeps a corrupt header from causing a huge allocation. */
+#define IMAGE_IO_MAX_SIZE 32767
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xC0
+#define QOI_OP_RGB   0xFE
+#define QOI_OP_RGBA  0xFF
+#define QOI_HASH(r, g, b, a) (((r) * 3 + (g) * 5 + (b) * 7 + (a) * 11) % 64)
+
+static const unsigned char qoi_end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+static cairo_status_t
+write_chunk_to_stdio (void *closure, const unsigned char *buf,
+                      unsigned int lentowrite)
+{
+    if (fwrite(buf, 1, lentowrite, closure) != lentowrite)
+        return CAIRO_STATUS_WRITE_ERROR;
+    return CAIRO_STATUS_SUCCESS;
+}
+
+static cairo_status_t
+read_chunk_from_stdio (void *closure, unsigned char *buf,
+                       unsigned int lentoread)
+{
+    if (fread(buf, 1, lentoread, closure) != lentoread)
+        return CAIRO_STATUS_READ_ERROR;
+    return CAIRO_STATUS_SUCCESS;
+}
+
+/* Get an image surface in one of the formats the conversions handle
+ * directly (argb32, rgb24 or a8), converting other formats into whichever
+ * of those can hold them.  The result must be destroyed by the caller. */
+static cairo_surface_t *
+image_io_common_format (cairo_surface_t *surface) {
+    cairo_format_t format = cairo_image_surface_get_format(surface);
+    cairo_surface_t *image;
+    cairo_t *cr;
+
+    if (format == CAIRO_FORMAT_ARGB32 || format == CAIRO_FORMAT_RGB24
+        || format == CAIRO_FORMAT_A8)
+        return cairo_surface_reference(surface);
+
+    image = cairo_image_surface_create(
+                format == CAIRO_FORMAT_A1 ? CAIRO_FORMAT_A8
+                                          : CAIRO_FORMAT_RGB24,
+                cairo_image_surface_get_width(surface),
+                cairo_image_surface_get_height(surface));
+    cr = cairo_create(image);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cr, surface, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    return image;
+}
+
+/* True if a string given instead of a filename is actually the image data
+ * itself.  That's the case if it starts with the right signature and has a
+ * newline or a nul byte in it, which no sensible filename would. */
+static int
+image_io_is_data (int fmt, const char *s, size_t len) {
+    const char *magic;
+    if (fmt == IMAGE_IO_PAM)
+        magic = "P7\n";
+    else if (fmt == IMAGE_IO_PPM)
+        magic = len >= 2 && s[1] == '5' ? "P5" : "P6";
+    else if (fmt == IMAGE_IO_QOI)
+        magic = "qoif";
+    else
+        return 0;
+    return len > strlen(magic) && !memcmp(s, magic, strlen(magic))
+           && (memchr(s, '\n', len) || memchr(s, '\0', len));
+}
+
+static void
+put_be32 (unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char) (v >> 24);
+    p[1] = (unsigned char) (v >> 16);
+    p[2] = (unsigned char) (v >> 8);
+    p[3] = (unsigned char) v;
+}
+
+static uint32_t
+get_be32 (const unsigned char *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16
+         | (uint32_t) p[2] << 8 | p[3];
+}
+
+/* Encode one row of RGBA pixels as QOI, continuing from the state left by
+ * the previous row.  Returns the number of bytes put in 'out', which needs
+ * room for five bytes per pixel. */
+typedef struct QoiState_ {
+    unsigned char index[64][4];
+    unsigned char prev[4];
+    int run;
+} QoiState;
+
+static size_t
+qoi_encode_row (QoiState *q, const unsigned char *px, int n,
+                unsigned char *out)
+{
+    unsigned char *o = out;
+    int i;
+
+    for (i = 0; i < n; ++i, px += 4) {
+        unsigned char *slot;
+
+        if (!memcmp(px, q->prev, 4)) {
+            if (++q->run == 62) {
+                *o++ = QOI_OP_RUN | (q->run - 1);
+                q->run = 0;
+            }
+            continue;
+        }
+        if (q->run) {
+            *o++ = QOI_OP_RUN | (q->run - 1);
+            q->run = 0;
+        }
+
+        slot = q->index[QOI_HASH(px[0], px[1], px[2], px[3])];
+        if (!memcmp(slot, px, 4))
+            *o++ = QOI_OP_INDEX | QOI_HASH(px[0], px[1], px[2], px[3]);
+        else if (px[3] == q->prev[3]) {
+            signed char vr = (signed char) (px[0] - q->prev[0]);
+            signed char vg = (signed char) (px[1] - q->prev[1]);
+            signed char vb = (signed char) (px[2] - q->prev[2]);
+            int vg_r = vr - vg, vg_b = vb - vg;
+
+            memcpy(slot, px, 4);
+            if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+                *o++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+            else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32
+                     && vg_b > -9 && vg_b < 8)
+            {
+                *o++ = QOI_OP_LUMA | (vg + 32);
+                *o++ = (vg_r + 8) << 4 | (vg_b + 8);
+            }
+            else {
+                *o++ = QOI_OP_RGB;
+                *o++ = px[0];
+                *o++ = px[1];
+                *o++ = px[2];
+            }
+        }
+        else {
+            memcpy(slot, px, 4);
+            *o++ = QOI_OP_RGBA;
+            memcpy(o, px, 4);
+            o += 4;
+        }
+        memcpy(q->prev, px, 4);
+    }
+    return o - out;
+}
+
+/* Write the image in 'fmt'.  Returns an error message on failure. */
+static const char *
+image_io_write (cairo_surface_t *surface, int fmt, cairo_write_func_t func,
+                void *closure)
+{
+    static const char write_error[] = "error writing image data";
+    cairo_surface_t *image;
+    cairo_format_t format;
+    const unsigned char *data;
+    int width, height, stride, y, layout, channels;
+    size_t row_bytes, len;
+    unsigned char *buf, *row, *out;
+    uint32_t *tmp;
+    char header[128];
+    PixelConversion conv;
+    QoiState qoi;
+    const char *err = 0;
+
+    if (fmt == IMAGE_IO_RAW)
+        image = cairo_surface_reference(surface);
+    else
+        image = image_io_common_format(surface);
+    if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(image);
+        return "out of memory";
+    }
+    cairo_surface_flush(image);
+    format = cairo_image_surface_get_format(image);
+    data = cairo_image_surface_get_data(image);
+    width = cairo_image_surface_get_width(image);
+    height = cairo_image_surface_get_height(image);
+    stride = cairo_image_surface_get_stride(image);
+
+    if (fmt == IMAGE_IO_RAW) {
+        row_bytes = ((size_t) width * format_bits_per_pixel(format) + 7) / 8;
+        for (y = 0; y < height && !err; ++y) {
+            if (func(closure, data + (size_t) y * stride, row_bytes))
+                err = write_error;
+        }
+        cairo_surface_destroy(image);
+        return err;
+    }
+
+    /* Pick the layout the pixels are written in. */
+    if (format == CAIRO_FORMAT_A8) {
+        if (fmt == IMAGE_IO_QOI) {
+            cairo_surface_destroy(image);
+            return "a8 images can't be written as QOI";
+        }
+        layout = PIXEL_LAYOUT_GRAY;
+    }
+    else if (format == CAIRO_FORMAT_RGB24 || fmt == IMAGE_IO_PPM)
+        layout = PIXEL_LAYOUT_RGB;
+    else
+        layout = PIXEL_LAYOUT_RGBA;
+    channels = pixel_layout_bytes[layout];
+
+    /* PPM has no alpha, so colours are left premultiplied, which is the
+     * same as compositing over black. */
+    pixel_conversion_init(&conv, 1, fmt == IMAGE_IO_QOI ? PIXEL_LAYOUT_RGBA
+                                                        : layout,
+                          format, fmt != IMAGE_IO_PPM, width);
+
+    /* Room for a row of unpremultiplied pixels, a converted row, and the
+     * QOI encoding of that. */
+    buf = malloc((size_t) width * 13 + 8);
+    if (!buf) {
+        cairo_surface_destroy(image);
+        return "out of memory";
+    }
+    tmp = (uint32_t *) buf;
+    row = buf + (size_t) width * 4;
+    out = buf + (size_t) width * 8;
+
+    if (fmt == IMAGE_IO_PAM) {
+        sprintf(header, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\n"
+                "TUPLTYPE %s\nENDHDR\n", width, height, channels,
+                channels == 4 ? "RGB_ALPHA"
+                              : channels == 3 ? "RGB" : "GRAYSCALE");
+        len = strlen(header);
+    }
+    else if (fmt == IMAGE_IO_PPM) {
+        sprintf(header, "P%c\n%d %d\n255\n", channels == 1 ? '5' : '6',
+                width, height);
+        len = strlen(header);
+    }
+    else {
+        memcpy(header, "qoif", 4);
+        put_be32((unsigned char *) header + 4, width);
+        put_be32((unsigned char *) header + 8, height);
+        header[12] = (char) channels;
+        header[13] = 0;
+        len = 14;
+        memset(&qoi, 0, sizeof(qoi));
+        qoi.prev[3] = 255;
+    }
+    if (func(closure, (const unsigned char *) header, len))
+        err = write_error;
+
+    row_bytes = (size_t) width * channels;
+    for (y = 0; y < height && !err; ++y) {
+        pixel_export_row(&conv, data + (size_t) y * stride, row, tmp);
+        if (fmt == IMAGE_IO_QOI) {
+            len = qoi_encode_row(&qoi, row, width, out);
+            if (func(closure, out, len))
+                err = write_error;
+        }
+        else if (func(closure, row, row_bytes))
+            err = write_error;
+    }
+
+    if (fmt == IMAGE_IO_QOI && !err) {
+        len = 0;
+        if (qoi.run)
+            out[len++] = QOI_OP_RUN | (qoi.run - 1);
+        memcpy(out + len, qoi_end_marker, 8);
+        if (func(closure, out, len + 8))
+            err = write_error;
+    }
+
+    free(buf);
+    cairo_surface_destroy(image);
+    return err;
+}
+
+/* Read a whitespace separated token from a Netpbm header, skipping
+ * comments.  Returns false at the end of the data. */
+static int
+pnm_read_token (cairo_read_func_t func, void *closure, char *tok,
+                size_t size)
+{
+    unsigned char c;
+    size_t len = 0;
+
+    for (;;) {
+        if (func(closure, &c, 1))
+            return 0;
+        if (c == '#') {
+            do {
+                if (func(closure, &c, 1))
+                    return 0;
+            } while (c != '\n');
+        }
+        else if (!isspace(c))
+            break;
+    }
+    for (;;) {
+        if (len + 1 < size)
+            tok[len++] = (char) c;
+        /* The single whitespace character after the last header value is
+         * consumed here, so the pixel data starts straight after it. */
+        if (func(closure, &c, 1) || isspace(c))
+            break;
+    }
+    tok[len] = '\0';
+    return 1;
+}
+
+static int
+pnm_read_number (cairo_read_func_t func, void *closure, int *value) {
+    char tok[16], *end;
+    long n;
+    if (!pnm_read_token(func, closure, tok, sizeof(tok)))
+        return 0;
+    n = strtol(tok, &end, 10);
+    if (*end || end == tok || n < 0 || n > INT_MAX)
+        return 0;
+    *value = (int) n;
+    return 1;
+}
+
+/* Read a PAM, PPM or PGM header and work out how the pixels are laid out.
+ * Returns an error message if the header is bad or not supported. */
+static const char *
+pnm_read_header (int fmt, cairo_read_func_t func, void *closure,
+                 int *width, int *height, int *channels)
+{
+    static const char bad_header[] = "bad or unsupported image header";
+    char tok[32];
+    int maxval = -1;
+
+    *width = *height = *channels = -1;
+    if (!pnm_read_token(func, closure, tok, sizeof(tok)))
+        return bad_header;
+
+    if (fmt == IMAGE_IO_PPM) {
+        if (!strcmp(tok, "P6"))
+            *channels = 3;
+        else if (!strcmp(tok, "P5"))
+            *channels = 1;
+        else
+            return "not a binary PPM or PGM file";
+        if (!pnm_read_number(func, closure, width)
+            || !pnm_read_number(func, closure, height)
+            || !pnm_read_number(func, closure, &maxval))
+            return bad_header;
+    }
+    else {
+        if (strcmp(tok, "P7"))
+            return "not a PAM file";
+        for (;;) {
+            if (!pnm_read_token(func, closure, tok, sizeof(tok)))
+                return bad_header;
+            if (!strcmp(tok, "ENDHDR"))
+                break;
+            else if (!strcmp(tok, "WIDTH")) {
+                if (!pnm_read_number(func, closure, width))
+                    return bad_header;
+            }
+            else if (!strcmp(tok, "HEIGHT")) {
+                if (!pnm_read_number(func, closure, height))
+                    return bad_header;
+            }
+            else if (!strcmp(tok, "DEPTH")) {
+                if (!pnm_read_number(func, closure, channels))
+                    return bad_header;
+            }
+            else if (!strcmp(tok, "MAXVAL")) {
+                if (!pnm_read_number(func, closure, &maxval))
+                    return bad_header;
+            }
+            else if (!strcmp(tok, "TUPLTYPE")) {
+                /* The depth says all we need to know. */
+                if (!pnm_read_token(func, closure, tok, sizeof(tok)))
+                    return bad_header;
+            }
+            else
+                return bad_header;
+        }
+        if (*channels != 1 && *channels != 3 && *channels != 4)
+            return "only PAM files with a depth of 1, 3 or 4 are supported";
+    }
+
+    if (maxval != 255)
+        return "only images with 8 bits per channel are supported";
+    if (*width < 1 || *width > IMAGE_IO_MAX_SIZE
+        || *height < 1 || *height > IMAGE_IO_MAX_SIZE)
+        return "image size out of range";
+    return 0;
+}
+
+/* Decode QOI data into rows of an image surface, converting them with
+ * 'conv' as they're done. */
+static const char *
+qoi_decode (cairo_read_func_t func, void *closure, const PixelConversion *conv,
+            unsigned char *data, int width, int height, int stride,
+            unsigned char *row)
+{
+    static const char truncated[] = "QOI data ended unexpectedly";
+    unsigned char index[64][4], px[4] = { 0, 0, 0, 255 }, b[4], end[8];
+    int x, y, run = 0;
+
+    memset(index, 0, sizeof(index));
+    for (y = 0; y < height; ++y) {
+        unsigned char *o = row;
+        for (x = 0; x < width; ++x, o += 4) {
+            if (run > 0)
+                --run;
+            else {
+                if (func(closure, b, 1))
+                    return truncated;
+                if (b[0] == QOI_OP_RGB) {
+                    if (func(closure, px, 3))
+                        return truncated;
+                }
+                else if (b[0] == QOI_OP_RGBA) {
+                    if (func(closure, px, 4))
+                        return truncated;
+                }
+                else if ((b[0] & 0xC0) == QOI_OP_INDEX)
+                    memcpy(px, index[b[0]], 4);
+                else if ((b[0] & 0xC0) == QOI_OP_DIFF) {
+                    px[0] += ((b[0] >> 4) & 3) - 2;
+                    px[1] += ((b[0] >> 2) & 3) - 2;
+                    px[2] += (b[0] & 3) - 2;
+                }
+                else if ((b[0] & 0xC0) == QOI_OP_LUMA) {
+                    int vg = (b[0] & 0x3F) - 32;
+                    if (func(closure, b + 1, 1))
+                        return truncated;
+                    px[0] += vg - 8 + ((b[1] >> 4) & 0x0F);
+                    px[1] += vg;
+                    px[2] += vg - 8 + (b[1] & 0x0F);
+                }
+                else
+                    run = b[0] & 0x3F;
+                memcpy(index[QOI_HASH(px[0], px[1], px[2], px[3])], px, 4);
+            }
+            memcpy(o, px, 4);
+        }
+        pixel_import_row(conv, row, data + (size_t) y * stride);
+    }
+
+    if (func(closure, end, 8) || memcmp(end, qoi_end_marker, 8))
+        return "QOI data is missing its end marker";
+    return 0;
+}
+
+/* Read an image in 'fmt' into a new image surface, which is returned in
+ * 'result'.  Raw data has no header, so its format and size have to be
+ * supplied.  Returns an error message on failure, in which case there is
+ * no surface. */
+static const char *
+image_io_read (int fmt, cairo_read_func_t func, void *closure,
+               cairo_format_t raw_format, int raw_width, int raw_height,
+               cairo_surface_t **result)
+{
+    cairo_surface_t *image;
+    cairo_format_t format;
+    unsigned char *data, *buf = 0, hdr[14];
+    int width, height, stride, channels, y, layout;
+    size_t row_bytes;
+    PixelConversion conv;
+    const char *err = 0;
+
+    *result = 0;
+    if (fmt == IMAGE_IO_RAW) {
+        format = raw_format;
+        width = raw_width;
+        height = raw_height;
+        channels = 0;
+    }
+    else if (fmt == IMAGE_IO_QOI) {
+        if (func(closure, hdr, 14))
+            return "QOI data ended unexpectedly";
+        if (memcmp(hdr, "qoif", 4))
+            return "not a QOI file";
+        width = (int) (get_be32(hdr + 4) & 0x7FFFFFFF);
+        height = (int) (get_be32(hdr + 8) & 0x7FFFFFFF);
+        channels = hdr[12];
+        if (channels != 3 && channels != 4)
+            return "bad number of channels in QOI header";
+        if (width < 1 || width > IMAGE_IO_MAX_SIZE
+            || height < 1 || height > IMAGE_IO_MAX_SIZE)
+            return "image size out of range";
+    }
+    else {
+        err = pnm_read_header(fmt, func, closure, &width, &height, &channels);
+        if (err)
+            return err;
+    }
+
+    if (fmt != IMAGE_IO_RAW) {
+        format = channels == 4 ? CAIRO_FORMAT_ARGB32
+               : channels == 3 ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_A8;
+        layout = channels == 4 ? PIXEL_LAYOUT_RGBA
+               : channels == 3 ? PIXEL_LAYOUT_RGB : PIXEL_LAYOUT_GRAY;
+        /* QOI pixels are always decoded to RGBA, even if there are only
+         * three channels in the file. */
+        if (fmt == IMAGE_IO_QOI)
+            layout = PIXEL_LAYOUT_RGBA;
+        pixel_conversion_init(&conv, 0, layout, format, channels == 4,
+                              width);
+    }
+
+    image = cairo_image_surface_create(format, width, height);
+    if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(image);
+        return "out of memory";
+    }
+    data = cairo_image_surface_get_data(image);
+    stride = cairo_image_surface_get_stride(image);
+
+    if (fmt == IMAGE_IO_RAW) {
+        /* Read straight into the surface's memory. */
+        row_bytes = ((size_t) width * format_bits_per_pixel(format) + 7) / 8;
+        for (y = 0; y < height && !err; ++y) {
+            if (func(closure, data + (size_t) y * stride, row_bytes))
+                err = "image data ended unexpectedly";
+        }
+    }
+    else {
+        buf = malloc((size_t) width * 4);
+        if (!buf)
+            err = "out of memory";
+        else if (fmt == IMAGE_IO_QOI)
+            err = qoi_decode(func, closure, &conv, data, width, height,
+                             stride, buf);
+        else {
+            row_bytes = (size_t) width * channels;
+            for (y = 0; y < height && !err; ++y) {
+                if (func(closure, buf, row_bytes))
+                    err = "image data ended unexpectedly";
+                else
+                    pixel_import_row(&conv, buf, data + (size_t) y * stride);
+            }
+        }
+        free(buf);
+    }
+
+    if (err) {
+        cairo_surface_destroy(image);
+        return err;
+    }
+    cairo_surface_mark_dirty(image);
+    *result = image;
+    return 0;
+}
+
+/* vi:set ts=4 sw=4 expandtab: */
@@ -0,0 +1,381 @@
+/* Copyright (C) 2007-2008 Geoff Richards
+ * Copyright (C) 2010-2011 Uli Schlachter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Mipmaps for drawing image surfaces scaled down a long way.  The first
+ * time a surface is drawn small, copies of it at a half, a quarter and so
+ * on of its size are made with a 2x2 box filter and kept with it, and the
+ * one closest to the size drawn is used instead, so that Cairo's filter
+ * only ever has to shrink it by less than a half.
+ *
+ * The copies are thrown away when the surface is drawn on through a
+ * context, or marked dirty.  Each chain of copies, and each pattern set to
+ * use them, counts as a user of the drawing hooks in draw_ops.c. */
+
+#define MIPMAP_MAX_LEVELS 24
+
+typedef struct MipmapChain_ {
+    int num_levels;             /* built so far */
+    cairo_surface_t *levels[MIPMAP_MAX_LEVELS];     /* half size first */
+} MipmapChain;
+
+/* Cairo locks a source pattern to the user space in effect when it was set,
+ * and doesn't say what that was, so contexts keep a note of it for sources
+ * using mipmaps, with a copy for each level of cairo_save(). */
+typedef struct MipmapSourceLock_ {
+    cairo_pattern_t *pattern;   /* reference held, or null if unknown */
+    cairo_matrix_t ctm;
+    struct MipmapSourceLock_ *saved;
+} MipmapSourceLock;
+
+static const cairo_user_data_key_t mipmap_surface_key = { 0 };
+static const cairo_user_data_key_t mipmap_pattern_key = { 0 };
+static const cairo_user_data_key_t mipmap_context_key = { 0 };
+
+/* Number of chains and patterns which need the drawing hooks. */
+static int mipmap_hooks = 0;
+
+static void
+mipmap_hook_release (void *data) {
+    MipmapChain *chain = data;
+    int i;
+    if (data != &mipmap_pattern_key) {
+        for (i = 0; i < chain->num_levels; ++i)
+            cairo_surface_destroy(chain->levels[i]);
+        free(chain);
+    }
+    --mipmap_hooks;
+    --draw_hooks_active;
+}
+
+static int
+mipmap_can_use (cairo_surface_t *surface) {
+    cairo_format_t fmt;
+    if (cairo_surface_get_type(surface) != CAIRO_SURFACE_TYPE_IMAGE)
+        return 0;
+    fmt = cairo_image_surface_get_format(surface);
+    return fmt == CAIRO_FORMAT_ARGB32 || fmt == CAIRO_FORMAT_RGB24;
+}
+
+/* Throw away any mipmaps made from 'surface', because it has changed. */
+static void
+mipmap_invalidate (cairo_surface_t *surface) {
+    if (mipmap_hooks && cairo_surface_get_user_data(surface,
+                                                    &mipmap_surface_key))
+        cairo_surface_set_user_data(surface, &mipmap_surface_key, 0, 0);
+}
+
+typedef struct MipmapHalveJob_ {
+    const unsigned char *src;
+    unsigned char *dst;
+    int src_width, src_height, src_stride, dst_width, dst_stride;
+} MipmapHalveJob;
+
+static void
+mipmap_halve_rows (void *closure, int begin, int end) {
+    MipmapHalveJob *job = closure;
+    const uint32_t *a, *b;
+    uint32_t *dst;
+    int y, y1, pairs = job->src_width / 2;
+
+    for (y = begin; y < end; ++y) {
+        /* An odd row or column at the end is paired with itself. */
+        y1 = 2 * y + 1 < job->src_height ? 2 * y + 1 : 2 * y;
+        a = (const uint32_t *) (job->src + (size_t) 2 * y * job->src_stride);
+        b = (const uint32_t *) (job->src + (size_t) y1 * job->src_stride);
+        dst = (uint32_t *) (job->dst + (size_t) y * job->dst_stride);
+        pixel_kernels->halve(a, b, dst, pairs);
+        if (pairs < job->dst_width)
+            dst[pairs] = average4(a[2 * pairs], a[2 * pairs],
+                                  b[2 * pairs], b[2 * pairs]);
+    }
+}
+
+/* Make an image half the size of 'src', rounding up. */
+static cairo_surface_t *
+mipmap_halve (cairo_surface_t *src) {
+    MipmapHalveJob job;
+    cairo_surface_t *dst;
+
+    job.src_width = cairo_image_surface_get_width(src);
+    job.src_height = cairo_image_surface_get_height(src);
+    job.dst_width = (job.src_width + 1) / 2;
+    dst = cairo_image_surface_create(cairo_image_surface_get_format(src),
+                                     job.dst_width, (job.src_height + 1) / 2);
+    if (cairo_surface_status(dst) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(dst);
+        return 0;
+    }
+    cairo_surface_flush(dst);
+    job.src = cairo_image_surface_get_data(src);
+    job.src_stride = cairo_image_surface_get_stride(src);
+    job.dst = cairo_image_surface_get_data(dst);
+    job.dst_stride = cairo_image_surface_get_stride(dst);
+    parallel_for(cairo_image_surface_get_height(dst), 16, mipmap_halve_rows,
+                 &job);
+    cairo_surface_mark_dirty(dst);
+    return dst;
+}
+
+/* Return the image to draw instead of 'surface' when it is shrunk by a
+ * factor of 2^level, making any missing mipmaps first.  That's the surface
+ * itself for level zero, and the smallest mipmap if there are fewer levels
+ * than asked for.  The caller doesn't get a reference. */
+static cairo_surface_t *
+mipmap_get (cairo_surface_t *surface, int level) {
+    MipmapChain *chain;
+    cairo_surface_t *prev, *next;
+
+    if (level <= 0 || !mipmap_can_use(surface)
+        || cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+        return surface;
+    if (level > MIPMAP_MAX_LEVELS)
+        level = MIPMAP_MAX_LEVELS;
+
+    chain = cairo_surface_get_user_data(surface, &mipmap_surface_key);
+    if (!chain) {
+        chain = malloc(sizeof(MipmapChain));
+        if (!chain)
+            return surface;
+        chain->num_levels = 0;
+        if (cairo_surface_set_user_data(surface, &mipmap_surface_key, chain,
+                                        mipmap_hook_release)
+            != CAIRO_STATUS_SUCCESS)
+        {
+            free(chain);
+            return surface;
+        }
+        ++mipmap_hooks;
+        ++draw_hooks_active;
+        cairo_surface_flush(surface);
+    }
+
+    while (chain->num_levels < level) {
+        prev = chain->num_levels ? chain->levels[chain->num_levels - 1]
+                                 : surface;
+        if (cairo_image_surface_get_width(prev) <= 1
+            && cairo_image_surface_get_height(prev) <= 1)
+            break;
+        if (!cairo_image_surface_get_data(prev) || !(next = mipmap_halve(prev)))
+            break;
+        chain->levels[chain->num_levels++] = next;
+    }
+    return chain->num_levels ? chain->levels[(chain->num_levels < level
+                                              ? chain->num_levels : level) - 1]
+                             : surface;
+}
+
+/* The level to use when each pixel drawn covers 'scale' pixels of the
+ * image, which leaves Cairo shrinking the mipmap by less than a half. */
+static int
+mipmap_level_for_scale (double scale) {
+    int level = 0;
+    while (scale >= 2 && level < MIPMAP_MAX_LEVELS) {
+        scale /= 2;
+        ++level;
+    }
+    return level;
+}
+
+static void
+mipmap_source_lock_free (void *data) {
+    MipmapSourceLock *lock = data, *next;
+    for (; lock; lock = next) {
+        next = lock->saved;
+        if (lock->pattern)
+            cairo_pattern_destroy(lock->pattern);
+        free(lock);
+    }
+}
+
+/* Called after the source of 'cr' is set to 'pattern'. */
+static void
+mipmap_source_set (cairo_t *cr, cairo_pattern_t *pattern) {
+    MipmapSourceLock *lock = cairo_get_user_data(cr, &mipmap_context_key);
+
+    if (!lock) {
+        if (!cairo_pattern_get_user_data(pattern, &mipmap_pattern_key))
+            return;
+        lock = malloc(sizeof(MipmapSourceLock));
+        if (!lock)
+            return;
+        lock->pattern = 0;
+        lock->saved = 0;
+        if (cairo_set_user_data(cr, &mipmap_context_key, lock,
+                                mipmap_source_lock_free)
+            != CAIRO_STATUS_SUCCESS)
+        {
+            free(lock);
+            return;
+        }
+    }
+
+    if (lock->pattern)
+        cairo_pattern_destroy(lock->pattern);
+    lock->pattern = cairo_pattern_reference(pattern);
+    cairo_get_matrix(cr, &lock->ctm);
+}
+
+/* Called after cairo_save(), to keep a copy of the note to go back to. */
+static void
+mipmap_context_save (cairo_t *cr) {
+    MipmapSourceLock *lock = cairo_get_user_data(cr, &mipmap_context_key);
+    MipmapSourceLock *saved;
+
+    if (!lock)
+        return;
+    saved = malloc(sizeof(MipmapSourceLock));
+    if (!saved) {
+        /* Forget everything, rather than get out of step with the
+         * saved states. */
+        cairo_set_user_data(cr, &mipmap_context_key, 0, 0);
+        return;
+    }
+    *saved = *lock;
+    if (saved->pattern)
+        cairo_pattern_reference(saved->pattern);
+    lock->saved = saved;
+}
+
+/* Called after cairo_restore().  Sources set before the note was started
+ * were locked to a user space which isn't known. */
+static void
+mipmap_context_restore (cairo_t *cr) {
+    MipmapSourceLock *lock = cairo_get_user_data(cr, &mipmap_context_key);
+    MipmapSourceLock *saved;
+
+    if (!lock)
+        return;
+    if (lock->pattern)
+        cairo_pattern_destroy(lock->pattern);
+    lock->pattern = 0;
+    if ((saved = lock->saved)) {
+        *lock = *saved;
+        free(saved);
+    }
+}
+
+/* Find the CTM which the source of 'cr' was locked to, which is the current
+ * one if it isn't known. */
+static void
+mipmap_source_ctm (cairo_t *cr, cairo_pattern_t *source,
+                   cairo_matrix_t *ctm)
+{
+    MipmapSourceLock *lock = cairo_get_user_data(cr, &mipmap_context_key);
+    if (lock && lock->pattern == source)
+        *ctm = lock->ctm;
+    else
+        cairo_get_matrix(cr, ctm);
+}
+
+/* Make 'pattern' the source of 'cr', locked to the user space 'ctm'. */
+static void
+mipmap_set_source_locked (cairo_t *cr, cairo_pattern_t *pattern,
+                          const cairo_matrix_t *ctm)
+{
+    cairo_matrix_t current;
+    cairo_get_matrix(cr, &current);
+    cairo_set_matrix(cr, ctm);
+    cairo_set_source(cr, pattern);
+    cairo_set_matrix(cr, &current);
+}
+
+/* Called by the drawing hooks before an operation on 'cr'.  The target is
+ * about to change, so its mipmaps go.  If the source is a pattern set to
+ * use mipmaps, and is being shrunk, a pattern for the right mipmap is put
+ * in its place, and the original is returned (with a reference) so that
+ * it can be put back afterwards. */
+static cairo_pattern_t *
+mipmap_draw_begin (cairo_t *cr) {
+    cairo_pattern_t *source = cairo_get_source(cr), *replacement;
+    cairo_surface_t *surface, *level;
+    cairo_matrix_t ctm, to_user, to_pattern, scale;
+    double sx, sy;
+
+    mipmap_invalidate(cairo_get_group_target(cr));
+
+    if (!cairo_pattern_get_user_data(source, &mipmap_pattern_key)
+        || cairo_pattern_get_surface(source, &surface) != CAIRO_STATUS_SUCCESS)
+        return 0;
+
+    /* Work out how many pixels of the image each device pixel covers. */
+    mipmap_source_ctm(cr, source, &ctm);
+    to_user = ctm;
+    if (cairo_matrix_invert(&to_user) != CAIRO_STATUS_SUCCESS)
+        return 0;
+    cairo_pattern_get_matrix(source, &to_pattern);
+    cairo_matrix_multiply(&to_pattern, &to_user, &to_pattern);
+    sx = sqrt(to_pattern.xx * to_pattern.xx + to_pattern.yx * to_pattern.yx);
+    sy = sqrt(to_pattern.xy * to_pattern.xy + to_pattern.yy * to_pattern.yy);
+
+    level = mipmap_get(surface, mipmap_level_for_scale(sx < sy ? sx : sy));
+    if (level == surface)
+        return 0;
+
+    replacement = cairo_pattern_create_for_surface(level);
+    cairo_matrix_init_scale(&scale,
+        (double) cairo_image_surface_get_width(level)
+                 / cairo_image_surface_get_width(surface),
+        (double) cairo_image_surface_get_height(level)
+                 / cairo_image_surface_get_height(surface));
+    cairo_pattern_get_matrix(source, &to_pattern);
+    cairo_matrix_multiply(&to_pattern, &to_pattern, &scale);
+    cairo_pattern_set_matrix(replacement, &to_pattern);
+    cairo_pattern_set_filter(replacement, cairo_pattern_get_filter(source));
+    cairo_pattern_set_extend(replacement, cairo_pattern_get_extend(source));
+
+    /* Both patterns have to be set in the user space the original was
+     * locked to, or the replacement would be drawn in the wrong place and
+     * the original would be moved when it is put back. */
+    cairo_pattern_reference(source);
+    mipmap_set_source_locked(cr, replacement, &ctm);
+    cairo_pattern_destroy(replacement);
+    return source;
+}
+
+static void
+mipmap_draw_end (cairo_t *cr, cairo_pattern_t *source) {
+    cairo_matrix_t ctm;
+    mipmap_source_ctm(cr, source, &ctm);
+    mipmap_set_source_locked(cr, source, &ctm);
+    cairo_pattern_destroy(source);
+}
+
+/* Turn the use of mipmaps by a surface pattern on or off.  Returns false
+ * if that couldn't be done. */
+static int
+mipmap_pattern_enable (cairo_pattern_t *pattern, int enable) {
+    if (enable == (cairo_pattern_get_user_data(pattern, &mipmap_pattern_key)
+                   != 0))
+        return 1;
+    if (cairo_pattern_set_user_data(pattern, &mipmap_pattern_key,
+                                    enable ? (void *) &mipmap_pattern_key : 0,
+                                    enable ? mipmap_hook_release : 0)
+        != CAIRO_STATUS_SUCCESS)
+        return 0;
+    if (enable) {
+        ++mipmap_hooks;
+        ++draw_hooks_active;
+    }
+    return 1;
+}
+
+/* vi:set ts=4 sw=4 expandtab: */
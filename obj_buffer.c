@@ -0,0 +1,326 @@
+/* Copyright (C) 2007-2008 Geoff Richards
+ * Copyright (C) 2010-2011 Uli Schlachter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Image buffer objects give direct access to the pixel memory of an image
+ * surface, without copying it into a Lua string the way surf:get_data()
+ * does.  The object just holds a reference to the surface, and looks up the
+ * data pointer each time it is used. */
+
+typedef struct ImageBufferInfo_ {
+    unsigned char *data;
+    cairo_format_t format;
+    int width, height, stride;
+    int bpp;                    /* bits per pixel */
+} ImageBufferInfo;
+
+static int
+format_bits_per_pixel (cairo_format_t fmt) {
+    switch (fmt) {
+        case CAIRO_FORMAT_A1:     return 1;
+        case CAIRO_FORMAT_A8:     return 8;
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+        case CAIRO_FORMAT_RGB16_565: return 16;
+#endif
+        default:                  return 32;
+    }
+}
+
+/* Get the buffer object at 'pos', flush any drawing pending on its surface
+ * so that the memory is up to date, and fill in 'info'. */
+static cairo_surface_t *
+get_image_buffer (lua_State *L, int pos, ImageBufferInfo *info) {
+    cairo_surface_t **obj = luaL_checkudata(L, pos, OOCAIRO_MT_NAME_BUFFER);
+
+    cairo_surface_flush(*obj);
+    info->data = cairo_image_surface_get_data(*obj);
+    if (!info->data && cairo_surface_status(*obj) != CAIRO_STATUS_SUCCESS)
+        luaL_error(L, "image buffer is no longer valid: %s",
+                   cairo_status_to_string(cairo_surface_status(*obj)));
+    info->format = cairo_image_surface_get_format(*obj);
+    info->width = cairo_image_surface_get_width(*obj);
+    info->height = cairo_image_surface_get_height(*obj);
+    info->stride = cairo_image_surface_get_stride(*obj);
+    info->bpp = format_bits_per_pixel(info->format);
+    return *obj;
+}
+
+static unsigned char *
+check_pixel_pos (lua_State *L, const ImageBufferInfo *info, int xpos,
+                 int *xret, int *yret)
+{
+    int x = luaL_checkinteger(L, xpos);
+    int y = luaL_checkinteger(L, xpos + 1);
+    luaL_argcheck(L, x >= 0 && x < info->width, xpos,
+                  "x coordinate out of range");
+    luaL_argcheck(L, y >= 0 && y < info->height, xpos + 1,
+                  "y coordinate out of range");
+    *xret = x;
+    *yret = y;
+    return info->data + (size_t) y * info->stride;
+}
+
+/* A1 pixels are packed into 32 bit words, starting from the least
+ * significant bit on little endian machines and the most significant one
+ * on big endian ones. */
+static int
+a1_bit (int x) {
+    return IS_BIG_ENDIAN ? 31 - (x & 31) : (x & 31);
+}
+
+static int
+buffer_eq (lua_State *L) {
+    cairo_surface_t **obj1 = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_BUFFER);
+    cairo_surface_t **obj2 = luaL_checkudata(L, 2, OOCAIRO_MT_NAME_BUFFER);
+    lua_pushboolean(L, *obj1 == *obj2);
+    return 1;
+}
+
+static int
+buffer_gc (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_BUFFER);
+    if (*obj) {
+        cairo_surface_destroy(*obj);
+        *obj = 0;
+    }
+    return 0;
+}
+
+static int
+buffer_len (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_BUFFER);
+    lua_pushnumber(L, (lua_Number) cairo_image_surface_get_stride(*obj)
+                      * cairo_image_surface_get_height(*obj));
+    return 1;
+}
+
+static int
+buffer_flush (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_BUFFER);
+    cairo_surface_flush(*obj);
+    return 0;
+}
+
+static int
+buffer_get (lua_State *L) {
+    ImageBufferInfo info;
+    const unsigned char *row;
+    int x, y;
+    uint32_t word;
+    uint16_t half;
+
+    get_image_buffer(L, 1, &info);
+    row = check_pixel_pos(L, &info, 2, &x, &y);
+
+    switch (info.bpp) {
+        case 1:
+            memcpy(&word, row + (x >> 5) * 4, 4);
+            lua_pushnumber(L, (word >> a1_bit(x)) & 1);
+            break;
+        case 8:
+            lua_pushnumber(L, row[x]);
+            break;
+        case 16:
+            memcpy(&half, row + x * 2, 2);
+            lua_pushnumber(L, half);
+            break;
+        default:
+            memcpy(&word, row + x * 4, 4);
+            lua_pushnumber(L, word);
+            break;
+    }
+    return 1;
+}
+
+static int
+buffer_get_format (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_BUFFER);
+    return format_to_lua(L, cairo_image_surface_get_format(*obj));
+}
+
+static int
+buffer_get_height (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_BUFFER);
+    lua_pushnumber(L, cairo_image_surface_get_height(*obj));
+    return 1;
+}
+
+static int
+buffer_get_pointer (lua_State *L) {
+    ImageBufferInfo info;
+    get_image_buffer(L, 1, &info);
+    lua_pushlightuserdata(L, info.data);
+    return 1;
+}
+
+static int
+buffer_get_row (lua_State *L) {
+    ImageBufferInfo info;
+    int y;
+
+    get_image_buffer(L, 1, &info);
+    y = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, y >= 0 && y < info.height, 2,
+                  "y coordinate out of range");
+    lua_pushlstring(L, (const char *) info.data + (size_t) y * info.stride,
+                    ((size_t) info.width * info.bpp + 7) / 8);
+    return 1;
+}
+
+static int
+buffer_get_stride (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_BUFFER);
+    lua_pushnumber(L, cairo_image_surface_get_stride(*obj));
+    return 1;
+}
+
+static int
+buffer_get_surface (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_BUFFER);
+    return oocairo_surface_push(L, *obj);
+}
+
+static int
+buffer_get_width (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_BUFFER);
+    lua_pushnumber(L, cairo_image_surface_get_width(*obj));
+    return 1;
+}
+
+/* Shared with surf:mark_dirty().  The rectangle is optional. */
+static int
+mark_dirty_from_lua (lua_State *L, cairo_surface_t *surface, int pos) {
+    if (lua_isnoneornil(L, pos)) {
+        cairo_surface_mark_dirty(surface);
+        damage_add_surface_all(surface);
+        mipmap_invalidate(surface);
+    }
+    else {
+        int x = luaL_checkinteger(L, pos);
+        int y = luaL_checkinteger(L, pos + 1);
+        int width = luaL_checkinteger(L, pos + 2);
+        int height = luaL_checkinteger(L, pos + 3);
+        luaL_argcheck(L, width >= 0, pos + 2, "width cannot be negative");
+        luaL_argcheck(L, height >= 0, pos + 3, "height cannot be negative");
+        cairo_surface_mark_dirty_rectangle(surface, x, y, width, height);
+        damage_add_surface_rect(surface, x, y, width, height);
+        mipmap_invalidate(surface);
+    }
+    return 0;
+}
+
+static int
+buffer_mark_dirty (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_BUFFER);
+    return mark_dirty_from_lua(L, *obj, 2);
+}
+
+static int
+buffer_set (lua_State *L) {
+    ImageBufferInfo info;
+    cairo_surface_t *surface;
+    unsigned char *row;
+    int x, y;
+    lua_Number value, max;
+    uint32_t word;
+    uint16_t half;
+
+    surface = get_image_buffer(L, 1, &info);
+    row = check_pixel_pos(L, &info, 2, &x, &y);
+    value = luaL_checknumber(L, 4);
+    max = info.bpp == 32 ? 4294967295.0 : (lua_Number) ((1u << info.bpp) - 1);
+    luaL_argcheck(L, value >= 0 && value <= max, 4,
+                  "pixel value out of range for this format");
+
+    switch (info.bpp) {
+        case 1:
+            memcpy(&word, row + (x >> 5) * 4, 4);
+            if (value)
+                word |= (uint32_t) 1 << a1_bit(x);
+            else
+                word &= ~((uint32_t) 1 << a1_bit(x));
+            memcpy(row + (x >> 5) * 4, &word, 4);
+            break;
+        case 8:
+            row[x] = (unsigned char) value;
+            break;
+        case 16:
+            half = (uint16_t) value;
+            memcpy(row + x * 2, &half, 2);
+            break;
+        default:
+            word = (uint32_t) value;
+            memcpy(row + x * 4, &word, 4);
+            break;
+    }
+
+    cairo_surface_mark_dirty_rectangle(surface, x, y, 1, 1);
+    damage_add_surface_rect(surface, x, y, 1, 1);
+    mipmap_invalidate(surface);
+    return 0;
+}
+
+static int
+buffer_set_row (lua_State *L) {
+    ImageBufferInfo info;
+    cairo_surface_t *surface;
+    int y;
+    const char *s;
+    size_t len, row_len;
+
+    surface = get_image_buffer(L, 1, &info);
+    y = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, y >= 0 && y < info.height, 2,
+                  "y coordinate out of range");
+    s = luaL_checklstring(L, 3, &len);
+    row_len = ((size_t) info.width * info.bpp + 7) / 8;
+    luaL_argcheck(L, len == row_len, 3,
+                  "row data must be exactly one row of pixels long");
+
+    memcpy(info.data + (size_t) y * info.stride, s, len);
+    cairo_surface_mark_dirty_rectangle(surface, 0, y, info.width, 1);
+    damage_add_surface_rect(surface, 0, y, info.width, 1);
+    mipmap_invalidate(surface);
+    return 0;
+}
+
+static const luaL_Reg
+buffer_methods[] = {
+    { "__eq", buffer_eq },
+    { "__gc", buffer_gc },
+    { "__len", buffer_len },
+    { "flush", buffer_flush },
+    { "get", buffer_get },
+    { "get_format", buffer_get_format },
+    { "get_height", buffer_get_height },
+    { "get_pointer", buffer_get_pointer },
+    { "get_row", buffer_get_row },
+    { "get_stride", buffer_get_stride },
+    { "get_surface", buffer_get_surface },
+    { "get_width", buffer_get_width },
+    { "len", buffer_len },
+    { "mark_dirty", buffer_mark_dirty },
+    { "set", buffer_set },
+    { "set_row", buffer_set_row },
+    { 0, 0 }
+};
+
+/* vi:set ts=4 sw=4 expandtab: */
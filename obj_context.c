@@ -170,7 +170,7 @@ cr_device_to_user_distance (lua_State *L) {
 static int
 cr_fill (lua_State *L) {
     cairo_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_CONTEXT);
-    cairo_fill(*obj);
+    DRAW_OP(L, *obj, DRAW_OP_FILL, cairo_fill(*obj));
     return 0;
 }
 
@@ -189,7 +189,7 @@ cr_fill_extents (lua_State *L) {
 static int
 cr_fill_preserve (lua_State *L) {
     cairo_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_CONTEXT);
-    cairo_fill_preserve(*obj);
+    DRAW_OP(L, *obj, DRAW_OP_FILL, cairo_fill_preserve(*obj));
     return 0;
 }
 
@@ -461,17 +461,20 @@ cr_mask (lua_State *L) {
             lua_getfield(L, LUA_REGISTRYINDEX, OOCAIRO_MT_NAME_PATTERN);
             if (lua_rawequal(L, -1, -2)) {
                 pattern = p;
-                cairo_mask(*obj, *pattern);
+                DRAW_OP_NOTE_MASK(*obj, *pattern);
+                DRAW_OP(L, *obj, DRAW_OP_MASK, cairo_mask(*obj, *pattern));
                 return 0;
             }
             lua_pop(L, 1);
 
             lua_getfield(L, LUA_REGISTRYINDEX, OOCAIRO_MT_NAME_SURFACE);
             if (lua_rawequal(L, -1, -2)) {
+                double x = luaL_optnumber(L, 3, 0);
+                double y = luaL_optnumber(L, 4, 0);
                 surface = p;
-                cairo_mask_surface(*obj, *surface,
-                                   luaL_optnumber(L, 3, 0),
-                                   luaL_optnumber(L, 4, 0));
+                DRAW_OP_NOTE_MASK_SURFACE(*obj);
+                DRAW_OP(L, *obj, DRAW_OP_MASK,
+                        cairo_mask_surface(*obj, *surface, x, y));
                 return 0;
             }
             lua_pop(L, 2);
@@ -498,14 +501,15 @@ cr_new_sub_path (lua_State *L) {
 static int
 cr_paint (lua_State *L) {
     cairo_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_CONTEXT);
-    cairo_paint(*obj);
+    DRAW_OP(L, *obj, DRAW_OP_PAINT, cairo_paint(*obj));
     return 0;
 }
 
 static int
 cr_paint_with_alpha (lua_State *L) {
     cairo_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_CONTEXT);
-    cairo_paint_with_alpha(*obj, luaL_checknumber(L, 2));
+    double alpha = luaL_checknumber(L, 2);
+    DRAW_OP(L, *obj, DRAW_OP_PAINT, cairo_paint_with_alpha(*obj, alpha));
     return 0;
 }
 
@@ -588,6 +592,7 @@ static int
 cr_restore (lua_State *L) {
     cairo_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_CONTEXT);
     cairo_restore(*obj);
+    mipmap_context_restore(*obj);
     return 0;
 }
 
@@ -602,6 +607,7 @@ static int
 cr_save (lua_State *L) {
     cairo_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_CONTEXT);
     cairo_save(*obj);
+    mipmap_context_save(*obj);
     return 0;
 }
 
@@ -792,6 +798,7 @@ cr_set_source (lua_State *L) {
             if (lua_rawequal(L, -1, -2)) {
                 pattern = p;
                 cairo_set_source(*obj, *pattern);
+                mipmap_source_set(*obj, *pattern);
                 return 0;
             }
             lua_pop(L, 1);
@@ -907,7 +914,8 @@ cr_show_glyphs (lua_State *L) {
     cairo_glyph_t *glyphs;
     int num_glyphs;
     from_lua_glyph_array(L, &glyphs, &num_glyphs, 2);
-    cairo_show_glyphs(*obj, glyphs, num_glyphs);
+    DRAW_GLYPHS_OP(L, *obj, DRAW_OP_GLYPHS, 0, glyphs, num_glyphs,
+                   cairo_show_glyphs(*obj, glyphs, num_glyphs));
     if (glyphs)
         GLYPHS_FREE(glyphs);
     return 0;
@@ -916,7 +924,9 @@ cr_show_glyphs (lua_State *L) {
 static int
 cr_show_text (lua_State *L) {
     cairo_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_CONTEXT);
-    cairo_show_text(*obj, luaL_checkstring(L, 2));
+    const char *text = luaL_checkstring(L, 2);
+    DRAW_GLYPHS_OP(L, *obj, DRAW_OP_GLYPHS, text, 0, 0,
+                   cairo_show_text(*obj, text));
     return 0;
 }
 
@@ -934,8 +944,10 @@ cr_show_text_glyphs (lua_State *L) {
     from_lua_glyph_array(L, &glyphs, &num_glyphs, 3);
     from_lua_clusters_table(L, &clusters, &num_clusters, &cluster_flags, 4);
 
-    cairo_show_text_glyphs(*obj, text, text_len, glyphs, num_glyphs,
-                           clusters, num_clusters, cluster_flags);
+    DRAW_GLYPHS_OP(L, *obj, DRAW_OP_GLYPHS, 0, glyphs, num_glyphs,
+                   cairo_show_text_glyphs(*obj, text, text_len,
+                                          glyphs, num_glyphs, clusters,
+                                          num_clusters, cluster_flags));
     if (glyphs)
         GLYPHS_FREE(glyphs);
     if (clusters)
@@ -947,7 +959,7 @@ cr_show_text_glyphs (lua_State *L) {
 static int
 cr_stroke (lua_State *L) {
     cairo_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_CONTEXT);
-    cairo_stroke(*obj);
+    DRAW_OP(L, *obj, DRAW_OP_STROKE, cairo_stroke(*obj));
     return 0;
 }
 
@@ -966,10 +978,18 @@ cr_stroke_extents (lua_State *L) {
 static int
 cr_stroke_preserve (lua_State *L) {
     cairo_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_CONTEXT);
-    cairo_stroke_preserve(*obj);
+    DRAW_OP(L, *obj, DRAW_OP_STROKE, cairo_stroke_preserve(*obj));
     return 0;
 }
 
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+static int
+cr_take_damage (lua_State *L) {
+    cairo_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_CONTEXT);
+    return damage_take(L, cairo_get_user_data(*obj, &damage_context_key));
+}
+#endif
+
 static int
 cr_text_extents (lua_State *L) {
     cairo_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_CONTEXT);
@@ -986,6 +1006,30 @@ cr_text_path (lua_State *L) {
     return 0;
 }
 
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+static int
+cr_track_damage (lua_State *L) {
+    cairo_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_CONTEXT);
+    int enable = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+    cairo_region_t *region = 0;
+    cairo_status_t status;
+
+    if (enable == (cairo_get_user_data(*obj, &damage_context_key) != 0))
+        return 0;
+    if (enable && !(region = damage_tracker_create()))
+        return luaL_error(L, "out of memory");
+    status = cairo_set_user_data(*obj, &damage_context_key, region,
+                                 region ? damage_region_free : 0);
+    if (status != CAIRO_STATUS_SUCCESS) {
+        if (region)
+            damage_region_free(region);
+        return luaL_error(L, "error tracking damage: %s",
+                          cairo_status_to_string(status));
+    }
+    return 0;
+}
+#endif
+
 static int
 cr_transform (lua_State *L) {
     cairo_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_CONTEXT);
@@ -1125,8 +1169,14 @@ context_methods[] = {
     { "stroke", cr_stroke },
     { "stroke_extents", cr_stroke_extents },
     { "stroke_preserve", cr_stroke_preserve },
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+    { "take_damage", cr_take_damage },
+#endif
     { "text_extents", cr_text_extents },
     { "text_path", cr_text_path },
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+    { "track_damage", cr_track_damage },
+#endif
     { "transform", cr_transform },
     { "translate", cr_translate },
     { "user_to_device", cr_user_to_device },
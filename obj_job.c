@@ -0,0 +1,243 @@
+/* Copyright (C) 2007-2008 Geoff Richards
+ * Copyright (C) 2010-2011 Uli Schlachter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Job objects stand for work which is being done in the background, such
+ * as encoding an image, so that Lua can carry on while it runs.  The code
+ * which creates a job supplies a function to do the work, which must not
+ * use Lua, and one which is called on the Lua thread afterwards to turn the
+ * outcome into return values.  The work is done by the thread pool in
+ * parallel.c.  If that can't take it, for example without POSIX threads,
+ * the work is done straight away, and the job is already finished when
+ * it's returned.
+ *
+ * The job itself is allocated separately from its Lua object, so that a
+ * job which is garbage collected while it's still running can be left to
+ * finish.  The pool then hands it back to the Lua state which created it,
+ * and it's freed on that state's thread the next time one of its jobs is
+ * created or collected, or when it's closed, so that Cairo objects in its
+ * data are never destroyed by a worker or by another state. */
+
+typedef cairo_status_t (*JobRunFunc) (void *data);
+typedef int (*JobResultFunc) (lua_State *L, void *data,
+                              cairo_status_t status);
+typedef void (*JobFreeFunc) (void *data);
+
+typedef struct Job_ {
+    TPoolTask task;
+    TPoolUser *user;             /* for the Lua state which created it */
+    JobRunFunc run;
+    JobResultFunc result;
+    JobFreeFunc free;
+    void *data;
+    cairo_status_t status;
+} Job;
+
+static const char * const job_state_names[] = {
+    "new", "queued", "running", "done", "cancelled"
+};
+
+static void
+job_task_run (TPoolTask *task) {
+    Job *job = task->data;
+    job->status = job->run(job->data);
+}
+
+static void
+job_destroy (Job *job) {
+    if (job->data && job->free)
+        job->free(job->data);
+    free(job);
+}
+
+/* The Lua state's user of the thread pool, which is made when the module
+ * is loaded. */
+static TPoolUser *
+job_pool_user (lua_State *L) {
+    TPoolUser *user;
+    lua_getfield(L, LUA_REGISTRYINDEX, OOCAIRO_THREAD_POOL_KEY);
+    user = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return user;
+}
+
+/* Free the jobs of a Lua state which were collected while they were still
+ * running, and have finished since. */
+static void
+job_free_orphans (TPoolUser *user) {
+    TPoolTask *task = tpool_take_orphans(user), *next;
+    for (; task; task = next) {
+        next = task->next_orphan;
+        job_destroy(task->data);
+    }
+}
+
+/* Push a new job object, which the caller fills in and then passes to
+ * job_start().  It is safe for the job to be garbage collected before it's
+ * started, as long as 'data' is either null or usable by 'free'. */
+static Job *
+job_create (lua_State *L, JobRunFunc run, JobResultFunc result,
+            JobFreeFunc free)
+{
+    TPoolUser *user = job_pool_user(L);
+    Job **obj = lua_newuserdata(L, sizeof(Job *));
+    Job *job;
+
+    *obj = 0;
+    luaL_getmetatable(L, OOCAIRO_MT_NAME_JOB);
+    lua_setmetatable(L, -2);
+    job_free_orphans(user);
+    job = *obj = malloc(sizeof(Job));
+    if (!job) {
+        luaL_error(L, "out of memory");
+        return 0;
+    }
+    job->task.run = job_task_run;
+    job->task.data = job;
+    job->task.state = TPOOL_TASK_NEW;
+    job->user = user;
+    job->run = run;
+    job->result = result;
+    job->free = free;
+    job->data = 0;
+    job->status = CAIRO_STATUS_SUCCESS;
+    return job;
+}
+
+static void
+job_start (Job *job) {
+    if (!tpool_submit(&job->task))
+        tpool_run_here(&job->task);
+}
+
+/* Do the work straight away, for jobs which can't be done by the pool. */
+static void
+job_run_here (Job *job) {
+    tpool_run_here(&job->task);
+}
+
+static Job *
+job_check (lua_State *L, int pos) {
+    Job **obj = luaL_checkudata(L, pos, OOCAIRO_MT_NAME_JOB);
+    if (!*obj)
+        luaL_error(L, "job object has been freed");
+    return *obj;
+}
+
+static int
+job_push_result (lua_State *L, Job *job, int state) {
+    if (state == TPOOL_TASK_NEW)
+        return luaL_error(L, "job was never started");
+    if (state == TPOOL_TASK_CANCELLED)
+        return luaL_error(L, "job was cancelled");
+    return job->result(L, job->data, job->status);
+}
+
+/* A job which is still queued or running isn't cancelled, because jobs
+ * such as writing a file are often started without the result being
+ * wanted.  It's left to the pool to finish, and freed afterwards. */
+static int
+job_gc (lua_State *L) {
+    Job **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_JOB);
+    Job *job = *obj;
+    TPoolUser *user;
+    if (!job)
+        return 0;
+    *obj = 0;
+    user = job->user;
+    if (!tpool_detach(&job->task, user))
+        job_destroy(job);
+    job_free_orphans(user);
+    return 0;
+}
+
+/* Returns true if the job was taken out of the queue before it started. */
+static int
+job_cancel (lua_State *L) {
+    Job *job = job_check(L, 1);
+    lua_pushboolean(L, tpool_cancel(&job->task));
+    return 1;
+}
+
+static int
+job_done (lua_State *L) {
+    Job *job = job_check(L, 1);
+    int state = tpool_task_state(&job->task, 0);
+    lua_pushboolean(L, state == TPOOL_TASK_DONE
+                       || state == TPOOL_TASK_CANCELLED);
+    return 1;
+}
+
+/* Returns whatever the job gives when it's finished, or nothing if it's
+ * still running. */
+static int
+job_result (lua_State *L) {
+    Job *job = job_check(L, 1);
+    int state = tpool_task_state(&job->task, 0);
+    if (state == TPOOL_TASK_QUEUED || state == TPOOL_TASK_RUNNING)
+        return 0;
+    return job_push_result(L, job, state);
+}
+
+/* Times are in microseconds, like the ones from the frame profiler. */
+static int
+job_stats (lua_State *L) {
+    Job *job = job_check(L, 1);
+    TPoolTask task;
+    int state = tpool_task_state(&job->task, &task);
+    double now = profiler_now();
+
+    lua_createtable(L, 0, 3);
+    lua_pushstring(L, job_state_names[state]);
+    lua_setfield(L, -2, "state");
+    if (state != TPOOL_TASK_NEW) {
+        lua_pushnumber(L, (state == TPOOL_TASK_QUEUED ? now
+                           : state == TPOOL_TASK_CANCELLED ? task.finished_at
+                           : task.started_at) - task.queued_at);
+        lua_setfield(L, -2, "wait_time");
+    }
+    if (state == TPOOL_TASK_RUNNING || state == TPOOL_TASK_DONE) {
+        lua_pushnumber(L, (state == TPOOL_TASK_DONE ? task.finished_at : now)
+                          - task.started_at);
+        lua_setfield(L, -2, "run_time");
+    }
+    return 1;
+}
+
+static int
+job_wait (lua_State *L) {
+    Job *job = job_check(L, 1);
+    tpool_wait(&job->task);
+    return job_push_result(L, job, tpool_task_state(&job->task, 0));
+}
+
+static const luaL_Reg
+job_methods[] = {
+    { "__gc", job_gc },
+    { "cancel", job_cancel },
+    { "done", job_done },
+    { "result", job_result },
+    { "stats", job_stats },
+    { "wait", job_wait },
+    { 0, 0 }
+};
+
+/* vi:set ts=4 sw=4 expandtab: */
@@ -384,6 +384,17 @@ mesh_set_corner_color_rgba (lua_State *L) {
 }
 #endif
 
+static int
+pattern_use_mipmaps (lua_State *L) {
+    cairo_pattern_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_PATTERN);
+    int enable = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+    if (cairo_pattern_get_type(*obj) != CAIRO_PATTERN_TYPE_SURFACE)
+        return luaL_error(L, "use_mipmaps() only works on surface patterns");
+    if (!mipmap_pattern_enable(*obj, enable))
+        return luaL_error(L, "out of memory");
+    return 0;
+}
+
 static const luaL_Reg
 pattern_methods[] = {
     { "__eq", pattern_eq },
@@ -402,6 +413,7 @@ pattern_methods[] = {
     { "set_extend", pattern_set_extend },
     { "set_filter", pattern_set_filter },
     { "set_matrix", pattern_set_matrix },
+    { "use_mipmaps", pattern_use_mipmaps },
 #if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 12, 0)
     { "begin_patch", mesh_begin_patch },
     { "curve_to", mesh_curve_to },
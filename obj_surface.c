@@ -37,15 +37,136 @@ image_surface_create (lua_State *L) {
     return 1;
 }
 
+/* The memory used by image surfaces created from data has to stay valid
+ * until Cairo is finished with the surface, which can be after the Lua
+ * object has been garbage collected.  So whatever keeps it alive (our own
+ * copy of the data, a reference to the surface it was borrowed from, or a
+ * reference to a Lua value) is attached to the surface as user data. */
+static cairo_user_data_key_t image_buffer_key;
+
+typedef struct ImageDataRef_ {
+    lua_State *L;
+    int ref;
+} ImageDataRef;
+
+static void
+image_data_ref_free (void *data) {
+    ImageDataRef *info = data;
+    luaL_unref(info->L, LUA_REGISTRYINDEX, info->ref);
+    free(info);
+}
+
+static void
+image_data_surface_free (void *data) {
+    cairo_surface_destroy(data);
+}
+
+/* Keep the Lua value at 'pos' alive for as long as 'surface' exists. */
+static int
+image_data_ref_value (lua_State *L, cairo_surface_t *surface, int pos) {
+    ImageDataRef *info = malloc(sizeof(ImageDataRef));
+    if (!info)
+        return 0;
+    info->L = L;
+    lua_pushvalue(L, pos);
+    info->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (cairo_surface_set_user_data(surface, &image_buffer_key, info,
+                                    image_data_ref_free)
+            != CAIRO_STATUS_SUCCESS)
+    {
+        image_data_ref_free(info);
+        return 0;
+    }
+    return 1;
+}
+
+/* Find the memory holding pixel data passed in from Lua, which can be a
+ * string (which mustn't be written to), an image buffer object, a full
+ * userdata without a metatable or a light userdata.  There's no way to tell how big the
+ * memory pointed to by a light userdata is, so for those the length is
+ * set to the largest possible value, and the caller has to trust it.  If
+ * 'borrowed' isn't null it is set to the surface of an image buffer. */
+static unsigned char *
+pixel_data_from_lua (lua_State *L, int pos, size_t *len,
+                     cairo_surface_t ***borrowed)
+{
+    unsigned char *data = 0;
+    cairo_surface_t **buf;
+
+    *len = (size_t) -1;
+    if (borrowed)
+        *borrowed = 0;
+
+    switch (lua_type(L, pos)) {
+        case LUA_TSTRING:
+            data = (unsigned char *) lua_tolstring(L, pos, len);
+            break;
+        case LUA_TUSERDATA:
+            data = lua_touserdata(L, pos);
+            *len = lua_objlen(L, pos);
+            if (lua_getmetatable(L, pos)) {
+                lua_getfield(L, LUA_REGISTRYINDEX, OOCAIRO_MT_NAME_BUFFER);
+                if (lua_rawequal(L, -1, -2)) {
+                    /* Use the memory of an image surface. */
+                    buf = lua_touserdata(L, pos);
+                    cairo_surface_flush(*buf);
+                    data = cairo_image_surface_get_data(*buf);
+                    *len = (size_t) cairo_image_surface_get_stride(*buf)
+                           * cairo_image_surface_get_height(*buf);
+                    luaL_argcheck(L, data != 0, pos, "image buffer is not valid");
+                    if (borrowed)
+                        *borrowed = buf;
+                }
+                else {
+                    /* Other objects with metatables, including this
+                     * module's own, hold memory which mustn't be
+                     * treated as pixels. */
+                    luaL_typerror(L, pos, "string, image buffer or userdata"
+                                  " without a metatable");
+                }
+                lua_pop(L, 2);
+            }
+            break;
+        case LUA_TLIGHTUSERDATA:
+            data = lua_touserdata(L, pos);
+            luaL_argcheck(L, data != 0, pos, "null pointer for image data");
+            break;
+        default:
+            luaL_typerror(L, pos, "string, image buffer or userdata");
+    }
+    return data;
+}
+
+static void image_pixels_changed (cairo_surface_t *surface, int x, int y,
+                                  int width, int height);
+
+/* Record that the first 'len' bytes of memory returned by
+ * pixel_data_from_lua() for an image buffer have been written to, which
+ * changes every row of its surface that they reach. */
+static void
+pixel_data_changed (cairo_surface_t *borrowed, size_t len) {
+    size_t stride = cairo_image_surface_get_stride(borrowed);
+    int height = cairo_image_surface_get_height(borrowed);
+    size_t rows = stride ? (len + stride - 1) / stride : 0;
+
+    if (rows < (size_t) height)
+        height = (int) rows;
+    image_pixels_changed(borrowed, 0, 0,
+                         cairo_image_surface_get_width(borrowed), height);
+}
+
 static int
 image_surface_create_from_data (lua_State *L) {
     cairo_format_t fmt;
     int width, height, stride, min_stride;
-    const char *data;
+    unsigned char *data;
     size_t data_len;
+    cairo_surface_t **borrowed;
+    unsigned char *buffer;
     SurfaceUserdata *surface;
+    int ok;
 
-    data = luaL_checklstring(L, 1, &data_len);
+    data = pixel_data_from_lua(L, 1, &data_len, &borrowed);
     fmt = format_from_lua(L, 2);
     width = luaL_checkinteger(L, 3);
     luaL_argcheck(L, width >= 0, 3, "image width cannot be negative");
@@ -66,63 +187,740 @@ image_surface_create_from_data (lua_State *L) {
     luaL_argcheck(L, data_len >= (size_t) stride * height, 1,
                   "image data string not long enough for this image size");
 
-    surface = create_surface_userdata(L);
-    surface->image_buffer = malloc(data_len);
-    if (!surface->image_buffer) {
+    if (lua_type(L, 1) != LUA_TSTRING) {
+        /* Use the memory directly, without copying it. */
+        luaL_argcheck(L, ((size_t) data & 3) == 0, 1,
+                      "image data must be aligned to 4 bytes");
+        surface = create_surface_userdata(L);
+        surface->surface = cairo_image_surface_create_for_data(
+                                data, fmt, width, height, stride);
+        if (cairo_surface_status(surface->surface) != CAIRO_STATUS_SUCCESS)
+            ok = 1;     /* error surface, which doesn't use the data */
+        else if (borrowed) {
+            ok = cairo_surface_set_user_data(surface->surface,
+                        &image_buffer_key, cairo_surface_reference(*borrowed),
+                        image_data_surface_free) == CAIRO_STATUS_SUCCESS;
+            if (!ok)
+                cairo_surface_destroy(*borrowed);
+        }
+        else if (lua_type(L, 1) == LUA_TUSERDATA)
+            ok = image_data_ref_value(L, surface->surface, 1);
+        else if (!lua_isnoneornil(L, 6))
+            ok = image_data_ref_value(L, surface->surface, 6);
+        else
+            ok = 1;
+    }
+    else {
+        surface = create_surface_userdata(L);
+        buffer = malloc(data_len);
+        if (!buffer) {
+            return luaL_error(L, "out of memory");
+        }
+        memcpy(buffer, data, data_len);
+        surface->surface = cairo_image_surface_create_for_data(
+                                buffer, fmt, width, height, stride);
+        if (cairo_surface_status(surface->surface) != CAIRO_STATUS_SUCCESS) {
+            free(buffer);
+            ok = 1;
+        }
+        else {
+            ok = cairo_surface_set_user_data(surface->surface,
+                                             &image_buffer_key, buffer, free)
+                    == CAIRO_STATUS_SUCCESS;
+            if (!ok)
+                free(buffer);
+        }
+    }
+
+    if (!ok) {
+        cairo_surface_destroy(surface->surface);
+        surface->surface = 0;
         return luaL_error(L, "out of memory");
     }
-    memcpy(surface->image_buffer, data, data_len);
-    surface->surface = cairo_image_surface_create_for_data(
-                            surface->image_buffer, fmt, width, height, stride);
     return 1;
 }
 
+#ifdef HAVE_MMAP
+/* Memory mapped from a file, attached to the surface which uses it with
+ * image_buffer_key so that it is unmapped when Cairo is done with it.
+ * Shared memory surfaces keep their file descriptor open, and remember the
+ * name of the shared memory object if it has one, so that they can be
+ * passed on to other processes. */
+typedef struct ImageMapping_ {
+    void *addr;
+    size_t len;
+    int fd;                     /* -1 if not kept open */
+    char *name;
+} ImageMapping;
+
+static void
+image_mapping_free (void *data) {
+    ImageMapping *map = data;
+    munmap(map->addr, map->len);
+    if (map->fd >= 0)
+        close(map->fd);
+    free(map->name);
+    free(map);
+}
+
+/* Check the format, width, height and optional stride arguments starting
+ * at 'pos', for an image surface on mapped memory. */
+static void
+mapped_image_args (lua_State *L, int pos, cairo_format_t *fmt, int *width,
+                   int *height, int *stride)
+{
+    int min_stride;
+
+    *fmt = format_from_lua(L, pos);
+    *width = luaL_checkinteger(L, pos + 1);
+    luaL_argcheck(L, *width > 0, pos + 1, "image width must be positive");
+    *height = luaL_checkinteger(L, pos + 2);
+    luaL_argcheck(L, *height > 0, pos + 2, "image height must be positive");
+    min_stride = cairo_format_stride_for_width(*fmt, *width);
+    luaL_argcheck(L, min_stride > 0, pos + 1, "image width too big");
+    *stride = luaL_optinteger(L, pos + 3, min_stride);
+    luaL_argcheck(L, *stride >= min_stride && *stride % 4 == 0, pos + 3,
+                  "stride must be a multiple of 4 and big enough for"
+                  " this width and pixel format");
+}
+
+/* Map 'len' bytes of 'fd' into memory, shared with anything else which
+ * maps it, and create an image surface using the pixel data starting at
+ * 'data_offset' bytes into it.  The file descriptor isn't needed after
+ * this.  Returns an error message on failure. */
+static const char *
+image_surface_for_mapping (int fd, size_t len, size_t data_offset,
+                           cairo_format_t fmt, int width, int height,
+                           int stride, cairo_surface_t **result)
+{
+    ImageMapping *map;
+    cairo_status_t status;
+    void *addr;
+
+    addr = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return strerror(errno);
+    map = malloc(sizeof(ImageMapping));
+    if (!map) {
+        munmap(addr, len);
+        return "out of memory";
+    }
+    map->addr = addr;
+    map->len = len;
+    map->fd = -1;
+    map->name = 0;
+
+    *result = cairo_image_surface_create_for_data(
+                    (unsigned char *) addr + data_offset, fmt, width, height,
+                    stride);
+    status = cairo_surface_status(*result);
+    if (status == CAIRO_STATUS_SUCCESS)
+        status = cairo_surface_set_user_data(*result, &image_buffer_key, map,
+                                             image_mapping_free);
+    if (status != CAIRO_STATUS_SUCCESS) {
+        image_mapping_free(map);
+        cairo_surface_destroy(*result);
+        *result = 0;
+        return cairo_status_to_string(status);
+    }
+    return 0;
+}
+
+static int
+image_surface_create_mmap (lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    cairo_format_t fmt;
+    int width, height, stride, fd;
+    size_t len;
+    struct stat st;
+    SurfaceUserdata *surface;
+    const char *err = 0;
+
+    mapped_image_args(L, 2, &fmt, &width, &height, &stride);
+    len = (size_t) stride * height;
+    surface = create_surface_userdata(L);
+
+    fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+        return luaL_error(L, "error opening image file '%s': %s", path,
+                          strerror(errno));
+    /* An existing file keeps its contents, but is made bigger if it isn't
+     * big enough for the image. */
+    if (fstat(fd, &st)
+        || ((size_t) st.st_size < len && ftruncate(fd, (off_t) len)))
+        err = strerror(errno);
+    else
+        err = image_surface_for_mapping(fd, len, 0, fmt, width, height,
+                                        stride, &surface->surface);
+    close(fd);
+    if (err)
+        return luaL_error(L, "error mapping image file '%s': %s", path, err);
+    return 1;
+}
+
+#ifdef HAVE_SHM_OPEN
+/* Shared memory images start with this header, so that whatever opens them
+ * knows what is in them.  The integers are in native byte order, since the
+ * memory can only be shared on one machine anyway.  The rest of the header
+ * is zero, and the pixel data starts 'header_size' bytes in. */
+#define SHM_IMAGE_MAGIC "oocairo"
+#define SHM_IMAGE_VERSION 1
+#define SHM_IMAGE_HEADER_SIZE 64
+
+typedef struct ShmImageHeader_ {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int32_t format;             /* a cairo_format_t value */
+    int32_t width, height, stride;
+} ShmImageHeader;
+
+/* Set on shared memory surfaces, pointing to the same ImageMapping as
+ * image_buffer_key, which is the one which owns it. */
+static cairo_user_data_key_t shm_image_key;
+
+/* Create a new anonymous shared memory object, which doesn't have a name
+ * that other processes can open it with. */
+static int
+shm_create_anonymous (void) {
+#ifdef HAVE_MEMFD_CREATE
+    return memfd_create("oocairo image", 0);
+#else
+    static unsigned int counter = 0;
+    char name[64];
+    int fd, tries;
+
+    for (tries = 0; tries < 100; ++tries) {
+        sprintf(name, "/oocairo-%ld-%u", (long) getpid(), counter++);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            shm_unlink(name);
+            return fd;
+        }
+        if (errno != EEXIST)
+            break;
+    }
+    return -1;
+#endif
+}
+
+static int
+format_is_known (int32_t fmt) {
+    size_t i;
+    for (i = 0; i < sizeof(format_values) / sizeof(format_values[0]); ++i)
+        if (format_values[i] == fmt)
+            return 1;
+    return 0;
+}
+
+/* Map shared memory image 'fd', and record the descriptor and name in the
+ * mapping so that it can be exported again.  Takes ownership of 'fd', so
+ * it is closed on failure.  If 'hdr' is given it is written into the
+ * memory first, otherwise it is read from there.  Returns an error message
+ * on failure. */
+static const char *
+shm_image_map (int fd, const char *name, const ShmImageHeader *hdr,
+               cairo_surface_t **result)
+{
+    ShmImageHeader h;
+    struct stat st;
+    size_t len;
+    ImageMapping *map;
+    const char *err;
+
+    if (hdr)
+        h = *hdr;
+    else {
+        if (pread(fd, &h, sizeof(h), 0) != (ssize_t) sizeof(h))
+            err = "not a shared memory image";
+        else if (memcmp(h.magic, SHM_IMAGE_MAGIC, sizeof(h.magic)))
+            err = "not a shared memory image";
+        else if (h.version != SHM_IMAGE_VERSION)
+            err = "unsupported shared memory image version";
+        else if (h.header_size < sizeof(h) || h.header_size % 4
+                 || !format_is_known(h.format) || h.width <= 0
+                 || h.height <= 0 || h.stride <= 0 || h.stride % 4
+                 || h.stride < cairo_format_stride_for_width(h.format,
+                                                             h.width)
+                 || (size_t) h.height > (SIZE_MAX - h.header_size)
+                                        / (size_t) h.stride)
+            err = "corrupt shared memory image header";
+        else
+            err = 0;
+        if (err) {
+            close(fd);
+            return err;
+        }
+    }
+
+    len = h.header_size + (size_t) h.stride * h.height;
+    if (hdr) {
+        if (ftruncate(fd, (off_t) len)) {
+            close(fd);
+            return strerror(errno);
+        }
+    }
+    else if (fstat(fd, &st) || (size_t) st.st_size < len) {
+        close(fd);
+        return "shared memory image is too small for its header";
+    }
+
+    err = image_surface_for_mapping(fd, len, h.header_size, h.format,
+                                    h.width, h.height, h.stride, result);
+    if (err) {
+        close(fd);
+        return err;
+    }
+
+    map = cairo_surface_get_user_data(*result, &image_buffer_key);
+    if (hdr)
+        memcpy(map->addr, &h, sizeof(h));
+    map->fd = fd;
+    if (name) {
+        map->name = malloc(strlen(name) + 1);
+        if (!map->name)
+            err = "out of memory";
+        else
+            strcpy(map->name, name);
+    }
+    if (!err && cairo_surface_set_user_data(*result, &shm_image_key, map, 0)
+                    != CAIRO_STATUS_SUCCESS)
+        err = "out of memory";
+    if (err) {
+        cairo_surface_destroy(*result);
+        *result = 0;
+    }
+    return err;
+}
+
+static int
+image_surface_create_shm (lua_State *L) {
+    ShmImageHeader hdr;
+    const char *name, *err;
+    int width, height, stride, fd;
+    cairo_format_t fmt;
+    SurfaceUserdata *surface;
+
+    mapped_image_args(L, 1, &fmt, &width, &height, &stride);
+    name = luaL_optstring(L, 5, 0);
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SHM_IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = SHM_IMAGE_VERSION;
+    hdr.header_size = SHM_IMAGE_HEADER_SIZE;
+    hdr.format = fmt;
+    hdr.width = width;
+    hdr.height = height;
+    hdr.stride = stride;
+    luaL_argcheck(L, (size_t) height
+                     <= (SIZE_MAX - SHM_IMAGE_HEADER_SIZE) / (size_t) stride,
+                  3, "image too big");
+    surface = create_surface_userdata(L);
+
+    fd = name ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)
+              : shm_create_anonymous();
+    if (fd < 0)
+        return luaL_error(L, "error creating shared memory image: %s",
+                          strerror(errno));
+    err = shm_image_map(fd, name, &hdr, &surface->surface);
+    if (err) {
+        if (name)
+            shm_unlink(name);
+        return luaL_error(L, "error creating shared memory image: %s", err);
+    }
+    return 1;
+}
+
+static int
+image_surface_open_shm (lua_State *L) {
+    const char *name = 0, *err;
+    int fd;
+    SurfaceUserdata *surface;
+
+    if (lua_type(L, 1) == LUA_TNUMBER) {
+        /* Use our own copy of the descriptor, so that it can be closed
+         * along with the surface without affecting the caller. */
+        fd = dup(luaL_checkinteger(L, 1));
+    }
+    else {
+        name = luaL_checkstring(L, 1);
+        fd = shm_open(name, O_RDWR, 0);
+    }
+    surface = create_surface_userdata(L);
+    if (fd < 0)
+        return luaL_error(L, "error opening shared memory image: %s",
+                          strerror(errno));
+    err = shm_image_map(fd, name, 0, &surface->surface);
+    if (err)
+        return luaL_error(L, "error opening shared memory image: %s", err);
+    return 1;
+}
+
+static int
+shm_unlink_name (lua_State *L) {
+    const char *name = luaL_checkstring(L, 1);
+    if (shm_unlink(name))
+        return luaL_error(L, "error removing shared memory image '%s': %s",
+                          name, strerror(errno));
+    return 0;
+}
+#endif
+#endif
+
+static int
+image_surface_import (lua_State *L) {
+    int layout, width, height, stride, straight, y;
+    cairo_format_t fmt;
+    const unsigned char *data;
+    unsigned char *dst;
+    size_t data_len;
+    int dst_stride;
+    PixelConversion conv;
+    const char *err;
+    SurfaceUserdata *surface;
+
+    layout = luaL_checkoption(L, 1, 0, pixel_layout_names);
+    data = pixel_data_from_lua(L, 2, &data_len, 0);
+    width = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, width >= 0, 3, "image width cannot be negative");
+    height = luaL_checkinteger(L, 4);
+    luaL_argcheck(L, height >= 0, 4, "image height cannot be negative");
+    stride = luaL_optinteger(L, 5, width * pixel_layout_bytes[layout]);
+    luaL_argcheck(L, stride >= width * pixel_layout_bytes[layout], 5,
+                  "stride value too small for this width and pixel layout");
+    straight = luaL_checkoption(L, 6, "straight", alpha_mode_names) == 0;
+    if (lua_isnoneornil(L, 7))
+        fmt = pixel_layout_channels[layout][0] >= 0 ? CAIRO_FORMAT_ARGB32
+                                                    : CAIRO_FORMAT_RGB24;
+    else
+        fmt = format_from_lua(L, 7);
+
+    luaL_argcheck(L, height == 0 || data_len >= (size_t) stride * (height - 1)
+                                      + (size_t) width * pixel_layout_bytes[layout],
+                  2, "image data not long enough for this image size");
+    err = pixel_conversion_init(&conv, 0, layout, fmt, straight, width);
+    if (err)
+        return luaL_error(L, "%s", err);
+
+    surface = create_surface_userdata(L);
+    surface->surface = cairo_image_surface_create(fmt, width, height);
+    if (cairo_surface_status(surface->surface) != CAIRO_STATUS_SUCCESS)
+        return 1;
+
+    cairo_surface_flush(surface->surface);
+    dst = cairo_image_surface_get_data(surface->surface);
+    dst_stride = cairo_image_surface_get_stride(surface->surface);
+    for (y = 0; y < height; ++y)
+        pixel_import_row(&conv, data + (size_t) y * stride,
+                         dst + (size_t) y * dst_stride);
+    cairo_surface_mark_dirty(surface->surface);
+    return 1;
+}
+
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+#define IMAGE_DIFF_DEFAULT_TILE 32
+
+/* Compare 'n' pixels starting at 'x' in two rows.  Returns the biggest
+ * difference between any of their channels, or for formats whose channels
+ * aren't whole bytes, just 1 if anything is different.  The unused byte of
+ * rgb24 pixels is ignored. */
+static unsigned int
+image_diff_row (const unsigned char *a, const unsigned char *b, int x, int n,
+                cairo_format_t fmt, int bpp)
+{
+    unsigned int max = 0, d;
+    size_t x0, x1, i;
+
+    switch (bpp) {
+        case 32:
+            return pixel_kernels->max_delta((const uint32_t *) a + x,
+                                            (const uint32_t *) b + x, n,
+                                            fmt == CAIRO_FORMAT_RGB24
+                                                ? 0x00FFFFFF : 0xFFFFFFFF);
+        case 8:
+            for (i = x; i < (size_t) x + n; ++i) {
+                d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+                if (d > max)
+                    max = d;
+            }
+            return max;
+        default:
+            x0 = (size_t) x * bpp / 8;
+            x1 = ((size_t) (x + n) * bpp + 7) / 8;
+            return memcmp(a + x0, b + x0, x1 - x0) != 0;
+    }
+}
+
+static int
+image_diff (lua_State *L) {
+    cairo_surface_t **a = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    cairo_surface_t **b = luaL_checkudata(L, 2, OOCAIRO_MT_NAME_SURFACE);
+    int tile = luaL_optinteger(L, 3, IMAGE_DIFF_DEFAULT_TILE);
+    int want_delta = lua_toboolean(L, 4);
+    cairo_format_t fmt;
+    int width, height, stride_a, stride_b, bpp, tx, ty, tw, th, y, changed;
+    int num_rects = 0, max_rects = 0, prev;
+    const unsigned char *data_a, *data_b;
+    unsigned int max_delta = 0, d;
+    cairo_rectangle_int_t *rects = 0, *tmp;
+    cairo_region_t **reg;
+
+    luaL_argcheck(L, cairo_surface_get_type(*a) == CAIRO_SURFACE_TYPE_IMAGE,
+                  1, "must be an image surface");
+    luaL_argcheck(L, cairo_surface_get_type(*b) == CAIRO_SURFACE_TYPE_IMAGE,
+                  2, "must be an image surface");
+    fmt = cairo_image_surface_get_format(*a);
+    width = cairo_image_surface_get_width(*a);
+    height = cairo_image_surface_get_height(*a);
+    luaL_argcheck(L, cairo_image_surface_get_format(*b) == fmt
+                     && cairo_image_surface_get_width(*b) == width
+                     && cairo_image_surface_get_height(*b) == height,
+                  2, "images must have the same format and size");
+    luaL_argcheck(L, tile > 0, 3, "tile size must be positive");
+
+    cairo_surface_flush(*a);
+    cairo_surface_flush(*b);
+    data_a = cairo_image_surface_get_data(*a);
+    data_b = cairo_image_surface_get_data(*b);
+    if ((!data_a || !data_b) && width > 0 && height > 0)
+        return luaL_error(L, "image surface has no pixel data");
+    stride_a = cairo_image_surface_get_stride(*a);
+    stride_b = cairo_image_surface_get_stride(*b);
+    bpp = format_bits_per_pixel(fmt);
+
+    reg = create_region_userdata(L);
+    for (ty = 0; ty < height; ty += tile) {
+        th = height - ty < tile ? height - ty : tile;
+        prev = 0;
+        for (tx = 0; tx < width; tx += tile) {
+            tw = width - tx < tile ? width - tx : tile;
+            changed = 0;
+            for (y = ty; y < ty + th; ++y) {
+                d = image_diff_row(data_a + (size_t) y * stride_a,
+                                   data_b + (size_t) y * stride_b,
+                                   tx, tw, fmt, bpp);
+                if (d) {
+                    changed = 1;
+                    if (d > max_delta)
+                        max_delta = d;
+                    if (!want_delta)
+                        break;
+                }
+            }
+            if (!changed) {
+                prev = 0;
+                continue;
+            }
+
+            /* Changed tiles next to each other in the same band are
+             * merged into one rectangle. */
+            if (prev) {
+                rects[num_rects - 1].width += tw;
+                continue;
+            }
+            if (num_rects == max_rects) {
+                max_rects = max_rects ? max_rects * 2 : 64;
+                tmp = realloc(rects, max_rects * sizeof(cairo_rectangle_int_t));
+                if (!tmp) {
+                    free(rects);
+                    return luaL_error(L, "out of memory");
+                }
+                rects = tmp;
+            }
+            rects[num_rects].x = tx;
+            rects[num_rects].y = ty;
+            rects[num_rects].width = tw;
+            rects[num_rects].height = th;
+            ++num_rects;
+            prev = 1;
+        }
+    }
+
+    *reg = cairo_region_create_rectangles(rects, num_rects);
+    free(rects);
+    if (!want_delta)
+        return 1;
+    lua_pushnumber(L, max_delta);
+    return 2;
+}
+#endif
+
+/* Shared by cairo.premultiply() and cairo.unpremultiply(). */
+static int
+premultiply_data (lua_State *L, int unpremultiply) {
+    size_t data_len;
+    cairo_surface_t **borrowed;
+    unsigned char *data = pixel_data_from_lua(L, 1, &data_len, &borrowed);
+    int width = luaL_checkinteger(L, 2);
+    int height = luaL_checkinteger(L, 3);
+    int stride = luaL_optinteger(L, 4, width * 4);
+
+    luaL_argcheck(L, width >= 0, 2, "image width cannot be negative");
+    luaL_argcheck(L, height >= 0, 3, "image height cannot be negative");
+    luaL_argcheck(L, stride >= width * 4, 4,
+                  "stride value too small for this width");
+    luaL_argcheck(L, height == 0 || data_len >= (size_t) stride * (height - 1)
+                                                + (size_t) width * 4,
+                  1, "image data not long enough for this image size");
+
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        /* Work on a copy, since strings can't be changed. */
+        unsigned char *copy = lua_newuserdata(L, data_len ? data_len : 1);
+        memcpy(copy, data, data_len);
+        data = copy;
+    }
+    if (((size_t) data & 3) != 0 || (stride & 3) != 0)
+        return luaL_argerror(L, 1, "image data must be aligned to 4 bytes");
+
+    if (unpremultiply)
+        pixel_unpremultiply_rows(data, stride, width, 0, height);
+    else
+        pixel_premultiply_rows(data, stride, width, 0, height);
+
+    if (lua_type(L, 1) == LUA_TSTRING)
+        lua_pushlstring(L, (const char *) data, data_len);
+    else {
+        if (borrowed && height > 0)
+            pixel_data_changed(*borrowed, (size_t) stride * (height - 1)
+                                          + (size_t) width * 4);
+        lua_pushvalue(L, 1);
+    }
+    return 1;
+}
+
+static int
+premultiply (lua_State *L) {
+    return premultiply_data(L, 0);
+}
+
+static int
+unpremultiply (lua_State *L) {
+    return premultiply_data(L, 1);
+}
+
+#define READ_BLOCK_SIZE (64 * 1024)
+
+/* PNG data is read from file handles in large blocks, and libpng is fed
+ * from those, rather than calling the Lua 'read' method for every little
+ * piece libpng asks for.  The current block is kept on the Lua stack at
+ * 'bufpos' so that it doesn't get collected while it's being used.  For PNG
+ * data given directly as a string, that string is the only block and there
+ * is no file handle. */
 struct ReadInfoLuaStream {
     lua_State *L;
-    int fhpos;
+    int fhpos;                  /* zero if reading from a string */
+    int bufpos;
     const char *errmsg;
+    const unsigned char *data;
+    size_t len, pos;
 };
 
-static cairo_status_t
-read_chunk_from_fh (void *closure, unsigned char *buf, unsigned int lentoread)
-{
-    struct ReadInfoLuaStream *info = closure;
-    const char *s;
-    size_t len;
+static const char png_signature[8] = "\211PNG\r\n\032\n";
 
+/* Read another block from the file handle.  Returns false with an error
+ * message set if there is no more data, or if reading failed. */
+static int
+read_block_from_fh (struct ReadInfoLuaStream *info, size_t wanted) {
     lua_State *L = info->L;
+
+    if (!info->fhpos) {
+        info->errmsg = "data ended unexpectedly";
+        return 0;
+    }
+
     lua_getfield(L, info->fhpos, "read");
     lua_pushvalue(L, info->fhpos);
-    lua_pushnumber(L, lentoread);
+    lua_pushnumber(L, wanted > READ_BLOCK_SIZE ? wanted : READ_BLOCK_SIZE);
     if (lua_pcall(L, 2, 1, 0)) {
         if (lua_isstring(L, -1))
             info->errmsg = lua_tostring(L, -1);
-        return CAIRO_STATUS_READ_ERROR;
+        return 0;
     }
 
-    s = lua_tolstring(L, -1, &len);
-    if (!s) {
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        info->errmsg = "data ended unexpectedly";
+        return 0;
+    }
+    if (lua_type(L, -1) != LUA_TSTRING) {
+        lua_pop(L, 1);
         info->errmsg = "'read' method on file handle didn't return string";
-        return CAIRO_STATUS_READ_ERROR;
+        return 0;
     }
-    if (len != lentoread) {
-        info->errmsg = "'read' method on file handle returned wrong amount"
-                           " of data";
-        return CAIRO_STATUS_READ_ERROR;
+
+    /* Short reads are fine, as long as we get something. */
+    lua_replace(L, info->bufpos);
+    info->data = (const unsigned char *) lua_tolstring(L, info->bufpos,
+                                                       &info->len);
+    info->pos = 0;
+    if (info->len == 0) {
+        info->errmsg = "data ended unexpectedly";
+        return 0;
+    }
+    return 1;
+}
+
+static cairo_status_t
+read_chunk_from_fh (void *closure, unsigned char *buf, unsigned int lentoread)
+{
+    struct ReadInfoLuaStream *info = closure;
+    size_t n;
+
+    while (lentoread > 0) {
+        if (info->pos == info->len && !read_block_from_fh(info, lentoread))
+            return CAIRO_STATUS_READ_ERROR;
+        n = info->len - info->pos;
+        if (n > lentoread)
+            n = lentoread;
+        memcpy(buf, info->data + info->pos, n);
+        info->pos += n;
+        buf += n;
+        lentoread -= n;
     }
 
-    memcpy(buf, s, len);
-    lua_pop(L, 1);
     return CAIRO_STATUS_SUCCESS;
 }
 
+/* Anything read ahead from the file handle but not used is given back by
+ * seeking backwards, if the file handle allows that, so that whatever
+ * follows the image data can still be read from it. */
+static void
+unread_stream_data (struct ReadInfoLuaStream *info) {
+    lua_State *L = info->L;
+    size_t unused = info->len - info->pos;
+
+    if (!info->fhpos || unused == 0)
+        return;
+    lua_getfield(L, info->fhpos, "seek");
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pushvalue(L, info->fhpos);
+    lua_pushliteral(L, "cur");
+    lua_pushnumber(L, -(lua_Number) unused);
+    if (lua_pcall(L, 3, 0, 0))
+        lua_pop(L, 1);
+}
+
 #ifdef CAIRO_HAS_PNG_FUNCTIONS
 static int
 image_surface_create_from_png (lua_State *L) {
-    SurfaceUserdata *surface = create_surface_userdata(L);
+    SurfaceUserdata *surface;
+    size_t len = 0;
+    const char *s = 0;
+    int type = lua_type(L, 1);
+
+    /* Strings are filenames, unless they look like PNG data themselves. */
+    if (type == LUA_TSTRING) {
+        s = lua_tolstring(L, 1, &len);
+        if (len < sizeof(png_signature)
+            || memcmp(s, png_signature, sizeof(png_signature)))
+            s = 0;
+    }
+    surface = create_surface_userdata(L);
 
-    if (lua_isstring(L, 1)) {
-        const char *filename = luaL_checkstring(L, 1);
+    if (!s && (type == LUA_TSTRING || type == LUA_TNUMBER)) {
+        const char *filename = lua_tostring(L, 1);
         surface->surface = cairo_image_surface_create_from_png(filename);
         switch (cairo_surface_status(surface->surface)) {
             case CAIRO_STATUS_FILE_NOT_FOUND:
@@ -134,27 +932,107 @@ image_surface_create_from_png (lua_State *L) {
     }
     else {
         struct ReadInfoLuaStream info;
+        cairo_status_t status;
+
+        if (!s && type != LUA_TTABLE && type != LUA_TUSERDATA)
+            return luaL_typerror(L, 1, "filename, PNG data or file handle");
 
+        lua_pushnil(L);
         info.L = L;
-        info.fhpos = 1;
+        info.fhpos = s ? 0 : 1;
+        info.bufpos = lua_gettop(L);
         info.errmsg = 0;
+        info.data = (const unsigned char *) s;
+        info.len = len;
+        info.pos = 0;
         surface->surface = cairo_image_surface_create_from_png_stream(
                                     read_chunk_from_fh, &info);
-        if (!surface->surface) {
-            lua_pushliteral(L, "error reading PNG file from Lua file handle");
-            if (info.errmsg) {
-                lua_pushliteral(L, ": ");
-                lua_pushstring(L, info.errmsg);
-                lua_concat(L, 3);
-            }
+        status = cairo_surface_status(surface->surface);
+        if (status != CAIRO_STATUS_SUCCESS) {
+            lua_pushstring(L, s ? "error reading PNG data from string"
+                                : "error reading PNG file from Lua file"
+                                  " handle");
+            lua_pushliteral(L, ": ");
+            lua_pushstring(L, info.errmsg ? info.errmsg
+                                          : cairo_status_to_string(status));
+            lua_concat(L, 3);
             return lua_error(L);
         }
+        unread_stream_data(&info);
+        lua_settop(L, info.bufpos - 1);
     }
 
     return 1;
 }
 #endif
 
+static int
+image_surface_create_from (lua_State *L) {
+    int fmt = luaL_checkoption(L, 1, 0, image_io_format_names);
+    int type = lua_type(L, 2);
+    cairo_format_t raw_format = CAIRO_FORMAT_ARGB32;
+    int raw_width = 0, raw_height = 0;
+    SurfaceUserdata *surface;
+    const char *s = 0, *err;
+    size_t len = 0;
+
+    if (fmt == IMAGE_IO_RAW) {
+        raw_format = format_from_lua(L, 3);
+        raw_width = luaL_checkinteger(L, 4);
+        luaL_argcheck(L, raw_width > 0, 4, "image width must be positive");
+        raw_height = luaL_checkinteger(L, 5);
+        luaL_argcheck(L, raw_height > 0, 5, "image height must be positive");
+    }
+    if (type == LUA_TSTRING) {
+        s = lua_tolstring(L, 2, &len);
+        if (!image_io_is_data(fmt, s, len))
+            s = 0;
+    }
+    surface = create_surface_userdata(L);
+
+    if (!s && (type == LUA_TSTRING || type == LUA_TNUMBER)) {
+        const char *filename = lua_tostring(L, 2);
+        FILE *fp = fopen(filename, "rb");
+        if (!fp)
+            return luaL_error(L, "image file '%s' not found", filename);
+        err = image_io_read(fmt, read_chunk_from_stdio, fp, raw_format,
+                            raw_width, raw_height, &surface->surface);
+        fclose(fp);
+        if (err)
+            return luaL_error(L, "error reading image file '%s': %s",
+                              filename, err);
+    }
+    else {
+        struct ReadInfoLuaStream info;
+
+        if (!s && type != LUA_TTABLE && type != LUA_TUSERDATA)
+            return luaL_typerror(L, 2, "filename, image data or file handle");
+
+        lua_pushnil(L);
+        info.L = L;
+        info.fhpos = s ? 0 : 2;
+        info.bufpos = lua_gettop(L);
+        info.errmsg = 0;
+        info.data = (const unsigned char *) s;
+        info.len = len;
+        info.pos = 0;
+        err = image_io_read(fmt, read_chunk_from_fh, &info, raw_format,
+                            raw_width, raw_height, &surface->surface);
+        if (err) {
+            lua_pushstring(L, s ? "error reading image data from string"
+                                : "error reading image from Lua file handle");
+            lua_pushliteral(L, ": ");
+            lua_pushstring(L, info.errmsg ? info.errmsg : err);
+            lua_concat(L, 3);
+            return lua_error(L);
+        }
+        unread_stream_data(&info);
+        lua_settop(L, info.bufpos - 1);
+    }
+
+    return 1;
+}
+
 /* This function is used for several types of surface which all have the
  * same type of construction, and are all a bit complicated because they
  * can write their output to a Lua file handle. */
@@ -189,6 +1067,8 @@ surface_create_with_size (lua_State *L, SimpleSizeCreatorFunc simplefunc, Stream
 
         surface->surface = streamfunc(write_chunk_to_fh, surface,
                                       width, height);
+        cairo_surface_set_user_data(surface->surface, &write_buffer_key,
+                                    surface, 0);
         if (cairo_surface_status(surface->surface) != CAIRO_STATUS_SUCCESS) {
             lua_pushliteral(L, "error writing surface output file to Lua"
                             " file handle");
@@ -268,6 +1148,7 @@ recording_surface_create (lua_State *L) {
 
     surface = create_surface_userdata(L);
     surface->surface = cairo_recording_surface_create(content, pextents);
+    draw_recording_register(surface->surface);
     return 1;
 }
 
@@ -356,24 +1237,387 @@ surface_gc (lua_State *L) {
     return 0;
 }
 
-static int
-surface_copy_page (lua_State *L) {
-    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
-    cairo_surface_copy_page(*obj);
-    return 0;
+/* Turn a colour into alpha, red, green and blue bytes, clamped and
+ * premultiplied as Cairo does for cairo_set_source_rgba(). */
+static void
+premultiplied_color (double r, double g, double b, double a,
+                     unsigned int *color)
+{
+    a = a < 0 ? 0 : a > 1 ? 1 : a;
+    color[0] = (unsigned int) (a * 255 + 0.5);
+    color[1] = (unsigned int) ((r < 0 ? 0 : r > 1 ? 1 : r) * a * 255 + 0.5);
+    color[2] = (unsigned int) ((g < 0 ? 0 : g > 1 ? 1 : g) * a * 255 + 0.5);
+    color[3] = (unsigned int) ((b < 0 ? 0 : b > 1 ? 1 : b) * a * 255 + 0.5);
 }
 
+/* Clip the rectangle x, y, width, height to the pixels of an image
+ * surface.  Returns false if nothing is left of it. */
 static int
-surface_finish (lua_State *L) {
-    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
-    cairo_surface_finish(*obj);
-    return 0;
+clip_to_image (cairo_surface_t *surface, int *x, int *y, int *width,
+               int *height)
+{
+    int img_width = cairo_image_surface_get_width(surface);
+    int img_height = cairo_image_surface_get_height(surface);
+
+    /* Nothing is added until the numbers are known to be in range, so
+     * that huge ones from Lua can't overflow. */
+    if (*width <= 0 || *height <= 0 || *x >= img_width || *y >= img_height)
+        return 0;
+    if (*x < 0) {
+        if (*x + *width <= 0)
+            return 0;
+        *width += *x;
+        *x = 0;
+    }
+    if (*y < 0) {
+        if (*y + *height <= 0)
+            return 0;
+        *height += *y;
+        *y = 0;
+    }
+    if (*width > img_width - *x) *width = img_width - *x;
+    if (*height > img_height - *y) *height = img_height - *y;
+    return 1;
 }
 
-static int
-surface_flush (lua_State *L) {
-    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+/* Tell Cairo, and anything watching, that pixels have been changed. */
+static void
+image_pixels_changed (cairo_surface_t *surface, int x, int y, int width,
+                      int height)
+{
+    cairo_surface_mark_dirty_rectangle(surface, x, y, width, height);
+    damage_add_surface_rect(surface, x, y, width, height);
+    mipmap_invalidate(surface);
+}
+
+/* Get the x, y, width, height rectangle of an image surface given as
+ * optional arguments starting at 'idx', defaulting to the whole image. */
+static void
+image_rect_from_lua (lua_State *L, cairo_surface_t *surface, int idx,
+                     int *x, int *y, int *width, int *height)
+{
+    int img_width = cairo_image_surface_get_width(surface);
+    int img_height = cairo_image_surface_get_height(surface);
+
+    *x = *y = 0;
+    *width = img_width;
+    *height = img_height;
+    if (lua_isnoneornil(L, idx))
+        return;
+    *x = luaL_checkinteger(L, idx);
+    *y = luaL_checkinteger(L, idx + 1);
+    luaL_argcheck(L, *x >= 0 && *x <= img_width, idx,
+                  "x coordinate out of range");
+    luaL_argcheck(L, *y >= 0 && *y <= img_height, idx + 1,
+                  "y coordinate out of range");
+    *width = luaL_checkinteger(L, idx + 2);
+    luaL_argcheck(L, *width >= 0 && *width <= img_width - *x, idx + 2,
+                  "rectangle width out of range");
+    *height = luaL_checkinteger(L, idx + 3);
+    luaL_argcheck(L, *height >= 0 && *height <= img_height - *y, idx + 3,
+                  "rectangle height out of range");
+}
+
+#define BLUR_MAX_RADIUS 1024
+
+static int
+surface_blur (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    lua_Number radius = luaL_checknumber(L, 2);
+    int x, y, width, height, channels;
+    unsigned char *data;
+    const char *err;
+
+    if (cairo_surface_get_type(*obj) != CAIRO_SURFACE_TYPE_IMAGE)
+        return luaL_error(L, "method 'blur' only works on image surfaces");
+    switch (cairo_image_surface_get_format(*obj)) {
+        case CAIRO_FORMAT_ARGB32:
+        case CAIRO_FORMAT_RGB24:
+            channels = 4; break;
+        case CAIRO_FORMAT_A8:
+            channels = 1; break;
+        default:
+            return luaL_error(L, "method 'blur' doesn't work on images of"
+                              " this format");
+    }
+    luaL_argcheck(L, radius >= 0 && radius <= BLUR_MAX_RADIUS, 2,
+                  "blur radius out of range");
+    image_rect_from_lua(L, *obj, 3, &x, &y, &width, &height);
+    if (width == 0 || height == 0)
+        return 0;
+
+    cairo_surface_flush(*obj);
+    data = cairo_image_surface_get_data(*obj);
+    if (!data)
+        return luaL_error(L, "image surface has no pixel data");
+    err = blur_image_rect(data, cairo_image_surface_get_width(*obj),
+                          cairo_image_surface_get_height(*obj),
+                          cairo_image_surface_get_stride(*obj), channels,
+                          x, y, width, height, radius / 2);
+    if (err)
+        return luaL_error(L, "%s", err);
+    image_pixels_changed(*obj, x, y, width, height);
+    return 0;
+}
+
+static int
+surface_clear (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    unsigned char *data;
+
+    if (cairo_surface_get_type(*obj) != CAIRO_SURFACE_TYPE_IMAGE)
+        return luaL_error(L, "method 'clear' only works on image surfaces");
+    cairo_surface_flush(*obj);
+    data = cairo_image_surface_get_data(*obj);
+    if (!data)
+        return 0;
+    memset(data, 0, (size_t) cairo_image_surface_get_stride(*obj)
+                    * cairo_image_surface_get_height(*obj));
+    image_pixels_changed(*obj, 0, 0, cairo_image_surface_get_width(*obj),
+                         cairo_image_surface_get_height(*obj));
+    return 0;
+}
+
+static int
+surface_copy_from (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    cairo_surface_t **src = luaL_checkudata(L, 2, OOCAIRO_MT_NAME_SURFACE);
+    int sx = luaL_checkinteger(L, 3), sy = luaL_checkinteger(L, 4);
+    int width = luaL_checkinteger(L, 5), height = luaL_checkinteger(L, 6);
+    int dx = luaL_checkinteger(L, 7), dy = luaL_checkinteger(L, 8);
+    int x, y, bpp, src_stride, dst_stride, step, i, bit;
+    const unsigned char *src_data;
+    unsigned char *dst_data;
+    uint32_t word;
+
+    if (cairo_surface_get_type(*obj) != CAIRO_SURFACE_TYPE_IMAGE)
+        return luaL_error(L, "method 'copy_from' only works on image surfaces");
+    if (cairo_surface_get_type(*src) != CAIRO_SURFACE_TYPE_IMAGE)
+        return luaL_argerror(L, 2, "source must be an image surface");
+    luaL_argcheck(L, cairo_image_surface_get_format(*src)
+                     == cairo_image_surface_get_format(*obj), 2,
+                  "source must have the same format");
+
+    /* Clip to the source, then to the destination, moving the other
+     * corner by the same amount. */
+    x = sx; y = sy;
+    if (!clip_to_image(*src, &sx, &sy, &width, &height))
+        return 0;
+    if ((dx > 0 && sx - x > INT_MAX - dx) || (dy > 0 && sy - y > INT_MAX - dy))
+        return 0;   /* off the end of any image */
+    dx += sx - x; dy += sy - y;
+    x = dx; y = dy;
+    if (!clip_to_image(*obj, &dx, &dy, &width, &height))
+        return 0;
+    sx += dx - x; sy += dy - y;
+
+    cairo_surface_flush(*src);
+    cairo_surface_flush(*obj);
+    src_data = cairo_image_surface_get_data(*src);
+    dst_data = cairo_image_surface_get_data(*obj);
+    if (!src_data || !dst_data)
+        return luaL_error(L, "image surface has no pixel data");
+    src_stride = cairo_image_surface_get_stride(*src);
+    dst_stride = cairo_image_surface_get_stride(*obj);
+    bpp = format_bits_per_pixel(cairo_image_surface_get_format(*obj));
+
+    /* Rows are copied bottom up when moving pixels down within one image,
+     * so that none are overwritten before they've been copied. */
+    step = *src == *obj && dy > sy ? -1 : 1;
+    for (y = step > 0 ? 0 : height - 1; y >= 0 && y < height; y += step) {
+        const unsigned char *from = src_data + (size_t) (sy + y) * src_stride;
+        unsigned char *to = dst_data + (size_t) (dy + y) * dst_stride;
+        if (bpp >= 8) {
+            memmove(to + (size_t) dx * (bpp / 8),
+                    from + (size_t) sx * (bpp / 8),
+                    (size_t) width * (bpp / 8));
+            continue;
+        }
+        /* A1 pixels are copied one bit at a time, in the direction which
+         * is safe for overlapping copies within a row. */
+        for (i = 0; i < width; ++i) {
+            x = dx > sx ? width - 1 - i : i;
+            memcpy(&word, from + ((sx + x) >> 5) * 4, 4);
+            bit = (word >> a1_bit(sx + x)) & 1;
+            memcpy(&word, to + ((dx + x) >> 5) * 4, 4);
+            if (bit)
+                word |= (uint32_t) 1 << a1_bit(dx + x);
+            else
+                word &= ~((uint32_t) 1 << a1_bit(dx + x));
+            memcpy(to + ((dx + x) >> 5) * 4, &word, 4);
+        }
+    }
+    image_pixels_changed(*obj, dx, dy, width, height);
+    return 0;
+}
+
+static int
+surface_copy_page (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    cairo_surface_copy_page(*obj);
+    return 0;
+}
+
+static int
+surface_export_pixels (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    int layout, straight, width, height, src_stride, stride, y;
+    const unsigned char *src;
+    unsigned char *dst;
+    size_t dst_len, row_len;
+    cairo_surface_t **borrowed = 0;
+    uint32_t *tmp = 0;
+    PixelConversion conv;
+    const char *err;
+
+    if (cairo_surface_get_type(*obj) != CAIRO_SURFACE_TYPE_IMAGE)
+        return luaL_error(L, "method 'export_pixels' only works on image surfaces");
+    layout = luaL_checkoption(L, 2, 0, pixel_layout_names);
+    straight = luaL_checkoption(L, 3, "straight", alpha_mode_names) == 0;
+
+    cairo_surface_flush(*obj);
+    src = cairo_image_surface_get_data(*obj);
+    width = cairo_image_surface_get_width(*obj);
+    height = cairo_image_surface_get_height(*obj);
+    src_stride = cairo_image_surface_get_stride(*obj);
+    if (!src)
+        return luaL_error(L, "image surface has no pixel data");
+
+    err = pixel_conversion_init(&conv, 1, layout,
+                                cairo_image_surface_get_format(*obj),
+                                straight, width);
+    if (err)
+        return luaL_error(L, "%s", err);
+
+    row_len = (size_t) width * pixel_layout_bytes[layout];
+    stride = luaL_optinteger(L, 5, row_len);
+    luaL_argcheck(L, stride >= 0 && (size_t) stride >= row_len, 5,
+                  "stride value too small for this width and pixel layout");
+
+    if (lua_isnoneornil(L, 4)) {
+        /* Convert into a scratch buffer and copy that into the string, since
+         * Lua strings can't be written to in place. */
+        dst_len = (size_t) stride * height;
+        dst = lua_newuserdata(L, dst_len ? dst_len : 1);
+    }
+    else {
+        luaL_argcheck(L, lua_type(L, 4) != LUA_TSTRING, 4,
+                      "can't write pixels into a string");
+        dst = pixel_data_from_lua(L, 4, &dst_len, &borrowed);
+        luaL_argcheck(L, height == 0
+                         || dst_len >= (size_t) stride * (height - 1) + row_len,
+                      4, "destination not big enough for the pixel data");
+    }
+
+    if (conv.alpha_fixup) {
+        tmp = malloc(width * 4 + 4);
+        if (!tmp)
+            return luaL_error(L, "out of memory");
+    }
+    for (y = 0; y < height; ++y)
+        pixel_export_row(&conv, src + (size_t) y * src_stride,
+                         dst + (size_t) y * stride, tmp);
+    free(tmp);
+
+    if (lua_isnoneornil(L, 4))
+        lua_pushlstring(L, (const char *) dst, dst_len);
+    else {
+        if (borrowed && height > 0)
+            pixel_data_changed(*borrowed, (size_t) stride * (height - 1)
+                                          + row_len);
+        lua_pushvalue(L, 4);
+    }
+    lua_pushnumber(L, stride);
+    return 2;
+}
+
+static int
+surface_fill_rect (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    int x = luaL_checkinteger(L, 2), y = luaL_checkinteger(L, 3);
+    int width = luaL_checkinteger(L, 4), height = luaL_checkinteger(L, 5);
+    double r = luaL_checknumber(L, 6), g = luaL_checknumber(L, 7),
+           b = luaL_checknumber(L, 8), a = luaL_optnumber(L, 9, 1);
+    unsigned int color[4];
+    cairo_format_t fmt;
+    unsigned char *data, *row, *first;
+    int stride, i, bpp;
+    uint32_t pixel, word;
+
+    if (cairo_surface_get_type(*obj) != CAIRO_SURFACE_TYPE_IMAGE)
+        return luaL_error(L, "method 'fill_rect' only works on image surfaces");
+    fmt = cairo_image_surface_get_format(*obj);
+    premultiplied_color(r, g, b, a, color);
+    switch (fmt) {
+        case CAIRO_FORMAT_ARGB32:
+            pixel = (color[0] << 24) | (color[1] << 16) | (color[2] << 8)
+                  | color[3];
+            break;
+        case CAIRO_FORMAT_RGB24:
+            pixel = 0xFF000000 | (color[1] << 16) | (color[2] << 8) | color[3];
+            break;
+        case CAIRO_FORMAT_A8:
+            pixel = color[0];
+            break;
+        case CAIRO_FORMAT_A1:
+            pixel = color[0] >= 128;
+            break;
+        default:
+            return luaL_error(L, "method 'fill_rect' doesn't work on images"
+                              " of this format");
+    }
+    if (!clip_to_image(*obj, &x, &y, &width, &height))
+        return 0;
+
+    cairo_surface_flush(*obj);
+    data = cairo_image_surface_get_data(*obj);
+    if (!data)
+        return luaL_error(L, "image surface has no pixel data");
+    stride = cairo_image_surface_get_stride(*obj);
+    bpp = format_bits_per_pixel(fmt);
+
+    /* Fill the first row, then copy it to the others.  A1 pixels are set
+     * one bit at a time, since the row may not start on a byte. */
+    first = data + (size_t) y * stride;
+    for (row = first; row < first + (size_t) height * stride; row += stride) {
+        if (bpp == 1) {
+            for (i = x; i < x + width; ++i) {
+                memcpy(&word, row + (i >> 5) * 4, 4);
+                if (pixel)
+                    word |= (uint32_t) 1 << a1_bit(i);
+                else
+                    word &= ~((uint32_t) 1 << a1_bit(i));
+                memcpy(row + (i >> 5) * 4, &word, 4);
+            }
+        }
+        else if (row != first)
+            memcpy(row + (size_t) x * (bpp / 8), first + (size_t) x * (bpp / 8),
+                   (size_t) width * (bpp / 8));
+        else if (bpp == 8)
+            memset(row + x, (int) pixel, width);
+        else {
+            uint32_t *p = (uint32_t *) row + x;
+            for (i = 0; i < width; ++i)
+                p[i] = pixel;
+        }
+    }
+    image_pixels_changed(*obj, x, y, width, height);
+    return 0;
+}
+
+static int
+surface_finish (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    cairo_surface_finish(*obj);
+    flush_surface_output(L, *obj);
+    return 0;
+}
+
+static int
+surface_flush (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
     cairo_surface_flush(*obj);
+    flush_surface_output(L, *obj);
     return 0;
 }
 
@@ -396,6 +1640,17 @@ surface_get_data (lua_State *L) {
     return 2;
 }
 
+static int
+surface_get_buffer (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    cairo_surface_t **buf;
+    if (cairo_surface_get_type(*obj) != CAIRO_SURFACE_TYPE_IMAGE)
+        return 0;   /* not an image surface */
+    buf = create_buffer_userdata(L);
+    *buf = cairo_surface_reference(*obj);
+    return 1;
+}
+
 static int
 surface_get_device_offset (lua_State *L) {
     cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
@@ -447,16 +1702,34 @@ surface_get_format (lua_State *L) {
     return format_to_lua(L, cairo_image_surface_get_format(*obj));
 }
 
+/* Rows of an image converted by pixel_export_row(), split between threads.
+ * The conversion mustn't need a temporary row. */
+typedef struct ExportRowsJob_ {
+    const PixelConversion *conv;
+    const unsigned char *src;
+    unsigned char *dst;
+    int src_stride, dst_stride;
+} ExportRowsJob;
+
+static void
+export_rows (void *closure, int begin, int end) {
+    ExportRowsJob *job = closure;
+    int y;
+    for (y = begin; y < end; ++y)
+        pixel_export_row(job->conv, job->src + (size_t) y * job->src_stride,
+                         job->dst + (size_t) y * job->dst_stride, 0);
+}
+
 static int
 surface_get_gdk_pixbuf (lua_State *L) {
     cairo_surface_t **surface;
     cairo_format_t format;
     int width, height, stridei, strideo;
-    unsigned char *buffer, *rowpo, *po;
-    const char *rowpi, *pi;
+    unsigned char *buffer;
     size_t buffer_len;
-    int x, y;
     int has_alpha;
+    PixelConversion conv;
+    ExportRowsJob job;
 
     surface = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
     if (cairo_surface_get_type(*surface) != CAIRO_SURFACE_TYPE_IMAGE)
@@ -467,6 +1740,7 @@ surface_get_gdk_pixbuf (lua_State *L) {
         return luaL_error(L, "can't make pixbuf from this image format");
     has_alpha = (format == CAIRO_FORMAT_ARGB32);
 
+    cairo_surface_flush(*surface);
     width = cairo_image_surface_get_width(*surface);
     height = cairo_image_surface_get_height(*surface);
     stridei = cairo_image_surface_get_stride(*surface);
@@ -480,43 +1754,18 @@ surface_get_gdk_pixbuf (lua_State *L) {
         return luaL_error(L, "out of memory");
     }
 
-    rowpi = (const char *) cairo_image_surface_get_data(*surface);
-    rowpo = buffer;
-
     /* Copy pixels from Cairo's pixel format to GdkPixbuf's, which is slightly
-     * different. */
-    if (IS_BIG_ENDIAN) {
-        for (y = 0; y < height; ++y) {
-            pi = rowpi;
-            po = rowpo;
-            for (x = 0; x < width; ++x) {
-                *po++ = pi[1];
-                *po++ = pi[2];
-                *po++ = pi[3];
-                if (has_alpha)
-                    *po++ = pi[0];
-                pi += 4;
-            }
-            rowpi += stridei;
-            rowpo += strideo;
-        }
-    }
-    else {
-        for (y = 0; y < height; ++y) {
-            pi = rowpi;
-            po = rowpo;
-            for (x = 0; x < width; ++x) {
-                *po++ = pi[2];
-                *po++ = pi[1];
-                *po++ = pi[0];
-                if (has_alpha)
-                    *po++ = pi[3];
-                pi += 4;
-            }
-            rowpi += stridei;
-            rowpo += strideo;
-        }
-    }
+     * different.  The colour values are left premultiplied, as they always
+     * have been. */
+    pixel_conversion_init(&conv, 1,
+                          has_alpha ? PIXEL_LAYOUT_RGBA : PIXEL_LAYOUT_RGB,
+                          format, 0, width);
+    job.conv = &conv;
+    job.src = cairo_image_surface_get_data(*surface);
+    job.src_stride = stridei;
+    job.dst = buffer;
+    job.dst_stride = strideo;
+    parallel_for(height, 64, export_rows, &job);
 
     /* The buffer needs to be copied in to a Lua string so that it can
      * be passed to Lua-Gnome. */
@@ -555,6 +1804,22 @@ surface_get_height (lua_State *L) {
     return 1;
 }
 
+#if defined(HAVE_MMAP) && defined(HAVE_SHM_OPEN)
+static int
+surface_get_shm (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    ImageMapping *map = cairo_surface_get_user_data(*obj, &shm_image_key);
+    if (!map)
+        return 0;   /* not a shared memory surface */
+    lua_pushnumber(L, map->fd);
+    if (map->name)
+        lua_pushstring(L, map->name);
+    else
+        lua_pushnil(L);
+    return 2;
+}
+#endif
+
 static int
 surface_get_type (lua_State *L) {
     cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
@@ -579,6 +1844,203 @@ surface_has_show_text_glyphs (lua_State *L) {
 }
 #endif
 
+static int
+surface_hash (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    int x, y, width, height, stride, bpp, i;
+    cairo_format_t fmt;
+    const unsigned char *data, *row;
+    uint32_t *tmp = 0;
+    size_t x0, x1;
+    Xxh64State state;
+    uint64_t h;
+    char hex[17];
+
+    if (cairo_surface_get_type(*obj) != CAIRO_SURFACE_TYPE_IMAGE)
+        return luaL_error(L, "method 'hash' only works on image surfaces");
+    fmt = cairo_image_surface_get_format(*obj);
+    image_rect_from_lua(L, *obj, 2, &x, &y, &width, &height);
+
+    cairo_surface_flush(*obj);
+    data = cairo_image_surface_get_data(*obj);
+    if (!data && width > 0 && height > 0)
+        return luaL_error(L, "image surface has no pixel data");
+    stride = cairo_image_surface_get_stride(*obj);
+    bpp = format_bits_per_pixel(fmt);
+    if (bpp == 1) {
+        /* Whole 32 bit words, since that's how A1 pixels are packed. */
+        x0 = (size_t) (x >> 5) * 4;
+        x1 = width > 0 ? ((size_t) (x + width) + 31) / 32 * 4 : x0;
+    }
+    else {
+        x0 = (size_t) x * bpp / 8;
+        x1 = ((size_t) (x + width) * bpp + 7) / 8;
+    }
+
+    /* The unused byte of rgb24 pixels can have any value, so it is set to
+     * 0xFF in a copy of each row before hashing it.  Likewise the bits of
+     * A1 words which are outside the rectangle are cleared. */
+    if ((fmt == CAIRO_FORMAT_RGB24 || bpp == 1) && width > 0) {
+        tmp = malloc(x1 - x0);
+        if (!tmp)
+            return luaL_error(L, "out of memory");
+    }
+
+    xxh64_init(&state);
+    for (; height > 0; --height, ++y) {
+        row = data + (size_t) y * stride + x0;
+        if (tmp) {
+            memcpy(tmp, row, x1 - x0);
+            if (bpp == 1) {
+                for (i = (x & ~31); i < x; ++i)
+                    tmp[0] &= ~((uint32_t) 1 << a1_bit(i));
+                for (i = x + width; i & 31; ++i)
+                    tmp[(x1 - x0) / 4 - 1] &= ~((uint32_t) 1 << a1_bit(i));
+            }
+            else {
+                for (i = 0; i < width; ++i)
+                    tmp[i] |= 0xFF000000;
+            }
+            xxh64_update(&state, (const unsigned char *) tmp, x1 - x0);
+        }
+        else
+            xxh64_update(&state, row, x1 - x0);
+    }
+    free(tmp);
+
+    h = xxh64_digest(&state);
+    sprintf(hex, "%08lx%08lx", (unsigned long) (h >> 32),
+            (unsigned long) (h & 0xFFFFFFFF));
+    lua_pushlstring(L, hex, 16);
+    return 1;
+}
+
+static int
+surface_mark_dirty (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    return mark_dirty_from_lua(L, *obj, 2);
+}
+
+static int
+surface_premultiply_pixels (lua_State *L, int unpremultiply) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    unsigned char *data;
+
+    if (cairo_surface_get_type(*obj) != CAIRO_SURFACE_TYPE_IMAGE
+        || cairo_image_surface_get_format(*obj) != CAIRO_FORMAT_ARGB32)
+        return luaL_error(L, "method '%s' only works on argb32 image surfaces",
+                          unpremultiply ? "unpremultiply" : "premultiply");
+
+    cairo_surface_flush(*obj);
+    data = cairo_image_surface_get_data(*obj);
+    if (!data)
+        return 0;
+    if (unpremultiply)
+        pixel_unpremultiply_rows(data, cairo_image_surface_get_stride(*obj),
+                                 cairo_image_surface_get_width(*obj),
+                                 0, cairo_image_surface_get_height(*obj));
+    else
+        pixel_premultiply_rows(data, cairo_image_surface_get_stride(*obj),
+                               cairo_image_surface_get_width(*obj),
+                               0, cairo_image_surface_get_height(*obj));
+    cairo_surface_mark_dirty(*obj);
+    damage_add_surface_all(*obj);
+    mipmap_invalidate(*obj);
+    return 0;
+}
+
+static int
+surface_premultiply (lua_State *L) {
+    return surface_premultiply_pixels(L, 0);
+}
+
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+static int
+surface_take_damage (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    return damage_take(L, cairo_surface_get_user_data(*obj,
+                                                      &damage_surface_key));
+}
+
+static int
+surface_track_damage (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    int enable = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+    cairo_region_t *region = 0;
+    cairo_status_t status;
+
+    if (enable == (cairo_surface_get_user_data(*obj, &damage_surface_key) != 0))
+        return 0;
+    if (enable && !(region = damage_tracker_create()))
+        return luaL_error(L, "out of memory");
+    status = cairo_surface_set_user_data(*obj, &damage_surface_key, region,
+                                         region ? damage_region_free : 0);
+    if (status != CAIRO_STATUS_SUCCESS) {
+        if (region)
+            damage_region_free(region);
+        return luaL_error(L, "error tracking damage: %s",
+                          cairo_status_to_string(status));
+    }
+    return 0;
+}
+#endif
+
+static int
+surface_unpremultiply (lua_State *L) {
+    return surface_premultiply_pixels(L, 1);
+}
+
+static int
+surface_scaled (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    int width = luaL_checkinteger(L, 2), height = luaL_checkinteger(L, 3);
+    cairo_filter_t filter = lua_isnoneornil(L, 4) ? CAIRO_FILTER_GOOD
+                                                  : filter_from_lua(L, 4);
+    int src_width, src_height;
+    double sx, sy;
+    cairo_surface_t *level, *scaled;
+    cairo_pattern_t *pattern;
+    cairo_matrix_t mat;
+    SurfaceUserdata *ud;
+    cairo_t *cr;
+
+    if (cairo_surface_get_type(*obj) != CAIRO_SURFACE_TYPE_IMAGE)
+        return luaL_error(L, "method 'scaled' only works on image surfaces");
+    luaL_argcheck(L, width > 0, 2, "image width must be positive");
+    luaL_argcheck(L, height > 0, 3, "image height must be positive");
+    src_width = cairo_image_surface_get_width(*obj);
+    src_height = cairo_image_surface_get_height(*obj);
+    if (src_width == 0 || src_height == 0)
+        return luaL_error(L, "can't scale an empty image");
+
+    sx = (double) src_width / width;
+    sy = (double) src_height / height;
+    level = mipmap_get(*obj, mipmap_level_for_scale(sx < sy ? sx : sy));
+
+    ud = create_surface_userdata(L);
+    scaled = cairo_image_surface_create(cairo_image_surface_get_format(*obj),
+                                        width, height);
+    ud->surface = scaled;
+    if (cairo_surface_status(scaled) != CAIRO_STATUS_SUCCESS)
+        return luaL_error(L, "error creating scaled surface: %s",
+                          cairo_status_to_string(cairo_surface_status(scaled)));
+
+    pattern = cairo_pattern_create_for_surface(level);
+    cairo_matrix_init_scale(&mat,
+                            (double) cairo_image_surface_get_width(level) / width,
+                            (double) cairo_image_surface_get_height(level) / height);
+    cairo_pattern_set_matrix(pattern, &mat);
+    cairo_pattern_set_filter(pattern, filter);
+    cairo_pattern_set_extend(pattern, CAIRO_EXTEND_PAD);
+    cr = cairo_create(scaled);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source(cr, pattern);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    cairo_pattern_destroy(pattern);
+    return 1;
+}
+
 static int
 surface_set_device_offset (lua_State *L) {
     cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
@@ -631,6 +2093,58 @@ surface_set_size (lua_State *L) {
 }
 #endif
 
+static int
+surface_shadow (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    lua_Number radius = luaL_checknumber(L, 2);
+    double r = luaL_optnumber(L, 3, 0), g = luaL_optnumber(L, 4, 0),
+           b = luaL_optnumber(L, 5, 0), a = luaL_optnumber(L, 6, 1);
+    unsigned int color[4];
+    int width, height, extent;
+    cairo_format_t fmt;
+    const unsigned char *data;
+    cairo_surface_t *shadow;
+    SurfaceUserdata *ud;
+    const char *err;
+
+    if (cairo_surface_get_type(*obj) != CAIRO_SURFACE_TYPE_IMAGE)
+        return luaL_error(L, "method 'shadow' only works on image surfaces");
+    luaL_argcheck(L, radius >= 0 && radius <= BLUR_MAX_RADIUS, 2,
+                  "blur radius out of range");
+    fmt = cairo_image_surface_get_format(*obj);
+    width = cairo_image_surface_get_width(*obj);
+    height = cairo_image_surface_get_height(*obj);
+    extent = blur_extent(radius / 2);
+
+    premultiplied_color(r, g, b, a, color);
+
+    cairo_surface_flush(*obj);
+    data = cairo_image_surface_get_data(*obj);
+    if (!data && width > 0 && height > 0)
+        return luaL_error(L, "image surface has no pixel data");
+
+    ud = create_surface_userdata(L);
+    shadow = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                        width + 2 * extent,
+                                        height + 2 * extent);
+    ud->surface = shadow;
+    if (cairo_surface_status(shadow) != CAIRO_STATUS_SUCCESS)
+        return luaL_error(L, "error creating shadow surface: %s",
+                          cairo_status_to_string(cairo_surface_status(shadow)));
+    cairo_surface_flush(shadow);
+    err = blur_shadow(data, fmt, width, height,
+                      cairo_image_surface_get_stride(*obj),
+                      cairo_image_surface_get_data(shadow),
+                      cairo_image_surface_get_stride(shadow), radius / 2,
+                      color);
+    if (err)
+        return luaL_error(L, "%s", err);
+    cairo_surface_mark_dirty(shadow);
+    lua_pushinteger(L, -extent);
+    lua_pushinteger(L, -extent);
+    return 3;
+}
+
 static int
 surface_show_page (lua_State *L) {
     cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
@@ -638,33 +2152,42 @@ surface_show_page (lua_State *L) {
     return 0;
 }
 
-#ifdef CAIRO_HAS_PNG_FUNCTIONS
 static int
-surface_write_to_png (lua_State *L) {
+surface_write_to (lua_State *L) {
     cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
-    int filetype = lua_type(L, 2);
+    int fmt = luaL_checkoption(L, 2, 0, image_io_format_names);
+    int filetype = lua_type(L, 3);
+    const char *err;
+
+    if (cairo_surface_get_type(*obj) != CAIRO_SURFACE_TYPE_IMAGE)
+        return luaL_error(L, "method 'write_to' only works on image surfaces");
 
     if (filetype == LUA_TSTRING || filetype == LUA_TNUMBER) {
-        const char *filename = lua_tostring(L, 2);
-        if (cairo_surface_write_to_png(*obj, filename) != CAIRO_STATUS_SUCCESS)
-            return luaL_error(L, "error writing surface to PNG file '%s'",
+        const char *filename = lua_tostring(L, 3);
+        FILE *fp = fopen(filename, "wb");
+        if (!fp)
+            return luaL_error(L, "error opening image file '%s' for writing",
                               filename);
+        err = image_io_write(*obj, fmt, write_chunk_to_stdio, fp);
+        if (fclose(fp) && !err)
+            err = "error writing image data";
+        if (err)
+            return luaL_error(L, "error writing image file '%s': %s",
+                              filename, err);
     }
     else if (filetype == LUA_TUSERDATA || filetype == LUA_TTABLE) {
         SurfaceUserdata info;
         init_surface_userdata(L, &info);
-        lua_pushvalue(L, 2);
+        lua_pushvalue(L, 3);
         info.fhref = luaL_ref(L, LUA_REGISTRYINDEX);
 
-        if (cairo_surface_write_to_png_stream(*obj, write_chunk_to_fh, &info)
-                != CAIRO_STATUS_SUCCESS)
-        {
-            lua_pushliteral(L, "error writing PNG file to Lua file handle");
-            if (info.errmsg) {
-                lua_pushliteral(L, ": ");
-                lua_pushstring(L, info.errmsg);
-                lua_concat(L, 3);
-            }
+        err = image_io_write(*obj, fmt, write_chunk_to_fh, &info);
+        if (!err && flush_write_buffer(&info) != CAIRO_STATUS_SUCCESS)
+            err = "error writing image data";
+        if (err) {
+            lua_pushliteral(L, "error writing image to Lua file handle: ");
+            lua_pushstring(L, info.errmsg ? info.errmsg : err);
+            lua_concat(L, 2);
             free_surface_userdata(&info);
             return lua_error(L);
         }
@@ -672,37 +2195,537 @@ surface_write_to_png (lua_State *L) {
         free_surface_userdata(&info);
     }
     else
-        return luaL_typerror(L, 1, "filename or file handle object");
+        return luaL_typerror(L, 3, "filename or file handle object");
 
     return 0;
 }
-#endif
 
-#if defined(CAIRO_HAS_PDF_SURFACE) && CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
-static int
-restrict_to_version (lua_State *L){
-    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
-    cairo_pdf_surface_restrict_to_version(*obj, pdf_version_from_lua(L, 2));
-    return 0;
+/* Growable memory buffer for output which is wanted as a string. */
+typedef struct MemBuffer_ {
+    unsigned char *data;
+    size_t len, size;
+} MemBuffer;
+
+static cairo_status_t
+write_chunk_to_membuf (void *closure, const unsigned char *buf,
+                       unsigned int lentowrite)
+{
+    MemBuffer *mem = closure;
+
+    if (mem->len + lentowrite > mem->size) {
+        size_t size = mem->size ? mem->size : 4096;
+        unsigned char *data;
+        while (size < mem->len + lentowrite)
+            size *= 2;
+        data = realloc(mem->data, size);
+        if (!data)
+            return CAIRO_STATUS_NO_MEMORY;
+        mem->data = data;
+        mem->size = size;
+    }
+    memcpy(mem->data + mem->len, buf, lentowrite);
+    mem->len += lentowrite;
+    return CAIRO_STATUS_SUCCESS;
 }
-#endif
 
-#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+#ifdef CAIRO_HAS_PNG_FUNCTIONS
+/* Options for PNG encoding.  These need oocairo to be built with libpng,
+ * which is then used directly instead of Cairo's own PNG writer. */
+typedef struct PngOptions_ {
+    int compression;        /* zlib level, or -1 for libpng's default */
+    int filter;             /* libpng filter flags, or -1 for the default */
+    int strip_alpha;        /* write opaque ARGB32 images as RGB */
+} PngOptions;
+
+static const char * const png_filter_names[] = {
+    "none", "sub", "up", "avg", "paeth", "adaptive", 0
+};
+
+/* Read the options table at 'pos', if there is one, and check that the
+ * surface can be encoded with them.  Returns false if there are no options,
+ * in which case Cairo's PNG writer should be used as normal. */
 static int
-create_for_rectangle(lua_State *L)
+png_options_from_lua (lua_State *L, int pos, cairo_surface_t *surface,
+                      PngOptions *opts)
 {
-    SurfaceUserdata *surface;
-    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
-    double x = luaL_checknumber(L, 2);
-    double y = luaL_checknumber(L, 3);
-    double width = luaL_checknumber(L, 4);
-    double height = luaL_checknumber(L, 5);
+    opts->compression = -1;
+    opts->filter = -1;
+    opts->strip_alpha = 1;
+    if (lua_isnoneornil(L, pos))
+        return 0;
+    luaL_checktype(L, pos, LUA_TTABLE);
+
+#ifndef HAVE_LIBPNG
+    (void) surface;
+    return luaL_error(L, "PNG encoding options are not available, because"
+                      " oocairo was built without libpng");
+#else
+    if (cairo_surface_get_type(surface) != CAIRO_SURFACE_TYPE_IMAGE)
+        return luaL_error(L, "PNG encoding options only work on image"
+                          " surfaces");
 
-    luaL_argcheck(L, width >= 0, 3, "surface width cannot be negative");
-    luaL_argcheck(L, height >= 0, 4, "surface height cannot be negative");
+    lua_getfield(L, pos, "compression");
+    if (!lua_isnil(L, -1)) {
+        lua_Number level = lua_tonumber(L, -1);
+        if (!lua_isnumber(L, -1) || level < 0 || level > 9
+            || level != (int) level)
+            return luaL_error(L, "PNG compression level must be a whole"
+                              " number from 0 to 9");
+        opts->compression = (int) level;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, pos, "filter");
+    if (!lua_isnil(L, -1)) {
+        static const int filters[] = {
+            PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG,
+            PNG_FILTER_PAETH, PNG_ALL_FILTERS
+        };
+        const char *name = lua_tostring(L, -1);
+        int i;
+        for (i = 0; png_filter_names[i]; ++i) {
+            if (name && !strcmp(name, png_filter_names[i]))
+                break;
+        }
+        if (!png_filter_names[i])
+            return luaL_error(L, "unknown PNG filter '%s'",
+                              name ? name : luaL_typename(L, -1));
+        opts->filter = filters[i];
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, pos, "strip_alpha");
+    if (!lua_isnil(L, -1))
+        opts->strip_alpha = lua_toboolean(L, -1);
+    lua_pop(L, 1);
 
-    surface = create_surface_userdata(L);
-    surface->surface = cairo_surface_create_for_rectangle(*obj, x, y, width, height);
+    return 1;
+#endif
+}
+
+#ifdef HAVE_LIBPNG
+typedef struct PngWriteInfo_ {
+    cairo_write_func_t func;
+    void *closure;
+    cairo_status_t status;
+} PngWriteInfo;
+
+static void
+png_write_cb (png_structp png, png_bytep data, png_size_t len) {
+    PngWriteInfo *w = png_get_io_ptr(png);
+    w->status = w->func(w->closure, data, (unsigned int) len);
+    if (w->status != CAIRO_STATUS_SUCCESS)
+        png_error(png, "error writing PNG data");
+}
+
+static void
+png_flush_cb (png_structp png) {
+    (void) png;
+}
+
+static void
+png_error_cb (png_structp png, png_const_charp msg) {
+    (void) msg;
+    longjmp(png_jmpbuf(png), 1);
+}
+
+static void
+png_warning_cb (png_structp png, png_const_charp msg) {
+    (void) png;
+    (void) msg;
+}
+
+static int
+image_is_opaque (const unsigned char *data, int stride, int width,
+                 int height)
+{
+    int x, y;
+    for (y = 0; y < height; ++y) {
+        const uint32_t *p = (const uint32_t *) (data + (size_t) y * stride);
+        for (x = 0; x < width; ++x) {
+            if ((p[x] >> 24) != 0xFF)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* Drive libpng to encode the image, given a conversion from its pixels to
+ * rows of the right PNG colour type, and space for doing the conversion. */
+static cairo_status_t
+png_encode_rows (const unsigned char *data, int width, int height,
+                 int stride, const PixelConversion *conv, int color_type,
+                 unsigned char *row, const PngOptions *opts,
+                 cairo_write_func_t func, void *closure)
+{
+    PngWriteInfo w;
+    png_structp png;
+    png_infop info;
+    int y;
+
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, png_error_cb,
+                                  png_warning_cb);
+    if (!png)
+        return CAIRO_STATUS_NO_MEMORY;
+    info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_write_struct(&png, 0);
+        return CAIRO_STATUS_NO_MEMORY;
+    }
+
+    w.func = func;
+    w.closure = closure;
+    w.status = CAIRO_STATUS_SUCCESS;
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return w.status != CAIRO_STATUS_SUCCESS ? w.status
+                                                : CAIRO_STATUS_WRITE_ERROR;
+    }
+
+    png_set_write_fn(png, &w, png_write_cb, png_flush_cb);
+    png_set_IHDR(png, info, width, height, 8, color_type, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (opts->compression >= 0)
+        png_set_compression_level(png, opts->compression);
+    if (opts->filter >= 0)
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, opts->filter);
+    png_write_info(png, info);
+
+    for (y = 0; y < height; ++y) {
+        pixel_export_row(conv, data + (size_t) y * stride, row,
+                         (uint32_t *) (row + (size_t) width * 4));
+        png_write_row(png, row);
+    }
+    png_write_end(png, info);
+
+    png_destroy_write_struct(&png, &info);
+    return CAIRO_STATUS_SUCCESS;
+}
+
+static cairo_status_t
+png_encode_image (cairo_surface_t *surface, const PngOptions *opts,
+                  cairo_write_func_t func, void *closure)
+{
+    cairo_surface_t *image = image_io_common_format(surface);
+    cairo_format_t format = cairo_image_surface_get_format(image);
+    cairo_status_t status = cairo_surface_status(image);
+    const unsigned char *data;
+    int width, height, stride, layout, color_type;
+    unsigned char *row;
+    PixelConversion conv;
+
+    if (status != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(image);
+        return status;
+    }
+    cairo_surface_flush(image);
+    data = cairo_image_surface_get_data(image);
+    width = cairo_image_surface_get_width(image);
+    height = cairo_image_surface_get_height(image);
+    stride = cairo_image_surface_get_stride(image);
+
+    if (format == CAIRO_FORMAT_A8) {
+        layout = PIXEL_LAYOUT_GRAY;
+        color_type = PNG_COLOR_TYPE_GRAY;
+    }
+    else if (format == CAIRO_FORMAT_RGB24
+             || (opts->strip_alpha
+                 && image_is_opaque(data, stride, width, height)))
+    {
+        layout = PIXEL_LAYOUT_RGB;
+        color_type = PNG_COLOR_TYPE_RGB;
+    }
+    else {
+        layout = PIXEL_LAYOUT_RGBA;
+        color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+    }
+    pixel_conversion_init(&conv, 1, layout, format, 1, width);
+
+    /* One row of output, then room for a row of unpremultiplied pixels. */
+    row = malloc((size_t) width * 8 + 4);
+    if (!row)
+        status = CAIRO_STATUS_NO_MEMORY;
+    else
+        status = png_encode_rows(data, width, height, stride, &conv,
+                                 color_type, row, opts, func, closure);
+
+    free(row);
+    cairo_surface_destroy(image);
+    return status;
+}
+#endif
+
+/* Write a surface in PNG format, using libpng directly when there are
+ * encoding options and Cairo's own writer otherwise. */
+static cairo_status_t
+write_png_stream (cairo_surface_t *surface, const PngOptions *opts,
+                  int have_opts, cairo_write_func_t func, void *closure)
+{
+#ifdef HAVE_LIBPNG
+    if (have_opts)
+        return png_encode_image(surface, opts, func, closure);
+#else
+    (void) opts;
+    (void) have_opts;
+#endif
+    return cairo_surface_write_to_png_stream(surface, func, closure);
+}
+
+static cairo_status_t
+write_png_file (cairo_surface_t *surface, const PngOptions *opts,
+                int have_opts, const char *filename)
+{
+    cairo_status_t status = CAIRO_STATUS_WRITE_ERROR;
+    FILE *fp;
+
+    if (!have_opts)
+        return cairo_surface_write_to_png(surface, filename);
+    fp = fopen(filename, "wb");
+    if (fp) {
+        status = write_png_stream(surface, opts, 1, write_chunk_to_stdio, fp);
+        if (fclose(fp) && status == CAIRO_STATUS_SUCCESS)
+            status = CAIRO_STATUS_WRITE_ERROR;
+    }
+    return status;
+}
+
+static int
+surface_write_to_png (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    int filetype = lua_type(L, 2);
+    PngOptions opts;
+    int have_opts = png_options_from_lua(L, 3, *obj, &opts);
+
+    if (filetype == LUA_TSTRING || filetype == LUA_TNUMBER) {
+        const char *filename = lua_tostring(L, 2);
+        if (write_png_file(*obj, &opts, have_opts, filename)
+                != CAIRO_STATUS_SUCCESS)
+            return luaL_error(L, "error writing surface to PNG file '%s'",
+                              filename);
+    }
+    else if (filetype == LUA_TUSERDATA || filetype == LUA_TTABLE) {
+        SurfaceUserdata info;
+        init_surface_userdata(L, &info);
+        lua_pushvalue(L, 2);
+        info.fhref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        if (write_png_stream(*obj, &opts, have_opts, write_chunk_to_fh, &info)
+                != CAIRO_STATUS_SUCCESS
+            || flush_write_buffer(&info) != CAIRO_STATUS_SUCCESS)
+        {
+            lua_pushliteral(L, "error writing PNG file to Lua file handle");
+            if (info.errmsg) {
+                lua_pushliteral(L, ": ");
+                lua_pushstring(L, info.errmsg);
+                lua_concat(L, 3);
+            }
+            free_surface_userdata(&info);
+            return lua_error(L);
+        }
+
+        free_surface_userdata(&info);
+    }
+    else
+        return luaL_typerror(L, 1, "filename or file handle object");
+
+    return 0;
+}
+
+/* Start the buffer off at a size which most PNG files of this image won't
+ * need to grow beyond, so that there is usually only one allocation. */
+static void
+init_png_membuf (MemBuffer *mem, cairo_surface_t *surface) {
+    mem->data = 0;
+    mem->len = 0;
+    mem->size = 64 * 1024;
+    if (cairo_surface_get_type(surface) == CAIRO_SURFACE_TYPE_IMAGE) {
+        size_t raw = (size_t) cairo_image_surface_get_stride(surface)
+                   * cairo_image_surface_get_height(surface);
+        mem->size = raw / 2 + 1024;
+        if (mem->size > 8 * 1024 * 1024)
+            mem->size = 8 * 1024 * 1024;
+    }
+    mem->data = malloc(mem->size);
+    if (!mem->data)
+        mem->size = 0;
+}
+
+static int
+surface_to_png_string (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    MemBuffer mem;
+    PngOptions opts;
+    int have_opts = png_options_from_lua(L, 2, *obj, &opts);
+    cairo_status_t status;
+
+    init_png_membuf(&mem, *obj);
+    status = write_png_stream(*obj, &opts, have_opts, write_chunk_to_membuf,
+                              &mem);
+    if (status != CAIRO_STATUS_SUCCESS) {
+        free(mem.data);
+        return luaL_error(L, "error encoding surface as PNG: %s",
+                          cairo_status_to_string(status));
+    }
+    lua_pushlstring(L, (const char *) mem.data, mem.len);
+    free(mem.data);
+    return 1;
+}
+
+/* Copy the pixels of an image surface into a new one, so that they can be
+ * used on another thread while the original carries on being drawn on. */
+static cairo_surface_t *
+image_snapshot (cairo_surface_t *surface) {
+    cairo_format_t fmt = cairo_image_surface_get_format(surface);
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    int src_stride = cairo_image_surface_get_stride(surface);
+    size_t row_bytes = ((size_t) width * format_bits_per_pixel(fmt) + 7) / 8;
+    cairo_surface_t *copy = cairo_image_surface_create(fmt, width, height);
+    const unsigned char *src;
+    unsigned char *dst;
+    int dst_stride, y;
+
+    if (cairo_surface_status(copy) != CAIRO_STATUS_SUCCESS)
+        return copy;
+    cairo_surface_flush(surface);
+    cairo_surface_flush(copy);
+    src = cairo_image_surface_get_data(surface);
+    dst = cairo_image_surface_get_data(copy);
+    dst_stride = cairo_image_surface_get_stride(copy);
+    for (y = 0; y < height; ++y)
+        memcpy(dst + (size_t) y * dst_stride, src + (size_t) y * src_stride,
+               row_bytes);
+    cairo_surface_mark_dirty(copy);
+    return copy;
+}
+
+typedef struct PngJob_ {
+    cairo_surface_t *image;     /* snapshot, until it's been encoded */
+    char *filename;             /* null when the PNG is wanted as a string */
+    PngOptions opts;
+    int have_opts;
+    MemBuffer mem;
+} PngJob;
+
+static cairo_status_t
+png_job_run (void *data) {
+    PngJob *pj = data;
+    cairo_status_t status;
+
+    if (pj->filename)
+        status = write_png_file(pj->image, &pj->opts, pj->have_opts,
+                                pj->filename);
+    else
+        status = write_png_stream(pj->image, &pj->opts, pj->have_opts,
+                                  write_chunk_to_membuf, &pj->mem);
+    /* The copy of the pixels isn't needed any more, so the memory can be
+     * freed without waiting for the job object to be collected. */
+    cairo_surface_destroy(pj->image);
+    pj->image = 0;
+    return status;
+}
+
+static int
+png_job_result (lua_State *L, void *data, cairo_status_t status) {
+    PngJob *pj = data;
+
+    if (pj->filename) {
+        if (status != CAIRO_STATUS_SUCCESS)
+            return luaL_error(L, "error writing surface to PNG file '%s'",
+                              pj->filename);
+        lua_pushboolean(L, 1);
+    }
+    else {
+        if (status != CAIRO_STATUS_SUCCESS)
+            return luaL_error(L, "error encoding surface as PNG: %s",
+                              cairo_status_to_string(status));
+        lua_pushlstring(L, (const char *) pj->mem.data, pj->mem.len);
+    }
+    return 1;
+}
+
+static void
+png_job_free (void *data) {
+    PngJob *pj = data;
+    if (pj->image)
+        cairo_surface_destroy(pj->image);
+    free(pj->filename);
+    free(pj->mem.data);
+    free(pj);
+}
+
+static int
+surface_write_to_png_async (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    int filetype = lua_type(L, 2);
+    Job *job;
+    PngJob *pj;
+
+    if (cairo_surface_get_type(*obj) != CAIRO_SURFACE_TYPE_IMAGE)
+        return luaL_error(L, "method 'write_to_png_async' only works on image"
+                          " surfaces");
+    if (filetype != LUA_TSTRING && filetype != LUA_TNUMBER
+        && filetype != LUA_TNIL && filetype != LUA_TNONE)
+        return luaL_typerror(L, 2, "filename or nil");
+
+    job = job_create(L, png_job_run, png_job_result, png_job_free);
+    pj = calloc(1, sizeof(PngJob));
+    if (!pj)
+        return luaL_error(L, "out of memory");
+    job->data = pj;
+    pj->have_opts = png_options_from_lua(L, 3, *obj, &pj->opts);
+
+    if (filetype == LUA_TSTRING || filetype == LUA_TNUMBER) {
+        size_t len;
+        const char *filename = lua_tolstring(L, 2, &len);
+        pj->filename = malloc(len + 1);
+        if (!pj->filename)
+            return luaL_error(L, "out of memory");
+        memcpy(pj->filename, filename, len + 1);
+    }
+    else
+        init_png_membuf(&pj->mem, *obj);
+
+    if (cairo_surface_status(*obj) != CAIRO_STATUS_SUCCESS)
+        return luaL_error(L, "can't write surface to PNG: %s",
+                          cairo_status_to_string(cairo_surface_status(*obj)));
+    pj->image = image_snapshot(*obj);
+    if (cairo_surface_status(pj->image) != CAIRO_STATUS_SUCCESS)
+        return luaL_error(L, "out of memory");
+
+    job_start(job);
+    return 1;
+}
+#endif
+
+#if defined(CAIRO_HAS_PDF_SURFACE) && CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+static int
+restrict_to_version (lua_State *L){
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    cairo_pdf_surface_restrict_to_version(*obj, pdf_version_from_lua(L, 2));
+    return 0;
+}
+#endif
+
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+static int
+create_for_rectangle(lua_State *L)
+{
+    SurfaceUserdata *surface;
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    double x = luaL_checknumber(L, 2);
+    double y = luaL_checknumber(L, 3);
+    double width = luaL_checknumber(L, 4);
+    double height = luaL_checknumber(L, 5);
+
+    luaL_argcheck(L, width >= 0, 3, "surface width cannot be negative");
+    luaL_argcheck(L, height >= 0, 4, "surface height cannot be negative");
+
+    surface = create_surface_userdata(L);
+    surface->surface = cairo_surface_create_for_rectangle(*obj, x, y, width, height);
+#ifdef CAIRO_HAS_RECORDING_SURFACE
+    cairo_surface_set_user_data(surface->surface, &draw_parent_key, *obj, 0);
+#endif
     return 1;
 }
 
@@ -790,6 +2813,666 @@ unmap_image(lua_State *L)
 }
 #endif
 
+#ifdef CAIRO_HAS_RECORDING_SURFACE
+#define RASTERIZE_DEFAULT_TILE_SIZE 256
+
+typedef struct RasterizeJob_ {
+    cairo_surface_t *copies[PARALLEL_MAX_THREADS];
+    unsigned char *data;
+    cairo_format_t format;
+    int width, height, stride, bpp;
+    int tile_size, cols, num_tiles, workers;
+    cairo_status_t status[PARALLEL_MAX_THREADS];
+} RasterizeJob;
+
+/* Replay a recording onto one tile of the target.  The tile gets an image
+ * surface of its own which shares the target's memory.  Cairo changes a
+ * recording while replaying it (keeping a list of the commands which are
+ * visible, and snapshots of it as a source), so each thread is given its
+ * own copy, and the threads have no Cairo objects in common. */
+static cairo_status_t
+rasterize_tile (RasterizeJob *job, cairo_surface_t *recording, int tile) {
+    int x = tile % job->cols * job->tile_size;
+    int y = tile / job->cols * job->tile_size;
+    int w = job->width - x, h = job->height - y;
+    cairo_surface_t *surface;
+    cairo_t *cr;
+    cairo_status_t status;
+
+    if (w > job->tile_size) w = job->tile_size;
+    if (h > job->tile_size) h = job->tile_size;
+    surface = cairo_image_surface_create_for_data(
+        job->data + (size_t) y * job->stride + x * job->bpp / 8,
+        job->format, w, h, job->stride);
+    cr = cairo_create(surface);
+    cairo_set_source_surface(cr, recording, -x, -y);
+    cairo_paint(cr);
+    status = cairo_status(cr);
+    cairo_destroy(cr);
+    cairo_surface_flush(surface);
+    if (status == CAIRO_STATUS_SUCCESS)
+        status = cairo_surface_status(surface);
+    cairo_surface_destroy(surface);
+    return status;
+}
+
+/* Each worker takes every 'workers'th tile, so that a busy part of the
+ * drawing is shared out rather than landing on one thread. */
+static void
+rasterize_workers (void *closure, int begin, int end) {
+    RasterizeJob *job = closure;
+    cairo_status_t status;
+    int worker, tile;
+
+    for (worker = begin; worker < end; ++worker) {
+        job->status[worker] = CAIRO_STATUS_SUCCESS;
+        for (tile = worker + 1; tile < job->num_tiles; tile += job->workers) {
+            status = rasterize_tile(job, job->copies[worker], tile);
+            if (status != CAIRO_STATUS_SUCCESS)
+                job->status[worker] = status;
+        }
+    }
+}
+
+static int
+rasterize_parallel (lua_State *L) {
+    cairo_surface_t **recording = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    cairo_surface_t **target = luaL_checkudata(L, 2, OOCAIRO_MT_NAME_SURFACE);
+    int threads = parallel_num_threads();
+    int tile_size = RASTERIZE_DEFAULT_TILE_SIZE, rows, i;
+    cairo_rectangle_t bounds;
+    cairo_status_t status;
+    RasterizeJob job;
+    cairo_t *cr;
+
+    luaL_argcheck(L, cairo_surface_get_type(*recording)
+                         == CAIRO_SURFACE_TYPE_RECORDING,
+                  1, "must be a recording surface");
+    luaL_argcheck(L, cairo_surface_get_type(*target) == CAIRO_SURFACE_TYPE_IMAGE,
+                  2, "must be an image surface");
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_getfield(L, 3, "threads");
+        if (!lua_isnil(L, -1))
+            threads = luaL_checkinteger(L, -1);
+        lua_getfield(L, 3, "tile");
+        if (!lua_isnil(L, -1))
+            tile_size = luaL_checkinteger(L, -1);
+        lua_pop(L, 2);
+        luaL_argcheck(L, threads > 0, 3, "number of threads must be positive");
+        luaL_argcheck(L, tile_size > 0, 3, "tile size must be positive");
+    }
+
+    cairo_surface_flush(*target);
+    job.data = cairo_image_surface_get_data(*target);
+    if (!job.data)
+        return luaL_error(L, "can't rasterize onto image surface: %s",
+                          cairo_status_to_string(cairo_surface_status(*target)));
+    job.format = cairo_image_surface_get_format(*target);
+    job.width = cairo_image_surface_get_width(*target);
+    job.height = cairo_image_surface_get_height(*target);
+    job.stride = cairo_image_surface_get_stride(*target);
+    job.bpp = format_bits_per_pixel(job.format);
+    if (job.width == 0 || job.height == 0)
+        return 0;
+
+    /* Recordings which can't be shared between threads are played back in
+     * one go, as a single tile. */
+    if (!recording_is_thread_safe(*recording))
+        tile_size = job.width > job.height ? job.width : job.height;
+
+    /* Tiles start on a multiple of 32 pixels, which keeps each tile's
+     * first pixel word aligned whatever the format is. */
+    if (tile_size > 0x40000000)
+        tile_size = 0x40000000;
+    tile_size = (tile_size + 31) & ~31;
+    job.tile_size = tile_size;
+    job.cols = (job.width + tile_size - 1) / tile_size;
+    rows = (job.height + tile_size - 1) / tile_size;
+    job.num_tiles = job.cols * rows;
+    job.workers = threads < job.num_tiles - 1 ? threads : job.num_tiles - 1;
+    if (job.workers > PARALLEL_MAX_THREADS)
+        job.workers = PARALLEL_MAX_THREADS;
+
+    /* The copies are recordings of the original being painted, which
+     * Cairo does by taking a snapshot of its drawing.  Flushing the
+     * original after each one lets go of the snapshot, so that every copy
+     * has one of its own. */
+    bounds.x = bounds.y = 0;
+    bounds.width = job.width;
+    bounds.height = job.height;
+    for (i = 0; i < job.workers; ++i) {
+        job.copies[i] = cairo_recording_surface_create(
+                            cairo_surface_get_content(*recording), &bounds);
+        cr = cairo_create(job.copies[i]);
+        cairo_set_source_surface(cr, *recording, 0, 0);
+        cairo_paint(cr);
+        cairo_destroy(cr);
+        cairo_surface_flush(*recording);
+    }
+
+    /* The first tile is done here with the original. */
+    status = rasterize_tile(&job, *recording, 0);
+    if (job.workers > 0)
+        parallel_for_threads(job.workers, 1, job.workers, rasterize_workers,
+                             &job);
+    for (i = 0; i < job.workers; ++i) {
+        if (job.status[i] != CAIRO_STATUS_SUCCESS)
+            status = job.status[i];
+        cairo_surface_destroy(job.copies[i]);
+    }
+
+    image_pixels_changed(*target, 0, 0, job.width, job.height);
+    if (status != CAIRO_STATUS_SUCCESS)
+        return luaL_error(L, "error rasterizing recording surface: %s",
+                          cairo_status_to_string(status));
+    return 0;
+}
+
+/* Vector documents made on a background thread by playing back a list of
+ * recording surfaces, one for each page. */
+enum {
+    DOCUMENT_PDF,
+    DOCUMENT_PS,
+    DOCUMENT_SVG
+};
+static const char * const document_type_names[] = {
+    "pdf", "ps", "svg", 0
+};
+
+/* The job has its own copy of each recording, so that Lua can carry on
+ * using the originals, and it's only released on the Lua thread. */
+typedef struct DocumentPage_ {
+    cairo_surface_t *recording;
+    double width, height;
+} DocumentPage;
+
+typedef struct DocumentJob_ {
+    int type;
+    char *filename;             /* null when the output is wanted as a string */
+    MemBuffer mem;
+    DocumentPage *pages;
+    int num_pages;
+} DocumentJob;
+
+static void
+document_job_release_pages (DocumentJob *dj) {
+    int i;
+    for (i = 0; i < dj->num_pages; ++i) {
+        if (dj->pages[i].recording)
+            cairo_surface_destroy(dj->pages[i].recording);
+    }
+    free(dj->pages);
+    dj->pages = 0;
+    dj->num_pages = 0;
+}
+
+static int
+document_type_supported (int type) {
+#ifdef CAIRO_HAS_PDF_SURFACE
+    if (type == DOCUMENT_PDF)
+        return 1;
+#endif
+#ifdef CAIRO_HAS_PS_SURFACE
+    if (type == DOCUMENT_PS)
+        return 1;
+#endif
+#ifdef CAIRO_HAS_SVG_SURFACE
+    if (type == DOCUMENT_SVG)
+        return 1;
+#endif
+    (void) type;
+    return 0;
+}
+
+static cairo_surface_t *
+document_surface_create (int type, cairo_write_func_t func, void *closure,
+                         double width, double height)
+{
+    switch (type) {
+#ifdef CAIRO_HAS_PDF_SURFACE
+        case DOCUMENT_PDF:
+            return cairo_pdf_surface_create_for_stream(func, closure, width,
+                                                       height);
+#endif
+#ifdef CAIRO_HAS_PS_SURFACE
+        case DOCUMENT_PS:
+            return cairo_ps_surface_create_for_stream(func, closure, width,
+                                                      height);
+#endif
+#ifdef CAIRO_HAS_SVG_SURFACE
+        case DOCUMENT_SVG:
+            return cairo_svg_surface_create_for_stream(func, closure, width,
+                                                       height);
+#endif
+        default:
+            (void) func;
+            (void) closure;
+            (void) width;
+            (void) height;
+            return 0;
+    }
+}
+
+static void
+document_set_page_size (cairo_surface_t *surface, int type, double width,
+                        double height)
+{
+#ifdef CAIRO_HAS_PDF_SURFACE
+    if (type == DOCUMENT_PDF)
+        cairo_pdf_surface_set_size(surface, width, height);
+#endif
+#ifdef CAIRO_HAS_PS_SURFACE
+    if (type == DOCUMENT_PS)
+        cairo_ps_surface_set_size(surface, width, height);
+#endif
+    (void) surface;
+    (void) type;
+    (void) width;
+    (void) height;
+}
+
+static cairo_status_t
+document_job_run (void *data) {
+    DocumentJob *dj = data;
+    cairo_write_func_t func = write_chunk_to_membuf;
+    void *closure = &dj->mem;
+    cairo_surface_t *surface;
+    cairo_status_t status;
+    FILE *fp = 0;
+    cairo_t *cr;
+    int i;
+
+    if (dj->filename) {
+        fp = fopen(dj->filename, "wb");
+        if (!fp)
+            return CAIRO_STATUS_WRITE_ERROR;
+        func = write_chunk_to_stdio;
+        closure = fp;
+    }
+
+    surface = document_surface_create(dj->type, func, closure,
+                                      dj->pages[0].width,
+                                      dj->pages[0].height);
+    for (i = 0; i < dj->num_pages; ++i) {
+        DocumentPage *page = &dj->pages[i];
+        if (i > 0)
+            document_set_page_size(surface, dj->type, page->width,
+                                   page->height);
+        cr = cairo_create(surface);
+        cairo_set_source_surface(cr, page->recording, 0, 0);
+        cairo_paint(cr);
+        cairo_show_page(cr);
+        cairo_destroy(cr);
+        if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+            break;
+    }
+    cairo_surface_finish(surface);
+    status = cairo_surface_status(surface);
+    cairo_surface_destroy(surface);
+
+    if (fp && fclose(fp) && status == CAIRO_STATUS_SUCCESS)
+        status = CAIRO_STATUS_WRITE_ERROR;
+    return status;
+}
+
+static int
+document_job_result (lua_State *L, void *data, cairo_status_t status) {
+    DocumentJob *dj = data;
+
+    if (status != CAIRO_STATUS_SUCCESS)
+        return luaL_error(L, "error writing %s document: %s",
+                          document_type_names[dj->type],
+                          cairo_status_to_string(status));
+    if (dj->filename)
+        lua_pushboolean(L, 1);
+    else
+        lua_pushlstring(L, (const char *) dj->mem.data, dj->mem.len);
+    return 1;
+}
+
+static void
+document_job_free (void *data) {
+    DocumentJob *dj = data;
+    document_job_release_pages(dj);
+    free(dj->filename);
+    free(dj->mem.data);
+    free(dj);
+}
+
+/* Read the page at the top of the stack, which is either a recording
+ * surface with extents, or a table of a recording surface and the width
+ * and height of the page.  Returns false if the recording has things in it
+ * which mustn't be played back on another thread. */
+static int
+document_page_from_lua (lua_State *L, int pagenum, DocumentPage *page) {
+    cairo_surface_t **obj;
+    cairo_rectangle_t extents;
+    double x, y;
+    cairo_t *cr;
+
+    extents.x = extents.y = 0;
+    if (lua_istable(L, -1)) {
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+        lua_rawgeti(L, -3, 3);
+        if (!lua_isnumber(L, -2) || !lua_isnumber(L, -1))
+            luaL_error(L, "page %d should be a table of a recording surface,"
+                       " width and height", pagenum);
+        extents.width = lua_tonumber(L, -2);
+        extents.height = lua_tonumber(L, -1);
+        lua_pop(L, 2);
+    }
+    else {
+        lua_pushvalue(L, -1);
+        extents.width = extents.height = -1;
+    }
+
+    obj = lua_touserdata(L, -1);
+    if (!obj || !lua_getmetatable(L, -1))
+        luaL_error(L, "page %d is not a recording surface", pagenum);
+    luaL_getmetatable(L, OOCAIRO_MT_NAME_SURFACE);
+    if (!lua_rawequal(L, -1, -2)
+        || cairo_surface_get_type(*obj) != CAIRO_SURFACE_TYPE_RECORDING)
+        luaL_error(L, "page %d is not a recording surface", pagenum);
+    lua_pop(L, 3);
+
+    if (extents.width < 0) {
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 12, 0)
+        if (!cairo_recording_surface_get_extents(*obj, &extents))
+            luaL_error(L, "page %d is an unbounded recording surface, so its"
+                       " size must be given", pagenum);
+#else
+        luaL_error(L, "page %d must be given with its size", pagenum);
+#endif
+    }
+    if (extents.width <= 0 || extents.height <= 0)
+        luaL_error(L, "page %d has no area", pagenum);
+    page->width = extents.width;
+    page->height = extents.height;
+
+    /* The copy is a recording of the original being painted, which Cairo
+     * does by taking a snapshot of its drawing.  Flushing the original
+     * then lets go of the snapshot, so that nothing is shared with it
+     * apart from things Cairo never changes, such as fonts. */
+    x = extents.x;
+    y = extents.y;
+    extents.x = extents.y = 0;
+    page->recording = cairo_recording_surface_create(
+                            cairo_surface_get_content(*obj), &extents);
+    cr = cairo_create(page->recording);
+    cairo_set_source_surface(cr, *obj, -x, -y);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    cairo_surface_flush(*obj);
+    if (cairo_surface_status(page->recording) != CAIRO_STATUS_SUCCESS)
+        luaL_error(L, "error copying page %d: %s", pagenum,
+                   cairo_status_to_string(
+                       cairo_surface_status(page->recording)));
+    return recording_is_thread_safe(*obj);
+}
+
+static int
+render_document_async (lua_State *L) {
+    int type = luaL_checkoption(L, 1, 0, document_type_names);
+    int filetype = lua_type(L, 2);
+    int num_pages, i, thread_safe = 1;
+    DocumentJob *dj;
+    Job *job;
+
+    if (!document_type_supported(type))
+        return luaL_error(L, "%s documents are not supported by Cairo",
+                          document_type_names[type]);
+    if (filetype != LUA_TSTRING && filetype != LUA_TNUMBER
+        && filetype != LUA_TNIL)
+        return luaL_typerror(L, 2, "filename or nil");
+    luaL_checktype(L, 3, LUA_TTABLE);
+    num_pages = lua_objlen(L, 3);
+    luaL_argcheck(L, num_pages > 0, 3, "document must have at least one page");
+    luaL_argcheck(L, type != DOCUMENT_SVG || num_pages == 1, 3,
+                  "SVG documents can only have one page");
+
+    job = job_create(L, document_job_run, document_job_result,
+                     document_job_free);
+    dj = calloc(1, sizeof(DocumentJob));
+    if (!dj)
+        return luaL_error(L, "out of memory");
+    job->data = dj;
+    dj->type = type;
+    dj->pages = calloc(num_pages, sizeof(DocumentPage));
+    if (!dj->pages)
+        return luaL_error(L, "out of memory");
+
+    /* Each page holds a copy of its recording from here on, which is only
+     * released when the job is garbage collected.  The page is counted
+     * first, so that its copy is released even if reading it fails. */
+    for (i = 0; i < num_pages; ++i) {
+        lua_rawgeti(L, 3, i + 1);
+        ++dj->num_pages;
+        if (!document_page_from_lua(L, i + 1, &dj->pages[i]))
+            thread_safe = 0;
+        lua_pop(L, 1);
+    }
+
+    if (filetype == LUA_TNIL) {
+        dj->mem.size = 64 * 1024;
+        dj->mem.data = malloc(dj->mem.size);
+        if (!dj->mem.data)
+            dj->mem.size = 0;
+    }
+    else {
+        size_t len;
+        const char *filename = lua_tolstring(L, 2, &len);
+        dj->filename = malloc(len + 1);
+        if (!dj->filename)
+            return luaL_error(L, "out of memory");
+        memcpy(dj->filename, filename, len + 1);
+    }
+
+    /* Text in user fonts, for example, has to be drawn on this thread,
+     * since it calls back into Lua. */
+    if (thread_safe)
+        job_start(job);
+    else
+        job_run_here(job);
+    return 1;
+}
+#endif
+
+#ifdef CAIRO_HAS_OBSERVER_SURFACE
+/* Lua functions registered as observer callbacks are kept in a linked list
+ * which is attached to the observer surface as user data, so that they stay
+ * referenced for exactly as long as Cairo might call them. */
+typedef struct ObserverCallback_ {
+    lua_State *L;
+    int ref;
+    struct ObserverCallback_ *next;
+} ObserverCallback;
+static cairo_user_data_key_t observer_udata_key;
+
+static void
+observer_udata_free (void *udata) {
+    ObserverCallback *cb = udata, *next;
+    while (cb) {
+        next = cb->next;
+        luaL_unref(cb->L, LUA_REGISTRYINDEX, cb->ref);
+        free(cb);
+        cb = next;
+    }
+}
+
+static void
+push_observed_surface (lua_State *L, cairo_surface_t *surface) {
+    /* The 'flush' and 'finish' callbacks can be called while the surface
+     * is being destroyed, in which case it can't be given to Lua any more. */
+    if (cairo_surface_get_reference_count(surface) > 0)
+        oocairo_surface_push(L, surface);
+    else
+        lua_pushnil(L);
+}
+
+static void
+observer_callback (cairo_surface_t *observer, cairo_surface_t *target,
+                   void *data)
+{
+    ObserverCallback *cb = data;
+    lua_State *L = cb->L;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cb->ref);
+    push_observed_surface(L, observer);
+    push_observed_surface(L, target);
+    lua_call(L, 2, 0);
+}
+
+typedef cairo_status_t (*ObserverAddCallbackFunc) (
+        cairo_surface_t *, cairo_surface_observer_callback_t, void *);
+static const char * const observer_callback_names[] = {
+    "paint", "mask", "fill", "stroke", "glyphs", "flush", "finish", 0
+};
+static const ObserverAddCallbackFunc observer_callback_funcs[] = {
+    cairo_surface_observer_add_paint_callback,
+    cairo_surface_observer_add_mask_callback,
+    cairo_surface_observer_add_fill_callback,
+    cairo_surface_observer_add_stroke_callback,
+    cairo_surface_observer_add_glyphs_callback,
+    cairo_surface_observer_add_flush_callback,
+    cairo_surface_observer_add_finish_callback
+};
+
+static int
+surface_create_observer (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    cairo_surface_observer_mode_t mode = CAIRO_SURFACE_OBSERVER_NORMAL;
+    SurfaceUserdata *surface;
+
+    if (!lua_isnoneornil(L, 2))
+        mode = surface_observer_mode_from_lua(L, 2);
+
+    surface = create_surface_userdata(L);
+    surface->surface = cairo_surface_create_observer(*obj, mode);
+#ifdef CAIRO_HAS_RECORDING_SURFACE
+    cairo_surface_set_user_data(surface->surface, &draw_parent_key, *obj, 0);
+#endif
+    return 1;
+}
+
+static int
+surface_observer_add_callback (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    int op = luaL_checkoption(L, 2, 0, observer_callback_names);
+    ObserverCallback *head, *cb;
+    cairo_status_t status;
+
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    if (cairo_surface_observer_elapsed(*obj) < 0)
+        return luaL_error(L, "method 'observer_add_callback' only works on"
+                          " observer surfaces");
+
+    cb = malloc(sizeof(ObserverCallback));
+    if (!cb)
+        return luaL_error(L, "out of memory");
+    lua_pushvalue(L, 3);
+    cb->L = L;
+    cb->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    cb->next = 0;
+
+    /* The first callback becomes the head of the list owned by the surface,
+     * later ones are chained on behind it. */
+    head = cairo_surface_get_user_data(*obj, &observer_udata_key);
+    if (head) {
+        cb->next = head->next;
+        head->next = cb;
+    }
+    else {
+        status = cairo_surface_set_user_data(*obj, &observer_udata_key, cb,
+                                             observer_udata_free);
+        if (status != CAIRO_STATUS_SUCCESS) {
+            observer_udata_free(cb);
+            return push_cairo_status(L, status);
+        }
+    }
+
+    return push_cairo_status(L,
+            observer_callback_funcs[op](*obj, observer_callback, cb));
+}
+
+static int
+surface_observer_elapsed (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    double elapsed = cairo_surface_observer_elapsed(*obj);
+    if (elapsed < 0)
+        return luaL_error(L, "method 'observer_elapsed' only works on"
+                          " observer surfaces");
+    lua_pushnumber(L, elapsed);
+    return 1;
+}
+
+typedef double (*DeviceObserverElapsedFunc) (cairo_device_t *);
+static const char * const device_observer_elapsed_names[] = {
+    "all", "paint", "mask", "fill", "stroke", "glyphs", 0
+};
+static const DeviceObserverElapsedFunc device_observer_elapsed_funcs[] = {
+    cairo_device_observer_elapsed,
+    cairo_device_observer_paint_elapsed,
+    cairo_device_observer_mask_elapsed,
+    cairo_device_observer_fill_elapsed,
+    cairo_device_observer_stroke_elapsed,
+    cairo_device_observer_glyphs_elapsed
+};
+
+static int
+surface_device_observer_elapsed (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    int op = luaL_checkoption(L, 2, "all", device_observer_elapsed_names);
+    cairo_device_t *device = cairo_surface_get_device(*obj);
+    double elapsed = -1;
+
+    if (device && cairo_surface_observer_elapsed(*obj) >= 0)
+        elapsed = device_observer_elapsed_funcs[op](device);
+    if (elapsed < 0)
+        return luaL_error(L, "method 'device_observer_elapsed' only works on"
+                          " observer surfaces");
+    lua_pushnumber(L, elapsed);
+    return 1;
+}
+
+static cairo_status_t
+write_chunk_to_buffer (void *closure, const unsigned char *buf,
+                       unsigned int lentowrite)
+{
+    luaL_addlstring(closure, (const char *) buf, lentowrite);
+    return CAIRO_STATUS_SUCCESS;
+}
+
+static int
+surface_observer_print (lua_State *L) {
+    cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
+    cairo_device_t *device;
+    cairo_status_t status;
+    luaL_Buffer buf;
+
+    if (cairo_surface_observer_elapsed(*obj) < 0)
+        return luaL_error(L, "method 'observer_print' only works on observer"
+                          " surfaces");
+
+    /* Nothing else touches the Lua stack while Cairo is writing the report,
+     * so it can go straight into a string buffer. */
+    luaL_buffinit(L, &buf);
+    if (lua_toboolean(L, 2)) {
+        device = cairo_surface_get_device(*obj);
+        status = cairo_device_observer_print(device, write_chunk_to_buffer,
+                                             &buf);
+    }
+    else
+        status = cairo_surface_observer_print(*obj, write_chunk_to_buffer,
+                                              &buf);
+    luaL_pushresult(&buf);
+    if (status != CAIRO_STATUS_SUCCESS)
+        return luaL_error(L, "error printing observer report: %s",
+                          cairo_status_to_string(status));
+    return 1;
+}
+#endif
+
 static int
 surface_status (lua_State *L) {
     cairo_surface_t **obj = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_SURFACE);
@@ -808,10 +3491,16 @@ surface_methods[] = {
 #if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 12, 0)
     { "supports_mime_type", supports_mime_type },
 #endif
+    { "blur", surface_blur },
+    { "clear", surface_clear },
+    { "copy_from", surface_copy_from },
     { "copy_page", surface_copy_page },
+    { "export_pixels", surface_export_pixels },
+    { "fill_rect", surface_fill_rect },
     { "finish", surface_finish },
     { "flush", surface_flush },
     { "get_content", surface_get_content },
+    { "get_buffer", surface_get_buffer },
     { "get_data", surface_get_data },
     { "get_device_offset", surface_get_device_offset },
 #ifdef CAIRO_HAS_PS_SURFACE
@@ -824,14 +3513,21 @@ surface_methods[] = {
     { "get_format", surface_get_format },
     { "get_gdk_pixbuf", surface_get_gdk_pixbuf },
     { "get_height", surface_get_height },
+#if defined(HAVE_MMAP) && defined(HAVE_SHM_OPEN)
+    { "get_shm", surface_get_shm },
+#endif
     { "get_type", surface_get_type },
     { "get_width", surface_get_width },
 #if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 8, 0)
     { "has_show_text_glyphs", surface_has_show_text_glyphs },
 #endif
+    { "hash", surface_hash },
 #if defined(CAIRO_HAS_PDF_SURFACE) && CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
     { "restrict_to_version", restrict_to_version },
 #endif
+    { "mark_dirty", surface_mark_dirty },
+    { "premultiply", surface_premultiply },
+    { "scaled", surface_scaled },
     { "set_device_offset", surface_set_device_offset },
 #ifdef CAIRO_HAS_PS_SURFACE
     { "set_eps", surface_set_eps },
@@ -840,14 +3536,34 @@ surface_methods[] = {
 #if defined(CAIRO_HAS_PDF_SURFACE) || defined(CAIRO_HAS_PS_SURFACE)
     { "set_size", surface_set_size },
 #endif
+    { "shadow", surface_shadow },
     { "show_page", surface_show_page },
     { "status", surface_status },
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+    { "take_damage", surface_take_damage },
+#endif
+#ifdef CAIRO_HAS_PNG_FUNCTIONS
+    { "to_png_string", surface_to_png_string },
+#endif
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+    { "track_damage", surface_track_damage },
+#endif
+    { "unpremultiply", surface_unpremultiply },
+    { "write_to", surface_write_to },
 #ifdef CAIRO_HAS_PNG_FUNCTIONS
     { "write_to_png", surface_write_to_png },
+    { "write_to_png_async", surface_write_to_png_async },
 #endif
 #if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 12, 0)
     { "map_to_image", map_to_image },
     { "unmap_image", unmap_image },
+#endif
+#ifdef CAIRO_HAS_OBSERVER_SURFACE
+    { "create_observer", surface_create_observer },
+    { "device_observer_elapsed", surface_device_observer_elapsed },
+    { "observer_add_callback", surface_observer_add_callback },
+    { "observer_elapsed", surface_observer_elapsed },
+    { "observer_print", surface_observer_print },
 #endif
     { 0, 0 }
 };
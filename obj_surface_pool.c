@@ -0,0 +1,244 @@
+/* Copyright (C) 2007-2008 Geoff Richards
+ * Copyright (C) 2010-2011 Uli Schlachter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Surface pools keep image surfaces which are no longer needed, so that
+ * a later request for an image of the same format and size can reuse the
+ * memory instead of allocating (and page faulting in) a fresh buffer.
+ * Only surfaces which came from a pool, and which nothing else has a
+ * reference to, are kept. */
+
+#define SURFACE_POOL_DEFAULT_MAX_BYTES (64 * 1024 * 1024)
+
+typedef struct SurfacePool_ {
+    cairo_surface_t **entries;  /* oldest first */
+    int num_entries, max_entries;
+    size_t bytes, max_bytes;
+    int clear;                  /* true to zero reused pixels */
+} SurfacePool;
+
+/* Set on surfaces created by a pool, to mark them as having ordinary
+ * image memory owned by Cairo, which is safe to hand out again. */
+static cairo_user_data_key_t surface_pool_key;
+
+static size_t
+pool_surface_bytes (cairo_surface_t *surface) {
+    return (size_t) cairo_image_surface_get_stride(surface)
+           * cairo_image_surface_get_height(surface);
+}
+
+/* Destroy the oldest pooled surfaces until no more than 'max' bytes are
+ * kept. */
+static void
+surface_pool_trim_to (SurfacePool *pool, size_t max) {
+    int n = 0;
+    while (n < pool->num_entries && pool->bytes > max) {
+        pool->bytes -= pool_surface_bytes(pool->entries[n]);
+        cairo_surface_destroy(pool->entries[n]);
+        ++n;
+    }
+    if (n) {
+        pool->num_entries -= n;
+        memmove(pool->entries, pool->entries + n,
+                pool->num_entries * sizeof(cairo_surface_t *));
+    }
+}
+
+static int
+surface_pool_create (lua_State *L) {
+    lua_Number max_bytes = luaL_optnumber(L, 1,
+                                          SURFACE_POOL_DEFAULT_MAX_BYTES);
+    SurfacePool *pool;
+
+    luaL_argcheck(L, max_bytes >= 0, 1, "memory limit cannot be negative");
+    pool = lua_newuserdata(L, sizeof(SurfacePool));
+    pool->entries = 0;
+    pool->num_entries = pool->max_entries = 0;
+    pool->bytes = 0;
+    pool->max_bytes = max_bytes < (lua_Number) (size_t) -1
+                    ? (size_t) max_bytes : (size_t) -1;
+    pool->clear = lua_isnoneornil(L, 2) ? 1 : lua_toboolean(L, 2);
+    luaL_getmetatable(L, OOCAIRO_MT_NAME_POOL);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int
+pool_gc (lua_State *L) {
+    SurfacePool *pool = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_POOL);
+    surface_pool_trim_to(pool, 0);
+    free(pool->entries);
+    pool->entries = 0;
+    pool->max_entries = 0;
+    return 0;
+}
+
+static int
+pool_acquire (lua_State *L) {
+    SurfacePool *pool = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_POOL);
+    cairo_format_t fmt;
+    int width, height, i;
+    cairo_surface_t *surface = 0, *s;
+    SurfaceUserdata *ud;
+
+    fmt = format_from_lua(L, 2);
+    width = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, width >= 0, 3, "image width cannot be negative");
+    height = luaL_checkinteger(L, 4);
+    luaL_argcheck(L, height >= 0, 4, "image height cannot be negative");
+
+    /* Take the most recently released match, since its memory is the most
+     * likely to still be in the cache. */
+    for (i = pool->num_entries - 1; i >= 0; --i) {
+        s = pool->entries[i];
+        if (cairo_image_surface_get_format(s) == fmt
+            && cairo_image_surface_get_width(s) == width
+            && cairo_image_surface_get_height(s) == height)
+            break;
+    }
+
+    /* The surface is only taken out of the pool once there's a Lua object
+     * to hold it, so that it isn't lost if that runs out of memory. */
+    ud = create_surface_userdata(L);
+    if (i >= 0) {
+        surface = pool->entries[i];
+        pool->bytes -= pool_surface_bytes(surface);
+        --pool->num_entries;
+        memmove(pool->entries + i, pool->entries + i + 1,
+                (pool->num_entries - i) * sizeof(cairo_surface_t *));
+        cairo_surface_set_device_offset(surface, 0, 0);
+        if (pool->clear) {
+            cairo_surface_flush(surface);
+            memset(cairo_image_surface_get_data(surface), 0,
+                   pool_surface_bytes(surface));
+            image_pixels_changed(surface, 0, 0, width, height);
+        }
+    }
+    else {
+        surface = cairo_image_surface_create(fmt, width, height);
+        /* If the mark can't be set the surface just won't be pooled. */
+        if (cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS)
+            cairo_surface_set_user_data(surface, &surface_pool_key,
+                                        &surface_pool_key, 0);
+    }
+    ud->surface = surface;
+    return 1;
+}
+
+static int
+pool_get_max_bytes (lua_State *L) {
+    SurfacePool *pool = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_POOL);
+    lua_pushnumber(L, (lua_Number) pool->max_bytes);
+    return 1;
+}
+
+static int
+pool_get_size (lua_State *L) {
+    SurfacePool *pool = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_POOL);
+    lua_pushnumber(L, (lua_Number) pool->bytes);
+    lua_pushnumber(L, pool->num_entries);
+    return 2;
+}
+
+static int
+pool_release (lua_State *L) {
+    SurfacePool *pool = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_POOL);
+    SurfaceUserdata *ud = luaL_checkudata(L, 2, OOCAIRO_MT_NAME_SURFACE);
+    cairo_surface_t *surface = ud->surface, **entries;
+    size_t size;
+    int keep;
+
+    /* The Lua object gives up its surface either way, and is left with
+     * one in an error state, so that any further use of it is harmless. */
+    ud->surface = cairo_image_surface_create((cairo_format_t) -1, 0, 0);
+
+    keep = cairo_surface_get_user_data(surface, &surface_pool_key) != 0
+        && cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS
+        && cairo_surface_get_reference_count(surface) == 1
+        && cairo_image_surface_get_data(surface) != 0;     /* not finished */
+    size = keep ? pool_surface_bytes(surface) : 0;
+    if (keep && size > pool->max_bytes)
+        keep = 0;
+
+    if (keep) {
+        surface_pool_trim_to(pool, pool->max_bytes - size);
+        if (pool->num_entries == pool->max_entries) {
+            int n = pool->max_entries ? pool->max_entries * 2 : 8;
+            entries = realloc(pool->entries, n * sizeof(cairo_surface_t *));
+            if (entries) {
+                pool->entries = entries;
+                pool->max_entries = n;
+            }
+            else
+                keep = 0;
+        }
+    }
+
+    if (keep) {
+        /* Forget what was attached to the surface during its last use,
+         * so that the next user doesn't get its damage or stale mipmaps. */
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+        cairo_surface_set_user_data(surface, &damage_surface_key, 0, 0);
+#endif
+        cairo_surface_set_user_data(surface, &mipmap_surface_key, 0, 0);
+        pool->entries[pool->num_entries++] = surface;
+        pool->bytes += size;
+    }
+    else
+        cairo_surface_destroy(surface);
+    lua_pushboolean(L, keep);
+    return 1;
+}
+
+static int
+pool_set_max_bytes (lua_State *L) {
+    SurfacePool *pool = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_POOL);
+    lua_Number max_bytes = luaL_checknumber(L, 2);
+    luaL_argcheck(L, max_bytes >= 0, 2, "memory limit cannot be negative");
+    pool->max_bytes = max_bytes < (lua_Number) (size_t) -1
+                    ? (size_t) max_bytes : (size_t) -1;
+    surface_pool_trim_to(pool, pool->max_bytes);
+    return 0;
+}
+
+static int
+pool_trim (lua_State *L) {
+    SurfacePool *pool = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_POOL);
+    lua_Number max_bytes = luaL_optnumber(L, 2, 0);
+    luaL_argcheck(L, max_bytes >= 0, 2, "memory limit cannot be negative");
+    surface_pool_trim_to(pool, max_bytes < (lua_Number) (size_t) -1
+                               ? (size_t) max_bytes : (size_t) -1);
+    return 0;
+}
+
+static const luaL_Reg
+pool_methods[] = {
+    { "__gc", pool_gc },
+    { "acquire", pool_acquire },
+    { "get_max_bytes", pool_get_max_bytes },
+    { "get_size", pool_get_size },
+    { "release", pool_release },
+    { "set_max_bytes", pool_set_max_bytes },
+    { "trim", pool_trim },
+    { 0, 0 }
+};
+
+/* vi:set ts=4 sw=4 expandtab: */
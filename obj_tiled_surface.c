@@ -0,0 +1,500 @@
+/* Copyright (C) 2007-2008 Geoff Richards
+ * Copyright (C) 2010-2011 Uli Schlachter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Tiled surfaces cover a canvas which may be far too big to keep in memory
+ * as one image, most of which is expected to stay empty.  Drawing is done
+ * through contexts on a recording surface the size of the canvas, with a
+ * damage tracker on it noting which areas have been drawn on.  When the
+ * tiles are needed the recording is played back onto each tile the damage
+ * touches, creating image surfaces for the ones which don't exist yet, and
+ * a fresh recording is started.
+ *
+ * Cairo plays a recording back onto an empty surface, so each recording
+ * starts by painting the existing tiles into it.  The tiles are then
+ * replaced by what comes out in the damaged areas, which gives the right
+ * answer for operators like CLEAR and SOURCE, and for formats without
+ * alpha.  Contexts on an old recording are marked so that drawing with
+ * them raises an error, instead of being silently lost. */
+
+#ifdef CAIRO_HAS_RECORDING_SURFACE
+#define TILED_DEFAULT_TILE_SIZE 256
+
+static const cairo_user_data_key_t tiled_stale_key = { 0 };
+
+/* Number of old recordings still in use by contexts. */
+static int tiled_stale_recordings = 0;
+
+typedef struct TileEntry_ {
+    int col, row;
+    cairo_surface_t *surface;   /* null for an empty slot */
+} TileEntry;
+
+typedef struct TiledSurface_ {
+    cairo_format_t format;
+    int width, height, tile_size;
+    cairo_surface_t *recording; /* drawing not played back onto tiles yet */
+    TileEntry *tiles;           /* hash table keyed on column and row */
+    int num_tiles, max_tiles;   /* max_tiles is zero or a power of two */
+} TiledSurface;
+
+static unsigned int
+tile_hash (int col, int row) {
+    return ((unsigned int) col * 0x9E3779B1u) ^ ((unsigned int) row * 0x85EBCA77u);
+}
+
+static TileEntry *
+tiled_find_slot (TileEntry *tiles, int max_tiles, int col, int row) {
+    unsigned int mask = max_tiles - 1, i = tile_hash(col, row) & mask;
+    while (tiles[i].surface && (tiles[i].col != col || tiles[i].row != row))
+        i = (i + 1) & mask;
+    return &tiles[i];
+}
+
+static cairo_surface_t *
+tiled_get (TiledSurface *ts, int col, int row) {
+    if (!ts->max_tiles)
+        return 0;
+    return tiled_find_slot(ts->tiles, ts->max_tiles, col, row)->surface;
+}
+
+static int
+tiled_tile_width (TiledSurface *ts, int col) {
+    int x = col * ts->tile_size;
+    return ts->width - x < ts->tile_size ? ts->width - x : ts->tile_size;
+}
+
+static int
+tiled_tile_height (TiledSurface *ts, int row) {
+    int y = row * ts->tile_size;
+    return ts->height - y < ts->tile_size ? ts->height - y : ts->tile_size;
+}
+
+/* Create an empty tile.  Returns null if there isn't enough memory. */
+static cairo_surface_t *
+tiled_add (TiledSurface *ts, int col, int row) {
+    cairo_surface_t *surface;
+    TileEntry *tiles, *slot;
+    int n, i;
+
+    /* Keep the table no more than half full. */
+    if (2 * (ts->num_tiles + 1) > ts->max_tiles) {
+        n = ts->max_tiles ? ts->max_tiles * 2 : 16;
+        tiles = calloc(n, sizeof(TileEntry));
+        if (!tiles)
+            return 0;
+        for (i = 0; i < ts->max_tiles; ++i) {
+            if (ts->tiles[i].surface)
+                *tiled_find_slot(tiles, n, ts->tiles[i].col,
+                                 ts->tiles[i].row) = ts->tiles[i];
+        }
+        free(ts->tiles);
+        ts->tiles = tiles;
+        ts->max_tiles = n;
+    }
+
+    surface = cairo_image_surface_create(ts->format, tiled_tile_width(ts, col),
+                                         tiled_tile_height(ts, row));
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        return 0;
+    }
+    slot = tiled_find_slot(ts->tiles, ts->max_tiles, col, row);
+    slot->col = col;
+    slot->row = row;
+    slot->surface = surface;
+    ++ts->num_tiles;
+    return surface;
+}
+
+/* Take a tile out of the table, moving later entries of its run back so
+ * that they can still be found. */
+static void
+tiled_remove (TiledSurface *ts, TileEntry *slot) {
+    unsigned int mask = ts->max_tiles - 1, i = slot - ts->tiles, j, home;
+
+    cairo_surface_destroy(slot->surface);
+    slot->surface = 0;
+    --ts->num_tiles;
+    for (j = (i + 1) & mask; ts->tiles[j].surface; j = (j + 1) & mask) {
+        home = tile_hash(ts->tiles[j].col, ts->tiles[j].row) & mask;
+        /* Leave it alone if its home slot is between the hole and it. */
+        if (((j - home) & mask) < ((j - i) & mask))
+            continue;
+        ts->tiles[i] = ts->tiles[j];
+        ts->tiles[j].surface = 0;
+        i = j;
+    }
+}
+
+/* True if every pixel of a tile is zero, not counting the unused byte of
+ * rgb24 pixels. */
+static int
+tiled_tile_is_empty (cairo_surface_t *tile) {
+    cairo_format_t fmt = cairo_image_surface_get_format(tile);
+    const unsigned char *data, *row;
+    int width = cairo_image_surface_get_width(tile);
+    int height = cairo_image_surface_get_height(tile);
+    int stride = cairo_image_surface_get_stride(tile), x, y, bytes;
+
+    cairo_surface_flush(tile);
+    if (!(data = cairo_image_surface_get_data(tile)))
+        return 0;
+    /* A1 rows are whole 32 bit words, and the spare bits stay clear. */
+    bytes = fmt == CAIRO_FORMAT_A1 ? (width + 31) / 32 * 4
+                                   : width * (format_bits_per_pixel(fmt) / 8);
+    for (y = 0; y < height; ++y) {
+        row = data + (size_t) y * stride;
+        if (fmt == CAIRO_FORMAT_RGB24) {
+            for (x = 0; x < width; ++x)
+                if (((const uint32_t *) row)[x] & 0xFFFFFF)
+                    return 0;
+        }
+        else {
+            for (x = 0; x < bytes; ++x)
+                if (row[x])
+                    return 0;
+        }
+    }
+    return 1;
+}
+
+/* Make drawing through contexts on 'recording' an error from now on. */
+static void
+tiled_stale_release (void *data) {
+    (void) data;
+    --tiled_stale_recordings;
+    --draw_hooks_active;
+}
+
+static void
+tiled_mark_stale (cairo_surface_t *recording) {
+    if (cairo_surface_set_user_data(recording, &tiled_stale_key,
+                                    (void *) &tiled_stale_key,
+                                    tiled_stale_release)
+        == CAIRO_STATUS_SUCCESS)
+    {
+        ++tiled_stale_recordings;
+        ++draw_hooks_active;
+    }
+}
+
+static int
+tiled_context_is_stale (cairo_t *cr) {
+    return cairo_surface_get_user_data(cairo_get_target(cr), &tiled_stale_key)
+           != 0;
+}
+
+/* Start a new recording, with the existing tiles painted into it and a
+ * damage tracker on it.  Returns false if there isn't enough memory. */
+static int
+tiled_new_recording (TiledSurface *ts) {
+    cairo_rectangle_t extents;
+    cairo_content_t content;
+    cairo_region_t *region;
+    cairo_t *cr;
+    int i;
+
+    content = ts->format == CAIRO_FORMAT_A8 || ts->format == CAIRO_FORMAT_A1
+            ? CAIRO_CONTENT_ALPHA
+            : ts->format == CAIRO_FORMAT_ARGB32 ? CAIRO_CONTENT_COLOR_ALPHA
+            : CAIRO_CONTENT_COLOR;
+    extents.x = extents.y = 0;
+    extents.width = ts->width;
+    extents.height = ts->height;
+    if (ts->recording) {
+        tiled_mark_stale(ts->recording);
+        cairo_surface_destroy(ts->recording);
+    }
+    ts->recording = cairo_recording_surface_create(content, &extents);
+    if (cairo_surface_status(ts->recording) != CAIRO_STATUS_SUCCESS)
+        return 0;
+    draw_recording_register(ts->recording);
+
+    if (ts->num_tiles) {
+        cr = cairo_create(ts->recording);
+        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+        for (i = 0; i < ts->max_tiles; ++i) {
+            if (!ts->tiles[i].surface)
+                continue;
+            cairo_set_source_surface(cr, ts->tiles[i].surface,
+                                     ts->tiles[i].col * ts->tile_size,
+                                     ts->tiles[i].row * ts->tile_size);
+            cairo_rectangle(cr, ts->tiles[i].col * ts->tile_size,
+                            ts->tiles[i].row * ts->tile_size,
+                            tiled_tile_width(ts, ts->tiles[i].col),
+                            tiled_tile_height(ts, ts->tiles[i].row));
+            cairo_fill(cr);
+        }
+        cairo_destroy(cr);
+    }
+
+    if (!(region = damage_tracker_create()))
+        return 0;
+    if (cairo_surface_set_user_data(ts->recording, &damage_surface_key,
+                                    region, damage_region_free)
+        != CAIRO_STATUS_SUCCESS)
+    {
+        damage_region_free(region);
+        return 0;
+    }
+    return 1;
+}
+
+/* Play back anything drawn since last time onto the tiles it touches. */
+static void
+tiled_flush (lua_State *L, TiledSurface *ts) {
+    cairo_region_t *region, *part;
+    cairo_rectangle_int_t ext, rect, r;
+    cairo_surface_t *tile;
+    cairo_t *cr;
+    int col, row, col0, col1, row0, row1, i, n;
+
+    if (!ts->recording)
+        luaL_error(L, "tiled surface has no recording surface");
+    region = cairo_surface_get_user_data(ts->recording, &damage_surface_key);
+    if (!region || cairo_region_is_empty(region))
+        return;
+
+    cairo_region_get_extents(region, &ext);
+    col0 = ext.x < 0 ? 0 : ext.x / ts->tile_size;
+    row0 = ext.y < 0 ? 0 : ext.y / ts->tile_size;
+    col1 = (ext.x + ext.width - 1) / ts->tile_size;
+    row1 = (ext.y + ext.height - 1) / ts->tile_size;
+    if (col1 > (ts->width - 1) / ts->tile_size)
+        col1 = (ts->width - 1) / ts->tile_size;
+    if (row1 > (ts->height - 1) / ts->tile_size)
+        row1 = (ts->height - 1) / ts->tile_size;
+
+    cairo_surface_flush(ts->recording);
+    for (row = row0; row <= row1; ++row) {
+        for (col = col0; col <= col1; ++col) {
+            rect.x = col * ts->tile_size;
+            rect.y = row * ts->tile_size;
+            rect.width = tiled_tile_width(ts, col);
+            rect.height = tiled_tile_height(ts, row);
+            if (cairo_region_contains_rectangle(region, &rect)
+                == CAIRO_REGION_OVERLAP_OUT)
+                continue;
+            tile = tiled_get(ts, col, row);
+            if (!tile && !(tile = tiled_add(ts, col, row)))
+                luaL_error(L, "out of memory");
+
+            /* Replace the damaged parts of the tile with what the recording
+             * has there. */
+            part = cairo_region_create_rectangle(&rect);
+            cairo_region_intersect(part, region);
+            cr = cairo_create(tile);
+            n = cairo_region_num_rectangles(part);
+            for (i = 0; i < n; ++i) {
+                cairo_region_get_rectangle(part, i, &r);
+                cairo_rectangle(cr, r.x - rect.x, r.y - rect.y,
+                                r.width, r.height);
+            }
+            cairo_region_destroy(part);
+            cairo_clip(cr);
+            cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+            cairo_set_source_surface(cr, ts->recording, -rect.x, -rect.y);
+            cairo_paint(cr);
+            cairo_destroy(cr);
+
+            if (tiled_tile_is_empty(tile))
+                tiled_remove(ts, tiled_find_slot(ts->tiles, ts->max_tiles,
+                                                 col, row));
+            else {
+                damage_add_surface_all(tile);
+                mipmap_invalidate(tile);
+            }
+        }
+    }
+
+    if (!tiled_new_recording(ts))
+        luaL_error(L, "out of memory");
+}
+
+static int
+tiled_surface_create (lua_State *L) {
+    cairo_format_t fmt = format_from_lua(L, 1);
+    int width = luaL_checkinteger(L, 2), height = luaL_checkinteger(L, 3);
+    int tile_size = luaL_optinteger(L, 4, TILED_DEFAULT_TILE_SIZE);
+    TiledSurface *ts;
+
+    luaL_argcheck(L, width > 0, 2, "canvas width must be positive");
+    luaL_argcheck(L, height > 0, 3, "canvas height must be positive");
+    luaL_argcheck(L, tile_size > 0, 4, "tile size must be positive");
+    ts = lua_newuserdata(L, sizeof(TiledSurface));
+    ts->format = fmt;
+    ts->width = width;
+    ts->height = height;
+    ts->tile_size = tile_size;
+    ts->recording = 0;
+    ts->tiles = 0;
+    ts->num_tiles = ts->max_tiles = 0;
+    luaL_getmetatable(L, OOCAIRO_MT_NAME_TILED);
+    lua_setmetatable(L, -2);
+    if (!tiled_new_recording(ts))
+        return luaL_error(L, "out of memory");
+    return 1;
+}
+
+static int
+tiled_gc (lua_State *L) {
+    TiledSurface *ts = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_TILED);
+    int i;
+    for (i = 0; i < ts->max_tiles; ++i)
+        if (ts->tiles[i].surface)
+            cairo_surface_destroy(ts->tiles[i].surface);
+    free(ts->tiles);
+    ts->tiles = 0;
+    ts->num_tiles = ts->max_tiles = 0;
+    if (ts->recording) {
+        tiled_mark_stale(ts->recording);
+        cairo_surface_destroy(ts->recording);
+        ts->recording = 0;
+    }
+    return 0;
+}
+
+static int
+tiled_context (lua_State *L) {
+    TiledSurface *ts = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_TILED);
+    cairo_t **obj;
+    if (!ts->recording)
+        return luaL_error(L, "tiled surface has no recording surface");
+    obj = create_context_userdata(L);
+    *obj = cairo_create(ts->recording);
+    return 1;
+}
+
+static int
+tiled_flush_method (lua_State *L) {
+    TiledSurface *ts = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_TILED);
+    tiled_flush(L, ts);
+    return 0;
+}
+
+static int
+tiled_get_format (lua_State *L) {
+    TiledSurface *ts = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_TILED);
+    return format_to_lua(L, ts->format);
+}
+
+static int
+tiled_get_size (lua_State *L) {
+    TiledSurface *ts = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_TILED);
+    lua_pushnumber(L, ts->width);
+    lua_pushnumber(L, ts->height);
+    return 2;
+}
+
+static int
+tiled_push_tile (lua_State *L, TiledSurface *ts, int col, int row) {
+    cairo_surface_t *tile = tiled_get(ts, col, row);
+    SurfaceUserdata *ud;
+    if (!tile) {
+        lua_pushnil(L);
+        return 1;
+    }
+    ud = create_surface_userdata(L);
+    ud->surface = cairo_surface_reference(tile);
+    return 1;
+}
+
+static int
+tiled_get_tile (lua_State *L) {
+    TiledSurface *ts = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_TILED);
+    int col = luaL_checkinteger(L, 2), row = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, col >= 0 && col <= (ts->width - 1) / ts->tile_size, 2,
+                  "tile column out of range");
+    luaL_argcheck(L, row >= 0 && row <= (ts->height - 1) / ts->tile_size, 3,
+                  "tile row out of range");
+    tiled_flush(L, ts);
+    return tiled_push_tile(L, ts, col, row);
+}
+
+static int
+tiled_get_tile_count (lua_State *L) {
+    TiledSurface *ts = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_TILED);
+    tiled_flush(L, ts);
+    lua_pushnumber(L, ts->num_tiles);
+    lua_pushnumber(L, ((lua_Number) (ts->width - 1) / ts->tile_size + 1)
+                      * ((ts->height - 1) / ts->tile_size + 1));
+    return 2;
+}
+
+static int
+tiled_get_tile_size (lua_State *L) {
+    TiledSurface *ts = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_TILED);
+    lua_pushnumber(L, ts->tile_size);
+    return 1;
+}
+
+/* The iterator returned by ts:tiles(), with the tiled surface and the next
+ * slot of its table to look at as upvalues. */
+static int
+tiled_tiles_iter (lua_State *L) {
+    TiledSurface *ts = luaL_checkudata(L, lua_upvalueindex(1),
+                                       OOCAIRO_MT_NAME_TILED);
+    int i = lua_tointeger(L, lua_upvalueindex(2));
+
+    for (; i < ts->max_tiles; ++i) {
+        if (ts->tiles[i].surface) {
+            lua_pushinteger(L, i + 1);
+            lua_replace(L, lua_upvalueindex(2));
+            lua_pushnumber(L, ts->tiles[i].col);
+            lua_pushnumber(L, ts->tiles[i].row);
+            tiled_push_tile(L, ts, ts->tiles[i].col, ts->tiles[i].row);
+            lua_pushnumber(L, ts->tiles[i].col * ts->tile_size);
+            lua_pushnumber(L, ts->tiles[i].row * ts->tile_size);
+            return 5;
+        }
+    }
+    lua_pushinteger(L, i);
+    lua_replace(L, lua_upvalueindex(2));
+    return 0;
+}
+
+static int
+tiled_tiles (lua_State *L) {
+    TiledSurface *ts = luaL_checkudata(L, 1, OOCAIRO_MT_NAME_TILED);
+    tiled_flush(L, ts);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, tiled_tiles_iter, 2);
+    return 1;
+}
+
+static const luaL_Reg
+tiled_methods[] = {
+    { "__gc", tiled_gc },
+    { "context", tiled_context },
+    { "flush", tiled_flush_method },
+    { "get_format", tiled_get_format },
+    { "get_size", tiled_get_size },
+    { "get_tile", tiled_get_tile },
+    { "get_tile_count", tiled_get_tile_count },
+    { "get_tile_size", tiled_get_tile_size },
+    { "tiles", tiled_tiles },
+    { 0, 0 }
+};
+#endif
+
+/* vi:set ts=4 sw=4 expandtab: */
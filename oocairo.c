@@ -25,7 +25,12 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <limits.h>
 #include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
 
 #ifdef CAIRO_HAS_PDF_SURFACE
 #include <cairo-pdf.h>
@@ -36,6 +41,20 @@
 #ifdef CAIRO_HAS_SVG_SURFACE
 #include <cairo-svg.h>
 #endif
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+#ifdef HAVE_MMAP
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 #if CAIRO_VERSION < CAIRO_VERSION_ENCODE(1, 6, 0)
 #error "This Lua binding requires Cairo version 1.6 or better."
@@ -313,6 +332,16 @@ static const cairo_region_overlap_t region_overlap_values[] = {
 ENUM_VAL_TO_LUA_STRING_FUNC(region_overlap)
 #endif
 
+#ifdef CAIRO_HAS_OBSERVER_SURFACE
+static const char * const surface_observer_mode_names[] = {
+    "normal", "record-operations", 0
+};
+static const cairo_surface_observer_mode_t surface_observer_mode_values[] = {
+    CAIRO_SURFACE_OBSERVER_NORMAL, CAIRO_SURFACE_OBSERVER_RECORD_OPERATIONS
+};
+ENUM_VAL_FROM_LUA_STRING_FUNC(surface_observer_mode)
+#endif
+
 static void
 to_lua_matrix (lua_State *L, cairo_matrix_t *mat, int pos) {
     double *matnums;
@@ -673,12 +702,21 @@ typedef struct SurfaceUserdata_ {
     int fhref;
     const char *errmsg;
     int errmsg_free;        /* true if errmsg must be freed */
-    /* This is only used for image surfaces initialized from data.  A copy
-     * is made and referenced here, and only freed when the surface object
-     * is GCed. */
-    unsigned char *image_buffer;
+    /* Output is collected here and passed to the file handle's 'write'
+     * method in large pieces, rather than once for every little chunk
+     * Cairo produces. */
+    unsigned char *wbuf;
+    size_t wbuf_len, wbuf_size;
 } SurfaceUserdata;
 
+/* Size of the write buffer given to new surfaces writing to file handles.
+ * Zero means that every chunk is written straight through. */
+static size_t write_buffer_size = 256 * 1024;
+
+/* Set on surfaces writing to a file handle, so that whichever Lua object
+ * they're accessed through can find the buffered output. */
+static const cairo_user_data_key_t write_buffer_key = { 0 };
+
 static void
 init_surface_userdata (lua_State *L, SurfaceUserdata *ud) {
     ud->surface = 0;
@@ -686,7 +724,9 @@ init_surface_userdata (lua_State *L, SurfaceUserdata *ud) {
     ud->fhref = LUA_NOREF;
     ud->errmsg = 0;
     ud->errmsg_free = 0;
-    ud->image_buffer = 0;
+    ud->wbuf = 0;
+    ud->wbuf_len = 0;
+    ud->wbuf_size = write_buffer_size;
 }
 
 static cairo_pattern_t **
@@ -756,6 +796,15 @@ create_surface_userdata (lua_State *L) {
     return ud;
 }
 
+static cairo_surface_t **
+create_buffer_userdata (lua_State *L) {
+    cairo_surface_t **obj = lua_newuserdata(L, sizeof(cairo_surface_t *));
+    *obj = 0;
+    luaL_getmetatable(L, OOCAIRO_MT_NAME_BUFFER);
+    lua_setmetatable(L, -2);
+    return obj;
+}
+
 #define PUSH(name, type, func, reference) \
 int \
 oocairo_ ## name ## _push (lua_State *L, type *obj) \
@@ -790,28 +839,6 @@ oocairo_matrix_push (lua_State *L, cairo_matrix_t *matrix)
     return 1;
 }
 
-static void
-free_surface_userdata (SurfaceUserdata *ud) {
-    if (ud->surface) {
-        cairo_surface_destroy(ud->surface);
-        ud->surface = 0;
-    }
-    if (ud->fhref != LUA_NOREF) {
-        luaL_unref(ud->L, LUA_REGISTRYINDEX, ud->fhref);
-        ud->fhref = LUA_NOREF;
-    }
-    if (ud->errmsg) {
-        if (ud->errmsg_free)
-            free((char *) ud->errmsg);
-        ud->errmsg = 0;
-        ud->errmsg_free = 0;
-    }
-    if (ud->image_buffer) {
-        free(ud->image_buffer);
-        ud->image_buffer = 0;
-    }
-}
-
 static char *
 my_strdup (const char *s) {
     char *copy = malloc(strlen(s) + 1);
@@ -822,10 +849,7 @@ my_strdup (const char *s) {
 }
 
 static cairo_status_t
-write_chunk_to_fh (void *closure, const unsigned char *buf,
-                   unsigned int lentowrite)
-{
-    SurfaceUserdata *info = closure;
+write_to_fh (SurfaceUserdata *info, const unsigned char *buf, size_t len) {
     lua_State *L = info->L;
 
     lua_rawgeti(L, LUA_REGISTRYINDEX, info->fhref);
@@ -836,13 +860,13 @@ write_chunk_to_fh (void *closure, const unsigned char *buf,
         return CAIRO_STATUS_WRITE_ERROR;
     }
     lua_pushvalue(L, -2);
-    lua_pushlstring(L, (const char *) buf, lentowrite);
+    lua_pushlstring(L, (const char *) buf, len);
     if (lua_pcall(L, 2, 0, 0)) {
         if (lua_isstring(L, -1)) {
             info->errmsg = my_strdup(lua_tostring(L, -1));
             info->errmsg_free = 1;
         }
-        lua_pop(L, 1);
+        lua_pop(L, 2);
         return CAIRO_STATUS_WRITE_ERROR;
     }
 
@@ -850,6 +874,94 @@ write_chunk_to_fh (void *closure, const unsigned char *buf,
     return CAIRO_STATUS_SUCCESS;
 }
 
+/* Pass anything left in the write buffer on to the file handle.  Once a
+ * write has failed there's no point trying again, so the data is dropped. */
+static cairo_status_t
+flush_write_buffer (SurfaceUserdata *info) {
+    size_t len = info->wbuf_len;
+    if (len == 0)
+        return CAIRO_STATUS_SUCCESS;
+    info->wbuf_len = 0;
+    if (info->errmsg || info->fhref == LUA_NOREF)
+        return CAIRO_STATUS_WRITE_ERROR;
+    return write_to_fh(info, info->wbuf, len);
+}
+
+static cairo_status_t
+write_chunk_to_fh (void *closure, const unsigned char *buf,
+                   unsigned int lentowrite)
+{
+    SurfaceUserdata *info = closure;
+    cairo_status_t status;
+
+    if (info->wbuf_len + lentowrite > info->wbuf_size) {
+        status = flush_write_buffer(info);
+        if (status != CAIRO_STATUS_SUCCESS)
+            return status;
+    }
+    /* Big chunks gain nothing from being copied into the buffer first. */
+    if (lentowrite >= info->wbuf_size)
+        return write_to_fh(info, buf, lentowrite);
+
+    if (!info->wbuf) {
+        info->wbuf = malloc(info->wbuf_size);
+        if (!info->wbuf)
+            return write_to_fh(info, buf, lentowrite);
+    }
+    memcpy(info->wbuf + info->wbuf_len, buf, lentowrite);
+    info->wbuf_len += lentowrite;
+    return CAIRO_STATUS_SUCCESS;
+}
+
+/* Flush the buffered output of a surface which is writing to a file handle,
+ * if it is one.  Throws a Lua error if the writing fails. */
+static void
+flush_surface_output (lua_State *L, cairo_surface_t *surface) {
+    SurfaceUserdata *info = cairo_surface_get_user_data(surface,
+                                                        &write_buffer_key);
+    if (info && info->wbuf_len > 0 && !info->errmsg) {
+        if (flush_write_buffer(info) != CAIRO_STATUS_SUCCESS)
+            luaL_error(L, "error writing surface output to Lua file handle:"
+                       " %s", info->errmsg ? info->errmsg : "unknown error");
+    }
+}
+
+static void
+free_surface_userdata (SurfaceUserdata *ud) {
+    if (ud->surface) {
+        if (ud->fhref != LUA_NOREF)
+            cairo_surface_set_user_data(ud->surface, &write_buffer_key, 0, 0);
+        cairo_surface_destroy(ud->surface);
+        ud->surface = 0;
+    }
+    /* Destroying the surface may have finished it, producing more output. */
+    flush_write_buffer(ud);
+    if (ud->wbuf) {
+        free(ud->wbuf);
+        ud->wbuf = 0;
+    }
+    if (ud->fhref != LUA_NOREF) {
+        luaL_unref(ud->L, LUA_REGISTRYINDEX, ud->fhref);
+        ud->fhref = LUA_NOREF;
+    }
+    if (ud->errmsg) {
+        if (ud->errmsg_free)
+            free((char *) ud->errmsg);
+        ud->errmsg = 0;
+        ud->errmsg_free = 0;
+    }
+}
+
+static int
+set_write_buffer_size (lua_State *L) {
+    lua_Number size = luaL_checknumber(L, 1);
+    luaL_argcheck(L, size >= 0 && size <= (lua_Number) INT_MAX, 1,
+                  "buffer size out of range");
+    lua_pushnumber(L, (lua_Number) write_buffer_size);
+    write_buffer_size = (size_t) size;
+    return 1;
+}
+
 #if LUA_VERSION_NUM >= 502
 static void
 get_gtk_module_function (lua_State *L, const char *name) {
@@ -880,14 +992,28 @@ push_cairo_status (lua_State *L, cairo_status_t status) {
     return 1;
 }
 
+#include "pixel_ops.c"
+#include "parallel.c"
+#include "blur.c"
+#include "draw_ops.c"
+#include "profiler.c"
+#include "damage.c"
+#include "hash.c"
+#include "mipmap.c"
+
+#include "obj_buffer.c"
+#include "image_io.c"
 #include "obj_context.c"
 #include "obj_font_face.c"
 #include "obj_font_opt.c"
+#include "obj_job.c"
 #include "obj_matrix.c"
 #include "obj_path.c"
 #include "obj_pattern.c"
 #include "obj_scaled_font.c"
 #include "obj_surface.c"
+#include "obj_surface_pool.c"
+#include "obj_tiled_surface.c"
 #include "obj_region.c"
 
 static int
@@ -916,6 +1042,59 @@ func (lua_State *L) {                                             \
 CHECK_VER(check_version, CAIRO_VERSION)
 CHECK_VER(check_runtime_version, cairo_version())
 
+static int
+pixel_simd (lua_State *L) {
+    const char *name = luaL_optstring(L, 1, 0);
+    if (name && !pixel_kernels_select(name))
+        return luaL_argerror(L, 1, "not supported by this CPU or build");
+    lua_pushstring(L, pixel_kernels->name);
+    return 1;
+}
+
+static int
+set_threads (lua_State *L) {
+    int threads = luaL_optinteger(L, 1, 0);
+    luaL_argcheck(L, threads >= 0, 1, "number of threads cannot be negative");
+    lua_pushinteger(L, parallel_num_threads());
+    tpool_set_threads(threads);
+    return 1;
+}
+
+static int
+thread_stats (lua_State *L) {
+    TPoolStats stats;
+    tpool_get_stats(&stats);
+    lua_createtable(L, 0, 8);
+    lua_pushinteger(L, stats.threads);
+    lua_setfield(L, -2, "threads");
+    lua_pushinteger(L, stats.workers);
+    lua_setfield(L, -2, "workers");
+    lua_pushinteger(L, stats.queued);
+    lua_setfield(L, -2, "queued");
+    lua_pushinteger(L, stats.running);
+    lua_setfield(L, -2, "running");
+    lua_pushnumber(L, stats.submitted);
+    lua_setfield(L, -2, "submitted");
+    lua_pushnumber(L, stats.completed);
+    lua_setfield(L, -2, "completed");
+    lua_pushnumber(L, stats.cancelled);
+    lua_setfield(L, -2, "cancelled");
+    lua_pushnumber(L, stats.stolen);
+    lua_setfield(L, -2, "stolen");
+    return 1;
+}
+
+/* Called when the Lua state is closed, before the module can be unloaded.
+ * Jobs from this state which are still running are waited for, so that
+ * they can be freed here. */
+static int
+thread_pool_gc (lua_State *L) {
+    TPoolUser *user = lua_touserdata(L, 1);
+    tpool_remove_user(user);
+    job_free_orphans(user);
+    return 0;
+}
+
 static const luaL_Reg
 constructor_funcs[] = {
     { "check_version", check_version },
@@ -924,8 +1103,25 @@ constructor_funcs[] = {
     { "context_create_gdk", context_create_gdk },
     { "font_options_create", font_options_create },
     { "format_stride_for_width", format_stride_for_width },
+    { "frame_begin", frame_begin },
+    { "frame_end", frame_end },
+    { "frame_history", frame_history },
+    { "frame_set_history_size", frame_set_history_size },
+    { "frame_trace_json", frame_trace_json },
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+    { "image_diff", image_diff },
+#endif
     { "image_surface_create", image_surface_create },
+    { "image_surface_create_from", image_surface_create_from },
     { "image_surface_create_from_data", image_surface_create_from_data },
+    { "image_surface_import", image_surface_import },
+#ifdef HAVE_MMAP
+    { "image_surface_create_mmap", image_surface_create_mmap },
+#ifdef HAVE_SHM_OPEN
+    { "image_surface_create_shm", image_surface_create_shm },
+    { "image_surface_open_shm", image_surface_open_shm },
+#endif
+#endif
 #ifdef CAIRO_HAS_PNG_FUNCTIONS
     { "image_surface_create_from_png", image_surface_create_from_png },
 #endif
@@ -938,6 +1134,8 @@ constructor_funcs[] = {
     { "pattern_create_radial", pattern_create_radial },
     { "pattern_create_rgb", pattern_create_rgb },
     { "pattern_create_rgba", pattern_create_rgba },
+    { "pixel_simd", pixel_simd },
+    { "premultiply", premultiply },
 #ifdef CAIRO_HAS_PDF_SURFACE
     { "pdf_surface_create", pdf_surface_create },
 #endif
@@ -946,17 +1144,28 @@ constructor_funcs[] = {
     { "ps_surface_create", ps_surface_create },
 #endif
     { "scaled_font_create", scaled_font_create },
+    { "set_threads", set_threads },
+    { "set_write_buffer_size", set_write_buffer_size },
+#if defined(HAVE_MMAP) && defined(HAVE_SHM_OPEN)
+    { "shm_unlink", shm_unlink_name },
+#endif
     { "surface_create_similar", surface_create_similar },
 #if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 12, 0)
     { "surface_create_similar_image", surface_create_similar_image },
 #endif
+    { "surface_pool_create", surface_pool_create },
 #ifdef CAIRO_HAS_SVG_SURFACE
     { "svg_surface_create", svg_surface_create },
     { "svg_get_versions", svg_get_versions },
+#endif
+    { "thread_stats", thread_stats },
+#ifdef CAIRO_HAS_RECORDING_SURFACE
+    { "tiled_surface_create", tiled_surface_create },
 #endif
 #if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 8, 0)
     { "toy_font_face_create", toy_font_face_create },
 #endif
+    { "unpremultiply", unpremultiply },
 #ifdef CAIRO_HAS_USER_FONT
     { "user_font_face_create", user_font_face_create },
 #endif
@@ -964,6 +1173,8 @@ constructor_funcs[] = {
 #ifdef CAIRO_HAS_RECORDING_SURFACE
     { "recording_surface_create", recording_surface_create },
     { "recording_surface_ink_extents", recording_surface_ink_extents },
+    { "rasterize_parallel", rasterize_parallel },
+    { "render_document_async", render_document_async },
 #endif
 #if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
     { "region_create", region_create },
@@ -1023,6 +1234,25 @@ luaopen_oocairo (lua_State *L) {
     lua_pop(L, 1);
 #endif
 
+    pixel_kernels_init();
+
+    /* A userdata value which registers the Lua state with the thread pool
+     * and keeps track of its jobs.  It stops the pool's workers when it's
+     * collected, which happens when the Lua state is closed, unless other
+     * Lua states are still using them.  Loading the module again in the
+     * same state keeps the same one. */
+    lua_getfield(L, LUA_REGISTRYINDEX, OOCAIRO_THREAD_POOL_KEY);
+    if (lua_isnil(L, -1)) {
+        TPoolUser *user = lua_newuserdata(L, sizeof(TPoolUser));
+        lua_createtable(L, 0, 1);
+        lua_pushcfunction(L, thread_pool_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        tpool_add_user(user);
+        lua_setfield(L, LUA_REGISTRYINDEX, OOCAIRO_THREAD_POOL_KEY);
+    }
+    lua_pop(L, 1);
+
     /* Create the table to return from 'require' */
     lua_newtable(L);
     lua_pushliteral(L, "_NAME");
@@ -1053,6 +1283,13 @@ luaopen_oocairo (lua_State *L) {
     lua_pushboolean(L, 1);
 #else
     lua_pushboolean(L, 0);
+#endif
+    lua_rawset(L, -3);
+    lua_pushliteral(L, "HAS_PNG_OPTIONS");
+#if defined(CAIRO_HAS_PNG_FUNCTIONS) && defined(HAVE_LIBPNG)
+    lua_pushboolean(L, 1);
+#else
+    lua_pushboolean(L, 0);
 #endif
     lua_rawset(L, -3);
     lua_pushliteral(L, "HAS_PS_SURFACE");
@@ -1081,6 +1318,13 @@ luaopen_oocairo (lua_State *L) {
     lua_pushboolean(L, 1);
 #else
     lua_pushboolean(L, 0);
+#endif
+    lua_rawset(L, -3);
+    lua_pushliteral(L, "HAS_OBSERVER_SURFACE");
+#ifdef CAIRO_HAS_OBSERVER_SURFACE
+    lua_pushboolean(L, 1);
+#else
+    lua_pushboolean(L, 0);
 #endif
     lua_rawset(L, -3);
 #if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
@@ -1117,6 +1361,16 @@ luaopen_oocairo (lua_State *L) {
                             pattern_methods);
     create_object_metatable(L, OOCAIRO_MT_NAME_SURFACE, "cairo surface object",
                             surface_methods);
+    create_object_metatable(L, OOCAIRO_MT_NAME_BUFFER, "cairo image buffer object",
+                            buffer_methods);
+    create_object_metatable(L, OOCAIRO_MT_NAME_POOL, "cairo surface pool object",
+                            pool_methods);
+    create_object_metatable(L, OOCAIRO_MT_NAME_JOB, "cairo job object",
+                            job_methods);
+#ifdef CAIRO_HAS_RECORDING_SURFACE
+    create_object_metatable(L, OOCAIRO_MT_NAME_TILED, "cairo tiled surface object",
+                            tiled_methods);
+#endif
 #if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
     create_object_metatable(L, OOCAIRO_MT_NAME_REGION, "cairo region object",
                             region_methods);
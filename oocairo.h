@@ -36,6 +36,13 @@
 #define OOCAIRO_MT_NAME_SCALEDFONT ("b8012f94-98b0-11dd-b174-00e081225ce5")
 #define OOCAIRO_MT_NAME_SURFACE    ("6d31a064-6711-11dd-bdd8-00e081225ce5")
 #define OOCAIRO_MT_NAME_REGION     ("047833B0-11e0-11dd-a561-00e081225ce5")
+#define OOCAIRO_MT_NAME_BUFFER     ("5a3f2e1c-9b4d-11e9-8f1a-00e081225ce5")
+#define OOCAIRO_MT_NAME_POOL       ("c4e1d7a2-3b8f-11ea-9d56-00e081225ce5")
+#define OOCAIRO_MT_NAME_TILED      ("9b0c55e6-4f2a-11ea-a1d3-00e081225ce5")
+#define OOCAIRO_MT_NAME_JOB        ("e3a71f08-6c2d-11ea-b4e9-00e081225ce5")
+
+/* Registry field holding the Lua state's user of the thread pool. */
+#define OOCAIRO_THREAD_POOL_KEY    ("oocairo.thread_pool")
 
 int luaopen_oocairo (lua_State *L);
 
@@ -0,0 +1,629 @@
+/* Copyright (C) 2007-2008 Geoff Richards
+ * Copyright (C) 2010-2011 Uli Schlachter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* A pool of worker threads shared by everything in the module which can
+ * use more than one CPU: image operations split across rows or tiles with
+ * parallel_for(), and jobs running in the background (see obj_job.c).
+ * Sharing one pool keeps the number of busy threads near the number of
+ * CPUs however many of these are going on at once.
+ *
+ * Each worker has its own queue.  New tasks are handed out to the queues
+ * in turn, and a worker with nothing left in its own queue steals the
+ * oldest task from another.  Tasks here are coarse (a band of an image, or
+ * a whole job), so one lock is shared by all the queues.  The workers are
+ * started the first time they're needed.
+ *
+ * The threads never touch a Lua state, so they mustn't do anything which
+ * could call back into Lua, such as rendering text in a user font.  Cairo
+ * objects they use must be their own, or ones which Cairo doesn't change
+ * when they're used, and they mustn't drop the last reference to anything
+ * whose destroy callbacks change state here.  Replaying a recording surface
+ * changes it, so each thread replays a copy of its own, made on the Lua
+ * thread, and only of recordings which have nothing drawn on them that
+ * breaks those rules (see draw_ops.c).  Without POSIX threads everything
+ * is done on the calling thread. */
+
+#define PARALLEL_MAX_THREADS 64
+
+typedef void (*ParallelFunc) (void *closure, int begin, int end);
+
+enum {
+    TPOOL_TASK_NEW,
+    TPOOL_TASK_QUEUED,
+    TPOOL_TASK_RUNNING,
+    TPOOL_TASK_DONE,
+    TPOOL_TASK_CANCELLED
+};
+
+typedef struct TPoolTask_ TPoolTask;
+
+/* Something which uses the pool, one for each Lua state which has loaded
+ * the module.  The fields are only changed with the pool's lock held. */
+typedef struct TPoolUser_ {
+    int pending;            /* detached tasks which haven't finished */
+    int closed;             /* no more tasks can be detached */
+    TPoolTask *orphans;      /* detached tasks which have finished */
+} TPoolUser;
+
+struct TPoolTask_ {
+    void (*run) (TPoolTask *task);
+    void *data;
+    /* These are only changed with the pool's lock held.  The times are
+     * from profiler_now(), and are set when the state changes. */
+    int state;
+    double queued_at, started_at, finished_at;
+    TPoolUser *owner;        /* set by tpool_detach() */
+    TPoolTask *next_orphan;
+};
+
+typedef struct TPoolStats_ {
+    int threads, workers, queued, running;
+    double submitted, completed, cancelled, stolen;
+} TPoolStats;
+
+static int parallel_threads = 0;    /* zero until the CPUs are counted */
+
+static double profiler_now (void);     /* in profiler.c */
+
+#ifdef HAVE_PTHREAD
+typedef struct TPoolQueue_ {
+    TPoolTask **tasks;       /* ring buffer, oldest at 'head' */
+    int head, count, size;
+} TPoolQueue;
+
+static pthread_mutex_t tpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tpool_work = PTHREAD_COND_INITIALIZER;    /* new tasks */
+static pthread_cond_t tpool_done = PTHREAD_COND_INITIALIZER;    /* finished */
+
+/* Everything else about the pool, which is protected by 'tpool_lock'. */
+static struct {
+    TPoolQueue queues[PARALLEL_MAX_THREADS];
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    int num_started;        /* workers started and not yet shut down */
+    int num_active;         /* how many of those take tasks */
+    int queued, running, next_queue, stop;
+    int users;              /* Lua states which have loaded the module */
+    TPoolStats stats;
+} tpool;
+#endif
+
+static int
+parallel_count_cpus (void) {
+    long n = 1;
+#if defined(HAVE_PTHREAD) && defined(_SC_NPROCESSORS_ONLN)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return n < 1 ? 1 : n > PARALLEL_MAX_THREADS ? PARALLEL_MAX_THREADS
+                                                : (int) n;
+}
+
+static int
+parallel_num_threads (void) {
+    int n;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&tpool_lock);
+#endif
+    if (!parallel_threads)
+        parallel_threads = parallel_count_cpus();
+    n = parallel_threads;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&tpool_lock);
+#endif
+    return n;
+}
+
+#ifdef HAVE_PTHREAD
+/* The calling thread does its share of parallel_for() work, so one fewer
+ * worker is needed than the number of threads, but there is always at
+ * least one so that background jobs don't hold up the caller. */
+static int
+tpool_wanted_workers (void) {
+    if (!parallel_threads)
+        parallel_threads = parallel_count_cpus();
+    return parallel_threads > 1 ? parallel_threads - 1 : 1;
+}
+
+static int
+tpool_queue_push (TPoolQueue *q, TPoolTask *task) {
+    if (q->count == q->size) {
+        int size = q->size ? q->size * 2 : 16, i;
+        TPoolTask **tasks = malloc(size * sizeof(TPoolTask *));
+        if (!tasks)
+            return 0;
+        for (i = 0; i < q->count; ++i)
+            tasks[i] = q->tasks[(q->head + i) % q->size];
+        free(q->tasks);
+        q->tasks = tasks;
+        q->head = 0;
+        q->size = size;
+    }
+    q->tasks[(q->head + q->count) % q->size] = task;
+    ++q->count;
+    return 1;
+}
+
+/* Take the newest task from a worker's own queue, since whatever it used
+ * is most likely to still be in the cache, or failing that the oldest one
+ * from another queue.  Called with the lock held. */
+static TPoolTask *
+tpool_take (int self, int *stolen) {
+    TPoolQueue *q = &tpool.queues[self];
+    int i;
+
+    *stolen = 0;
+    if (q->count)
+        return q->tasks[(q->head + --q->count) % q->size];
+    for (i = 1; i < tpool.num_started; ++i) {
+        q = &tpool.queues[(self + i) % tpool.num_started];
+        if (q->count) {
+            TPoolTask *task = q->tasks[q->head];
+            q->head = (q->head + 1) % q->size;
+            --q->count;
+            *stolen = 1;
+            return task;
+        }
+    }
+    return 0;
+}
+
+/* Remove a task from whichever queue it's in.  Called with the lock held. */
+static int
+tpool_unqueue (TPoolTask *task) {
+    int i, j;
+    for (i = 0; i < tpool.num_started; ++i) {
+        TPoolQueue *q = &tpool.queues[i];
+        for (j = 0; j < q->count; ++j) {
+            if (q->tasks[(q->head + j) % q->size] == task) {
+                for (; j < q->count - 1; ++j)
+                    q->tasks[(q->head + j) % q->size]
+                        = q->tasks[(q->head + j + 1) % q->size];
+                --q->count;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void *
+tpool_worker_main (void *data) {
+    int self = (int) (intptr_t) data, stolen;
+    TPoolTask *task;
+
+    pthread_mutex_lock(&tpool_lock);
+    for (;;) {
+        /* Workers beyond the number wanted stay asleep, but finish off
+         * anything left in their queues before shutting down. */
+        while (!(tpool.queued && (self < tpool.num_active || tpool.stop))
+               && !(tpool.stop && !tpool.queued))
+            pthread_cond_wait(&tpool_work, &tpool_lock);
+        task = tpool_take(self, &stolen);
+        if (!task) {
+            if (tpool.stop)
+                break;  /* stopping, with nothing queued */
+            pthread_cond_wait(&tpool_work, &tpool_lock);
+            continue;
+        }
+        --tpool.queued;
+        ++tpool.running;
+        if (stolen)
+            ++tpool.stats.stolen;
+        task->state = TPOOL_TASK_RUNNING;
+        task->started_at = profiler_now();
+        pthread_mutex_unlock(&tpool_lock);
+
+        task->run(task);
+
+        pthread_mutex_lock(&tpool_lock);
+        task->state = TPOOL_TASK_DONE;
+        task->finished_at = profiler_now();
+        if (task->owner) {
+            task->next_orphan = task->owner->orphans;
+            task->owner->orphans = task;
+            --task->owner->pending;
+        }
+        --tpool.running;
+        ++tpool.stats.completed;
+        pthread_cond_broadcast(&tpool_done);
+    }
+    pthread_mutex_unlock(&tpool_lock);
+    return 0;
+}
+
+/* Start any workers which are wanted but not running yet.  Returns the
+ * number which can be given tasks.  Called with the lock held. */
+static int
+tpool_start_workers (void) {
+    int wanted = tpool_wanted_workers();
+    while (tpool.num_started < wanted
+           && pthread_create(&tpool.threads[tpool.num_started], 0,
+                             tpool_worker_main,
+                             (void *) (intptr_t) tpool.num_started) == 0)
+        ++tpool.num_started;
+    tpool.num_active = wanted < tpool.num_started ? wanted : tpool.num_started;
+    return tpool.num_active;
+}
+#endif
+
+/* Queue a task to be run by one of the workers.  Returns false if that
+ * can't be done, in which case the caller should use tpool_run_here(). */
+static int
+tpool_submit (TPoolTask *task) {
+#ifdef HAVE_PTHREAD
+    int ok = 0;
+    pthread_mutex_lock(&tpool_lock);
+    /* While the workers are being shut down nothing new can be queued,
+     * since they might already have finished. */
+    if (!tpool.stop && tpool_start_workers()) {
+        TPoolQueue *q = &tpool.queues[tpool.next_queue++ % tpool.num_active];
+        ok = tpool_queue_push(q, task);
+        if (ok) {
+            task->state = TPOOL_TASK_QUEUED;
+            task->owner = 0;
+            task->queued_at = profiler_now();
+            ++tpool.queued;
+            ++tpool.stats.submitted;
+            /* Broadcast, because the worker woken by a signal might be
+             * one of the sleeping spares. */
+            pthread_cond_broadcast(&tpool_work);
+        }
+    }
+    pthread_mutex_unlock(&tpool_lock);
+    return ok;
+#else
+    (void) task;
+    return 0;
+#endif
+}
+
+static void
+tpool_set_state (TPoolTask *task, int state) {
+    double now = profiler_now();
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&tpool_lock);
+#endif
+    task->state = state;
+    if (state == TPOOL_TASK_RUNNING)
+        task->queued_at = task->started_at = now;
+    else if (state == TPOOL_TASK_DONE)
+        task->finished_at = now;
+#ifdef HAVE_PTHREAD
+    if (state == TPOOL_TASK_DONE)
+        pthread_cond_broadcast(&tpool_done);
+    pthread_mutex_unlock(&tpool_lock);
+#endif
+}
+
+/* Run a task on the calling thread instead of in the tpool. */
+static void
+tpool_run_here (TPoolTask *task) {
+    tpool_set_state(task, TPOOL_TASK_RUNNING);
+    task->run(task);
+    tpool_set_state(task, TPOOL_TASK_DONE);
+}
+
+/* Get the state of a task, and a copy of it with consistent times if
+ * 'copy' isn't null. */
+static int
+tpool_task_state (TPoolTask *task, TPoolTask *copy) {
+    int state;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&tpool_lock);
+#endif
+    state = task->state;
+    if (copy)
+        *copy = *task;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&tpool_lock);
+#endif
+    return state;
+}
+
+/* Take a task back out of the pool if it hasn't started yet.  Returns true
+ * if it was cancelled, or false if it's already running or finished. */
+static int
+tpool_cancel (TPoolTask *task) {
+    int cancelled = 0;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&tpool_lock);
+    if (task->state == TPOOL_TASK_QUEUED && tpool_unqueue(task)) {
+        task->state = TPOOL_TASK_CANCELLED;
+        task->finished_at = profiler_now();
+        --tpool.queued;
+        ++tpool.stats.cancelled;
+        cancelled = 1;
+    }
+    pthread_mutex_unlock(&tpool_lock);
+#else
+    (void) task;
+#endif
+    return cancelled;
+}
+
+/* Block until a task submitted to the pool has finished or been
+ * cancelled. */
+static void
+tpool_wait (TPoolTask *task) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&tpool_lock);
+    while (task->state == TPOOL_TASK_QUEUED
+           || task->state == TPOOL_TASK_RUNNING)
+        pthread_cond_wait(&tpool_done, &tpool_lock);
+    pthread_mutex_unlock(&tpool_lock);
+#else
+    (void) task;
+#endif
+}
+
+/* Give up waiting for a task, when whatever owns it goes away before it
+ * has finished.  Returns false if it has already finished, or was never
+ * submitted, in which case the caller can free it straight away.
+ * Otherwise the task is left to run, and is then handed back by
+ * tpool_take_orphans() for 'user', so that it can be freed by the thread
+ * which owns it rather than by a worker.  Once 'user' is closed nothing
+ * would take it back, so this waits for the task to finish instead. */
+static int
+tpool_detach (TPoolTask *task, TPoolUser *user) {
+    int detached = 0;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&tpool_lock);
+    if (!user->closed) {
+        if (task->state == TPOOL_TASK_QUEUED
+            || task->state == TPOOL_TASK_RUNNING)
+        {
+            task->owner = user;
+            ++user->pending;
+            detached = 1;
+        }
+    }
+    else {
+        while (task->state == TPOOL_TASK_QUEUED
+               || task->state == TPOOL_TASK_RUNNING)
+            pthread_cond_wait(&tpool_done, &tpool_lock);
+    }
+    pthread_mutex_unlock(&tpool_lock);
+#else
+    (void) task;
+    (void) user;
+#endif
+    return detached;
+}
+
+/* Returns a list, linked through 'next_orphan', of the tasks detached for
+ * 'user' which have finished since last time. */
+static TPoolTask *
+tpool_take_orphans (TPoolUser *user) {
+    TPoolTask *orphans = 0;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&tpool_lock);
+    orphans = user->orphans;
+    user->orphans = 0;
+    pthread_mutex_unlock(&tpool_lock);
+#else
+    (void) user;
+#endif
+    return orphans;
+}
+
+/* Change the number of threads used for parallel work, including the
+ * calling one.  Workers which aren't wanted any more go to sleep rather
+ * than exiting, since they might be in the middle of a task. */
+static void
+tpool_set_threads (int threads) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&tpool_lock);
+#endif
+    if (threads > PARALLEL_MAX_THREADS)
+        threads = PARALLEL_MAX_THREADS;
+    parallel_threads = threads < 1 ? parallel_count_cpus() : threads;
+#ifdef HAVE_PTHREAD
+    /* No new workers while shutting down, since tpool_shutdown() only
+     * joins the ones which were running when it started. */
+    if (tpool.num_started && !tpool.stop)
+        tpool_start_workers();
+    pthread_cond_broadcast(&tpool_work);
+    pthread_mutex_unlock(&tpool_lock);
+#endif
+}
+
+static void
+tpool_get_stats (TPoolStats *stats) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&tpool_lock);
+    *stats = tpool.stats;
+    stats->workers = tpool.num_active;
+    stats->queued = tpool.queued;
+    stats->running = tpool.running;
+    pthread_mutex_unlock(&tpool_lock);
+#else
+    memset(stats, 0, sizeof(TPoolStats));
+#endif
+    stats->threads = parallel_num_threads();
+}
+
+/* Stop the workers once they've finished everything queued, so that none
+ * are left running code from the module after it's unloaded.  They're
+ * started again if anything else is submitted. */
+static void
+tpool_shutdown (void) {
+#ifdef HAVE_PTHREAD
+    int i, n;
+
+    pthread_mutex_lock(&tpool_lock);
+    if (tpool.stop) {
+        /* Another thread is already doing it. */
+        while (tpool.stop)
+            pthread_cond_wait(&tpool_done, &tpool_lock);
+        pthread_mutex_unlock(&tpool_lock);
+        return;
+    }
+    tpool.stop = 1;
+    n = tpool.num_started;
+    pthread_cond_broadcast(&tpool_work);
+    pthread_mutex_unlock(&tpool_lock);
+
+    for (i = 0; i < n; ++i)
+        pthread_join(tpool.threads[i], 0);
+
+    pthread_mutex_lock(&tpool_lock);
+    for (i = 0; i < n; ++i) {
+        free(tpool.queues[i].tasks);
+        memset(&tpool.queues[i], 0, sizeof(TPoolQueue));
+    }
+    tpool.num_started = tpool.num_active = 0;
+    tpool.queued = tpool.running = tpool.next_queue = 0;
+    tpool.stop = 0;
+    pthread_cond_broadcast(&tpool_done);
+    pthread_mutex_unlock(&tpool_lock);
+#endif
+}
+
+/* The pool belongs to the process, but each Lua state which loads the
+ * module counts as a user of it, and the workers are only stopped when the
+ * last one is closed. */
+static void
+tpool_add_user (TPoolUser *user) {
+    memset(user, 0, sizeof(TPoolUser));
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&tpool_lock);
+    ++tpool.users;
+    pthread_mutex_unlock(&tpool_lock);
+#endif
+}
+
+/* Wait for the tasks detached for 'user' to finish, after which they can
+ * be taken with tpool_take_orphans(). */
+static void
+tpool_remove_user (TPoolUser *user) {
+#ifdef HAVE_PTHREAD
+    int last;
+    pthread_mutex_lock(&tpool_lock);
+    user->closed = 1;
+    while (user->pending)
+        pthread_cond_wait(&tpool_done, &tpool_lock);
+    last = --tpool.users == 0;
+    pthread_mutex_unlock(&tpool_lock);
+    if (last)
+        tpool_shutdown();
+#else
+    user->closed = 1;
+#endif
+}
+
+/* A parallel_for() call hands out numbered ranges to whichever threads
+ * are free, starting with the calling one. */
+typedef struct ParallelGroup_ {
+    ParallelFunc func;
+    void *closure;
+    int n, num_ranges, next;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+} ParallelGroup;
+
+static void
+parallel_group_run (ParallelGroup *group) {
+    int i;
+    for (;;) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&group->lock);
+#endif
+        i = group->next++;
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&group->lock);
+#endif
+        if (i >= group->num_ranges)
+            break;
+        group->func(group->closure,
+                    (int) ((long long) group->n * i / group->num_ranges),
+                    (int) ((long long) group->n * (i + 1) / group->num_ranges));
+    }
+}
+
+static void
+parallel_helper_run (TPoolTask *task) {
+    parallel_group_run(task->data);
+}
+
+/* Call 'func' for contiguous ranges of [0, n) which between them cover all
+ * of it, using up to 'threads' threads, and return when they've all
+ * finished.  Ranges are never smaller than 'grain' items, so small jobs
+ * stay on the calling thread. */
+static void
+parallel_for_threads (int n, int grain, int threads, ParallelFunc func,
+                      void *closure)
+{
+    ParallelGroup group;
+#ifdef HAVE_PTHREAD
+    TPoolTask helpers[PARALLEL_MAX_THREADS];
+    int num_helpers = 0, i;
+#endif
+
+    if (n <= 0)
+        return;
+    if (grain < 1)
+        grain = 1;
+    if (threads > PARALLEL_MAX_THREADS)
+        threads = PARALLEL_MAX_THREADS;
+    if (threads > n / grain)
+        threads = n / grain;
+    if (threads < 1)
+        threads = 1;
+
+    group.func = func;
+    group.closure = closure;
+    group.n = n;
+    group.num_ranges = threads;
+    group.next = 0;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&group.lock, 0);
+    for (i = 1; i < threads; ++i) {
+        helpers[num_helpers].run = parallel_helper_run;
+        helpers[num_helpers].data = &group;
+        helpers[num_helpers].state = TPOOL_TASK_NEW;
+        if (!tpool_submit(&helpers[num_helpers]))
+            break;
+        ++num_helpers;
+    }
+#endif
+
+    parallel_group_run(&group);
+
+#ifdef HAVE_PTHREAD
+    /* Every range has been started by now, so helpers which haven't got
+     * going yet have nothing to do, but the rest must be waited for. */
+    for (i = 0; i < num_helpers; ++i) {
+        if (!tpool_cancel(&helpers[i]))
+            tpool_wait(&helpers[i]);
+    }
+    pthread_mutex_destroy(&group.lock);
+#endif
+}
+
+/* The same, with as many threads as the pool is set to use. */
+static void
+parallel_for (int n, int grain, ParallelFunc func, void *closure) {
+    parallel_for_threads(n, grain, parallel_num_threads(), func, closure);
+}
+
+/* vi:set ts=4 sw=4 expandtab: */
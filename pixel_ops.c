@@ -0,0 +1,1127 @@
+/* Copyright (C) 2007-2008 Geoff Richards
+ * Copyright (C) 2010-2011 Uli Schlachter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Conversion between the pixel formats Cairo uses for image surfaces and
+ * the byte layouts other libraries tend to want.  Conversions work a row
+ * at a time, and are built from a handful of small kernels which each have
+ * a plain C version and, where the CPU allows it, SSE2, AVX2 or NEON ones.
+ * The fastest available set is picked when the module is loaded.
+ *
+ * This file doesn't use Lua at all, so that the conversions can be done
+ * without holding on to a Lua state. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+    && defined(__SSE2__)
+#define PIXEL_HAVE_SSE2
+#include <emmintrin.h>
+#if defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define PIXEL_HAVE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PIXEL_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+/* External pixel layouts, named by the order of the bytes in memory. */
+enum {
+    PIXEL_LAYOUT_RGBA,
+    PIXEL_LAYOUT_BGRA,
+    PIXEL_LAYOUT_ARGB,
+    PIXEL_LAYOUT_RGB,
+    PIXEL_LAYOUT_BGR,
+    PIXEL_LAYOUT_GRAY
+};
+static const char * const pixel_layout_names[] = {
+    "rgba", "bgra", "argb", "rgb", "bgr", "gray", 0
+};
+static const int pixel_layout_bytes[] = { 4, 4, 4, 3, 3, 1 };
+
+/* Byte offset of the alpha, red, green and blue channels within a pixel of
+ * each layout, or -1 if the layout doesn't have that channel. */
+static const signed char pixel_layout_channels[][4] = {
+    {  3,  0,  1,  2 },
+    {  3,  2,  1,  0 },
+    {  0,  1,  2,  3 },
+    { -1,  0,  1,  2 },
+    { -1,  2,  1,  0 },
+    { -1, -1, -1, -1 }
+};
+
+static const char * const alpha_mode_names[] = {
+    "straight", "premultiplied", 0
+};
+
+/* In a permutation, this means "fill the byte with 255" rather than
+ * copying one from the input. */
+#define PIXEL_OPAQUE 0xFF
+
+/* Byte offset in memory of channel 'c' (0 for alpha to 3 for blue) within
+ * a 32 bit pixel in Cairo's native format. */
+static int
+native_channel_offset (int c) {
+    return IS_BIG_ENDIAN ? c : 3 - c;
+}
+
+typedef struct PixelKernels_ {
+    const char *name;
+    /* dst[4i+k] = src[4i+perm[k]] */
+    void (*permute4) (const unsigned char *src, unsigned char *dst, int n,
+                      const unsigned char *perm);
+    /* dst[3i+k] = src[4i+perm[k]] */
+    void (*pack3) (const unsigned char *src, unsigned char *dst, int n,
+                   const unsigned char *perm);
+    /* dst[4i+k] = src[3i+perm[k]] */
+    void (*unpack3) (const unsigned char *src, unsigned char *dst, int n,
+                     const unsigned char *perm);
+    void (*to_gray) (const uint32_t *src, unsigned char *dst, int n);
+    void (*from_gray) (const unsigned char *src, uint32_t *dst, int n);
+    void (*premultiply) (uint32_t *p, int n);
+    void (*unpremultiply) (uint32_t *p, int n);
+    /* Biggest difference between corresponding bytes of a[i] & mask and
+     * b[i] & mask, or zero if they're the same. */
+    unsigned int (*max_delta) (const uint32_t *a, const uint32_t *b, int n,
+                               uint32_t mask);
+    /* One row of a vertical box blur: add the row entering the window to
+     * the running sums, write the scaled sums to 'out', then take away the
+     * row leaving the window.  The sums are scaled by inv / 2^23. */
+    void (*box_step) (uint32_t *sum, const unsigned char *add,
+                      const unsigned char *sub, unsigned char *out, int n,
+                      uint32_t inv);
+    /* dst[i] is the average of a[2i], a[2i+1], b[2i] and b[2i+1], taking
+     * each byte separately and rounding to nearest. */
+    void (*halve) (const uint32_t *a, const uint32_t *b, uint32_t *dst,
+                   int n);
+} PixelKernels;
+
+/* Plain C versions, which also deal with the odd pixels left over at the
+ * ends of rows by the SIMD ones. */
+
+static void
+permute4_c (const unsigned char *src, unsigned char *dst, int n,
+            const unsigned char *perm)
+{
+    int i, k;
+    for (i = 0; i < n; ++i, src += 4, dst += 4) {
+        for (k = 0; k < 4; ++k)
+            dst[k] = perm[k] == PIXEL_OPAQUE ? 255 : src[perm[k]];
+    }
+}
+
+static void
+pack3_c (const unsigned char *src, unsigned char *dst, int n,
+         const unsigned char *perm)
+{
+    int i;
+    for (i = 0; i < n; ++i, src += 4, dst += 3) {
+        dst[0] = src[perm[0]];
+        dst[1] = src[perm[1]];
+        dst[2] = src[perm[2]];
+    }
+}
+
+static void
+unpack3_c (const unsigned char *src, unsigned char *dst, int n,
+           const unsigned char *perm)
+{
+    int i, k;
+    for (i = 0; i < n; ++i, src += 3, dst += 4) {
+        for (k = 0; k < 4; ++k)
+            dst[k] = perm[k] == PIXEL_OPAQUE ? 255 : src[perm[k]];
+    }
+}
+
+/* Luma from ITU-R BT.601, with weights adding up to 256. */
+#define GRAY_R 77
+#define GRAY_G 150
+#define GRAY_B 29
+
+static void
+to_gray_c (const uint32_t *src, unsigned char *dst, int n) {
+    int i;
+    for (i = 0; i < n; ++i) {
+        uint32_t p = src[i];
+        dst[i] = (GRAY_R * ((p >> 16) & 0xFF) + GRAY_G * ((p >> 8) & 0xFF)
+                  + GRAY_B * (p & 0xFF) + 128) >> 8;
+    }
+}
+
+static void
+from_gray_c (const unsigned char *src, uint32_t *dst, int n) {
+    int i;
+    for (i = 0; i < n; ++i)
+        dst[i] = 0xFF000000 | (src[i] * 0x010101u);
+}
+
+/* The same rounding as Cairo uses when reading and writing PNG files. */
+static unsigned int
+premultiply_channel (unsigned int c, unsigned int a) {
+    unsigned int t = c * a + 0x80;
+    return (t + (t >> 8)) >> 8;
+}
+
+static void
+premultiply_c (uint32_t *p, int n) {
+    int i;
+    for (i = 0; i < n; ++i) {
+        uint32_t v = p[i], a = v >> 24;
+        if (a == 255)
+            continue;
+        p[i] = (a << 24)
+             | (premultiply_channel((v >> 16) & 0xFF, a) << 16)
+             | (premultiply_channel((v >> 8) & 0xFF, a) << 8)
+             | premultiply_channel(v & 0xFF, a);
+    }
+}
+
+static unsigned int
+unpremultiply_channel (unsigned int c, unsigned int a) {
+    unsigned int v = (c * 255 + a / 2) / a;
+    return v > 255 ? 255 : v;
+}
+
+static void
+unpremultiply_c (uint32_t *p, int n) {
+    int i;
+    for (i = 0; i < n; ++i) {
+        uint32_t v = p[i], a = v >> 24;
+        if (a == 255)
+            continue;
+        if (a == 0)
+            p[i] = 0;
+        else
+            p[i] = (a << 24)
+                 | (unpremultiply_channel((v >> 16) & 0xFF, a) << 16)
+                 | (unpremultiply_channel((v >> 8) & 0xFF, a) << 8)
+                 | unpremultiply_channel(v & 0xFF, a);
+    }
+}
+
+static unsigned int
+max_delta_c (const uint32_t *a, const uint32_t *b, int n, uint32_t mask) {
+    unsigned int max = 0, x, y, d;
+    int i, k;
+    for (i = 0; i < n; ++i) {
+        if (((a[i] ^ b[i]) & mask) == 0)
+            continue;
+        for (k = 0; k < 32; k += 8) {
+            x = ((a[i] & mask) >> k) & 0xFF;
+            y = ((b[i] & mask) >> k) & 0xFF;
+            d = x > y ? x - y : y - x;
+            if (d > max)
+                max = d;
+        }
+    }
+    return max;
+}
+
+#define BOX_SHIFT 23
+
+static void
+box_step_c (uint32_t *sum, const unsigned char *add, const unsigned char *sub,
+            unsigned char *out, int n, uint32_t inv)
+{
+    int i;
+    for (i = 0; i < n; ++i) {
+        uint32_t s = sum[i] + add[i];
+        out[i] = (s * inv + (1 << (BOX_SHIFT - 1))) >> BOX_SHIFT;
+        sum[i] = s - sub[i];
+    }
+}
+
+static uint32_t
+average4 (uint32_t p, uint32_t q, uint32_t r, uint32_t s) {
+    uint32_t out = 0;
+    int k;
+    for (k = 0; k < 32; k += 8)
+        out |= ((((p >> k) & 0xFF) + ((q >> k) & 0xFF) + ((r >> k) & 0xFF)
+                 + ((s >> k) & 0xFF) + 2) >> 2) << k;
+    return out;
+}
+
+static void
+halve_c (const uint32_t *a, const uint32_t *b, uint32_t *dst, int n) {
+    int i;
+    for (i = 0; i < n; ++i)
+        dst[i] = average4(a[2 * i], a[2 * i + 1], b[2 * i], b[2 * i + 1]);
+}
+
+/* Largest byte in a vector register which has been stored to memory. */
+static unsigned int
+max_byte (const unsigned char *p, int n) {
+    unsigned int max = 0;
+    int i;
+    for (i = 0; i < n; ++i)
+        if (p[i] > max)
+            max = p[i];
+    return max;
+}
+
+static const PixelKernels pixel_kernels_c = {
+    "scalar",
+    permute4_c, pack3_c, unpack3_c, to_gray_c, from_gray_c,
+    premultiply_c, unpremultiply_c, max_delta_c, box_step_c, halve_c
+};
+
+#ifdef PIXEL_HAVE_SSE2
+/* x86 is always little endian, so within each 32 bit lane byte k of the
+ * pixel is at bit 8k. */
+static void
+permute4_sse2 (const unsigned char *src, unsigned char *dst, int n,
+               const unsigned char *perm)
+{
+    __m128i mask = _mm_set1_epi32(0xFF), fill = _mm_setzero_si128();
+    __m128i shr[4], shl[4];
+    int i, k, copy[4];
+
+    for (k = 0; k < 4; ++k) {
+        copy[k] = perm[k] != PIXEL_OPAQUE;
+        if (copy[k]) {
+            shr[k] = _mm_cvtsi32_si128(8 * perm[k]);
+            shl[k] = _mm_cvtsi32_si128(8 * k);
+        }
+        else
+            fill = _mm_or_si128(fill, _mm_set1_epi32(0xFF << (8 * k)));
+    }
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + 4 * i));
+        __m128i out = fill;
+        for (k = 0; k < 4; ++k) {
+            if (copy[k])
+                out = _mm_or_si128(out, _mm_sll_epi32(
+                        _mm_and_si128(_mm_srl_epi32(v, shr[k]), mask), shl[k]));
+        }
+        _mm_storeu_si128((__m128i *) (dst + 4 * i), out);
+    }
+    permute4_c(src + 4 * i, dst + 4 * i, n - i, perm);
+}
+
+static void
+to_gray_sse2 (const uint32_t *src, unsigned char *dst, int n) {
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    const __m128i wr = _mm_set1_epi32(GRAY_R), wg = _mm_set1_epi32(GRAY_G),
+                  wb = _mm_set1_epi32(GRAY_B), round = _mm_set1_epi32(128);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i y[2];
+        int k;
+        for (k = 0; k < 2; ++k) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (src + i + 4 * k));
+            /* Each channel is below 256, so the 16 bit multiplies can't
+             * overflow into the upper half of the 32 bit lanes. */
+            __m128i r = _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(v, 16), mask), wr);
+            __m128i g = _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(v, 8), mask), wg);
+            __m128i b = _mm_mullo_epi16(_mm_and_si128(v, mask), wb);
+            y[k] = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(r, g),
+                                                _mm_add_epi32(b, round)), 8);
+        }
+        y[0] = _mm_packs_epi32(y[0], y[1]);
+        _mm_storel_epi64((__m128i *) (dst + i), _mm_packus_epi16(y[0], y[0]));
+    }
+    to_gray_c(src + i, dst + i, n - i);
+}
+
+static void
+from_gray_sse2 (const unsigned char *src, uint32_t *dst, int n) {
+    const __m128i ff = _mm_set1_epi8((char) 0xFF);
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i g = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i gg_lo = _mm_unpacklo_epi8(g, g), gg_hi = _mm_unpackhi_epi8(g, g);
+        __m128i ga_lo = _mm_unpacklo_epi8(g, ff), ga_hi = _mm_unpackhi_epi8(g, ff);
+        /* Bytes b,g,r,a in memory for each pixel. */
+        _mm_storeu_si128((__m128i *) (dst + i),
+                         _mm_unpacklo_epi16(gg_lo, ga_lo));
+        _mm_storeu_si128((__m128i *) (dst + i + 4),
+                         _mm_unpackhi_epi16(gg_lo, ga_lo));
+        _mm_storeu_si128((__m128i *) (dst + i + 8),
+                         _mm_unpacklo_epi16(gg_hi, ga_hi));
+        _mm_storeu_si128((__m128i *) (dst + i + 12),
+                         _mm_unpackhi_epi16(gg_hi, ga_hi));
+    }
+    from_gray_c(src + i, dst + i, n - i);
+}
+
+/* Multiply the colour channels of four pixels by their alpha.  The 16 bit
+ * products are divided by 255 with the same rounding as the C version. */
+static __m128i
+premultiply4_sse2 (__m128i v) {
+    const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi16(0x80);
+    const __m128i alpha = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+    __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xFF), 0xFF);
+    __m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xFF), 0xFF);
+    __m128i tlo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), round);
+    __m128i thi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), round);
+    tlo = _mm_srli_epi16(_mm_add_epi16(tlo, _mm_srli_epi16(tlo, 8)), 8);
+    thi = _mm_srli_epi16(_mm_add_epi16(thi, _mm_srli_epi16(thi, 8)), 8);
+    /* Keep the original alpha values. */
+    tlo = _mm_or_si128(_mm_andnot_si128(alpha, tlo), _mm_and_si128(alpha, lo));
+    thi = _mm_or_si128(_mm_andnot_si128(alpha, thi), _mm_and_si128(alpha, hi));
+    return _mm_packus_epi16(tlo, thi);
+}
+
+static void
+premultiply_sse2 (uint32_t *p, int n) {
+    int i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        _mm_storeu_si128((__m128i *) (p + i), premultiply4_sse2(v));
+    }
+    premultiply_c(p + i, n - i);
+}
+
+/* Divide the colour channels of four pixels by their alpha.  This is done
+ * as (c * 255 + a / 2) / a in single precision, which can represent all
+ * the values involved exactly, and the quotient is never close enough to
+ * the next integer up for the rounding of the division to make truncating
+ * it give a different answer from the integer division in the C version.
+ * Zero alpha divides by zero, but the resulting infinities and NaNs all
+ * convert to negative integers, which the packing turns into zero. */
+static __m128i
+unpremultiply4_sse2 (__m128i v) {
+    const __m128i mask = _mm_set1_epi32(0xFF), c255 = _mm_set1_epi32(255);
+    __m128i a = _mm_srli_epi32(v, 24), half = _mm_srli_epi32(a, 1);
+    __m128 af = _mm_cvtepi32_ps(a);
+    __m128i q[3], bg, ra;
+    int k;
+
+    for (k = 0; k < 3; ++k) {
+        __m128i c = _mm_and_si128(_mm_srli_epi32(v, 8 * k), mask);
+        __m128i num = _mm_add_epi32(_mm_mullo_epi16(c, c255), half);
+        q[k] = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(num), af));
+    }
+
+    /* Pack to bytes, which also clamps to 255, giving b0..b3 g0..g3 r0..r3
+     * a0..a3, then interleave those back into pixels. */
+    bg = _mm_packs_epi32(q[0], q[1]);
+    ra = _mm_packs_epi32(q[2], a);
+    v = _mm_packus_epi16(bg, ra);
+    v = _mm_unpacklo_epi8(v, _mm_srli_si128(v, 8));
+    return _mm_unpacklo_epi8(v, _mm_srli_si128(v, 8));
+}
+
+static void
+unpremultiply_sse2 (uint32_t *p, int n) {
+    int i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        _mm_storeu_si128((__m128i *) (p + i), unpremultiply4_sse2(v));
+    }
+    unpremultiply_c(p + i, n - i);
+}
+
+/* The absolute difference of unsigned bytes is the larger of the two
+ * saturating subtractions, since the other one is zero. */
+static unsigned int
+max_delta_sse2 (const uint32_t *a, const uint32_t *b, int n, uint32_t mask) {
+    const __m128i m = _mm_set1_epi32((int) mask);
+    __m128i acc = _mm_setzero_si128();
+    unsigned char bytes[16];
+    unsigned int max, tail;
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i va = _mm_and_si128(_mm_loadu_si128((const __m128i *) (a + i)), m);
+        __m128i vb = _mm_and_si128(_mm_loadu_si128((const __m128i *) (b + i)), m);
+        acc = _mm_max_epu8(acc, _mm_or_si128(_mm_subs_epu8(va, vb),
+                                             _mm_subs_epu8(vb, va)));
+    }
+    _mm_storeu_si128((__m128i *) bytes, acc);
+    max = max_byte(bytes, 16);
+    tail = max_delta_c(a + i, b + i, n - i, mask);
+    return tail > max ? tail : max;
+}
+
+/* Scale four sums, using even and odd lanes for the 32x32 bit multiplies
+ * since SSE2 only has the widening kind.  The products fit in 32 bits. */
+static __m128i
+box_scale4_sse2 (__m128i s, __m128i inv, __m128i round) {
+    __m128i even = _mm_mul_epu32(s, inv);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(s, 32), inv);
+    even = _mm_srli_epi64(_mm_add_epi64(even, round), BOX_SHIFT);
+    odd = _mm_srli_epi64(_mm_add_epi64(odd, round), BOX_SHIFT);
+    return _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+}
+
+static void
+box_step_sse2 (uint32_t *sum, const unsigned char *add,
+               const unsigned char *sub, unsigned char *out, int n,
+               uint32_t inv)
+{
+    const __m128i zero = _mm_setzero_si128(), vinv = _mm_set1_epi32((int) inv);
+    const __m128i round = _mm_set1_epi64x(1 << (BOX_SHIFT - 1));
+    int i, k;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *) (add + i));
+        __m128i vs = _mm_loadu_si128((const __m128i *) (sub + i));
+        __m128i a16[2], s16[2], a32, s32, s, scaled[4];
+        a16[0] = _mm_unpacklo_epi8(va, zero);
+        a16[1] = _mm_unpackhi_epi8(va, zero);
+        s16[0] = _mm_unpacklo_epi8(vs, zero);
+        s16[1] = _mm_unpackhi_epi8(vs, zero);
+        for (k = 0; k < 4; ++k) {
+            a32 = k & 1 ? _mm_unpackhi_epi16(a16[k / 2], zero)
+                        : _mm_unpacklo_epi16(a16[k / 2], zero);
+            s32 = k & 1 ? _mm_unpackhi_epi16(s16[k / 2], zero)
+                        : _mm_unpacklo_epi16(s16[k / 2], zero);
+            s = _mm_add_epi32(_mm_loadu_si128((const __m128i *) (sum + i + 4 * k)),
+                              a32);
+            scaled[k] = box_scale4_sse2(s, vinv, round);
+            _mm_storeu_si128((__m128i *) (sum + i + 4 * k),
+                             _mm_sub_epi32(s, s32));
+        }
+        /* The scaled values are at most 255, so signed packing is safe. */
+        _mm_storeu_si128((__m128i *) (out + i),
+                         _mm_packus_epi16(_mm_packs_epi32(scaled[0], scaled[1]),
+                                          _mm_packs_epi32(scaled[2], scaled[3])));
+    }
+    box_step_c(sum + i, add + i, sub + i, out + i, n - i, inv);
+}
+
+/* Sum of the bytes of the even and odd pixels, as 16 bit values. */
+static void
+halve_sum_sse2 (const uint32_t *p, __m128i *lo, __m128i *hi) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128 v0 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) p));
+    __m128 v1 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) (p + 4)));
+    __m128i even = _mm_castps_si128(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i odd = _mm_castps_si128(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1)));
+    *lo = _mm_add_epi16(_mm_unpacklo_epi8(even, zero),
+                        _mm_unpacklo_epi8(odd, zero));
+    *hi = _mm_add_epi16(_mm_unpackhi_epi8(even, zero),
+                        _mm_unpackhi_epi8(odd, zero));
+}
+
+static void
+halve_sse2 (const uint32_t *a, const uint32_t *b, uint32_t *dst, int n) {
+    const __m128i two = _mm_set1_epi16(2);
+    __m128i alo, ahi, blo, bhi, lo, hi;
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        halve_sum_sse2(a + 2 * i, &alo, &ahi);
+        halve_sum_sse2(b + 2 * i, &blo, &bhi);
+        lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(alo, blo), two), 2);
+        hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(ahi, bhi), two), 2);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(lo, hi));
+    }
+    halve_c(a + 2 * i, b + 2 * i, dst + i, n - i);
+}
+
+static const PixelKernels pixel_kernels_sse2 = {
+    "sse2",
+    permute4_sse2, pack3_c, unpack3_c, to_gray_sse2, from_gray_sse2,
+    premultiply_sse2, unpremultiply_sse2, max_delta_sse2, box_step_sse2,
+    halve_sse2
+};
+#endif
+
+#ifdef PIXEL_HAVE_AVX2
+#define PIXEL_AVX2 __attribute__((target("avx2")))
+
+/* Build the byte shuffle control for one 128 bit lane, for pixels of
+ * 'in' bytes being turned into pixels of 'out' bytes.  Also sets 'fill' to
+ * have 255 in the bytes which should be opaque. */
+static void
+shuffle_control (unsigned char *ctl, unsigned char *fill, int in, int out,
+                 const unsigned char *perm)
+{
+    int px, k;
+    memset(ctl, 0x80, 16);
+    memset(fill, 0, 16);
+    for (px = 0; px * out + out <= 16 && px * in + in <= 16; ++px) {
+        for (k = 0; k < out; ++k) {
+            if (perm[k] == PIXEL_OPAQUE)
+                fill[px * out + k] = 0xFF;
+            else
+                ctl[px * out + k] = px * in + perm[k];
+        }
+    }
+}
+
+static PIXEL_AVX2 void
+permute4_avx2 (const unsigned char *src, unsigned char *dst, int n,
+               const unsigned char *perm)
+{
+    unsigned char c[16], f[16];
+    __m256i ctl, fill;
+    int i;
+
+    shuffle_control(c, f, 4, 4, perm);
+    ctl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) c));
+    fill = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) f));
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + 4 * i));
+        v = _mm256_or_si256(_mm256_shuffle_epi8(v, ctl), fill);
+        _mm256_storeu_si256((__m256i *) (dst + 4 * i), v);
+    }
+    permute4_c(src + 4 * i, dst + 4 * i, n - i, perm);
+}
+
+static PIXEL_AVX2 void
+pack3_avx2 (const unsigned char *src, unsigned char *dst, int n,
+            const unsigned char *perm)
+{
+    unsigned char c[16], f[16];
+    __m256i ctl;
+    int i;
+
+    shuffle_control(c, f, 4, 3, perm);
+    ctl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) c));
+
+    /* Each lane produces 12 bytes but is stored as 16, so stop early
+     * enough that the extra bytes never go past the end of the row. */
+    for (i = 0; i + 10 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + 4 * i));
+        v = _mm256_shuffle_epi8(v, ctl);
+        _mm_storeu_si128((__m128i *) (dst + 3 * i),
+                         _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i *) (dst + 3 * i + 12),
+                         _mm256_extracti128_si256(v, 1));
+    }
+    pack3_c(src + 4 * i, dst + 3 * i, n - i, perm);
+}
+
+static PIXEL_AVX2 void
+unpack3_avx2 (const unsigned char *src, unsigned char *dst, int n,
+              const unsigned char *perm)
+{
+    unsigned char c[16], f[16];
+    __m256i ctl, fill;
+    int i;
+
+    shuffle_control(c, f, 3, 4, perm);
+    ctl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) c));
+    fill = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) f));
+
+    /* Same again, but here it's the loads which read 4 bytes too many. */
+    for (i = 0; i + 10 <= n; i += 8) {
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                        _mm_loadu_si128((const __m128i *) (src + 3 * i))),
+                        _mm_loadu_si128((const __m128i *) (src + 3 * i + 12)), 1);
+        v = _mm256_or_si256(_mm256_shuffle_epi8(v, ctl), fill);
+        _mm256_storeu_si256((__m256i *) (dst + 4 * i), v);
+    }
+    unpack3_c(src + 3 * i, dst + 4 * i, n - i, perm);
+}
+
+/* These are the same as the SSE2 versions, since all the instructions used
+ * work within each 128 bit lane. */
+static PIXEL_AVX2 void
+premultiply_avx2 (uint32_t *p, int n) {
+    const __m256i zero = _mm256_setzero_si256(), round = _mm256_set1_epi16(0x80);
+    const __m256i alpha = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0,
+                                           -1, 0, 0, 0, -1, 0, 0, 0);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+        __m256i lo = _mm256_unpacklo_epi8(v, zero), hi = _mm256_unpackhi_epi8(v, zero);
+        __m256i alo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, 0xFF), 0xFF);
+        __m256i ahi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, 0xFF), 0xFF);
+        __m256i tlo = _mm256_add_epi16(_mm256_mullo_epi16(lo, alo), round);
+        __m256i thi = _mm256_add_epi16(_mm256_mullo_epi16(hi, ahi), round);
+        tlo = _mm256_srli_epi16(_mm256_add_epi16(tlo, _mm256_srli_epi16(tlo, 8)), 8);
+        thi = _mm256_srli_epi16(_mm256_add_epi16(thi, _mm256_srli_epi16(thi, 8)), 8);
+        tlo = _mm256_blendv_epi8(tlo, lo, alpha);
+        thi = _mm256_blendv_epi8(thi, hi, alpha);
+        _mm256_storeu_si256((__m256i *) (p + i), _mm256_packus_epi16(tlo, thi));
+    }
+    premultiply_c(p + i, n - i);
+}
+
+static PIXEL_AVX2 void
+unpremultiply_avx2 (uint32_t *p, int n) {
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    int i, k;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+        __m256i a = _mm256_srli_epi32(v, 24), half = _mm256_srli_epi32(a, 1);
+        __m256 af = _mm256_cvtepi32_ps(a);
+        __m256i q[3];
+        for (k = 0; k < 3; ++k) {
+            __m256i c = _mm256_and_si256(_mm256_srli_epi32(v, 8 * k), mask);
+            __m256i num = _mm256_add_epi32(_mm256_mullo_epi32(c, _mm256_set1_epi32(255)),
+                                           half);
+            q[k] = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(num), af));
+        }
+        v = _mm256_packus_epi16(_mm256_packs_epi32(q[0], q[1]),
+                                _mm256_packs_epi32(q[2], a));
+        v = _mm256_unpacklo_epi8(v, _mm256_srli_si256(v, 8));
+        v = _mm256_unpacklo_epi8(v, _mm256_srli_si256(v, 8));
+        _mm256_storeu_si256((__m256i *) (p + i), v);
+    }
+    unpremultiply_c(p + i, n - i);
+}
+
+static PIXEL_AVX2 unsigned int
+max_delta_avx2 (const uint32_t *a, const uint32_t *b, int n, uint32_t mask) {
+    const __m256i m = _mm256_set1_epi32((int) mask);
+    __m256i acc = _mm256_setzero_si256();
+    unsigned char bytes[32];
+    unsigned int max, tail;
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (a + i)), m);
+        __m256i vb = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (b + i)), m);
+        acc = _mm256_max_epu8(acc, _mm256_or_si256(_mm256_subs_epu8(va, vb),
+                                                   _mm256_subs_epu8(vb, va)));
+    }
+    _mm256_storeu_si256((__m256i *) bytes, acc);
+    max = max_byte(bytes, 32);
+    tail = max_delta_c(a + i, b + i, n - i, mask);
+    return tail > max ? tail : max;
+}
+
+static const PixelKernels pixel_kernels_avx2 = {
+    "avx2",
+    permute4_avx2, pack3_avx2, unpack3_avx2, to_gray_sse2, from_gray_sse2,
+    premultiply_avx2, unpremultiply_avx2, max_delta_avx2, box_step_sse2,
+    halve_sse2
+};
+#endif
+
+#ifdef PIXEL_HAVE_NEON
+static void
+permute4_neon (const unsigned char *src, unsigned char *dst, int n,
+               const unsigned char *perm)
+{
+    const uint8x16_t opaque = vdupq_n_u8(255);
+    int i, k;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        uint8x16x4_t in = vld4q_u8(src + 4 * i), out;
+        for (k = 0; k < 4; ++k)
+            out.val[k] = perm[k] == PIXEL_OPAQUE ? opaque : in.val[perm[k]];
+        vst4q_u8(dst + 4 * i, out);
+    }
+    permute4_c(src + 4 * i, dst + 4 * i, n - i, perm);
+}
+
+static void
+pack3_neon (const unsigned char *src, unsigned char *dst, int n,
+            const unsigned char *perm)
+{
+    int i, k;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        uint8x16x4_t in = vld4q_u8(src + 4 * i);
+        uint8x16x3_t out;
+        for (k = 0; k < 3; ++k)
+            out.val[k] = in.val[perm[k]];
+        vst3q_u8(dst + 3 * i, out);
+    }
+    pack3_c(src + 4 * i, dst + 3 * i, n - i, perm);
+}
+
+static void
+unpack3_neon (const unsigned char *src, unsigned char *dst, int n,
+              const unsigned char *perm)
+{
+    const uint8x16_t opaque = vdupq_n_u8(255);
+    int i, k;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        uint8x16x3_t in = vld3q_u8(src + 3 * i);
+        uint8x16x4_t out;
+        for (k = 0; k < 4; ++k)
+            out.val[k] = perm[k] == PIXEL_OPAQUE ? opaque : in.val[perm[k]];
+        vst4q_u8(dst + 4 * i, out);
+    }
+    unpack3_c(src + 3 * i, dst + 4 * i, n - i, perm);
+}
+
+static void
+to_gray_neon (const uint32_t *src, unsigned char *dst, int n) {
+    const uint8x8_t wr = vdup_n_u8(GRAY_R), wg = vdup_n_u8(GRAY_G),
+                    wb = vdup_n_u8(GRAY_B);
+    const int r = native_channel_offset(1), g = native_channel_offset(2),
+              b = native_channel_offset(3);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        uint8x8x4_t in = vld4_u8((const uint8_t *) (src + i));
+        uint16x8_t y = vmull_u8(in.val[r], wr);
+        y = vmlal_u8(y, in.val[g], wg);
+        y = vmlal_u8(y, in.val[b], wb);
+        vst1_u8(dst + i, vrshrn_n_u16(y, 8));
+    }
+    to_gray_c(src + i, dst + i, n - i);
+}
+
+static void
+from_gray_neon (const unsigned char *src, uint32_t *dst, int n) {
+    const uint8x16_t opaque = vdupq_n_u8(255);
+    int i, k;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        uint8x16_t g = vld1q_u8(src + i);
+        uint8x16x4_t out;
+        for (k = 0; k < 4; ++k)
+            out.val[native_channel_offset(k)] = k == 0 ? opaque : g;
+        vst4q_u8((uint8_t *) (dst + i), out);
+    }
+    from_gray_c(src + i, dst + i, n - i);
+}
+
+static void
+premultiply_neon (uint32_t *p, int n) {
+    const int a = native_channel_offset(0);
+    int i, k;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        uint8x8x4_t v = vld4_u8((const uint8_t *) (p + i));
+        for (k = 0; k < 4; ++k) {
+            uint16x8_t t;
+            if (k == a)
+                continue;
+            /* (t + ((t + 128) >> 8) + 128) >> 8, the same as the C version */
+            t = vmull_u8(v.val[k], v.val[a]);
+            v.val[k] = vrshrn_n_u16(vrsraq_n_u16(t, t, 8), 8);
+        }
+        vst4_u8((uint8_t *) (p + i), v);
+    }
+    premultiply_c(p + i, n - i);
+}
+
+#ifdef __aarch64__
+/* The same method as the SSE2 version.  32 bit ARM has no vector divide. */
+static void
+unpremultiply_neon (uint32_t *p, int n) {
+    const uint32x4_t mask = vdupq_n_u32(0xFF);
+    int i, k;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        uint32x4_t v = vld1q_u32(p + i);
+        uint32x4_t a = vshrq_n_u32(v, 24), half = vshrq_n_u32(a, 1);
+        float32x4_t af = vcvtq_f32_u32(a);
+        uint32x4_t out = vshlq_n_u32(a, 24);
+        for (k = 0; k < 3; ++k) {
+            uint32x4_t c = vandq_u32(vshlq_u32(v, vdupq_n_s32(-8 * k)), mask);
+            float32x4_t q = vdivq_f32(vcvtq_f32_u32(vmlaq_n_u32(half, c, 255)), af);
+            /* Zero alpha gives infinity or NaN, which must come out as 0. */
+            uint32x4_t qi = vminq_u32(vcvtq_u32_f32(q), mask);
+            qi = vandq_u32(qi, vtstq_u32(a, a));
+            out = vorrq_u32(out, vshlq_u32(qi, vdupq_n_s32(8 * k)));
+        }
+        vst1q_u32(p + i, out);
+    }
+    unpremultiply_c(p + i, n - i);
+}
+#else
+#define unpremultiply_neon unpremultiply_c
+#endif
+
+static unsigned int
+max_delta_neon (const uint32_t *a, const uint32_t *b, int n, uint32_t mask) {
+    const uint32x4_t m = vdupq_n_u32(mask);
+    uint8x16_t acc = vdupq_n_u8(0);
+    unsigned char bytes[16];
+    unsigned int max, tail;
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        uint8x16_t va = vreinterpretq_u8_u32(vandq_u32(vld1q_u32(a + i), m));
+        uint8x16_t vb = vreinterpretq_u8_u32(vandq_u32(vld1q_u32(b + i), m));
+        acc = vmaxq_u8(acc, vabdq_u8(va, vb));
+    }
+    vst1q_u8(bytes, acc);
+    max = max_byte(bytes, 16);
+    tail = max_delta_c(a + i, b + i, n - i, mask);
+    return tail > max ? tail : max;
+}
+
+static void
+box_step_neon (uint32_t *sum, const unsigned char *add,
+               const unsigned char *sub, unsigned char *out, int n,
+               uint32_t inv)
+{
+    const uint32x4_t vinv = vdupq_n_u32(inv);
+    const uint32x4_t round = vdupq_n_u32(1 << (BOX_SHIFT - 1));
+    int i, k;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        uint8x16_t va = vld1q_u8(add + i), vs = vld1q_u8(sub + i);
+        uint16x8_t a16[2], s16[2];
+        uint16x4_t scaled[4];
+        a16[0] = vmovl_u8(vget_low_u8(va));
+        a16[1] = vmovl_u8(vget_high_u8(va));
+        s16[0] = vmovl_u8(vget_low_u8(vs));
+        s16[1] = vmovl_u8(vget_high_u8(vs));
+        for (k = 0; k < 4; ++k) {
+            uint16x4_t a4 = k & 1 ? vget_high_u16(a16[k / 2])
+                                  : vget_low_u16(a16[k / 2]);
+            uint16x4_t s4 = k & 1 ? vget_high_u16(s16[k / 2])
+                                  : vget_low_u16(s16[k / 2]);
+            uint32x4_t s = vaddw_u16(vld1q_u32(sum + i + 4 * k), a4);
+            scaled[k] = vmovn_u32(vshrq_n_u32(vmlaq_u32(round, s, vinv),
+                                              BOX_SHIFT));
+            vst1q_u32(sum + i + 4 * k, vsubw_u16(s, s4));
+        }
+        vst1q_u8(out + i, vcombine_u8(
+            vmovn_u16(vcombine_u16(scaled[0], scaled[1])),
+            vmovn_u16(vcombine_u16(scaled[2], scaled[3]))));
+    }
+    box_step_c(sum + i, add + i, sub + i, out + i, n - i, inv);
+}
+
+static void
+halve_neon (const uint32_t *a, const uint32_t *b, uint32_t *dst, int n) {
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        /* Loading pairs splits the even pixels from the odd ones. */
+        uint32x4x2_t va = vld2q_u32(a + 2 * i), vb = vld2q_u32(b + 2 * i);
+        uint8x16_t ae = vreinterpretq_u8_u32(va.val[0]);
+        uint8x16_t ao = vreinterpretq_u8_u32(va.val[1]);
+        uint8x16_t be = vreinterpretq_u8_u32(vb.val[0]);
+        uint8x16_t bo = vreinterpretq_u8_u32(vb.val[1]);
+        uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(ae), vget_low_u8(ao)),
+                                  vaddl_u8(vget_low_u8(be), vget_low_u8(bo)));
+        uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(ae), vget_high_u8(ao)),
+                                  vaddl_u8(vget_high_u8(be), vget_high_u8(bo)));
+        vst1q_u32(dst + i, vreinterpretq_u32_u8(
+            vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2))));
+    }
+    halve_c(a + 2 * i, b + 2 * i, dst + i, n - i);
+}
+
+static const PixelKernels pixel_kernels_neon = {
+    "neon",
+    permute4_neon, pack3_neon, unpack3_neon, to_gray_neon, from_gray_neon,
+    premultiply_neon, unpremultiply_neon, max_delta_neon, box_step_neon,
+    halve_neon
+};
+#endif
+
+static const PixelKernels *pixel_kernels = &pixel_kernels_c;
+
+/* All the sets of kernels this build and CPU can use, best first. */
+static int
+pixel_kernels_available (const PixelKernels **sets) {
+    int n = 0;
+#ifdef PIXEL_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        sets[n++] = &pixel_kernels_avx2;
+#endif
+#ifdef PIXEL_HAVE_SSE2
+    sets[n++] = &pixel_kernels_sse2;
+#endif
+#ifdef PIXEL_HAVE_NEON
+    sets[n++] = &pixel_kernels_neon;
+#endif
+    sets[n++] = &pixel_kernels_c;
+    return n;
+}
+
+static void
+pixel_kernels_init (void) {
+    const PixelKernels *sets[4];
+    pixel_kernels_available(sets);
+    pixel_kernels = sets[0];
+}
+
+/* Select a set of kernels by name.  Returns false if it isn't available. */
+static int
+pixel_kernels_select (const char *name) {
+    const PixelKernels *sets[4];
+    int i, n = pixel_kernels_available(sets);
+    for (i = 0; i < n; ++i) {
+        if (strcmp(sets[i]->name, name) == 0) {
+            pixel_kernels = sets[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* A conversion between rows of a Cairo image and an external layout. */
+typedef enum {
+    PIXEL_CONV_COPY,        /* a8 <-> gray */
+    PIXEL_CONV_PERMUTE4,
+    PIXEL_CONV_PACK3,       /* export to rgb/bgr */
+    PIXEL_CONV_UNPACK3,     /* import from rgb/bgr */
+    PIXEL_CONV_GRAY         /* to gray for export, from gray for import */
+} PixelConvKind;
+
+typedef struct PixelConversion_ {
+    PixelConvKind kind;
+    int width;
+    int exporting;
+    /* Export: unpremultiply before converting.  Import: premultiply after,
+     * and then for rgb24 force the pixels opaque. */
+    int alpha_fixup;
+    int force_opaque;
+    unsigned char perm[4];
+} PixelConversion;
+
+/* Set up a conversion.  Returns an error message if it isn't possible. */
+static const char *
+pixel_conversion_init (PixelConversion *conv, int exporting, int layout,
+                       cairo_format_t format, int straight, int width)
+{
+    const signed char *chan = pixel_layout_channels[layout];
+    int c, has_alpha = chan[0] >= 0;
+
+    memset(conv, 0, sizeof(*conv));
+    conv->exporting = exporting;
+    conv->width = width;
+
+    if (format == CAIRO_FORMAT_A8) {
+        if (layout != PIXEL_LAYOUT_GRAY)
+            return "a8 images can only be converted to or from gray pixels";
+        conv->kind = PIXEL_CONV_COPY;
+        return 0;
+    }
+    if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)
+        return "can't convert pixels of this image format";
+
+    if (layout == PIXEL_LAYOUT_GRAY) {
+        conv->kind = PIXEL_CONV_GRAY;
+        conv->alpha_fixup = exporting && straight
+                            && format == CAIRO_FORMAT_ARGB32;
+        return 0;
+    }
+
+    if (exporting) {
+        conv->kind = has_alpha ? PIXEL_CONV_PERMUTE4 : PIXEL_CONV_PACK3;
+        conv->alpha_fixup = straight && format == CAIRO_FORMAT_ARGB32;
+        for (c = 0; c < 4; ++c) {
+            if (chan[c] < 0)
+                continue;
+            conv->perm[chan[c]] = (c == 0 && format == CAIRO_FORMAT_RGB24)
+                                  ? PIXEL_OPAQUE : native_channel_offset(c);
+        }
+    }
+    else {
+        conv->kind = has_alpha ? PIXEL_CONV_PERMUTE4 : PIXEL_CONV_UNPACK3;
+        if (has_alpha && straight)
+            conv->alpha_fixup = 1;
+        conv->force_opaque = has_alpha && format == CAIRO_FORMAT_RGB24;
+        for (c = 0; c < 4; ++c) {
+            conv->perm[native_channel_offset(c)]
+                = chan[c] < 0 ? PIXEL_OPAQUE : chan[c];
+        }
+        if (conv->force_opaque && !conv->alpha_fixup)
+            conv->perm[native_channel_offset(0)] = PIXEL_OPAQUE;
+    }
+    return 0;
+}
+
+/* Convert one row from a Cairo image to the external layout.  'tmp' must
+ * have room for a row of 32 bit pixels if 'alpha_fixup' is set. */
+static void
+pixel_export_row (const PixelConversion *conv, const unsigned char *src,
+                  unsigned char *dst, uint32_t *tmp)
+{
+    const PixelKernels *k = pixel_kernels;
+    int n = conv->width;
+
+    if (conv->alpha_fixup) {
+        memcpy(tmp, src, n * 4);
+        k->unpremultiply(tmp, n);
+        src = (const unsigned char *) tmp;
+    }
+
+    switch (conv->kind) {
+        case PIXEL_CONV_COPY:
+            memcpy(dst, src, n);
+            break;
+        case PIXEL_CONV_PERMUTE4:
+            k->permute4(src, dst, n, conv->perm);
+            break;
+        case PIXEL_CONV_PACK3:
+            k->pack3(src, dst, n, conv->perm);
+            break;
+        default:
+            k->to_gray((const uint32_t *) src, dst, n);
+            break;
+    }
+}
+
+/* Convert one row in the external layout into a row of a Cairo image. */
+static void
+pixel_import_row (const PixelConversion *conv, const unsigned char *src,
+                  unsigned char *dst)
+{
+    const PixelKernels *k = pixel_kernels;
+    int n = conv->width, i;
+
+    switch (conv->kind) {
+        case PIXEL_CONV_COPY:
+            memcpy(dst, src, n);
+            return;
+        case PIXEL_CONV_PERMUTE4:
+            k->permute4(src, dst, n, conv->perm);
+            break;
+        case PIXEL_CONV_UNPACK3:
+            k->unpack3(src, dst, n, conv->perm);
+            break;
+        default:
+            k->from_gray(src, (uint32_t *) dst, n);
+            break;
+    }
+
+    if (conv->alpha_fixup) {
+        uint32_t *p = (uint32_t *) dst;
+        k->premultiply(p, n);
+        if (conv->force_opaque) {
+            for (i = 0; i < n; ++i)
+                p[i] |= 0xFF000000;
+        }
+    }
+}
+
+/* Premultiply or unpremultiply rows y0 to y1-1 of 32 bit pixels in place.
+ * Each row is done independently, so different ranges can be done by
+ * different threads. */
+static void
+pixel_premultiply_rows (unsigned char *data, int stride, int width,
+                        int y0, int y1)
+{
+    int y;
+    for (y = y0; y < y1; ++y)
+        pixel_kernels->premultiply((uint32_t *) (data + (size_t) y * stride),
+                                   width);
+}
+
+static void
+pixel_unpremultiply_rows (unsigned char *data, int stride, int width,
+                          int y0, int y1)
+{
+    int y;
+    for (y = y0; y < y1; ++y)
+        pixel_kernels->unpremultiply((uint32_t *) (data + (size_t) y * stride),
+                                     width);
+}
+
+/* vi:set ts=4 sw=4 expandtab: */
@@ -0,0 +1,310 @@
+/* Copyright (C) 2007-2008 Geoff Richards
+ * Copyright (C) 2010-2011 Uli Schlachter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Frame profiler.  Lua code marks out spans with frame_begin/frame_end, and
+ * the drawing operations done through context objects while a span is open
+ * are timed and added to it (and to all the spans enclosing it).  A span
+ * started while no other span is open begins a new frame, and the last few
+ * frames are kept in a ring buffer so that they can be inspected or exported
+ * as a timeline afterwards.
+ *
+ * The profiler state is global to the module rather than per Lua state,
+ * since the drawing operations have no cheap way to find the latter. */
+
+#define PROFILER_NAME_MAX 64
+#define PROFILER_MAX_DEPTH 32
+#define PROFILER_DEFAULT_HISTORY 60
+
+typedef struct ProfilerStats_ {
+    double draw_time;                   /* microseconds spent in Cairo */
+    double pixels;                      /* device pixels touched */
+    unsigned long calls[DRAW_OP_COUNT];
+} ProfilerStats;
+
+typedef struct ProfilerSpan_ {
+    char name[PROFILER_NAME_MAX];
+    double start, duration;             /* microseconds */
+    int depth;
+    ProfilerStats stats;
+} ProfilerSpan;
+
+typedef struct ProfilerFrame_ {
+    unsigned long number;
+    int num_spans, max_spans;
+    ProfilerSpan *spans;                /* in the order they were finished */
+} ProfilerFrame;
+
+static struct {
+    int depth;
+    ProfilerSpan open[PROFILER_MAX_DEPTH];
+    ProfilerFrame current;
+    unsigned long num_frames;           /* total number ever finished */
+    int history_set;                    /* false until first used */
+    int history_size;
+    ProfilerFrame *history;             /* ring buffer of finished frames */
+} profiler;
+
+static double
+profiler_now (void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+#else
+    return (double) clock() * 1e6 / CLOCKS_PER_SEC;
+#endif
+}
+
+/* Called after each instrumented drawing operation. */
+static void
+profiler_add_draw_op (int op, double elapsed, double pixels) {
+    int i;
+    for (i = 0; i < profiler.depth; ++i) {
+        ProfilerStats *stats = &profiler.open[i].stats;
+        stats->draw_time += elapsed;
+        stats->pixels += pixels;
+        ++stats->calls[op];
+    }
+}
+
+static void
+profiler_free_frame (ProfilerFrame *frame) {
+    free(frame->spans);
+    frame->spans = 0;
+    frame->num_spans = frame->max_spans = 0;
+}
+
+static int
+profiler_set_history_size (lua_State *L, int size) {
+    ProfilerFrame *history = 0;
+    int i;
+
+    if (size > 0) {
+        history = calloc(size, sizeof(ProfilerFrame));
+        if (!history)
+            return luaL_error(L, "out of memory");
+    }
+    for (i = 0; i < profiler.history_size; ++i)
+        profiler_free_frame(&profiler.history[i]);
+    free(profiler.history);
+    profiler.history = history;
+    profiler.history_size = size;
+    profiler.history_set = 1;
+    return 0;
+}
+
+static ProfilerSpan *
+profiler_append_span (lua_State *L, ProfilerFrame *frame) {
+    if (frame->num_spans == frame->max_spans) {
+        int max_spans = frame->max_spans ? frame->max_spans * 2 : 16;
+        ProfilerSpan *spans = realloc(frame->spans,
+                                      max_spans * sizeof(ProfilerSpan));
+        if (!spans) {
+            luaL_error(L, "out of memory");
+            return 0;
+        }
+        frame->spans = spans;
+        frame->max_spans = max_spans;
+    }
+    return &frame->spans[frame->num_spans++];
+}
+
+static void
+profiler_push_span (lua_State *L, const ProfilerSpan *span,
+                    unsigned long frame)
+{
+    int i;
+
+    lua_createtable(L, 0, 9);
+    lua_pushstring(L, span->name);
+    lua_setfield(L, -2, "name");
+    lua_pushnumber(L, frame);
+    lua_setfield(L, -2, "frame");
+    lua_pushnumber(L, span->depth);
+    lua_setfield(L, -2, "depth");
+    lua_pushnumber(L, span->start);
+    lua_setfield(L, -2, "start");
+    lua_pushnumber(L, span->duration);
+    lua_setfield(L, -2, "duration");
+    lua_pushnumber(L, span->stats.draw_time);
+    lua_setfield(L, -2, "draw_time");
+    lua_pushnumber(L, span->stats.pixels);
+    lua_setfield(L, -2, "pixels");
+
+    lua_createtable(L, 0, DRAW_OP_COUNT);
+    for (i = 0; i < DRAW_OP_COUNT; ++i) {
+        lua_pushnumber(L, span->stats.calls[i]);
+        lua_setfield(L, -2, draw_op_names[i]);
+    }
+    lua_setfield(L, -2, "calls");
+}
+
+static int
+frame_begin (lua_State *L) {
+    const char *name = luaL_checkstring(L, 1);
+    ProfilerSpan *span;
+
+    if (profiler.depth == PROFILER_MAX_DEPTH)
+        return luaL_error(L, "frame profiler spans nested too deeply");
+    if (!profiler.history_set)
+        profiler_set_history_size(L, PROFILER_DEFAULT_HISTORY);
+
+    if (profiler.depth == 0) {
+        profiler.current.num_spans = 0;
+        ++draw_hooks_active;
+    }
+
+    span = &profiler.open[profiler.depth];
+    memset(span, 0, sizeof(ProfilerSpan));
+    strncpy(span->name, name, PROFILER_NAME_MAX - 1);
+    span->depth = profiler.depth++;
+    span->start = profiler_now();
+    return 0;
+}
+
+static int
+frame_end (lua_State *L) {
+    ProfilerSpan *span, *done;
+
+    if (profiler.depth == 0)
+        return luaL_error(L, "frame_end called without matching frame_begin");
+
+    span = &profiler.open[profiler.depth - 1];
+    span->duration = profiler_now() - span->start;
+    done = profiler_append_span(L, &profiler.current);
+    *done = *span;
+    --profiler.depth;
+
+    if (profiler.depth == 0) {
+        --draw_hooks_active;
+        profiler.current.number = profiler.num_frames++;
+        if (profiler.history_size > 0) {
+            /* Swap the finished frame into the ring buffer, reusing the
+             * memory of whichever frame it displaces for the next one. */
+            ProfilerFrame *slot = &profiler.history[profiler.current.number
+                                                    % profiler.history_size];
+            ProfilerFrame tmp = *slot;
+            *slot = profiler.current;
+            profiler.current = tmp;
+            done = &slot->spans[slot->num_spans - 1];
+        }
+    }
+
+    profiler_push_span(L, done, profiler.depth ? profiler.num_frames
+                                               : profiler.num_frames - 1);
+    return 1;
+}
+
+static int
+frame_history (lua_State *L) {
+    unsigned long first = 0, n;
+    int i, count = 0;
+
+    if (profiler.num_frames > (unsigned long) profiler.history_size)
+        first = profiler.num_frames - profiler.history_size;
+
+    lua_newtable(L);
+    for (n = first; n < profiler.num_frames; ++n) {
+        ProfilerFrame *frame = &profiler.history[n % profiler.history_size];
+        for (i = 0; i < frame->num_spans; ++i) {
+            profiler_push_span(L, &frame->spans[i], frame->number);
+            lua_rawseti(L, -2, ++count);
+        }
+    }
+    return 1;
+}
+
+static int
+frame_set_history_size (lua_State *L) {
+    int size = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, size >= 0, 1, "history size cannot be negative");
+    profiler_set_history_size(L, size);
+    profiler.num_frames = 0;
+    return 0;
+}
+
+static void
+add_json_string (luaL_Buffer *buf, const char *s) {
+    char esc[8];
+    luaL_addchar(buf, '"');
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            luaL_addchar(buf, '\\');
+            luaL_addchar(buf, *s);
+        }
+        else if ((unsigned char) *s < 0x20) {
+            sprintf(esc, "\\u%04x", (unsigned char) *s);
+            luaL_addstring(buf, esc);
+        }
+        else
+            luaL_addchar(buf, *s);
+    }
+    luaL_addchar(buf, '"');
+}
+
+/* Returns the spans of all the frames in the history as a JSON document in
+ * the Trace Event Format, which can be loaded into Chrome's trace viewer
+ * and similar tools. */
+static int
+frame_trace_json (lua_State *L) {
+    unsigned long first = 0, n;
+    int i, op, comma = 0;
+    char num[64];
+    luaL_Buffer buf;
+
+    if (profiler.num_frames > (unsigned long) profiler.history_size)
+        first = profiler.num_frames - profiler.history_size;
+
+    luaL_buffinit(L, &buf);
+    luaL_addstring(&buf, "{\"traceEvents\":[");
+    for (n = first; n < profiler.num_frames; ++n) {
+        ProfilerFrame *frame = &profiler.history[n % profiler.history_size];
+        for (i = 0; i < frame->num_spans; ++i) {
+            const ProfilerSpan *span = &frame->spans[i];
+            if (comma)
+                luaL_addchar(&buf, ',');
+            comma = 1;
+            luaL_addstring(&buf, "\n{\"name\":");
+            add_json_string(&buf, span->name);
+            sprintf(num, ",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f",
+                    span->start);
+            luaL_addstring(&buf, num);
+            sprintf(num, ",\"dur\":%.3f,\"args\":{\"frame\":%lu",
+                    span->duration, frame->number);
+            luaL_addstring(&buf, num);
+            sprintf(num, ",\"draw_time\":%.3f,\"pixels\":%.0f",
+                    span->stats.draw_time, span->stats.pixels);
+            luaL_addstring(&buf, num);
+            for (op = 0; op < DRAW_OP_COUNT; ++op) {
+                sprintf(num, ",\"%s\":%lu", draw_op_names[op],
+                        span->stats.calls[op]);
+                luaL_addstring(&buf, num);
+            }
+            luaL_addstring(&buf, "}}");
+        }
+    }
+    luaL_addstring(&buf, "\n]}\n");
+    luaL_pushresult(&buf);
+    return 1;
+}
+
+/* vi:set ts=4 sw=4 expandtab: */
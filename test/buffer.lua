@@ -0,0 +1,302 @@
+require "test-setup"
+local lunit = require "lunit"
+local Cairo = require "oocairo"
+
+local assert_error      = lunit.assert_error
+local assert_true       = lunit.assert_true
+local assert_equal      = lunit.assert_equal
+local assert_userdata   = lunit.assert_userdata
+local assert_nil        = lunit.assert_nil
+local assert_number     = lunit.assert_number
+local assert_not_equal  = lunit.assert_not_equal
+local assert_string     = lunit.assert_string
+
+local module = { _NAME="test.buffer" }
+
+function module.test_create ()
+    local surface = Cairo.image_surface_create("argb32", 23, 45)
+    local buf = surface:get_buffer()
+    assert_userdata(buf)
+    assert_equal("cairo image buffer object", buf._NAME)
+    assert_equal(23, buf:get_width())
+    assert_equal(45, buf:get_height())
+    assert_equal("argb32", buf:get_format())
+    assert_true(buf:get_stride() >= 23 * 4)
+    assert_equal(buf:get_stride() * 45, #buf)
+    assert_equal(#buf, buf:len())
+    assert_equal(surface, buf:get_surface())
+    assert_equal(buf, surface:get_buffer())
+    assert_userdata(buf:get_pointer())
+end
+
+function module.test_not_image ()
+    local surface = Cairo.image_surface_create("rgb24", 10, 10)
+    local sub = Cairo.surface_create_similar(surface, "color", 5, 5)
+    if sub:get_type() ~= "image" then
+        assert_nil(sub:get_buffer())
+    end
+end
+
+function module.test_get_sees_drawing ()
+    local surface = Cairo.image_surface_create("argb32", 4, 3)
+    local buf = surface:get_buffer()
+    assert_equal(0, buf:get(3, 2))
+
+    local cr = Cairo.context_create(surface)
+    cr:set_source_rgba(1, 0, 0, 1)
+    cr:paint()
+    assert_equal(0xFFFF0000, buf:get(0, 0))
+    assert_equal(0xFFFF0000, buf:get(3, 2))
+end
+
+function module.test_set_seen_by_cairo ()
+    local surface = Cairo.image_surface_create("rgb24", 3, 3)
+    local buf = surface:get_buffer()
+    buf:set(1, 1, 0x0000FF)
+
+    local data, stride = surface:get_data()
+    local other = Cairo.image_surface_create_from_data(data, "rgb24", 3, 3,
+                                                        stride)
+    assert_equal(0x0000FF, other:get_buffer():get(1, 1))
+    assert_equal(0, other:get_buffer():get(0, 1))
+
+    -- Drawing from the modified surface must pick up the change.
+    local dest = Cairo.image_surface_create("rgb24", 3, 3)
+    local cr = Cairo.context_create(dest)
+    cr:set_source(surface, 0, 0)
+    cr:paint()
+    assert_equal(0x0000FF, dest:get_buffer():get(1, 1) % 0x1000000)
+end
+
+function module.test_a8_and_a1 ()
+    local surface = Cairo.image_surface_create("a8", 5, 2)
+    local buf = surface:get_buffer()
+    buf:set(4, 1, 200)
+    assert_equal(200, buf:get(4, 1))
+    assert_error("too big for a8", function () buf:set(0, 0, 256) end)
+
+    surface = Cairo.image_surface_create("a1", 40, 2)
+    buf = surface:get_buffer()
+    buf:set(33, 1, 1)
+    assert_equal(1, buf:get(33, 1))
+    assert_equal(0, buf:get(32, 1))
+    assert_equal(0, buf:get(34, 1))
+    buf:set(33, 1, 0)
+    assert_equal(0, buf:get(33, 1))
+end
+
+function module.test_rows ()
+    local surface = Cairo.image_surface_create("a8", 5, 3)
+    local buf = surface:get_buffer()
+    buf:set_row(1, "\1\2\3\4\5")
+    assert_equal("\1\2\3\4\5", buf:get_row(1))
+    assert_equal("\0\0\0\0\0", buf:get_row(0))
+    assert_equal(3, buf:get(2, 1))
+    assert_error("row too short", function () buf:set_row(0, "\1") end)
+    assert_error("row out of range", function () buf:get_row(3) end)
+end
+
+function module.test_bad_coords ()
+    local buf = Cairo.image_surface_create("rgb24", 3, 3):get_buffer()
+    assert_error("x too big", function () buf:get(3, 0) end)
+    assert_error("y too big", function () buf:get(0, 3) end)
+    assert_error("negative", function () buf:set(-1, 0, 0) end)
+    assert_error("negative value", function () buf:set(0, 0, -1) end)
+end
+
+function module.test_outlives_surface_object ()
+    local buf = Cairo.image_surface_create("a8", 2, 2):get_buffer()
+    collectgarbage("collect")
+    buf:set(1, 1, 7)
+    assert_equal(7, buf:get(1, 1))
+
+    local data = string.rep("\9", 8)
+    buf = Cairo.image_surface_create_from_data(data, "a8", 2, 2, 4):get_buffer()
+    collectgarbage("collect")
+    assert_equal(9, buf:get(1, 1))
+end
+
+function module.test_create_from_buffer ()
+    local orig = Cairo.image_surface_create("a8", 6, 4)
+    local buf = orig:get_buffer()
+    local stride = buf:get_stride()
+    local shared = Cairo.image_surface_create_from_data(buf, "a8", 6, 4, stride)
+    assert_equal("a8", shared:get_format())
+
+    -- Changes go both ways, since the memory is shared.
+    buf:set(5, 3, 77)
+    assert_equal(77, shared:get_buffer():get(5, 3))
+    local cr = Cairo.context_create(shared)
+    cr:paint()
+    assert_equal(255, buf:get(0, 0))
+
+    -- The original surface must stay alive while the new one exists.
+    orig, buf = nil, nil
+    collectgarbage("collect")
+    assert_equal(255, shared:get_buffer():get(2, 2))
+
+    assert_error("buffer too small", function ()
+        Cairo.image_surface_create_from_data(shared:get_buffer(), "a8",
+                                             6, 5, stride)
+    end)
+end
+
+function module.test_create_from_pointer ()
+    local orig = Cairo.image_surface_create("rgb24", 3, 2)
+    local buf = orig:get_buffer()
+    local shared = Cairo.image_surface_create_from_data(buf:get_pointer(),
+                                                         "rgb24", 3, 2,
+                                                         buf:get_stride(), buf)
+    shared:get_buffer():set(2, 1, 0x123456)
+    assert_equal(0x123456, buf:get(2, 1) % 0x1000000)
+
+    orig, buf = nil, nil
+    collectgarbage("collect")
+    assert_equal(0x123456, shared:get_buffer():get(2, 1) % 0x1000000)
+end
+
+function module.test_create_from_bad_data ()
+    assert_error("boolean data", function ()
+        Cairo.image_surface_create_from_data(true, "a8", 1, 1, 4)
+    end)
+    assert_error("no data", function ()
+        Cairo.image_surface_create_from_data(nil, "a8", 1, 1, 4)
+    end)
+
+    -- Objects from this module aren't pixel memory, even though they're
+    -- userdata values.
+    local pattern = Cairo.pattern_create_rgb(1, 0, 0)
+    local surface = Cairo.image_surface_create("rgb24", 4, 4)
+    assert_error("pattern as data", function ()
+        Cairo.image_surface_create_from_data(pattern, "a8", 1, 1, 4)
+    end)
+    assert_error("surface as data", function ()
+        Cairo.image_surface_create_from_data(surface, "a8", 1, 1, 4)
+    end)
+    assert_error("context as premultiply data", function ()
+        Cairo.premultiply(Cairo.context_create(surface), 1, 1)
+    end)
+    assert_error("pattern as export destination", function ()
+        surface:export_pixels("rgba", "straight", pattern)
+    end)
+end
+
+if Cairo.image_surface_create_mmap then
+    module.teardown = clean_up_temp_files
+
+    function module.test_create_mmap ()
+        local filename = tmpname()
+        local surface = Cairo.image_surface_create_mmap(filename, "argb32",
+                                                        20, 10)
+        local buf = surface:get_buffer()
+        assert_equal(Cairo.format_stride_for_width("argb32", 20),
+                     buf:get_stride())
+        buf:set(3, 4, 0xFF123456)
+        surface:finish()
+        surface, buf = nil, nil
+        collectgarbage("collect")
+
+        local fh = assert(io.open(filename, "rb"))
+        assert_equal(Cairo.format_stride_for_width("argb32", 20) * 10,
+                     #fh:read("*a"))
+        fh:close()
+
+        -- Opening it again gives back the same pixels.
+        surface = Cairo.image_surface_create_mmap(filename, "argb32", 20, 10)
+        assert_equal(0xFF123456, surface:get_buffer():get(3, 4))
+    end
+
+    function module.test_create_mmap_stride ()
+        local filename = tmpname()
+        local surface = Cairo.image_surface_create_mmap(filename, "a8",
+                                                        10, 3, 64)
+        assert_equal(64, surface:get_buffer():get_stride())
+        assert_error("stride too small", function ()
+            Cairo.image_surface_create_mmap(filename, "a8", 10, 3, 8)
+        end)
+        assert_error("stride not aligned", function ()
+            Cairo.image_surface_create_mmap(filename, "a8", 10, 3, 18)
+        end)
+        assert_error("zero height", function ()
+            Cairo.image_surface_create_mmap(filename, "a8", 10, 0)
+        end)
+        assert_error("bad filename", function ()
+            Cairo.image_surface_create_mmap("/nonexistent/dir/file", "a8",
+                                            10, 3)
+        end)
+    end
+end
+
+if Cairo.image_surface_create_shm then
+    function module.test_create_shm_anonymous ()
+        local surface = Cairo.image_surface_create_shm("argb32", 20, 10)
+        local fd, name = surface:get_shm()
+        assert_number(fd)
+        assert_nil(name)
+        surface:get_buffer():set(3, 4, 0xFF123456)
+        surface:flush()
+
+        -- Opening the descriptor gives a surface sharing the same pixels.
+        local other = Cairo.image_surface_open_shm(fd)
+        assert_equal("argb32", other:get_format())
+        assert_equal(20, other:get_width())
+        assert_equal(10, other:get_height())
+        assert_equal(surface:get_buffer():get_stride(),
+                     other:get_buffer():get_stride())
+        assert_equal(0xFF123456, other:get_buffer():get(3, 4))
+        other:get_buffer():set(5, 6, 0x80000000)
+        assert_equal(0x80000000, surface:get_buffer():get(5, 6))
+
+        -- The other surface has its own copy of the descriptor.
+        assert_not_equal(fd, (other:get_shm()))
+        assert_nil(Cairo.image_surface_create("argb32", 1, 1):get_shm())
+    end
+
+    function module.test_create_shm_named ()
+        local name = "/oocairo-test-" .. os.time() .. "-" .. math.random(1e6)
+        local surface = Cairo.image_surface_create_shm("a8", 10, 3, 64, name)
+        local _, got_name = surface:get_shm()
+        assert_equal(name, got_name)
+        surface:get_buffer():set(9, 2, 200)
+        surface:flush()
+
+        local ok, err = pcall(function ()
+            assert_error("name already exists", function ()
+                Cairo.image_surface_create_shm("a8", 10, 3, 64, name)
+            end)
+            local other = Cairo.image_surface_open_shm(name)
+            assert_equal(64, other:get_buffer():get_stride())
+            assert_equal(200, other:get_buffer():get(9, 2))
+        end)
+        Cairo.shm_unlink(name)
+        assert_true(ok, err)
+        assert_error("already unlinked", function () Cairo.shm_unlink(name) end)
+        assert_error("open unlinked name",
+                     function () Cairo.image_surface_open_shm(name) end)
+    end
+
+    function module.test_open_shm_bad ()
+        assert_error("bad descriptor",
+                     function () Cairo.image_surface_open_shm(-1) end)
+        assert_error("bad argument type",
+                     function () Cairo.image_surface_open_shm(true) end)
+        assert_error("bad stride", function ()
+            Cairo.image_surface_create_shm("argb32", 10, 3, 8)
+        end)
+    end
+end
+
+function module.test_mark_dirty ()
+    local surface = Cairo.image_surface_create("rgb24", 10, 10)
+    surface:mark_dirty()
+    surface:mark_dirty(1, 2, 3, 4)
+    surface:get_buffer():mark_dirty(0, 0, 10, 10)
+    assert_error("negative width",
+                 function () surface:mark_dirty(0, 0, -1, 1) end)
+    assert_string(surface:get_data())
+end
+
+lunit.testcase(module)
+return module
+
+-- vi:ts=4 sw=4 expandtab
@@ -18,13 +18,41 @@ local module = { _NAME="test.general" }
 
 function module.test_support_flags ()
     for _, feature in ipairs{
-        "HAS_PDF_SURFACE", "HAS_PNG_FUNCTIONS", "HAS_PS_SURFACE",
-        "HAS_SVG_SURFACE", "HAS_USER_FONT"
+        "HAS_PDF_SURFACE", "HAS_PNG_FUNCTIONS", "HAS_PNG_OPTIONS",
+        "HAS_PS_SURFACE", "HAS_SVG_SURFACE", "HAS_USER_FONT"
     } do
         assert_boolean(Cairo[feature], "flag for feature " .. feature)
     end
 end
 
+function module.test_threads ()
+    local default = Cairo.set_threads(1)
+    assert_number(default)
+    assert_true(default >= 1)
+    local stats = Cairo.thread_stats()
+    assert_equal(1, stats.threads)
+    for _, field in ipairs{ "workers", "queued", "running", "submitted",
+                            "completed", "cancelled", "stolen" } do
+        assert_number(stats[field], "stats field " .. field)
+    end
+
+    -- The result of split up work doesn't depend on how it's split.
+    local function blurred ()
+        local surface = Cairo.image_surface_create("argb32", 300, 200)
+        draw_arbitrary_stuff(Cairo, surface)
+        surface:blur(5)
+        return surface:hash()
+    end
+    local expected = blurred()
+    assert_equal(1, Cairo.set_threads(4))
+    assert_equal(4, Cairo.thread_stats().threads)
+    assert_equal(expected, blurred())
+
+    assert_equal(4, Cairo.set_threads())
+    assert_equal(default, Cairo.thread_stats().threads)
+    assert_error("negative", function () Cairo.set_threads(-1) end)
+end
+
 lunit.testcase(module)
 return module
 
@@ -0,0 +1,161 @@
+require "test-setup"
+local lunit = require "lunit"
+local Cairo = require "oocairo"
+
+local assert_error      = lunit.assert_error
+local assert_true       = lunit.assert_true
+local assert_equal      = lunit.assert_equal
+local assert_match      = lunit.assert_match
+
+local module = { _NAME="test.image_io" }
+
+module.teardown = clean_up_temp_files
+
+local function test_surface (format)
+    local surface = Cairo.image_surface_create(format, 37, 5)
+    local cr = Cairo.context_create(surface)
+    cr:set_source_rgba(1, 0.5, 0, 0.5)
+    cr:rectangle(0, 0, 20, 5)
+    cr:fill()
+    cr:set_source_rgba(0.2, 0.4, 0.6, 1)
+    cr:rectangle(20, 0, 17, 5)
+    cr:fill()
+    return surface
+end
+
+-- Collects everything written to it, like a file opened for writing.
+local function string_writer ()
+    local fh = { data = "" }
+    function fh:write (s) self.data = self.data .. s end
+    return fh
+end
+
+-- Pixel data can change by one in each channel when converting between
+-- premultiplied and straight alpha.
+local function assert_same_pixels (expected, got, desc)
+    local a, b = expected:get_data(), got:get_data()
+    assert_equal(#a, #b, desc)
+    for i = 1, #a do
+        assert_true(math.abs(a:byte(i) - b:byte(i)) <= 1, desc)
+    end
+end
+
+local function check_round_trip (type, format, expected_format)
+    local surface = test_surface(format)
+    local filename = tmpname()
+    surface:write_to(type, filename)
+    local loaded = Cairo.image_surface_create_from(type, filename)
+    assert_equal(expected_format or format, loaded:get_format())
+    assert_equal(37, loaded:get_width())
+    assert_equal(5, loaded:get_height())
+    if not expected_format then
+        assert_same_pixels(surface, loaded, type .. " " .. format)
+    end
+
+    -- The same through file handles, and from a string.
+    local fh = string_writer()
+    surface:write_to(type, fh)
+    local f = assert(io.open(filename, "rb"))
+    assert_equal(f:read("*a"), fh.data)
+    f:close()
+    loaded = Cairo.image_surface_create_from(type, fh.data)
+    assert_equal(expected_format or format, loaded:get_format())
+    return fh.data
+end
+
+function module.test_pam ()
+    assert_match("^P7\nWIDTH 37\nHEIGHT 5\nDEPTH 4\n",
+                 check_round_trip("pam", "argb32"))
+    assert_match("^P7\nWIDTH 37\nHEIGHT 5\nDEPTH 3\n",
+                 check_round_trip("pam", "rgb24"))
+    check_round_trip("pam", "a8")
+end
+
+function module.test_ppm ()
+    assert_match("^P6\n37 5\n255\n",
+                 check_round_trip("ppm", "argb32", "rgb24"))
+    assert_equal(#"P6\n37 5\n255\n" + 37 * 5 * 3,
+                 #check_round_trip("ppm", "rgb24"))
+    assert_match("^P5\n", check_round_trip("ppm", "a8"))
+end
+
+function module.test_qoi ()
+    local data = check_round_trip("qoi", "argb32")
+    assert_match("^qoif", data)
+    assert_equal(4, data:byte(13))
+    -- The flat areas of colour compress well.
+    assert_true(#data < 37 * 5)
+    assert_equal(3, check_round_trip("qoi", "rgb24"):byte(13))
+    assert_error("a8 as QOI", function ()
+        test_surface("a8"):write_to("qoi", tmpname())
+    end)
+end
+
+function module.test_raw ()
+    for _, format in ipairs{ "argb32", "rgb24", "a8" } do
+        local surface = test_surface(format)
+        local fh = string_writer()
+        surface:write_to("raw", fh)
+        local row = format == "a8" and 37 or 37 * 4
+        assert_equal(row * 5, #fh.data)
+        local filename = tmpname()
+        surface:write_to("raw", filename)
+        local loaded = Cairo.image_surface_create_from("raw", filename,
+                                                       format, 37, 5)
+        assert_same_pixels(surface, loaded, "raw " .. format)
+    end
+end
+
+function module.test_pnm_comments ()
+    local data = "P6\n# a comment\n2 1\n# another\n255\n" ..
+                 "\255\0\0" .. "\0\0\255"
+    local surface = Cairo.image_surface_create_from("ppm", data)
+    assert_equal("rgb24", surface:get_format())
+    assert_equal(2, surface:get_width())
+end
+
+function module.test_errors ()
+    assert_error("bad type", function ()
+        Cairo.image_surface_create_from("gif", "foo.gif")
+    end)
+    assert_error("missing file", function ()
+        Cairo.image_surface_create_from("qoi", "nonexistent-file.qoi")
+    end)
+    assert_error("raw without size", function ()
+        Cairo.image_surface_create_from("raw", tmpname())
+    end)
+    assert_error("truncated data", function ()
+        Cairo.image_surface_create_from("ppm", "P6\n2 2\n255\n\0\0\0")
+    end)
+    assert_error("16 bit data", function ()
+        Cairo.image_surface_create_from("ppm", "P6\n1 1\n65535\n\0\0\0\0\0\0")
+    end)
+    assert_error("file handle without read method", function ()
+        Cairo.image_surface_create_from("pam", string_writer())
+    end)
+    if Cairo.HAS_SVG_SURFACE then
+        local svg = Cairo.svg_surface_create(tmpname(), 10, 10)
+        assert_error("non-image surface", function ()
+            svg:write_to("pam", tmpname())
+        end)
+    end
+end
+
+function module.test_stream_unread ()
+    local surface = test_surface("argb32")
+    local filename = tmpname()
+    local fh = assert(io.open(filename, "wb"))
+    surface:write_to("qoi", fh)
+    fh:write("trailing data")
+    fh:close()
+    fh = assert(io.open(filename, "rb"))
+    local loaded = Cairo.image_surface_create_from("qoi", fh)
+    assert_equal("trailing data", fh:read("*a"))
+    fh:close()
+    assert_same_pixels(surface, loaded, "qoi from file handle")
+end
+
+lunit.testcase(module)
+return module
+
+-- vi:ts=4 sw=4 expandtab
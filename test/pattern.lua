@@ -164,6 +164,106 @@ function module.test_not_gradient_pattern ()
                  function () pat:add_color_stop_rgba(0, 0.1, 0.2, 0.3, 0.4) end)
 end
 
+local function checkerboard (size)
+    local surface = Cairo.image_surface_create("argb32", size, size)
+    local buf = surface:get_buffer()
+    for y = 0, size - 1 do
+        for x = 0, size - 1 do
+            buf:set(x, y, (x + y) % 2 == 0 and 0xFF000000 or 0xFFFFFFFF)
+        end
+    end
+    return surface
+end
+
+function module.test_use_mipmaps ()
+    local pat = Cairo.pattern_create_for_surface(checkerboard(64))
+    pat:use_mipmaps()
+    local surface = Cairo.image_surface_create("argb32", 8, 8)
+    local cr = Cairo.context_create(surface)
+    cr:scale(1 / 8, 1 / 8)
+    cr:set_source(pat)
+    cr:paint()
+    assert_equal(pat, cr:get_source())
+    -- Each pixel is the average of an 8x8 block of the checkerboard.
+    local grey = surface:get_buffer():get(3, 4)
+    assert_equal(0xFF808080, grey)
+    pat:use_mipmaps(false)
+
+    assert_error("not a surface pattern", function ()
+        Cairo.pattern_create_rgb(1, 0, 0):use_mipmaps()
+    end)
+end
+
+function module.test_mipmaps_locked_to_user_space ()
+    -- The pattern is drawn in the user space in effect when it was set as
+    -- the source, so scaling afterwards doesn't shrink it.
+    local pat = Cairo.pattern_create_for_surface(checkerboard(64))
+    pat:use_mipmaps()
+    local surface = Cairo.image_surface_create("argb32", 8, 8)
+    local cr = Cairo.context_create(surface)
+    cr:set_source(pat)
+    cr:scale(1 / 8, 1 / 8)
+    cr:paint()
+    cr:paint()
+    local buf = surface:get_buffer()
+    assert_equal(0xFF000000, buf:get(3, 3))
+    assert_equal(0xFFFFFFFF, buf:get(3, 4))
+
+    -- And the other way round, the mipmap is used when the pattern was set
+    -- while shrinking, and stays that way after the first operation.
+    surface = Cairo.image_surface_create("argb32", 8, 8)
+    cr = Cairo.context_create(surface)
+    cr:scale(1 / 8, 1 / 8)
+    cr:set_source(pat)
+    cr:identity_matrix()
+    cr:paint()
+    assert_equal(0xFF808080, surface:get_buffer():get(3, 4))
+    surface:get_buffer():set(3, 4, 0)
+    cr:paint()
+    assert_equal(0xFF808080, surface:get_buffer():get(3, 4))
+
+    -- Restoring a saved state brings back the user space of its source.
+    surface = Cairo.image_surface_create("argb32", 8, 8)
+    cr = Cairo.context_create(surface)
+    cr:set_source(pat)
+    cr:save()
+    cr:scale(1 / 8, 1 / 8)
+    cr:set_source(pat)
+    cr:restore()
+    cr:scale(1 / 8, 1 / 8)
+    cr:paint()
+    buf = surface:get_buffer()
+    assert_equal(0xFF000000, buf:get(3, 3))
+    assert_equal(0xFFFFFFFF, buf:get(3, 4))
+end
+
+function module.test_mipmaps_after_errors ()
+    -- A drawing operation which throws an error leaves the pattern set as
+    -- the source, not the mipmap drawn in its place.
+    local pat = Cairo.pattern_create_for_surface(checkerboard(64))
+    pat:use_mipmaps()
+    local surface = Cairo.image_surface_create("argb32", 8, 8)
+    local cr = Cairo.context_create(surface)
+    cr:scale(1 / 8, 1 / 8)
+    cr:set_source(pat)
+    assert_error("bad mask offset", function ()
+        cr:mask(surface, "x")
+    end)
+    assert_equal(pat, cr:get_source())
+
+    if Cairo.user_font_face_create then
+        cr:set_font_face(Cairo.user_font_face_create({
+            render_glyph = function () error("no glyphs here") end,
+        }))
+        cr:set_font_size(80)
+        assert_error("error from user font", function ()
+            cr:show_text("x")
+        end)
+        assert_equal(pat, cr:get_source())
+    end
+    pat:use_mipmaps(false)
+end
+
 function module.test_equality ()
     -- Different userdatas, same Cairo object.
     local surface = Cairo.image_surface_create("rgb24", 23, 45)
@@ -56,6 +56,47 @@ if Cairo.HAS_PDF_SURFACE then
         check_file_contains_pdf(filename)
     end
 
+    local function write_counter ()
+        local fh = { calls = 0, data = "" }
+        function fh:write (s)
+            self.calls = self.calls + 1
+            self.data = self.data .. s
+        end
+        return fh
+    end
+
+    function module.test_stream_buffered ()
+        local fh = write_counter()
+        local surface = Cairo.pdf_surface_create(fh, 300, 200)
+        draw_arbitrary_stuff(Cairo, surface)
+        surface:finish()
+        assert_match("^%%PDF", fh.data)
+        assert_match("%%%%EOF%s*$", fh.data)
+        assert_equal(1, fh.calls)
+    end
+
+    function module.test_stream_unbuffered ()
+        local old = Cairo.set_write_buffer_size(0)
+        local fh = write_counter()
+        local ok, err = pcall(function ()
+            local surface = Cairo.pdf_surface_create(fh, 300, 200)
+            draw_arbitrary_stuff(Cairo, surface)
+            surface:finish()
+        end)
+        assert_equal(0, Cairo.set_write_buffer_size(old))
+        assert_true(ok, err)
+        assert_match("^%%PDF", fh.data)
+        assert_true(fh.calls > 1)
+    end
+
+    function module.test_stream_write_error ()
+        local fh = { write = function () error("disk full") end }
+        local surface = Cairo.pdf_surface_create(fh, 300, 200)
+        draw_arbitrary_stuff(Cairo, surface)
+        assert_error("error from write method",
+                     function () surface:finish() end)
+    end
+
     function module.test_create_bad ()
         assert_error("wrong type instead of file/filename",
                      function () Cairo.pdf_surface_create(true, 300, 200) end)
@@ -0,0 +1,309 @@
+require "test-setup"
+local lunit = require "lunit"
+local Cairo = require "oocairo"
+
+local assert_error      = lunit.assert_error
+local assert_true       = lunit.assert_true
+local assert_false      = lunit.assert_false
+local assert_equal      = lunit.assert_equal
+local assert_string     = lunit.assert_string
+
+local module = { _NAME="test.pixels" }
+
+local default_simd
+
+function module.setup ()
+    default_simd = default_simd or Cairo.pixel_simd()
+end
+
+function module.teardown ()
+    Cairo.pixel_simd(default_simd)
+end
+
+-- A surface big enough for the SIMD code to be used, with a width which
+-- leaves some pixels over for the scalar code at the end of each row.
+local function test_surface (format)
+    local surface = Cairo.image_surface_create(format or "argb32", 37, 5)
+    local cr = Cairo.context_create(surface)
+    cr:set_source_rgba(1, 0.5, 0, 0.5)
+    cr:rectangle(0, 0, 20, 5)
+    cr:fill()
+    cr:set_source_rgba(0.2, 0.4, 0.6, 1)
+    cr:rectangle(20, 0, 17, 5)
+    cr:fill()
+    return surface
+end
+
+local function bytes (s, i, n)
+    return { s:byte(i, i + n - 1) }
+end
+
+function module.test_export_rgba ()
+    local surface = test_surface()
+    local data, stride = surface:export_pixels("rgba")
+    assert_equal(37 * 4, stride)
+    assert_equal(37 * 4 * 5, #data)
+    local px = bytes(data, 1, 4)
+    assert_equal(255, px[1])
+    assert_true(px[2] >= 127 and px[2] <= 129)
+    assert_equal(0, px[3])
+    assert_equal(128, px[4])
+
+    data = surface:export_pixels("rgba", "premultiplied")
+    px = bytes(data, 1, 4)
+    assert_equal(128, px[1])
+    assert_equal(128, px[4])
+
+    data = surface:export_pixels("bgra")
+    px = bytes(data, 1, 4)
+    assert_equal(0, px[1])
+    assert_equal(255, px[3])
+end
+
+function module.test_export_rgb_and_gray ()
+    local surface = test_surface()
+    local data, stride = surface:export_pixels("bgr")
+    assert_equal(37 * 3, stride)
+    assert_equal(37 * 3 * 5, #data)
+    local px = bytes(data, 20 * 3 + 1, 3)
+    assert_equal(153, px[1])
+    assert_equal(102, px[2])
+    assert_equal(51, px[3])
+
+    data = surface:export_pixels("gray")
+    assert_equal(37 * 5, #data)
+    assert_equal(math.floor((77 * 51 + 150 * 102 + 29 * 153 + 128) / 256),
+                 data:byte(21))
+end
+
+function module.test_export_a8 ()
+    local surface = Cairo.image_surface_create("a8", 3, 2)
+    surface:get_buffer():set(1, 1, 99)
+    assert_equal("\0\0\0\0\99\0", surface:export_pixels("gray"))
+    assert_error("a8 as rgba", function () surface:export_pixels("rgba") end)
+end
+
+function module.test_export_into_buffer ()
+    local surface = test_surface()
+    local dest = Cairo.image_surface_create("argb32", 37, 5)
+    local buf = dest:get_buffer()
+    local ret, stride = surface:export_pixels(Cairo.BYTE_ORDER == "argb"
+                                              and "argb" or "bgra",
+                                              "premultiplied", buf,
+                                              buf:get_stride())
+    assert_equal(buf, ret)
+    assert_equal(buf:get_stride(), stride)
+    assert_equal(surface:get_data(), dest:get_data())
+
+    assert_error("string destination", function ()
+        surface:export_pixels("rgba", "straight", string.rep(" ", 1000))
+    end)
+    assert_error("destination too small", function ()
+        surface:export_pixels("rgba", "straight",
+                              Cairo.image_surface_create("a8", 1, 1):get_buffer())
+    end)
+end
+
+function module.test_import ()
+    local data = "\255\0\0\255" .. "\0\255\0\128" .. "\0\0\0\0"
+    local surface = Cairo.image_surface_import("rgba", data, 3, 1)
+    assert_equal("argb32", surface:get_format())
+    local buf = surface:get_buffer()
+    assert_equal(0xFFFF0000, buf:get(0, 0))
+    assert_equal(0x80008000, buf:get(1, 0))
+    assert_equal(0, buf:get(2, 0))
+
+    surface = Cairo.image_surface_import("rgba", data, 3, 1, nil,
+                                         "premultiplied")
+    assert_equal(0x8000FF00, surface:get_buffer():get(1, 0))
+
+    surface = Cairo.image_surface_import("rgb", "\1\2\3\0\4\5\6\0", 1, 2, 4)
+    assert_equal("rgb24", surface:get_format())
+    assert_equal(0x010203, surface:get_buffer():get(0, 0) % 0x1000000)
+    assert_equal(0x040506, surface:get_buffer():get(0, 1) % 0x1000000)
+
+    surface = Cairo.image_surface_import("gray", "\7\8", 2, 1, nil, nil, "a8")
+    assert_equal("a8", surface:get_format())
+    assert_equal(8, surface:get_buffer():get(1, 0))
+
+    assert_error("not enough data", function ()
+        Cairo.image_surface_import("rgb", "\1\2", 1, 1)
+    end)
+    assert_error("rgba into a8", function ()
+        Cairo.image_surface_import("rgba", data, 3, 1, nil, nil, "a8")
+    end)
+    assert_error("bad layout", function ()
+        Cairo.image_surface_import("yuv", data, 3, 1)
+    end)
+end
+
+function module.test_round_trip ()
+    local surface = test_surface()
+    for _, layout in ipairs{ "rgba", "bgra", "argb" } do
+        local data = surface:export_pixels(layout, "premultiplied")
+        local copy = Cairo.image_surface_import(layout, data, 37, 5, nil,
+                                                "premultiplied")
+        assert_equal(surface:get_data(), copy:get_data(), layout)
+    end
+end
+
+function module.test_simd_matches_scalar ()
+    local surface = test_surface()
+    local rgb = test_surface("rgb24")
+    local function all_exports ()
+        local out = {}
+        for _, layout in ipairs{ "rgba", "bgra", "argb", "rgb", "bgr", "gray" } do
+            for _, alpha in ipairs{ "straight", "premultiplied" } do
+                out[#out + 1] = surface:export_pixels(layout, alpha)
+                out[#out + 1] = rgb:export_pixels(layout, alpha)
+                local copy = Cairo.image_surface_import(layout, out[#out], 37,
+                                                        5, nil, alpha)
+                out[#out + 1] = copy:get_data()
+            end
+        end
+        return table.concat(out)
+    end
+
+    Cairo.pixel_simd("scalar")
+    local expected = all_exports()
+    for _, name in ipairs{ "sse2", "avx2", "neon" } do
+        if pcall(Cairo.pixel_simd, name) then
+            assert_equal(name, Cairo.pixel_simd())
+            assert_true(expected == all_exports(), "kernels for " .. name)
+        end
+    end
+    assert_error("unknown kernels", function () Cairo.pixel_simd("mmx") end)
+end
+
+function module.test_premultiply_data ()
+    local data = "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    local src = Cairo.image_surface_import("rgba", "\255\128\0\128", 1, 1,
+                                           nil, "premultiplied")
+    local px = src:get_data()
+    local straight = Cairo.unpremultiply(px, 1, 1)
+    local again = Cairo.premultiply(straight, 1, 1)
+    assert_equal(px, again)
+    if Cairo.BYTE_ORDER == "bgra" then
+        assert_equal(src:export_pixels("bgra", "straight"), straight)
+    end
+
+    local buf = Cairo.image_surface_create("argb32", 5, 1):get_buffer()
+    assert_equal(buf, Cairo.premultiply(buf, 5, 1, buf:get_stride()))
+    assert_error("too short", function () Cairo.premultiply(data, 6, 1) end)
+    assert_error("bad stride", function () Cairo.premultiply(data, 5, 1, 3) end)
+end
+
+function module.test_premultiply_surface ()
+    local surface = test_surface()
+    local orig = surface:get_data()
+    surface:unpremultiply()
+    assert_equal(surface:export_pixels("bgra", "premultiplied"),
+                 test_surface():export_pixels("bgra", "straight"))
+    surface:premultiply()
+    assert_equal(orig, surface:get_data())
+
+    assert_error("not argb32", function ()
+        Cairo.image_surface_create("rgb24", 1, 1):premultiply()
+    end)
+end
+
+function module.test_premultiply_simd_matches_scalar ()
+    -- Every combination of alpha and colour value, including invalid ones.
+    local t = {}
+    for a = 0, 255 do
+        for c = 0, 255, 3 do
+            t[#t + 1] = string.char(c, 255 - c, c, a)
+        end
+    end
+    local data = table.concat(t)
+    local width = #data / 4
+    Cairo.pixel_simd("scalar")
+    local expected_p = Cairo.premultiply(data, width, 1)
+    local expected_u = Cairo.unpremultiply(data, width, 1)
+    for _, name in ipairs{ "sse2", "avx2", "neon" } do
+        if pcall(Cairo.pixel_simd, name) then
+            assert_true(expected_p == Cairo.premultiply(data, width, 1), name)
+            assert_true(expected_u == Cairo.unpremultiply(data, width, 1), name)
+        end
+    end
+end
+
+if Cairo.image_diff then
+    function module.test_image_diff ()
+        local a = test_surface()
+        local b = test_surface()
+        local region, delta = Cairo.image_diff(a, b, 8, true)
+        assert_true(region:is_empty())
+        assert_equal(0, delta)
+
+        local buf = b:get_buffer()
+        buf:set(35, 4, buf:get(35, 4) + 3)
+        buf:set(9, 0, buf:get(9, 0) + 0x100)
+        local original_simd = Cairo.pixel_simd()
+        Cairo.pixel_simd("scalar")
+        region, delta = Cairo.image_diff(a, b, 8, true)
+        assert_equal(3, delta)
+        local rects = region:get_rectangles()
+        assert_equal(2, #rects)
+        assert_equal(8, rects[1].x)
+        assert_equal(0, rects[1].y)
+        assert_equal(8, rects[1].width)
+        assert_equal(5, rects[1].height)
+        assert_equal(32, rects[2].x)
+        assert_equal(5, rects[2].width)
+
+        for _, name in ipairs{ "sse2", "avx2", "neon" } do
+            if pcall(Cairo.pixel_simd, name) then
+                local r, d = Cairo.image_diff(a, b, 8, true)
+                assert_true(r == region, name)
+                assert_equal(3, d, name)
+                assert_true(Cairo.image_diff(a, b, 8) == region, name)
+            end
+        end
+        Cairo.pixel_simd(original_simd)
+
+        -- The default tile size covers the whole of such a small image.
+        local ext = Cairo.image_diff(a, b):get_extents()
+        assert_equal(0, ext.x)
+        assert_equal(37, ext.width)
+        assert_equal(5, ext.height)
+    end
+
+    function module.test_image_diff_rgb24 ()
+        local a = Cairo.image_surface_create("rgb24", 3, 3)
+        local b = Cairo.image_surface_create("rgb24", 3, 3)
+        -- The unused byte doesn't count.
+        b:get_buffer():set(1, 1, 0xFF000000)
+        assert_true(Cairo.image_diff(a, b, 1):is_empty())
+        b:get_buffer():set(1, 1, 0x00000001)
+        local region = Cairo.image_diff(a, b, 1)
+        assert_true(region:contains_point(1, 1))
+        assert_false(region:contains_point(0, 1))
+    end
+
+    function module.test_image_diff_bad ()
+        local a = Cairo.image_surface_create("argb32", 3, 3)
+        assert_error("different size", function ()
+            Cairo.image_diff(a, Cairo.image_surface_create("argb32", 3, 4))
+        end)
+        assert_error("different format", function ()
+            Cairo.image_diff(a, Cairo.image_surface_create("rgb24", 3, 3))
+        end)
+        assert_error("bad tile size", function () Cairo.image_diff(a, a, 0) end)
+        if Cairo.HAS_RECORDING_SURFACE then
+            local recording = Cairo.recording_surface_create("color-alpha",
+                                                             0, 0, 3, 3)
+            assert_error("not an image", function ()
+                Cairo.image_diff(a, recording)
+            end)
+            assert_error("not an image", function ()
+                Cairo.image_diff(recording, a)
+            end)
+        end
+    end
+end
+
+lunit.testcase(module)
+return module
+
+-- vi:ts=4 sw=4 expandtab
@@ -0,0 +1,108 @@
+require "test-setup"
+local lunit = require "lunit"
+local Cairo = require "oocairo"
+
+local assert_error      = lunit.assert_error
+local assert_true       = lunit.assert_true
+local assert_equal      = lunit.assert_equal
+local assert_table      = lunit.assert_table
+local assert_number     = lunit.assert_number
+local assert_string     = lunit.assert_string
+local assert_match      = lunit.assert_match
+
+local module = { _NAME="test.profiler" }
+
+function module.setup ()
+    Cairo.frame_set_history_size(60)
+end
+
+local function draw_frame (cr)
+    Cairo.frame_begin("frame")
+    Cairo.frame_begin("background")
+    cr:paint()
+    local inner = Cairo.frame_end()
+    cr:rectangle(10, 10, 20, 30)
+    cr:fill()
+    cr:rectangle(0, 0, 5, 5)
+    cr:stroke()
+    return inner, Cairo.frame_end()
+end
+
+function module.test_spans ()
+    local surface = Cairo.image_surface_create("rgb24", 100, 50)
+    local cr = Cairo.context_create(surface)
+    local inner, outer = draw_frame(cr)
+
+    assert_table(inner)
+    assert_equal("background", inner.name)
+    assert_equal(1, inner.depth)
+    assert_equal(1, inner.calls.paint)
+    assert_equal(0, inner.calls.fill)
+    assert_equal(5000, inner.pixels)
+
+    assert_equal("frame", outer.name)
+    assert_equal(0, outer.depth)
+    assert_equal(0, outer.frame)
+    assert_equal(1, outer.calls.paint)
+    assert_equal(1, outer.calls.fill)
+    assert_equal(1, outer.calls.stroke)
+    assert_equal(0, outer.calls.mask)
+    assert_equal(0, outer.calls.glyphs)
+    assert_true(outer.pixels >= 5000 + 600)
+    assert_number(outer.start)
+    assert_true(outer.duration >= outer.draw_time)
+    assert_true(inner.start >= outer.start)
+end
+
+function module.test_no_span ()
+    local surface = Cairo.image_surface_create("rgb24", 10, 10)
+    local cr = Cairo.context_create(surface)
+    cr:paint()
+    assert_equal(0, #Cairo.frame_history())
+end
+
+function module.test_history ()
+    local surface = Cairo.image_surface_create("rgb24", 10, 10)
+    local cr = Cairo.context_create(surface)
+    Cairo.frame_set_history_size(2)
+    for _ = 1, 3 do draw_frame(cr) end
+
+    local spans = Cairo.frame_history()
+    assert_equal(4, #spans)
+    assert_equal("background", spans[1].name)
+    assert_equal(1, spans[1].frame)
+    assert_equal("frame", spans[4].name)
+    assert_equal(2, spans[4].frame)
+
+    Cairo.frame_set_history_size(0)
+    local _, outer = draw_frame(cr)
+    assert_equal("frame", outer.name)
+    assert_equal(0, #Cairo.frame_history())
+end
+
+function module.test_trace_json ()
+    local surface = Cairo.image_surface_create("rgb24", 10, 10)
+    local cr = Cairo.context_create(surface)
+    Cairo.frame_begin("quote\"d")
+    cr:paint()
+    Cairo.frame_end()
+
+    local json = Cairo.frame_trace_json()
+    assert_string(json)
+    assert_match("^{\"traceEvents\":%[", json)
+    assert_match("\"name\":\"quote\\\"d\"", json)
+    assert_match("\"ph\":\"X\"", json)
+    assert_match("\"paint\":1", json)
+end
+
+function module.test_errors ()
+    assert_error("frame_end without begin", function () Cairo.frame_end() end)
+    assert_error("negative history size",
+                 function () Cairo.frame_set_history_size(-1) end)
+    assert_error("missing span name", function () Cairo.frame_begin() end)
+end
+
+lunit.testcase(module)
+return module
+
+-- vi:ts=4 sw=4 expandtab
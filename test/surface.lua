@@ -213,6 +213,48 @@ if Cairo.HAS_PNG_FUNCTIONS then
         fh:close()
         check_wood_image_surface(surface)
     end
+
+    local function read_png_data ()
+        local fh = assert(io.open(FILENAME, "rb"))
+        local data = fh:read("*a")
+        fh:close()
+        return data
+    end
+
+    function module.test_create_from_png_data ()
+        local surface = Cairo.image_surface_create_from_png(read_png_data())
+        check_wood_image_surface(surface)
+        assert_error("truncated PNG data", function ()
+            Cairo.image_surface_create_from_png(read_png_data():sub(1, 50))
+        end)
+    end
+
+    function module.test_create_from_png_short_reads ()
+        local data, pos, calls = read_png_data(), 1, 0
+        local fh = {}
+        function fh:read (n)
+            calls = calls + 1
+            if pos > #data then return nil end
+            local s = data:sub(pos, pos + math.min(n, 37) - 1)
+            pos = pos + #s
+            return s
+        end
+        local surface = Cairo.image_surface_create_from_png(fh)
+        check_wood_image_surface(surface)
+        assert_true(calls > 1)
+    end
+
+    function module.test_create_from_png_stream_unread ()
+        local filename = tmpname()
+        local fh = assert(io.open(filename, "wb"))
+        fh:write(read_png_data(), "trailing data")
+        fh:close()
+        fh = assert(io.open(filename, "rb"))
+        local surface = Cairo.image_surface_create_from_png(fh)
+        check_wood_image_surface(surface)
+        assert_equal("trailing data", fh:read("*a"))
+        fh:close()
+    end
 end
 
 if MemFile and Cairo.HAS_PNG_FUNCTIONS then
@@ -253,6 +295,151 @@ if Cairo.HAS_PNG_FUNCTIONS then
         fh:close()
         check_file_contains_png(filename)
     end
+
+    function module.test_to_png_string ()
+        local surface = Cairo.image_surface_create("argb32", 300, 200)
+        draw_arbitrary_stuff(Cairo, surface)
+        local data = surface:to_png_string()
+        check_data_is_png(data)
+
+        local filename = tmpname()
+        surface:write_to_png(filename)
+        local fh = assert(io.open(filename, "rb"))
+        assert_equal(fh:read("*a"), data)
+        fh:close()
+
+        local loaded = Cairo.image_surface_create_from_png(data)
+        assert_equal(300, loaded:get_width())
+        assert_equal(200, loaded:get_height())
+    end
+
+    function module.test_write_to_png_async ()
+        local surface = Cairo.image_surface_create("argb32", 300, 200)
+        draw_arbitrary_stuff(Cairo, surface)
+        local expected = surface:to_png_string()
+
+        local job = surface:write_to_png_async()
+        assert_equal("cairo job object", job._NAME)
+        -- Drawing after the job starts doesn't affect what gets encoded.
+        Cairo.context_create(surface):paint()
+        assert_equal(expected, job:wait())
+        assert_true(job:done())
+        assert_equal(expected, job:result())
+        local stats = job:stats()
+        assert_equal("done", stats.state)
+        assert_number(stats.wait_time)
+        assert_number(stats.run_time)
+        assert_false(job:cancel())
+
+        -- A job which is cancelled before it starts never gives a result.
+        local jobs = {}
+        for i = 1, 8 do jobs[i] = surface:write_to_png_async() end
+        for i = 8, 1, -1 do
+            if jobs[i]:cancel() then
+                assert_true(jobs[i]:done())
+                assert_equal("cancelled", jobs[i]:stats().state)
+                assert_error("cancelled", function () jobs[i]:wait() end)
+            else
+                assert_string(jobs[i]:wait())
+            end
+        end
+
+        local filename = tmpname()
+        job = surface:write_to_png_async(filename)
+        assert_true(job:wait())
+        check_file_contains_png(filename)
+
+        job = surface:write_to_png_async(tmpname() .. "/no/such/dir.png")
+        assert_error("bad filename", function () job:wait() end)
+        assert_error("file handle", function ()
+            surface:write_to_png_async(io.stdout)
+        end)
+        if Cairo.HAS_PDF_SURFACE then
+            local pdf = Cairo.pdf_surface_create(tmpname(), 10, 10)
+            assert_error("not an image surface",
+                         function () pdf:write_to_png_async() end)
+        end
+    end
+end
+
+-- The colour type from the IHDR chunk is at offset 25 in a PNG file.
+local function png_color_type (data)
+    return data:byte(26)
+end
+
+if Cairo.HAS_PNG_OPTIONS then
+    function module.test_png_options ()
+        local surface = Cairo.image_surface_create("argb32", 40, 30)
+        local cr = Cairo.context_create(surface)
+        cr:set_source_rgba(1, 0.5, 0, 0.5)
+        cr:paint()
+        local before = surface:get_data()
+
+        local small = surface:to_png_string({ compression = 9 })
+        local fast = surface:to_png_string({ compression = 0,
+                                             filter = "none" })
+        check_data_is_png(small)
+        check_data_is_png(fast)
+        assert_true(#small < #fast)
+        assert_equal(6, png_color_type(small))
+
+        -- Decoding gives back the same pixels, within rounding.
+        for _, data in ipairs{ small, fast } do
+            local loaded = Cairo.image_surface_create_from_png(data)
+            assert_equal("argb32", loaded:get_format())
+            local after = loaded:get_data()
+            for i = 1, #before do
+                assert_true(math.abs(before:byte(i) - after:byte(i)) <= 1)
+            end
+        end
+
+        local filename = tmpname()
+        surface:write_to_png(filename, { filter = "paeth" })
+        local fh = assert(io.open(filename, "rb"))
+        check_data_is_png(fh:read("*a"))
+        fh:close()
+    end
+
+    function module.test_png_options_strip_alpha ()
+        local surface = Cairo.image_surface_create("argb32", 40, 30)
+        local cr = Cairo.context_create(surface)
+        cr:set_source_rgb(0, 0.5, 1)
+        cr:paint()
+        assert_equal(2, png_color_type(surface:to_png_string({})))
+        assert_equal(6, png_color_type(
+            surface:to_png_string({ strip_alpha = false })))
+
+        local rgb = Cairo.image_surface_create("rgb24", 40, 30)
+        assert_equal(2, png_color_type(rgb:to_png_string({})))
+        local a8 = Cairo.image_surface_create("a8", 40, 30)
+        assert_equal(0, png_color_type(a8:to_png_string({})))
+    end
+
+    function module.test_png_options_bad ()
+        local surface = Cairo.image_surface_create("rgb24", 10, 10)
+        assert_error("compression out of range", function ()
+            surface:to_png_string({ compression = 10 })
+        end)
+        assert_error("unknown filter", function ()
+            surface:to_png_string({ filter = "foo" })
+        end)
+        assert_error("options not a table", function ()
+            surface:to_png_string("fast")
+        end)
+        if Cairo.HAS_SVG_SURFACE then
+            local svg = Cairo.svg_surface_create(tmpname(), 10, 10)
+            assert_error("options on non-image surface", function ()
+                svg:write_to_png(tmpname(), { compression = 1 })
+            end)
+        end
+    end
+elseif Cairo.HAS_PNG_FUNCTIONS then
+    function module.test_png_options_unavailable ()
+        local surface = Cairo.image_surface_create("rgb24", 10, 10)
+        assert_error("options without libpng", function ()
+            surface:to_png_string({ compression = 1 })
+        end)
+    end
 end
 
 if MemFile and Cairo.HAS_PNG_FUNCTIONS then
@@ -415,6 +602,165 @@ if Cairo.HAS_RECORDING_SURFACE then
         -- negative size
         assert_error(function() Cairo.recording_surface_create("alpha", 0, 0, -10, -10) end)
     end
+
+    function module.test_rasterize_parallel ()
+        local recording = Cairo.recording_surface_create("color-alpha")
+        local cr = Cairo.context_create(recording)
+        cr:set_source_rgba(1, 0, 0, 0.5)
+        cr:rectangle(10, 20, 150, 60)
+        cr:fill()
+        cr:set_source_rgb(0, 0, 1)
+        cr:rectangle(50.5, 5, 30, 90.25)
+        cr:fill()
+
+        local expected = Cairo.image_surface_create("argb32", 170, 100)
+        cr = Cairo.context_create(expected)
+        cr:set_source(recording, 0, 0)
+        cr:paint()
+
+        for _, opts in ipairs{ {}, { tile = 20 }, { threads = 3, tile = 64 },
+                               { threads = 1 } } do
+            local image = Cairo.image_surface_create("argb32", 170, 100)
+            assert_nil(Cairo.rasterize_parallel(recording, image, opts))
+            assert_equal(expected:hash(), image:hash())
+        end
+
+        local image = Cairo.image_surface_create("argb32", 170, 100)
+        assert_error("not a recording surface", function ()
+            Cairo.rasterize_parallel(image, image)
+        end)
+        assert_error("not an image surface", function ()
+            Cairo.rasterize_parallel(recording, recording)
+        end)
+        assert_error("bad thread count", function ()
+            Cairo.rasterize_parallel(recording, image, { threads = 0 })
+        end)
+    end
+
+    if Cairo.user_font_face_create then
+        function module.test_rasterize_parallel_user_font ()
+            -- The glyphs are drawn by a Lua callback, which can't be called
+            -- from other threads, so all the tiles are done on this one.
+            local font = Cairo.user_font_face_create({
+                render_glyph = function (font, glyph, cr, extents)
+                    cr:rectangle(0, -0.75, 0.5, 0.75)
+                    cr:fill()
+                    extents.x_advance = 0.75
+                end,
+            })
+            local recording = Cairo.recording_surface_create("color-alpha")
+            local cr = Cairo.context_create(recording)
+            cr:set_font_face(font)
+            cr:set_font_size(40)
+            cr:set_source_rgb(0, 0, 1)
+            for y = 50, 300, 50 do
+                cr:move_to(5, y)
+                cr:show_text("abcdefghij")
+            end
+
+            local image = Cairo.image_surface_create("argb32", 310, 310)
+            Cairo.rasterize_parallel(recording, image,
+                                     { threads = 4, tile = 32 })
+            local expected = Cairo.image_surface_create("argb32", 310, 310)
+            cr = Cairo.context_create(expected)
+            cr:set_source(recording, 0, 0)
+            cr:paint()
+            assert_equal(expected:hash(), image:hash())
+            local blank = Cairo.image_surface_create("argb32", 310, 310)
+            assert_not_equal(blank:hash(), image:hash())
+        end
+    end
+
+    local function recording_page (width, height)
+        local page = Cairo.recording_surface_create("color-alpha", 0, 0,
+                                                    width, height)
+        draw_arbitrary_stuff(Cairo, page)
+        return page
+    end
+
+    if Cairo.HAS_PDF_SURFACE then
+        function module.test_render_document_async ()
+            local pages = { { recording_page(300, 200), 300, 200 },
+                            { recording_page(100, 400), 100, 400 } }
+            local job = Cairo.render_document_async("pdf", nil, pages)
+            assert_equal("cairo job object", job._NAME)
+            local data = job:wait()
+            assert_match("^%%PDF", data)
+
+            local filename = tmpname()
+            job = Cairo.render_document_async("pdf", filename, pages)
+            assert_true(job:wait())
+            local fh = assert(io.open(filename, "rb"))
+            assert_match("^%%PDF", fh:read("*a"))
+            fh:close()
+
+            -- Pages can have their size taken from the recording.
+            if Cairo.check_version(1, 12, 0) then
+                job = Cairo.render_document_async("pdf", nil,
+                                                  { recording_page(50, 60) })
+                assert_match("^%%PDF", job:wait())
+            end
+
+            assert_error("no pages", function ()
+                Cairo.render_document_async("pdf", nil, {})
+            end)
+            assert_error("not a recording surface", function ()
+                local image = Cairo.image_surface_create("rgb24", 10, 10)
+                Cairo.render_document_async("pdf", nil, { { image, 10, 10 } })
+            end)
+            assert_error("unknown type", function ()
+                Cairo.render_document_async("gif", nil, pages)
+            end)
+        end
+
+        function module.test_render_document_async_copies_pages ()
+            -- The job works from its own copy, so the page can be drawn on
+            -- again straight away.
+            local page = Cairo.recording_surface_create("color-alpha")
+            local cr = Cairo.context_create(page)
+            cr:rectangle(10, 10, 20, 20)
+            cr:fill()
+            local job = Cairo.render_document_async("pdf", nil,
+                                                    { { page, 50, 50 } })
+            cr:set_source_rgb(1, 0, 0)
+            cr:paint()
+            assert_match("^%%PDF", job:wait())
+        end
+
+        if Cairo.user_font_face_create then
+            function module.test_render_document_async_user_font ()
+                -- Text in a user font calls back into Lua, so the document
+                -- is made before the function returns.
+                local page = Cairo.recording_surface_create("color-alpha")
+                local cr = Cairo.context_create(page)
+                cr:set_font_face(Cairo.user_font_face_create({
+                    render_glyph = function (font, glyph, cr, extents)
+                        cr:rectangle(0, -0.75, 0.5, 0.75)
+                        cr:fill()
+                        extents.x_advance = 0.75
+                    end,
+                }))
+                cr:set_font_size(20)
+                cr:move_to(10, 40)
+                cr:show_text("abc")
+                local job = Cairo.render_document_async("pdf", nil,
+                                                        { { page, 100, 50 } })
+                assert_true(job:done())
+                assert_match("^%%PDF", job:result())
+            end
+        end
+    end
+
+    if Cairo.HAS_SVG_SURFACE then
+        function module.test_render_document_async_svg ()
+            local page = { recording_page(30, 40), 30, 40 }
+            local job = Cairo.render_document_async("svg", nil, { page })
+            assert_match("<svg", job:wait())
+            assert_error("more than one SVG page", function ()
+                Cairo.render_document_async("svg", nil, { page, page })
+            end)
+        end
+    end
 end
 
 if Cairo.check_version(1, 10, 0) then
@@ -478,6 +824,350 @@ if Cairo.check_version(1, 12, 0) then
     end
 end
 
+if Cairo.HAS_OBSERVER_SURFACE then
+    function module.test_observer ()
+        local surface = Cairo.image_surface_create("argb32", 20, 20)
+        local observer = surface:create_observer("record-operations")
+        assert_equal("cairo surface object", observer._NAME)
+
+        local fills, targets = 0, {}
+        assert_nil(observer:observer_add_callback("fill", function (obs, target)
+            fills = fills + 1
+            targets[#targets + 1] = target
+        end))
+
+        local cr = Cairo.context_create(observer)
+        cr:rectangle(2, 2, 10, 10)
+        cr:fill()
+        cr:rectangle(5, 5, 10, 10)
+        cr:fill()
+        cr:paint()
+        assert_equal(2, fills)
+        assert_true(targets[1] == surface)
+
+        assert_number(observer:observer_elapsed())
+        assert_number(observer:device_observer_elapsed())
+        assert_number(observer:device_observer_elapsed("fill"))
+        assert_string(observer:observer_print())
+        assert_string(observer:observer_print(true))
+    end
+
+    function module.test_observer_bad ()
+        local surface = Cairo.image_surface_create("argb32", 20, 20)
+        assert_error("bad mode", function () surface:create_observer("foo") end)
+        assert_error("not an observer", function ()
+            surface:observer_add_callback("fill", function () end)
+        end)
+        assert_error("not an observer", function () surface:observer_elapsed() end)
+        local observer = surface:create_observer()
+        assert_error("bad operation", function ()
+            observer:observer_add_callback("foo", function () end)
+        end)
+        assert_error("callback not a function", function ()
+            observer:observer_add_callback("fill", "foo")
+        end)
+        assert_error("bad operation", function ()
+            observer:device_observer_elapsed("foo")
+        end)
+    end
+end
+
+function module.test_blur ()
+    local surface = Cairo.image_surface_create("a8", 21, 21)
+    local buf = surface:get_buffer()
+    buf:set(10, 10, 255)
+    local before = surface:hash()
+    surface:blur(0)
+    assert_equal(before, surface:hash())
+
+    surface:blur(4)
+    local mid = buf:get(10, 10)
+    assert_true(mid > 0 and mid < 255)
+    assert_true(buf:get(12, 10) > 0)
+    assert_equal(buf:get(7, 10), buf:get(13, 10))
+    assert_equal(buf:get(10, 7), buf:get(10, 13))
+    assert_equal(0, buf:get(0, 0))
+
+    -- Only the rectangle changes, even though the dot is just outside it.
+    surface = Cairo.image_surface_create("a8", 21, 21)
+    buf = surface:get_buffer()
+    buf:set(10, 10, 255)
+    surface:blur(4, 0, 0, 10, 10)
+    assert_equal(255, buf:get(10, 10))
+    assert_true(buf:get(9, 9) > 0)
+    assert_equal(0, buf:get(11, 11))
+
+    assert_error("negative radius", function () surface:blur(-1) end)
+    assert_error("rectangle outside image",
+                 function () surface:blur(2, 15, 0, 10, 10) end)
+    assert_error("a1 image", function ()
+        Cairo.image_surface_create("a1", 8, 8):blur(2)
+    end)
+end
+
+function module.test_shadow ()
+    local surface = Cairo.image_surface_create("argb32", 10, 10)
+    local cr = Cairo.context_create(surface)
+    cr:paint()
+    local shadow, x, y = surface:shadow(4, 1, 0, 0, 0.5)
+    check_image_surface(shadow, "shadow")
+    assert_equal("argb32", shadow:get_format())
+    assert_true(x < 0)
+    assert_equal(x, y)
+    assert_equal(10 - 2 * x, shadow:get_width())
+    assert_equal(10 - 2 * y, shadow:get_height())
+    local buf = shadow:get_buffer()
+    assert_equal(0x80800000, buf:get(5 - x, 5 - y))
+    assert_equal(0, buf:get(0, 0))
+
+    -- Without a blur the shadow is the same shape as the image.
+    shadow, x, y = surface:shadow(0)
+    assert_equal(0, x)
+    assert_equal(10, shadow:get_width())
+    assert_equal(0xFF000000, shadow:get_buffer():get(0, 0))
+end
+
+function module.test_scaled ()
+    local surface = Cairo.image_surface_create("argb32", 64, 64)
+    local buf = surface:get_buffer()
+    for y = 0, 63 do
+        for x = 0, 63 do
+            buf:set(x, y, (x + y) % 2 == 0 and 0xFF000000 or 0xFFFFFFFF)
+        end
+    end
+    local small = surface:scaled(8, 8)
+    check_image_surface(small, "scaled")
+    assert_equal("argb32", small:get_format())
+    assert_equal(8, small:get_width())
+    assert_equal(8, small:get_height())
+    assert_equal(0xFF808080, small:get_buffer():get(5, 2))
+
+    -- Drawing on the image throws away the mipmaps made from it.
+    local cr = Cairo.context_create(surface)
+    cr:set_source_rgb(1, 1, 1)
+    cr:paint()
+    assert_equal(0xFFFFFFFF, surface:scaled(8, 8, "fast"):get_buffer():get(5, 2))
+    assert_equal(128, surface:scaled(128, 128):get_width())
+
+    assert_error("bad size", function () surface:scaled(0, 8) end)
+    assert_error("bad filter", function () surface:scaled(8, 8, "foo") end)
+end
+
+function module.test_fill_rect ()
+    local surface = Cairo.image_surface_create("argb32", 10, 10)
+    local buf = surface:get_buffer()
+    surface:fill_rect(2, 3, 4, 5, 1, 0, 0, 0.5)
+    assert_equal(0x80800000, buf:get(2, 3))
+    assert_equal(0x80800000, buf:get(5, 7))
+    assert_equal(0, buf:get(6, 7))
+    assert_equal(0, buf:get(5, 8))
+
+    -- Clipped to the image.
+    surface:fill_rect(-5, -5, 7, 7, 0, 0, 1)
+    assert_equal(0xFF0000FF, buf:get(1, 1))
+    assert_equal(0, buf:get(2, 2))
+
+    local a1 = Cairo.image_surface_create("a1", 40, 2)
+    a1:fill_rect(3, 1, 33, 1, 0, 0, 0)
+    buf = a1:get_buffer()
+    assert_equal(0, buf:get(2, 1))
+    assert_equal(1, buf:get(3, 1))
+    assert_equal(1, buf:get(35, 1))
+    assert_equal(0, buf:get(36, 1))
+    assert_equal(0, buf:get(10, 0))
+
+    -- Rectangles near the limits of the integer range don't wrap round.
+    surface = Cairo.image_surface_create("a8", 10, 10)
+    buf = surface:get_buffer()
+    surface:fill_rect(5, 5, 2147483647, 2147483647, 0, 0, 0)
+    assert_equal(255, buf:get(9, 9))
+    assert_equal(0, buf:get(4, 4))
+    surface:fill_rect(-2147483640, 0, 2147483647, 1, 0, 0, 0)
+    assert_equal(255, buf:get(6, 0))
+    assert_equal(0, buf:get(7, 0))
+
+    if Cairo.HAS_RECORDING_SURFACE then
+        local recording = Cairo.recording_surface_create("color-alpha",
+                                                         0, 0, 3, 3)
+        assert_error("not an image surface", function ()
+            recording:fill_rect(0, 0, 1, 1, 0, 0, 0)
+        end)
+    end
+end
+
+function module.test_copy_from ()
+    local src = Cairo.image_surface_create("argb32", 10, 10)
+    local dst = Cairo.image_surface_create("argb32", 10, 10)
+    src:get_buffer():set(1, 2, 0xFF112233)
+    dst:copy_from(src, 0, 0, 4, 4, 5, 5)
+    assert_equal(0xFF112233, dst:get_buffer():get(6, 7))
+
+    -- Clipped to both images.
+    dst:copy_from(src, -1, 0, 20, 20, 0, 0)
+    assert_equal(0xFF112233, dst:get_buffer():get(2, 2))
+
+    -- Overlapping copies within one image.
+    src:copy_from(src, 0, 0, 9, 9, 1, 1)
+    assert_equal(0xFF112233, src:get_buffer():get(2, 3))
+    src:copy_from(src, 2, 3, 5, 5, 0, 0)
+    assert_equal(0xFF112233, src:get_buffer():get(0, 0))
+
+    assert_error("different formats", function ()
+        dst:copy_from(Cairo.image_surface_create("a8", 5, 5), 0, 0, 1, 1, 0, 0)
+    end)
+end
+
+function module.test_clear ()
+    local surface = Cairo.image_surface_create("rgb24", 5, 5)
+    local blank = surface:hash()
+    surface:fill_rect(0, 0, 5, 5, 1, 1, 1)
+    assert_not_equal(blank, surface:hash())
+    surface:clear()
+    assert_equal(blank, surface:hash())
+end
+
+function module.test_hash ()
+    -- Check against the reference XXH64 values, using rows of bytes.
+    local surface = Cairo.image_surface_create("a8", 3, 2)
+    local buf = surface:get_buffer()
+    buf:set_row(0, "abc")
+    buf:set_row(1, "xyz")
+    assert_equal("ef46db3751d8e999", surface:hash(0, 0, 0, 0))
+    assert_equal("d24ec4f1a98c6e5b", surface:hash(0, 0, 1, 1))
+    assert_equal("44bc2cf5ad770999", surface:hash(0, 0, 3, 1))
+    assert_not_equal(surface:hash(), surface:hash(0, 0, 3, 1))
+
+    -- Padding at the ends of rows is ignored.
+    local padded = Cairo.image_surface_create_from_data("abc\1xyz\1", "a8",
+                                                        3, 2, 4)
+    assert_equal(surface:hash(), padded:hash())
+
+    assert_error("rectangle outside image", function () surface:hash(2, 0, 2, 1) end)
+    if Cairo.HAS_RECORDING_SURFACE then
+        local recording = Cairo.recording_surface_create("color-alpha",
+                                                         0, 0, 3, 3)
+        assert_error("not an image surface", function () recording:hash() end)
+    end
+end
+
+function module.test_hash_a1 ()
+    -- Pixels outside the rectangle don't affect the hash, even when they
+    -- share a byte with ones inside it.
+    local a = Cairo.image_surface_create("a1", 40, 2)
+    local b = Cairo.image_surface_create("a1", 40, 2)
+    local buf = b:get_buffer()
+    buf:set(2, 0, 1)
+    buf:set(12, 1, 1)
+    buf:set(39, 1, 1)
+    assert_equal(a:hash(3, 0, 9, 2), b:hash(3, 0, 9, 2))
+    assert_equal(a:hash(0, 0, 2, 2), b:hash(0, 0, 2, 2))
+    assert_equal(a:hash(33, 0, 5, 2), b:hash(33, 0, 5, 2))
+    assert_not_equal(a:hash(2, 0, 1, 1), b:hash(2, 0, 1, 1))
+    assert_not_equal(a:hash(), b:hash())
+end
+
+function module.test_hash_rgb24 ()
+    local a = Cairo.image_surface_create("rgb24", 5, 5)
+    local b = Cairo.image_surface_create("rgb24", 5, 5)
+    b:get_buffer():set(2, 2, 0xFF000000)
+    assert_equal(a:hash(), b:hash())
+    b:get_buffer():set(2, 2, 0x00000001)
+    assert_not_equal(a:hash(), b:hash())
+    assert_equal(a:hash(0, 0, 5, 2), b:hash(0, 0, 5, 2))
+end
+
+if Cairo.check_version(1, 10, 0) then
+    local function assert_extents (region, x, y, width, height)
+        local ext = region:get_extents()
+        assert_equal(x, ext.x)
+        assert_equal(y, ext.y)
+        assert_equal(width, ext.width)
+        assert_equal(height, ext.height)
+    end
+
+    function module.test_damage_surface ()
+        local surface = Cairo.image_surface_create("argb32", 100, 100)
+        local cr = Cairo.context_create(surface)
+        assert_nil(surface:take_damage())
+        surface:track_damage()
+
+        cr:rectangle(10, 20, 30, 5)
+        cr:fill()
+        assert_extents(surface:take_damage(), 10, 20, 30, 5)
+        assert_true(surface:take_damage():is_empty())
+
+        -- Transformed and clipped drawing.
+        cr:scale(2, 2)
+        cr:rectangle(40, 40, 20, 20)
+        cr:fill()
+        assert_extents(surface:take_damage(), 80, 80, 20, 20)
+
+        -- Painting covers the whole clip.
+        cr:identity_matrix()
+        cr:rectangle(5, 5, 10, 10)
+        cr:clip()
+        cr:paint()
+        assert_extents(surface:take_damage(), 5, 5, 10, 10)
+        cr:reset_clip()
+
+        -- Writes through image buffers are counted too.
+        surface:get_buffer():set(70, 3, 0)
+        surface:mark_dirty(1, 2, 3, 4)
+        assert_extents(surface:take_damage(), 1, 2, 70, 4)
+
+        -- And so are rows written through them by other functions.
+        local other = Cairo.image_surface_create("argb32", 10, 4)
+        other:export_pixels("bgra", "premultiplied", surface:get_buffer(), 400)
+        assert_extents(surface:take_damage(), 0, 0, 100, 4)
+        Cairo.premultiply(surface:get_buffer(), 100, 2)
+        assert_extents(surface:take_damage(), 0, 0, 100, 2)
+
+        surface:track_damage(false)
+        cr:paint()
+        assert_nil(surface:take_damage())
+    end
+
+    function module.test_damage_unbounded_operator ()
+        local surface = Cairo.image_surface_create("argb32", 50, 50)
+        local cr = Cairo.context_create(surface)
+        surface:track_damage()
+        cr:set_operator("in")
+        cr:rectangle(10, 10, 5, 5)
+        cr:fill()
+        assert_extents(surface:take_damage(), 0, 0, 50, 50)
+    end
+
+    function module.test_damage_device_offset ()
+        local surface = Cairo.image_surface_create("argb32", 50, 50)
+        surface:set_device_offset(10, 20)
+        surface:track_damage()
+        local cr = Cairo.context_create(surface)
+        cr:track_damage()
+        cr:rectangle(0, 0, 5, 5)
+        cr:stroke()
+        local ext = surface:take_damage():get_extents()
+        local cr_ext = cr:take_damage():get_extents()
+        assert_equal(cr_ext.x + 10, ext.x)
+        assert_equal(cr_ext.y + 20, ext.y)
+        assert_true(ext.width >= 5)
+    end
+
+    function module.test_damage_context ()
+        local surface = Cairo.image_surface_create("argb32", 50, 50)
+        local cr1 = Cairo.context_create(surface)
+        local cr2 = Cairo.context_create(surface)
+        assert_nil(cr1:take_damage())
+        cr1:track_damage()
+        cr1:rectangle(1, 1, 2, 2)
+        cr1:fill()
+        cr2:rectangle(30, 30, 2, 2)
+        cr2:fill()
+        assert_extents(cr1:take_damage(), 1, 1, 2, 2)
+        cr1:track_damage(false)
+        assert_nil(cr1:take_damage())
+    end
+end
+
 lunit.testcase(module)
 return module
 
@@ -0,0 +1,146 @@
+require "test-setup"
+local lunit = require "lunit"
+local Cairo = require "oocairo"
+
+local assert_error      = lunit.assert_error
+local assert_true       = lunit.assert_true
+local assert_false      = lunit.assert_false
+local assert_equal      = lunit.assert_equal
+local assert_userdata   = lunit.assert_userdata
+local assert_not_equal  = lunit.assert_not_equal
+local assert_nil        = lunit.assert_nil
+
+local module = { _NAME="test.surface_pool" }
+
+function module.test_create ()
+    local pool = Cairo.surface_pool_create()
+    assert_userdata(pool)
+    assert_equal("cairo surface pool object", pool._NAME)
+    assert_equal(64 * 1024 * 1024, pool:get_max_bytes())
+    local bytes, count = pool:get_size()
+    assert_equal(0, bytes)
+    assert_equal(0, count)
+    assert_error("negative limit",
+                 function () Cairo.surface_pool_create(-1) end)
+end
+
+function module.test_double_gc ()
+    local pool = Cairo.surface_pool_create()
+    pool:release(pool:acquire("argb32", 4, 4))
+    pool:__gc()
+    pool:__gc()
+end
+
+function module.test_acquire_release ()
+    local pool = Cairo.surface_pool_create()
+    local surface = pool:acquire("argb32", 23, 45)
+    assert_equal("image", surface:get_type())
+    assert_equal("argb32", surface:get_format())
+    assert_equal(23, surface:get_width())
+    assert_equal(45, surface:get_height())
+    local stride = surface:get_buffer():get_stride()
+    local pointer = surface:get_buffer():get_pointer()
+    collectgarbage("collect")   -- drop the buffer objects
+
+    assert_true(pool:release(surface))
+    local bytes, count = pool:get_size()
+    assert_equal(stride * 45, bytes)
+    assert_equal(1, count)
+    assert_error("released surface is no longer usable",
+                 function () surface:get_buffer():get(0, 0) end)
+
+    -- A different size doesn't match.
+    local other = pool:acquire("argb32", 23, 44)
+    assert_equal(1, select(2, pool:get_size()))
+
+    -- The same size gets the same memory back.
+    local again = pool:acquire("argb32", 23, 45)
+    assert_equal(pointer, again:get_buffer():get_pointer())
+    assert_equal(0, select(2, pool:get_size()))
+    assert_true(pool:release(other))
+end
+
+function module.test_clear ()
+    local function reuse (pool)
+        local surface = pool:acquire("a8", 10, 10)
+        surface:get_buffer():set(2, 3, 99)
+        surface:set_device_offset(5, 5)
+        collectgarbage("collect")
+        assert_true(pool:release(surface))
+        surface = pool:acquire("a8", 10, 10)
+        local x, y = surface:get_device_offset()
+        assert_equal(0, x)
+        assert_equal(0, y)
+        return surface:get_buffer():get(2, 3)
+    end
+    assert_equal(0, reuse(Cairo.surface_pool_create()))
+    assert_equal(99, reuse(Cairo.surface_pool_create(nil, false)))
+end
+
+function module.test_reuse_forgets_state ()
+    local pool = Cairo.surface_pool_create()
+
+    -- Mipmaps made from the old contents aren't used for the new ones.
+    local surface = pool:acquire("argb32", 64, 64)
+    surface:fill_rect(0, 0, 64, 64, 1, 0, 0)
+    assert_not_equal(0, surface:scaled(8, 8):get_buffer():get(4, 4))
+    assert_true(pool:release(surface))
+    surface = pool:acquire("argb32", 64, 64)
+    assert_equal(0, surface:scaled(8, 8):get_buffer():get(4, 4))
+
+    if Cairo.check_version(1, 10, 0) then
+        surface:track_damage()
+        surface:fill_rect(0, 0, 5, 5, 1, 1, 1)
+        assert_true(pool:release(surface))
+        surface = pool:acquire("argb32", 64, 64)
+        assert_nil(surface:take_damage())
+    end
+end
+
+function module.test_not_kept ()
+    local pool = Cairo.surface_pool_create()
+
+    -- Surfaces which didn't come from a pool.
+    assert_false(pool:release(Cairo.image_surface_create("rgb24", 5, 5)))
+
+    -- Surfaces still in use elsewhere.
+    local surface = pool:acquire("rgb24", 5, 5)
+    local cr = Cairo.context_create(surface)
+    assert_false(pool:release(surface))
+    assert_equal("image", cr:get_target():get_type())
+
+    -- Finished surfaces.
+    surface = pool:acquire("rgb24", 5, 5)
+    surface:finish()
+    assert_false(pool:release(surface))
+
+    -- Releasing again does nothing.
+    assert_false(pool:release(surface))
+    assert_equal(0, select(2, pool:get_size()))
+end
+
+function module.test_memory_limit ()
+    local stride = Cairo.format_stride_for_width("argb32", 10)
+    local pool = Cairo.surface_pool_create(stride * 10 * 2)
+    local s1 = pool:acquire("argb32", 10, 10)
+    local s2 = pool:acquire("argb32", 10, 10)
+    local s3 = pool:acquire("argb32", 10, 10)
+    local big = pool:acquire("argb32", 10, 30)
+    assert_true(pool:release(s1))
+    assert_true(pool:release(s2))
+    assert_true(pool:release(s3))
+    assert_equal(2, select(2, pool:get_size()))
+    assert_false(pool:release(big))
+    assert_equal(stride * 10 * 2, pool:get_size())
+
+    pool:set_max_bytes(stride * 10)
+    assert_equal(stride * 10, pool:get_max_bytes())
+    assert_equal(1, select(2, pool:get_size()))
+    pool:trim()
+    assert_equal(0, pool:get_size())
+end
+
+lunit.testcase(module)
+return module
+
+-- vi:ts=4 sw=4 expandtab
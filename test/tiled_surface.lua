@@ -0,0 +1,167 @@
+require "test-setup"
+local lunit = require "lunit"
+local Cairo = require "oocairo"
+
+local assert_error      = lunit.assert_error
+local assert_true       = lunit.assert_true
+local assert_equal      = lunit.assert_equal
+local assert_userdata   = lunit.assert_userdata
+local assert_nil        = lunit.assert_nil
+
+local module = { _NAME="test.tiled_surface" }
+
+if Cairo.HAS_RECORDING_SURFACE then
+    function module.test_create ()
+        local ts = Cairo.tiled_surface_create("argb32", 100000, 50000, 128)
+        assert_userdata(ts)
+        assert_equal("cairo tiled surface object", ts._NAME)
+        assert_equal("argb32", ts:get_format())
+        local width, height = ts:get_size()
+        assert_equal(100000, width)
+        assert_equal(50000, height)
+        assert_equal(128, ts:get_tile_size())
+        local count, total = ts:get_tile_count()
+        assert_equal(0, count)
+        assert_equal(782 * 391, total)
+        assert_equal(256, Cairo.tiled_surface_create("a8", 10, 10):get_tile_size())
+
+        assert_error("bad size",
+                     function () Cairo.tiled_surface_create("argb32", 0, 10) end)
+        assert_error("bad tile size", function ()
+            Cairo.tiled_surface_create("argb32", 10, 10, 0)
+        end)
+    end
+
+    function module.test_double_gc ()
+        local ts = Cairo.tiled_surface_create("argb32", 1000, 1000)
+        ts:__gc()
+        ts:__gc()
+    end
+
+    function module.test_drawing ()
+        local ts = Cairo.tiled_surface_create("argb32", 1000000, 1000000, 100)
+        local cr = ts:context()
+        cr:set_source_rgb(1, 0, 0)
+        -- Straddles four tiles.
+        cr:rectangle(250090, 120090, 20, 20)
+        cr:fill()
+        assert_equal(4, ts:get_tile_count())
+
+        local tile = ts:get_tile(2500, 1200)
+        assert_equal("image", tile:get_type())
+        assert_equal(100, tile:get_width())
+        local buf = tile:get_buffer()
+        assert_equal(0xFFFF0000, buf:get(95, 95))
+        assert_equal(0, buf:get(85, 85))
+        assert_equal(0xFFFF0000, ts:get_tile(2501, 1201):get_buffer():get(5, 5))
+        assert_nil(ts:get_tile(0, 0))
+        assert_error("tile out of range", function () ts:get_tile(10000, 0) end)
+
+        -- Drawing again only plays back the new drawing.
+        cr = ts:context()
+        cr:set_source_rgb(0, 0, 1)
+        cr:rectangle(250000, 120000, 10, 10)
+        cr:fill()
+        ts:flush()
+        assert_equal(0xFF0000FF, buf:get(5, 5))
+        assert_equal(0xFFFF0000, buf:get(95, 95))
+
+        local seen = 0
+        for col, row, t, x, y in ts:tiles() do
+            assert_true(col == 2500 or col == 2501)
+            assert_true(row == 1200 or row == 1201)
+            assert_equal(col * 100, x)
+            assert_equal(row * 100, y)
+            assert_equal(100, t:get_height())
+            seen = seen + 1
+        end
+        assert_equal(4, seen)
+    end
+
+    function module.test_edge_tiles ()
+        local ts = Cairo.tiled_surface_create("a8", 250, 130, 100)
+        local cr = ts:context()
+        cr:paint()
+        local count, total = ts:get_tile_count()
+        assert_equal(6, count)
+        assert_equal(6, total)
+        local tile = ts:get_tile(2, 1)
+        assert_equal(50, tile:get_width())
+        assert_equal(30, tile:get_height())
+        assert_equal(255, tile:get_buffer():get(49, 29))
+    end
+
+    function module.test_stale_context ()
+        local ts = Cairo.tiled_surface_create("a8", 100, 100)
+        local cr = ts:context()
+        cr:rectangle(0, 0, 10, 10)
+        cr:fill()
+        ts:flush()
+        cr:rectangle(20, 20, 10, 10)
+        assert_error("context out of date", function () cr:fill() end)
+        assert_equal(0, ts:get_tile(0, 0):get_buffer():get(25, 25))
+    end
+
+    function module.test_rgb24 ()
+        -- Undrawn parts of a recording are black for rgb24, which mustn't
+        -- wipe out what was drawn before.
+        local ts = Cairo.tiled_surface_create("rgb24", 100, 100)
+        local cr = ts:context()
+        cr:set_source_rgb(1, 0, 0)
+        cr:rectangle(0, 0, 10, 10)
+        cr:fill()
+        ts:flush()
+        cr = ts:context()
+        cr:set_source_rgb(0, 1, 0)
+        cr:rectangle(50, 50, 10, 10)
+        cr:fill()
+        local buf = ts:get_tile(0, 0):get_buffer()
+        assert_equal(0xFF0000, buf:get(5, 5) % 0x1000000)
+        assert_equal(0x00FF00, buf:get(55, 55) % 0x1000000)
+    end
+
+    function module.test_operators ()
+        local ts = Cairo.tiled_surface_create("argb32", 200, 100, 100)
+        local ref = Cairo.image_surface_create("argb32", 100, 100)
+        local function draw (cr, x)
+            cr:set_source_rgb(1, 0, 0)
+            cr:rectangle(x, 0, 50, 50)
+            cr:fill()
+        end
+        draw(ts:context(), 100)
+        draw(ts:context(), 0)
+        draw(Cairo.context_create(ref), 0)
+        ts:flush()
+
+        local function draw_over (cr, x)
+            cr:set_operator("source")
+            cr:set_source_rgba(0, 0, 1, 0.5)
+            cr:rectangle(x + 10, 10, 20, 20)
+            cr:fill()
+            cr:set_operator("clear")
+            cr:rectangle(x + 40, 0, 10, 10)
+            cr:fill()
+        end
+        draw_over(ts:context(), 0)
+        draw_over(Cairo.context_create(ref), 0)
+        local buf, ref_buf = ts:get_tile(0, 0):get_buffer(), ref:get_buffer()
+        for _, pos in ipairs({ { 5, 5 }, { 15, 15 }, { 45, 5 }, { 45, 45 },
+                               { 60, 60 } }) do
+            assert_equal(ref_buf:get(pos[1], pos[2]),
+                         buf:get(pos[1], pos[2]))
+        end
+
+        -- A tile cleared completely is freed.
+        local cr = ts:context()
+        cr:set_operator("clear")
+        cr:rectangle(100, 0, 100, 100)
+        cr:fill()
+        assert_nil(ts:get_tile(1, 0))
+        assert_equal(1, ts:get_tile_count())
+    end
+end
+
+lunit.testcase(module)
+return module
+
+-- vi:ts=4 sw=4 expandtab